@@ -1,219 +1,1760 @@
 #include "client.h"
 #include <vector>
-#include <cstring> 
-#include <iostream> 
+#include <cstring>
+#include <cstddef>
+#include <iostream>
 #include <string>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 
 using namespace std;
 
-// Global State 
-SocketHandle gSocket = -1;
-std::vector<Command> gCommandBuffer;      
-std::vector<Command> unprocessedCommands; 
+// UDP match settings (only used when the server accepted MATCH_FEATURE_UDP)
+const uint32_t UDP_WINDOW_TICKS = 8;
+const int UDP_RESEND_MS = 20;
+const int UDP_STEP_TIMEOUT_MS = 10000;
+
+// lobby text (ReadLobbyMessage/ReadLobbyMessages)
+const size_t LOBBY_READ_SIZE = 16 * 1024; // most bytes one call takes off the socket
+const size_t LOBBY_MAX_LINE = 64 * 1024;  // a longer line is cut here, same limit as the server
+const size_t LOBBY_FRAME_HEADER = 4;      // binary lobby: the uint32 length in front of every frame
+
+// connecting (SessionConnectAsync / SessionPollConnect)
+const int CONNECT_TIMEOUT_MS = 10000; // what the blocking DLLConnect waits at most
+const int CONNECT_STAGGER_MS = 250;   // head start each address gets before the next one is tried too
+const int RESOLVE_CACHE_SECONDS = 60;
+const size_t RESOLVE_CACHE_SIZE = 16;
+
+struct ResolvedAddress {
+    sockaddr_storage addr;
+    socklen_t len;
+};
+
+// a host name lookup, done on its own thread so the game never waits on DNS
+struct PendingResolve {
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool done = false;
+    std::vector<ResolvedAddress> addresses;
+};
+
+struct CachedResolve {
+    std::vector<ResolvedAddress> addresses; // the one that connected last time first
+    std::chrono::steady_clock::time_point expires;
+};
+
+// shared with the lookup threads
+std::mutex gResolveMutex;
+std::map<std::string, CachedResolve> gResolveCache;
+
+enum ConnectState {
+    CONNECT_IDLE,
+    CONNECT_RESOLVING,
+    CONNECT_RACING, // attempts to the resolved addresses going, see StepConnect
+    CONNECT_DONE,
+    CONNECT_FAILED,
+    CONNECT_NO_HOST,
+};
+
+struct ConnectRace {
+    ConnectState state = CONNECT_IDLE;
+    std::string host;
+    uint16_t port = 0;
+    std::shared_ptr<PendingResolve> resolve;
+    std::vector<ResolvedAddress> addresses;
+    size_t next = 0; // first address not tried yet
+    std::vector<std::pair<SocketHandle, size_t>> attempts; // connecting sockets and their address
+    std::chrono::steady_clock::time_point nextAttempt;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// what a session's async call is waiting for, see PollSessions
+enum PendingRead {
+    PENDING_NONE,
+    PENDING_GAME_START, // SessionWaitForGameStartAsync
+    PENDING_FRAME,      // SessionSendStepAsync
+};
+
+// Everything one connection to the server needs. The exports without a handle work
+// on session 0, the default session, so a game never has to know sessions exist
+struct ClientSession {
+    bool in_use = false;
+    bool wsaStarted = false; // WSAStartup is per connection, undone in CloseSession
+    SocketHandle sock = -1;
+    ConnectRace connect;
+    std::vector<Command> commandBuffer;
+    std::vector<Command> unprocessedCommands;
+    size_t nextUnprocessed = 0; // GetNextCommand's position in unprocessedCommands
+
+    // UDP match state
+    bool askedFeatures = false; // our ACK listed features, so the server answers with the accepted mask
+    SocketHandle udpSocket = INVALID_SOCKET;
+    uint32_t udpToken = 0;
+    uint32_t udpInputTick = 0; // newest tick we submitted inputs for
+    uint32_t udpFrameTick = 0; // newest frame we handed to the game
+    std::deque<std::pair<uint32_t, std::vector<char>>> udpPendingInputs; // encoded ticks sent but not acked yet
+    std::chrono::steady_clock::time_point udpLastSend; // of the inputs, for resends
+    std::chrono::steady_clock::time_point udpDeadline; // the step fails if its frame is not in by then
+
+    // optional state hash for the next SendStep, see SetStateHash
+    bool hasStateHash = false;
+    uint64_t stateHash = 0;
+
+    // tick numbers (MATCH_FEATURE_TICKS) and FrameStep's pacing
+    uint32_t acceptedFeatures = 0; // what the server said yes to at game start
+    uint32_t stepTick = 0;         // frame number our last upload was for
+    uint32_t frameTick = 0;        // number of the last frame handed to the game
+    uint32_t tickRatio = 1;        // render frames per submission, see SetTickRatio
+    uint32_t framesSinceSubmit = 0;
+    bool submitDue = false;   // the ratio came round while the last frame was still out
+    bool stepInFlight = false; // FrameStep submitted and has not reported the frame yet
+
+    // shared buffer mode (RegisterCommandBuffer): the game's own buffer, layout in client.h
+    char* shared = nullptr;
+    uint32_t sharedCapacity = 0; // commands each region holds
+
+    // lobby text: lobbyIn[lobbyRead, lobbyLines) are whole lines the game has not read yet,
+    // PINGs already taken out, anything after lobbyLines is a line still arriving
+    std::string lobbyIn;
+    size_t lobbyRead = 0;
+    size_t lobbyLines = 0;
+    bool lobbyClosed = false; // the server hung up, reported once the lines are read
+
+    // binary lobby (UseBinaryLobby): lobbyIn holds frames instead of lines, and
+    // the decoded fields of the last reply ReadLobbyReply took. All of it is reused
+    bool lobbyBinary = false;
+    bool lobbyGreeting = false; // the text WELCOME may still be in front of the first frame
+    std::vector<char> lobbyOut; // the command being sent
+    std::vector<int32_t> replyInts;
+    std::vector<std::pair<uint32_t, uint32_t>> replyStrings; // offset and length in replyText
+    std::string replyText;
+
+    // async calls: bytes PollSessions read that nothing has used yet, what they are for
+    std::vector<char> inbox;
+    PendingRead pending = PENDING_NONE;
+    int result = 0; // of the last async call: 0 waiting, 1 done, -1 failed
+    int playerId = -1;
+};
+
+// Sessions by handle. Slots are reused after DestroySession, a slot and its
+// vectors stay allocated so a bot farm creating and dropping sessions does not churn
+std::vector<std::unique_ptr<ClientSession>> gSessions;
+std::vector<uint32_t> gFreeSessions;
+
+ClientSession& DefaultSession() {
+    if (gSessions.empty()) {
+        gSessions.emplace_back(new ClientSession());
+        gSessions[0]->in_use = true;
+    }
+    return *gSessions[0];
+}
+
+// nullptr for a handle that is not a live session
+ClientSession* FindSession(double handle) {
+    if (handle == 0) return &DefaultSession();
+    if (handle < 0 || handle >= gSessions.size()) return nullptr;
+    ClientSession* s = gSessions[(size_t)handle].get();
+    return s->in_use ? s : nullptr;
+}
+
+// poll() over any number of sockets, select() can't take descriptors past FD_SETSIZE
+#ifdef _WIN32
+typedef WSAPOLLFD PollFd;
+int PollSockets(PollFd* fds, size_t count, int timeout_ms) {
+    return WSAPoll(fds, (ULONG)count, timeout_ms);
+}
+#else
+typedef pollfd PollFd;
+int PollSockets(PollFd* fds, size_t count, int timeout_ms) {
+    return poll(fds, count, timeout_ms);
+}
+#endif
+
+bool Readable(SocketHandle sock, int timeout_ms) {
+    PollFd fd = {};
+    fd.fd = sock;
+    fd.events = POLLIN;
+    return PollSockets(&fd, 1, timeout_ms) > 0;
+}
 
 //Helper
-bool RecieveData(char* buffer, int expected_size) {
-    if (gSocket == -1) return false;
+bool RecieveData(ClientSession& s, char* buffer, int expected_size) {
+    if (s.sock == -1) return false;
     ssize_t bytes_received = 0;
+    // bytes an async call already read come first
+    if (!s.inbox.empty()) {
+        bytes_received = std::min((size_t)expected_size, s.inbox.size());
+        memcpy(buffer, s.inbox.data(), bytes_received);
+        s.inbox.erase(s.inbox.begin(), s.inbox.begin() + bytes_received);
+    }
     while (bytes_received < expected_size) {
-        ssize_t result = recv(gSocket, buffer + bytes_received, expected_size - bytes_received, 0);
+        ssize_t result = recv(s.sock, buffer + bytes_received, expected_size - bytes_received, 0);
         if (result <= 0) return false;
         bytes_received += result;
     }
     return true;
 }
-    
+
 bool SendText(int sock, string msg){
     msg += "\n";
     return send(sock, msg.c_str(), msg.length(), 0) > 0;
 }
 
+// one recv that never waits: > 0 bytes read, 0 connection gone, -1 nothing there yet
+int RecvNow(SocketHandle sock, char* buffer, int len) {
+#ifdef _WIN32
+    if (!Readable(sock, 0)) return -1;
+    int r = recv(sock, buffer, len, 0);
+    return r < 0 ? 0 : r;
+#else
+    ssize_t r = recv(sock, buffer, len, MSG_DONTWAIT);
+    if (r < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? -1 : 0;
+    return (int)r;
+#endif
+}
+
+bool SendAll(ClientSession& s, const char* data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        int r = send(s.sock, data + sent, (int)(len - sent), 0);
+        if (r <= 0) return false;
+        sent += r;
+    }
+    return true;
+}
+
+void PutU32(std::vector<char>& out, uint32_t v) {
+    char bytes[sizeof(v)];
+    memcpy(bytes, &v, sizeof(v));
+    out.insert(out.end(), bytes, bytes + sizeof(v));
+}
+
+// one binary lobby command: uint32 length, uint8 type, then a string (REGISTER, CHAT),
+// a number (JOIN, ACK) or nothing
+bool SendLobbyFrame(ClientSession& s, uint8_t type, uint32_t number, const char* text, size_t text_len) {
+    bool hasText = type == LOBBY_REGISTER || type == LOBBY_CHAT;
+    bool hasNumber = type == LOBBY_JOIN || type == LOBBY_ACK;
+    uint32_t len = 1 + (hasText ? sizeof(uint32_t) + text_len : 0) + (hasNumber ? sizeof(uint32_t) : 0);
+    s.lobbyOut.clear();
+    PutU32(s.lobbyOut, len);
+    s.lobbyOut.push_back((char)type);
+    if (hasNumber) PutU32(s.lobbyOut, number);
+    if (hasText) {
+        PutU32(s.lobbyOut, (uint32_t)text_len);
+        s.lobbyOut.insert(s.lobbyOut.end(), text, text + text_len);
+    }
+    return SendAll(s, s.lobbyOut.data(), s.lobbyOut.size());
+}
+
+// binary counterpart of FillLobby's line loop: lobbyLines ends after the last whole frame
+void FrameLobby(ClientSession& s) {
+    size_t start = s.lobbyLines;
+    // the server's first frame is its 1 byte REPLY_WELCOME, whose length starts with 1.
+    // Anything else in front of it is a text line from before it saw our hello
+    while (s.lobbyGreeting && start < s.lobbyIn.size() && s.lobbyIn[start] != 1) {
+        size_t nl = s.lobbyIn.find('\n', start);
+        if (nl == std::string::npos) return;
+        s.lobbyIn.erase(start, nl + 1 - start);
+    }
+    if (start < s.lobbyIn.size()) s.lobbyGreeting = false;
+
+    while (s.lobbyIn.size() - start >= LOBBY_FRAME_HEADER) {
+        uint32_t len;
+        memcpy(&len, &s.lobbyIn[start], sizeof(len));
+        if (len == 0 || len > LOBBY_MAX_LINE) {
+            // not a frame, nothing after it can be trusted
+            s.lobbyIn.resize(start);
+            s.lobbyClosed = true;
+            break;
+        }
+        if (s.lobbyIn.size() - start - LOBBY_FRAME_HEADER < len) break;
+        if (len == 1 && (uint8_t)s.lobbyIn[start + LOBBY_FRAME_HEADER] == REPLY_PING) {
+            SendLobbyFrame(s, LOBBY_PONG, 0, nullptr, 0);
+            s.lobbyIn.erase(start, LOBBY_FRAME_HEADER + len);
+            continue;
+        }
+        start += LOBBY_FRAME_HEADER + len;
+    }
+    s.lobbyLines = start;
+}
+
+// Reads what the socket has (one syscall) and frames it into lines. The server PINGs
+// a quiet lobby connection and drops it if nothing comes back, so PING lines are
+// answered and cut out here and the game never sees them
+void FillLobby(ClientSession& s) {
+    if (s.lobbyClosed) return;
+    // what the game read is dropped once it is most of the buffer
+    if (s.lobbyRead > 0 && s.lobbyRead * 2 >= s.lobbyIn.size()) {
+        s.lobbyIn.erase(0, s.lobbyRead);
+        s.lobbyLines -= s.lobbyRead;
+        s.lobbyRead = 0;
+    }
+
+    size_t old_size = s.lobbyIn.size();
+    s.lobbyIn.resize(old_size + LOBBY_READ_SIZE);
+    int bytes = RecvNow(s.sock, &s.lobbyIn[old_size], LOBBY_READ_SIZE);
+    s.lobbyIn.resize(old_size + std::max(bytes, 0));
+    if (bytes == 0) s.lobbyClosed = true;
+    if (bytes <= 0) return;
+    if (s.lobbyBinary) {
+        FrameLobby(s);
+        return;
+    }
+
+    size_t start = s.lobbyLines;
+    while (start < s.lobbyIn.size()) {
+        size_t nl = s.lobbyIn.find('\n', start);
+        if (nl == std::string::npos) {
+            if (s.lobbyIn.size() - start < LOBBY_MAX_LINE) break;
+            // nobody sends lines this long, cut it so the buffer can't grow forever
+            nl = start + LOBBY_MAX_LINE;
+            s.lobbyIn.insert(nl, 1, '\n');
+        }
+        size_t len = nl - start;
+        if (len > 0 && s.lobbyIn[nl - 1] == '\r') len--;
+        if (len == 4 && s.lobbyIn.compare(start, 4, "PING") == 0) {
+            SendText(s.sock, "PONG");
+            s.lobbyIn.erase(start, nl + 1 - start);
+            continue;
+        }
+        start = nl + 1;
+    }
+    s.lobbyLines = start;
+}
+
+// the next whole lobby line, without its line break. False if there is none yet
+bool NextLobbyLine(ClientSession& s, const char*& line, size_t& len) {
+    if (s.lobbyRead >= s.lobbyLines) return false;
+    size_t nl = s.lobbyIn.find('\n', s.lobbyRead);
+    line = s.lobbyIn.data() + s.lobbyRead;
+    len = nl - s.lobbyRead;
+    if (len > 0 && line[len - 1] == '\r') len--;
+    s.lobbyRead = nl + 1;
+    return true;
+}
+
+bool TakeU32(const char*& p, const char* end, uint32_t& v) {
+    if (end - p < (ptrdiff_t)sizeof(v)) return false;
+    memcpy(&v, p, sizeof(v));
+    p += sizeof(v);
+    return true;
+}
+
+bool TakeInt(ClientSession& s, const char*& p, const char* end) {
+    uint32_t v;
+    if (!TakeU32(p, end, v)) return false;
+    s.replyInts.push_back((int32_t)v);
+    return true;
+}
+
+bool TakeString(ClientSession& s, const char*& p, const char* end) {
+    uint32_t len;
+    if (!TakeU32(p, end, len) || (size_t)(end - p) < len) return false;
+    s.replyStrings.emplace_back((uint32_t)s.replyText.size(), len);
+    s.replyText.append(p, len);
+    p += len;
+    return true;
+}
+
+// takes the next whole frame apart into replyInts/replyStrings. Its type, 0 if none is there
+int NextLobbyReply(ClientSession& s) {
+    if (s.lobbyRead >= s.lobbyLines) return 0;
+    uint32_t len;
+    memcpy(&len, &s.lobbyIn[s.lobbyRead], sizeof(len));
+    const char* p = s.lobbyIn.data() + s.lobbyRead + LOBBY_FRAME_HEADER;
+    const char* end = p + len;
+    s.lobbyRead += LOBBY_FRAME_HEADER + len;
+
+    s.replyInts.clear();
+    s.replyStrings.clear();
+    s.replyText.clear();
+    uint8_t type = (uint8_t)*p++;
+    uint32_t count = 0;
+    // a short payload just leaves the fields it did not have out
+    switch (type) {
+        case REPLY_REGISTERED:
+        case REPLY_LOGGED_IN:
+            TakeInt(s, p, end) && TakeString(s, p, end);
+            break;
+        case REPLY_ERROR:
+        case REPLY_CREATED:
+            TakeInt(s, p, end);
+            break;
+        case REPLY_GAMES:
+            if (!TakeU32(p, end, count)) break;
+            for (uint32_t i = 0; i < count && TakeInt(s, p, end); i++) {}
+            break;
+        case REPLY_LEADERBOARD:
+            if (!TakeU32(p, end, count)) break;
+            for (uint32_t i = 0; i < count && TakeInt(s, p, end) && TakeString(s, p, end); i++) {}
+            break;
+        case REPLY_CHAT:
+            TakeString(s, p, end) && TakeString(s, p, end);
+            break;
+        case REPLY_ECHO:
+        case REPLY_STATS:
+        case REPLY_TRACE:
+            TakeString(s, p, end);
+            break;
+    }
+    return type;
+}
+
+// a text command ("JOIN 3\n") as its frame, for games that keep using SendLobbyMessage
+bool SendLobbyText(ClientSession& s, const char* msg) {
+    static const std::pair<const char*, uint8_t> words[] = {
+        {"REGISTER", LOBBY_REGISTER}, {"LIST", LOBBY_LIST}, {"CREATE", LOBBY_CREATE}, {"JOIN", LOBBY_JOIN},
+        {"CHAT", LOBBY_CHAT}, {"LEADERBOARD", LOBBY_LEADERBOARD}, {"EXIT", LOBBY_EXIT},
+        {"UNREGISTER", LOBBY_UNREGISTER}, {"STATS", LOBBY_STATS}, {"TRACE", LOBBY_TRACE},
+        {"PING", LOBBY_PING}, {"PONG", LOBBY_PONG}, {"ACK", LOBBY_ACK},
+    };
+    size_t len = strlen(msg);
+    while (len > 0 && (msg[len - 1] == '\n' || msg[len - 1] == '\r')) len--;
+    size_t word = 0;
+    while (word < len && msg[word] != ' ') word++;
+    const char* rest = msg + std::min(word + 1, len); // the text after one space, like the server's CHAT
+    size_t rest_len = len - (rest - msg);
+
+    uint8_t type = 0; // unknown, the server answers with its error
+    for (const auto& w : words) {
+        if (strlen(w.first) == word && memcmp(w.first, msg, word) == 0) type = w.second;
+    }
+    if (type == LOBBY_REGISTER) {
+        size_t name = 0; // just the first word, like the text server
+        while (name < rest_len && rest[name] != ' ') name++;
+        rest_len = name;
+    }
+    uint32_t number = type == LOBBY_JOIN ? (uint32_t)strtol(std::string(rest, rest_len).c_str(), nullptr, 10) : 0;
+    if (len == 0) return true; // a blank line means nothing in either format
+    return SendLobbyFrame(s, type, number, rest, rest_len);
+}
+
+// when the lobby is left for a match, bytes read past the last line belong to the match
+void LobbyToInbox(ClientSession& s) {
+    s.inbox.insert(s.inbox.begin(), s.lobbyIn.begin() + s.lobbyLines, s.lobbyIn.end());
+    s.lobbyIn.clear();
+    s.lobbyRead = 0;
+    s.lobbyLines = 0;
+}
+
+void CloseUdp(ClientSession& s) {
+    if (s.udpSocket != INVALID_SOCKET) CLOSE_SOCKET(s.udpSocket);
+    s.udpSocket = INVALID_SOCKET;
+    s.udpPendingInputs.clear();
+}
+
+// UDP socket "connected" to the same host as the lobby connection
+bool OpenUdp(ClientSession& s, uint16_t port, uint32_t token) {
+    sockaddr_storage server;
+    socklen_t len = sizeof(server);
+    if (getpeername(s.sock, (sockaddr*)&server, &len) != 0) return false;
+    if (server.ss_family == AF_INET) ((sockaddr_in*)&server)->sin_port = htons(port);
+    else ((sockaddr_in6*)&server)->sin6_port = htons(port);
+
+    CloseUdp(s);
+    s.udpSocket = socket(server.ss_family, SOCK_DGRAM, 0);
+    if (s.udpSocket == INVALID_SOCKET) return false;
+    if (connect(s.udpSocket, (sockaddr*)&server, len) != 0) {
+        CloseUdp(s);
+        return false;
+    }
+    s.udpToken = token;
+    s.udpInputTick = 0;
+    s.udpFrameTick = 0;
+    return true;
+}
+
+uint32_t SharedGet(ClientSession& s, uint32_t offset) {
+    uint32_t value;
+    memcpy(&value, s.shared + offset, sizeof(value));
+    return value;
+}
+
+void SharedSet(ClientSession& s, uint32_t offset, uint32_t value) {
+    memcpy(s.shared + offset, &value, sizeof(value));
+}
+
+Command* SharedOut(ClientSession& s) {
+    return (Command*)(s.shared + SHARED_OUT_COMMANDS);
+}
+
+Command* SharedIn(ClientSession& s) {
+    return SharedOut(s) + s.sharedCapacity;
+}
+
+// what the next step uploads: the outbound region in shared buffer mode, commandBuffer otherwise
+const Command* PendingCommands(ClientSession& s, uint32_t& count) {
+    if (s.shared) {
+        count = std::min(SharedGet(s, SHARED_OUT_COUNT), s.sharedCapacity);
+        return SharedOut(s);
+    }
+    count = s.commandBuffer.size();
+    return s.commandBuffer.data();
+}
+
+void ClearPendingCommands(ClientSession& s) {
+    s.commandBuffer.clear();
+    if (s.shared) SharedSet(s, SHARED_OUT_COUNT, 0);
+    s.hasStateHash = false;
+}
+
+// the Add*Command helpers. A full outbound region drops the command, the server would
+// drop what goes over its --max-commands anyway
+void QueueCommand(ClientSession& s, const Command& cmd) {
+    if (!s.shared) {
+        s.commandBuffer.push_back(cmd);
+        return;
+    }
+    uint32_t count = SharedGet(s, SHARED_OUT_COUNT);
+    if (count >= s.sharedCapacity) return;
+    memcpy(SharedOut(s) + count, &cmd, sizeof(Command));
+    SharedSet(s, SHARED_OUT_COUNT, count + 1);
+}
+
+// commands of a new frame that did not go to the shared buffer
+void ResetUnprocessed(ClientSession& s, size_t count) {
+    s.unprocessedCommands.resize(count);
+    s.nextUnprocessed = 0;
+}
+
+// puts a received frame where the game reads it: the inbound region in shared buffer
+// mode (what does not fit is left for GetNextCommand), unprocessedCommands otherwise
+void DeliverFrame(ClientSession& s, const Command* cmds, uint32_t count) {
+    uint32_t in_place = s.shared ? std::min(count, s.sharedCapacity) : 0;
+    if (s.shared) {
+        memcpy(SharedIn(s), cmds, in_place * sizeof(Command));
+        SharedSet(s, SHARED_IN_COUNT, in_place);
+    }
+    ResetUnprocessed(s, count - in_place);
+    if (count > in_place) memcpy(s.unprocessedCommands.data(), cmds + in_place, (count - in_place) * sizeof(Command));
+}
+
+// this tick's upload: uint32 count (| TICK_HAS_TAG | TICK_HAS_HASH), the frame number
+// if tag is not 0, the hash if there is one, then the commands.
+// Same encoding over TCP and inside UDP datagrams
+void EncodeStep(ClientSession& s, std::vector<char>& out, uint32_t tag) {
+    uint32_t count;
+    const Command* cmds = PendingCommands(s, count);
+    size_t tag_size = tag ? sizeof(tag) : 0;
+    size_t hash_size = s.hasStateHash ? sizeof(s.stateHash) : 0;
+    out.resize(sizeof(count) + tag_size + hash_size + count * sizeof(Command));
+    uint32_t header = count | (tag ? TICK_HAS_TAG : 0) | (s.hasStateHash ? TICK_HAS_HASH : 0);
+    char* p = out.data();
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    if (tag) memcpy(p, &tag, sizeof(tag));
+    p += tag_size;
+    if (s.hasStateHash) memcpy(p, &s.stateHash, sizeof(s.stateHash));
+    p += hash_size;
+    if (count > 0) memcpy(p, cmds, count * sizeof(Command));
+    ClearPendingCommands(s);
+}
+
+// SendStep's upload in shared buffer mode. The count, tag and hash go in the bytes the
+// layout keeps free right before the outbound commands, so the whole tick is one send
+// straight out of the game's buffer
+bool SendSharedStep(ClientSession& s, uint32_t tag) {
+    uint32_t count;
+    const Command* cmds = PendingCommands(s, count);
+    char* end = (char*)(cmds + count);
+    char* start = (char*)cmds;
+    uint32_t header = count;
+    if (s.hasStateHash) {
+        start -= sizeof(s.stateHash);
+        memcpy(start, &s.stateHash, sizeof(s.stateHash));
+        header |= TICK_HAS_HASH;
+    }
+    if (tag) {
+        start -= sizeof(tag);
+        memcpy(start, &tag, sizeof(tag));
+        header |= TICK_HAS_TAG;
+    }
+    start -= sizeof(header);
+    memcpy(start, &header, sizeof(header));
+    ClearPendingCommands(s);
+    return SendAll(s, start, end - start);
+}
+
+// count, tag, hash and commands of this tick in one send. Tag and hash together don't
+// fit in the 12 free bytes of the shared buffer, that one tick is copied instead
+bool SendTcpStep(ClientSession& s) {
+    s.stepTick++;
+    uint32_t tag = (s.acceptedFeatures & MATCH_FEATURE_TICKS) ? s.stepTick : 0;
+    if (s.shared && !(tag && s.hasStateHash)) return SendSharedStep(s, tag);
+    std::vector<char> step;
+    EncodeStep(s, step, tag);
+    return SendAll(s, step.data(), step.size());
+}
+
+// one datagram with every input the server has not acked, plus our frame ack
+void SendUdpInputs(ClientSession& s) {
+    std::vector<char> packet(sizeof(UdpInputHeader));
+    UdpInputHeader header;
+    header.token = s.udpToken;
+    header.frame_ack = s.udpFrameTick;
+    header.first_tick = s.udpPendingInputs.empty() ? s.udpInputTick + 1 : s.udpPendingInputs.front().first;
+    header.tick_count = 0;
+    for (const auto& input : s.udpPendingInputs) {
+        if (header.tick_count >= UDP_WINDOW_TICKS) break;
+        packet.insert(packet.end(), input.second.begin(), input.second.end());
+        header.tick_count++;
+    }
+    memcpy(packet.data(), &header, sizeof(header));
+    send(s.udpSocket, packet.data(), packet.size(), 0);
+}
+
+// applies acks and the next frame from one server datagram
+void HandleUdpFrames(ClientSession& s, const char* data, size_t len) {
+    if (len < sizeof(UdpFrameHeader)) return;
+    UdpFrameHeader header;
+    memcpy(&header, data, sizeof(header));
+    while (!s.udpPendingInputs.empty() && s.udpPendingInputs.front().first <= header.input_ack) {
+        s.udpPendingInputs.pop_front();
+    }
+
+    size_t offset = sizeof(header);
+    for (uint32_t k = 0; k < header.tick_count; k++) {
+        uint32_t count;
+        if (len - offset < sizeof(count)) return;
+        memcpy(&count, data + offset, sizeof(count));
+        offset += sizeof(count);
+        if ((len - offset) / sizeof(Command) < count) return;
+
+        if (header.first_tick + k == s.udpFrameTick + 1) {
+            const Command* cmds = (const Command*)(data + offset);
+            DeliverFrame(s, cmds, count);
+            s.udpFrameTick++;
+            s.frameTick = s.udpFrameTick;
+
+            // last frame of the match: ack it right away since there is no next SendStep to carry the ack
+            for (uint32_t c = 0; c < count; c++) {
+                if (cmds[c].command_type == 4) {
+                    s.udpPendingInputs.clear();
+                    SendUdpInputs(s);
+                    CloseUdp(s);
+                    return;
+                }
+            }
+        }
+        offset += count * sizeof(Command);
+    }
+}
+
+// SendStep over UDP, first half: queue this tick's inputs and send them. Datagrams
+// number their ticks already, so inputs never carry a tag here
+void UdpSubmit(ClientSession& s) {
+    s.udpInputTick++;
+    s.stepTick = s.udpInputTick;
+    s.udpPendingInputs.emplace_back(s.udpInputTick, std::vector<char>());
+    EncodeStep(s, s.udpPendingInputs.back().second, 0);
+    SendUdpInputs(s);
+    s.udpLastSend = std::chrono::steady_clock::now();
+    s.udpDeadline = s.udpLastSend + std::chrono::milliseconds(UDP_STEP_TIMEOUT_MS);
+}
+
+// second half: takes what arrived (waiting up to wait_ms for it) and resends the inputs
+// every UDP_RESEND_MS. 1 once the frame for the last submission is in, 0 not yet, -1 timed out
+int UdpPoll(ClientSession& s, int wait_ms) {
+    char buffer[65536];
+    while (s.udpFrameTick < s.udpInputTick && s.udpSocket != INVALID_SOCKET && Readable(s.udpSocket, wait_ms)) {
+        int bytes = recv(s.udpSocket, buffer, sizeof(buffer), 0);
+        if (bytes > 0) HandleUdpFrames(s, buffer, bytes);
+        wait_ms = 0;
+    }
+    if (s.udpFrameTick >= s.udpInputTick) return 1;
+    auto now = std::chrono::steady_clock::now();
+    if (now > s.udpDeadline) return -1;
+    if (now - s.udpLastSend >= std::chrono::milliseconds(UDP_RESEND_MS)) {
+        SendUdpInputs(s); // nothing back yet, our datagram or the answer was probably lost
+        s.udpLastSend = now;
+    }
+    return 0;
+}
+
+// the blocking SendStep over UDP
+double UdpSendStep(ClientSession& s) {
+    UdpSubmit(s);
+    int done;
+    while ((done = UdpPoll(s, UDP_RESEND_MS)) == 0) {}
+    return done == 1 ? 1.0 : 0.0;
+}
+
+// Packed frames (MATCH_FEATURE_COMPRESS), the decoder half of Server/frame_codec.cpp
+bool GetVarint(const char*& p, const char* end, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+// a column of doubles, each XORed with the one before. The control byte counts the
+// zero bytes on top (high nibble) and at the bottom (low nibble), the rest follows
+bool UnpackDoubles(const char*& p, const char* end, uint32_t count, size_t offset, Command* out) {
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (p >= end) return false;
+        uint8_t control = (uint8_t)*p++;
+        int lead = control >> 4;
+        int trail = control & 0xf;
+        if (lead + trail > 8 || end - p < 8 - lead - trail) return false;
+        uint64_t x = 0;
+        for (int b = trail; b < 8 - lead; b++) x |= (uint64_t)(uint8_t)*p++ << (b * 8);
+        prev ^= x;
+        memcpy((char*)&out[i] + offset, &prev, sizeof(prev));
+    }
+    return true;
+}
+
+// unit id deltas (zigzag varints), runs of command_type/unit_type, then target_x and target_y
+bool UnpackCommands(const char* data, size_t len, uint32_t count, Command* out) {
+    const char* p = data;
+    const char* end = data + len;
+
+    uint32_t id = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t delta;
+        if (!GetVarint(p, end, delta)) return false;
+        id += (delta >> 1) ^ (0u - (delta & 1));
+        out[i].unit_id = id;
+    }
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run, type, unit_type;
+        if (!GetVarint(p, end, run) || !GetVarint(p, end, type) || !GetVarint(p, end, unit_type)) return false;
+        if (run == 0 || run > count - i) return false;
+        for (uint32_t k = 0; k < run; k++, i++) {
+            out[i].command_type = type;
+            out[i].unit_type = unit_type;
+        }
+    }
+
+    if (!UnpackDoubles(p, end, count, offsetof(Command, target_x), out)) return false;
+    if (!UnpackDoubles(p, end, count, offsetof(Command, target_y), out)) return false;
+    return p == end;
+}
+
+// a packed frame's commands to wherever the game reads them
+bool DeliverPacked(ClientSession& s, const char* packed, size_t len, uint32_t count) {
+    if (s.shared && count <= s.sharedCapacity) {
+        if (!UnpackCommands(packed, len, count, SharedIn(s))) return false;
+        SharedSet(s, SHARED_IN_COUNT, count);
+        ResetUnprocessed(s, 0);
+        return true;
+    }
+    std::vector<Command> frame(count);
+    if (!UnpackCommands(packed, len, count, frame.data())) return false;
+    DeliverFrame(s, frame.data(), count);
+    return true;
+}
+
+// the frame that answers our step, over TCP. A plain frame is read straight into the
+// inbound region in shared buffer mode
+bool ReceiveFrame(ClientSession& s) {
+    uint32_t header = 0;
+    if (!RecieveData(s, (char*)&header, sizeof(header))) return false;
+    uint32_t count = header & ~(FRAME_COMPRESSED | FRAME_TICK_TAGGED);
+    // with MATCH_FEATURE_TICKS the server says which frame this is
+    if (!(header & FRAME_TICK_TAGGED)) s.frameTick++;
+    else if (!RecieveData(s, (char*)&s.frameTick, sizeof(s.frameTick))) return false;
+    ResetUnprocessed(s, 0);
+    if (s.shared) SharedSet(s, SHARED_IN_COUNT, 0);
+
+    if (header & FRAME_COMPRESSED) {
+        // only sent when we asked for MATCH_FEATURE_COMPRESS: packed size, then the packed commands
+        uint32_t packed_size = 0;
+        if (!RecieveData(s, (char*)&packed_size, sizeof(packed_size))) return false;
+        std::vector<char> packed(packed_size);
+        if (!RecieveData(s, packed.data(), packed_size)) return false;
+        return DeliverPacked(s, packed.data(), packed.size(), count);
+    }
+
+    uint32_t in_place = s.shared ? std::min(count, s.sharedCapacity) : 0;
+    if (in_place > 0) {
+        if (!RecieveData(s, (char*)SharedIn(s), in_place * sizeof(Command))) return false;
+        SharedSet(s, SHARED_IN_COUNT, in_place);
+    }
+    ResetUnprocessed(s, count - in_place);
+    if (count > in_place && !RecieveData(s, (char*)s.unprocessedCommands.data(), (count - in_place) * sizeof(Command))) return false;
+    return true;
+}
+
+bool SetBlocking(SocketHandle sock, bool blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    return ioctlsocket(sock, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) return false;
+    return fcntl(sock, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK)) == 0;
+#endif
+}
+
+bool ConnectInProgress() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EINPROGRESS;
+#endif
+}
+
+// every address of host, families taking turns (RFC 8305) so a broken IPv6 route
+// costs one stagger step instead of the whole list
+bool ResolveHost(const std::string& host, int flags, std::vector<ResolvedAddress>& out) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0) return false;
+
+    std::vector<ResolvedAddress> first, other;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(sockaddr_storage)) continue;
+        ResolvedAddress a;
+        memcpy(&a.addr, ai->ai_addr, ai->ai_addrlen);
+        a.len = (socklen_t)ai->ai_addrlen;
+        // getaddrinfo already sorted them by preference, keep its first family first
+        (ai->ai_family == result->ai_family ? first : other).push_back(a);
+    }
+    freeaddrinfo(result);
+
+    out.clear();
+    for (size_t i = 0; i < first.size() || i < other.size(); i++) {
+        if (i < first.size()) out.push_back(first[i]);
+        if (i < other.size()) out.push_back(other[i]);
+    }
+    return !out.empty();
+}
+
+bool CachedAddresses(const std::string& host, std::vector<ResolvedAddress>& out) {
+    std::lock_guard<std::mutex> lock(gResolveMutex);
+    auto it = gResolveCache.find(host);
+    if (it == gResolveCache.end()) return false;
+    if (it->second.expires < std::chrono::steady_clock::now()) {
+        gResolveCache.erase(it);
+        return false;
+    }
+    out = it->second.addresses;
+    return true;
+}
+
+void CacheAddresses(const std::string& host, const std::vector<ResolvedAddress>& addresses) {
+    std::lock_guard<std::mutex> lock(gResolveMutex);
+    auto now = std::chrono::steady_clock::now();
+    if (gResolveCache.size() >= RESOLVE_CACHE_SIZE && !gResolveCache.count(host)) {
+        for (auto it = gResolveCache.begin(); it != gResolveCache.end();) {
+            if (it->second.expires < now) it = gResolveCache.erase(it);
+            else ++it;
+        }
+        if (gResolveCache.size() >= RESOLVE_CACHE_SIZE) gResolveCache.erase(gResolveCache.begin());
+    }
+    CachedResolve& entry = gResolveCache[host];
+    entry.addresses = addresses;
+    entry.expires = now + std::chrono::seconds(RESOLVE_CACHE_SECONDS);
+}
+
+// the address that won goes first next time, so a reconnect needs no race
+void PromoteCachedAddress(const std::string& host, const ResolvedAddress& winner) {
+    std::lock_guard<std::mutex> lock(gResolveMutex);
+    auto it = gResolveCache.find(host);
+    if (it == gResolveCache.end()) return;
+    std::vector<ResolvedAddress>& list = it->second.addresses;
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].len == winner.len && memcmp(&list[i].addr, &winner.addr, winner.len) == 0) {
+            std::rotate(list.begin(), list.begin() + i, list.begin() + i + 1);
+            return;
+        }
+    }
+}
+
+void StopConnect(ClientSession& s, ConnectState state) {
+    ConnectRace& c = s.connect;
+    for (auto& attempt : c.attempts) CLOSE_SOCKET(attempt.first);
+    c.attempts.clear();
+    c.resolve.reset();
+    c.state = state;
+}
+
+// starts a non-blocking connect to the next address, false once they are all tried
+bool StartAttempt(ClientSession& s) {
+    ConnectRace& c = s.connect;
+    while (c.next < c.addresses.size()) {
+        size_t index = c.next++;
+        ResolvedAddress a = c.addresses[index];
+        if (a.addr.ss_family == AF_INET) ((sockaddr_in*)&a.addr)->sin_port = htons(c.port);
+        else if (a.addr.ss_family == AF_INET6) ((sockaddr_in6*)&a.addr)->sin6_port = htons(c.port);
+        else continue;
+
+        SocketHandle sock = socket(a.addr.ss_family, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) continue;
+        if (!SetBlocking(sock, false)) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+        if (connect(sock, (sockaddr*)&a.addr, a.len) != 0 && !ConnectInProgress()) {
+            CLOSE_SOCKET(sock);
+            continue;
+        }
+        c.attempts.emplace_back(sock, index);
+        return true;
+    }
+    return false;
+}
+
+// Moves a connect along, waiting at most wait_ms for something to happen.
+// Returns what SessionPollConnect does: 0 still connecting, 1 connected, 2 failed, 3 host not found
+double StepConnect(ClientSession& s, int wait_ms) {
+    ConnectRace& c = s.connect;
+    auto now = std::chrono::steady_clock::now();
+
+    if (c.state == CONNECT_RESOLVING) {
+        auto until = std::min(c.deadline, now + std::chrono::milliseconds(wait_ms));
+        std::unique_lock<std::mutex> lock(c.resolve->mutex);
+        if (!c.resolve->ready.wait_until(lock, until, [&] { return c.resolve->done; })) {
+            lock.unlock();
+            if (std::chrono::steady_clock::now() >= c.deadline) StopConnect(s, CONNECT_FAILED);
+            return c.state == CONNECT_FAILED ? 2.0 : 0.0;
+        }
+        c.addresses.swap(c.resolve->addresses);
+        lock.unlock();
+        c.resolve.reset();
+        if (c.addresses.empty()) {
+            StopConnect(s, CONNECT_NO_HOST);
+            return 3.0;
+        }
+        c.state = CONNECT_RACING;
+        c.next = 0;
+        c.nextAttempt = now;
+        wait_ms = 0; // the lookup used up the wait, connect attempts start on the next call
+    }
+
+    if (c.state != CONNECT_RACING) {
+        if (c.state == CONNECT_DONE) return 1.0;
+        if (c.state == CONNECT_NO_HOST) return 3.0;
+        return 2.0;
+    }
+
+    // Happy eyeballs: the next address joins in every CONNECT_STAGGER_MS (or as soon as
+    // an attempt fails) and the first one that connects wins
+    if (now >= c.nextAttempt || c.attempts.empty()) {
+        if (StartAttempt(s)) c.nextAttempt = now + std::chrono::milliseconds(CONNECT_STAGGER_MS);
+    }
+    if (c.attempts.empty()) {
+        StopConnect(s, CONNECT_FAILED);
+        return 2.0;
+    }
+
+    auto until = std::min(c.deadline, now + std::chrono::milliseconds(wait_ms));
+    if (c.next < c.addresses.size()) until = std::min(until, c.nextAttempt);
+    int timeout = (int)std::max<int64_t>(0, std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count());
+
+    std::vector<PollFd> fds(c.attempts.size());
+    for (size_t i = 0; i < fds.size(); i++) {
+        fds[i].fd = c.attempts[i].first;
+        fds[i].events = POLLOUT;
+    }
+    if (PollSockets(fds.data(), fds.size(), timeout) > 0) {
+        for (size_t i = fds.size(); i-- > 0;) {
+            if (!fds[i].revents) continue;
+            SocketHandle sock = c.attempts[i].first;
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &len) == 0 && error == 0 && SetBlocking(sock, true)) {
+                ResolvedAddress winner = c.addresses[c.attempts[i].second];
+                c.attempts.erase(c.attempts.begin() + i);
+                StopConnect(s, CONNECT_DONE);
+                s.sock = sock;
+                PromoteCachedAddress(c.host, winner);
+                return 1.0;
+            }
+            CLOSE_SOCKET(sock);
+            c.attempts.erase(c.attempts.begin() + i);
+            c.nextAttempt = now; // a refused address hands its turn on right away
+        }
+    }
+
+    if (std::chrono::steady_clock::now() >= c.deadline) {
+        StopConnect(s, CONNECT_FAILED);
+        return 2.0;
+    }
+    if (c.attempts.empty() && c.next >= c.addresses.size()) {
+        StopConnect(s, CONNECT_FAILED);
+        return 2.0;
+    }
+    return 0.0;
+}
+
+// player id, then the accepted features and the UDP port and token if we asked for any
+double FinishGameStart(ClientSession& s, uint32_t my_player_id, uint32_t accepted, uint16_t udp_port, uint32_t token) {
+    CloseUdp(s);
+    s.acceptedFeatures = accepted;
+    s.stepTick = 0;
+    s.frameTick = 0;
+    s.framesSinceSubmit = 0;
+    s.submitDue = false;
+    s.stepInFlight = false;
+    if ((accepted & MATCH_FEATURE_UDP) && !OpenUdp(s, udp_port, token)) return -3.0;
+    return (double)my_player_id;
+}
+
+// Async calls: true once the inbox holds everything the pending call waits for,
+// which is then taken out of it
+bool TryFinishPending(ClientSession& s) {
+    const char* p = s.inbox.data();
+    size_t have = s.inbox.size();
+    uint32_t first = 0;
+    if (have < sizeof(first)) return false;
+    memcpy(&first, p, sizeof(first));
+
+    size_t used = 0;
+    if (s.pending == PENDING_GAME_START) {
+        uint32_t accepted = 0;
+        uint16_t udp_port = 0;
+        uint32_t token = 0;
+        used = sizeof(first);
+        if (s.askedFeatures) {
+            if (have < used + sizeof(accepted)) return false;
+            memcpy(&accepted, p + used, sizeof(accepted));
+            used += sizeof(accepted);
+            if (accepted & MATCH_FEATURE_UDP) {
+                if (have < used + sizeof(udp_port) + sizeof(token)) return false;
+                memcpy(&udp_port, p + used, sizeof(udp_port));
+                memcpy(&token, p + used + sizeof(udp_port), sizeof(token));
+                used += sizeof(udp_port) + sizeof(token);
+            }
+        }
+        s.askedFeatures = false;
+        double id = FinishGameStart(s, first, accepted, udp_port, token);
+        s.playerId = (int)id;
+        s.result = id >= 0 ? 1 : -1;
+    } else {
+        uint32_t count = first & ~(FRAME_COMPRESSED | FRAME_TICK_TAGGED);
+        // the frame number and packed size words that follow the count
+        size_t header = sizeof(first) + ((first & FRAME_TICK_TAGGED) ? sizeof(uint32_t) : 0);
+        if (first & FRAME_COMPRESSED) {
+            uint32_t packed_size = 0;
+            if (have < header + sizeof(packed_size)) return false;
+            memcpy(&packed_size, p + header, sizeof(packed_size));
+            header += sizeof(packed_size);
+            used = header + packed_size;
+        } else {
+            used = header + (size_t)count * sizeof(Command);
+        }
+        if (have < used) return false;
+
+        if (first & FRAME_TICK_TAGGED) memcpy(&s.frameTick, p + sizeof(first), sizeof(s.frameTick));
+        else s.frameTick++;
+        ResetUnprocessed(s, 0);
+        if (first & FRAME_COMPRESSED) {
+            s.result = DeliverPacked(s, p + header, used - header, count) ? 1 : -1;
+        } else {
+            DeliverFrame(s, (const Command*)(p + header), count);
+            s.result = 1;
+        }
+    }
+    s.inbox.erase(s.inbox.begin(), s.inbox.begin() + used);
+    s.pending = PENDING_NONE;
+    return true;
+}
+
+// takes what the socket has for a pending async call without waiting.
+// The call fails if the connection is gone
+void ReadPendingNow(ClientSession& s) {
+    char buffer[65536];
+    int bytes;
+    while (!TryFinishPending(s) && (bytes = RecvNow(s.sock, buffer, sizeof(buffer))) != -1) {
+        if (bytes == 0) {
+            s.pending = PENDING_NONE;
+            s.result = -1;
+            return;
+        }
+        s.inbox.insert(s.inbox.end(), buffer, buffer + bytes);
+    }
+}
+
+void CloseSession(ClientSession& s) {
+    CloseUdp(s);
+    s.hasStateHash = false;
+    s.shared = nullptr;
+    s.sharedCapacity = 0;
+    s.commandBuffer.clear();
+    ResetUnprocessed(s, 0);
+    s.inbox.clear();
+    s.lobbyIn.clear();
+    s.lobbyRead = 0;
+    s.lobbyLines = 0;
+    s.lobbyClosed = false;
+    s.lobbyBinary = false;
+    s.lobbyGreeting = false;
+    s.pending = PENDING_NONE;
+    s.result = 0;
+    s.askedFeatures = false;
+    s.acceptedFeatures = 0;
+    s.stepInFlight = false;
+    StopConnect(s, CONNECT_IDLE);
+    if (s.sock != -1) {
+        CLOSE_SOCKET(s.sock);
+        s.sock = -1;
+    }
+    if (s.wsaStarted) {
+        s.wsaStarted = false;
+        #ifdef _WIN32
+            WSACleanup();
+        #endif
+    }
+}
+
 extern "C" {
 
+    // SESSIONS
+
+    // a new connection slot, connect it with SessionConnect. Returns its handle (>= 1)
+    EXPORT_API double CreateSession() {
+        DefaultSession();
+        uint32_t handle;
+        if (!gFreeSessions.empty()) {
+            handle = gFreeSessions.back();
+            gFreeSessions.pop_back();
+        } else {
+            handle = gSessions.size();
+            gSessions.emplace_back(new ClientSession());
+        }
+        gSessions[handle]->in_use = true;
+        return handle;
+    }
+
+    // closes the session's connection, the handle may come back from a later CreateSession
+    EXPORT_API double DestroySession(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || handle == 0) return 0.0;
+        CloseSession(*s);
+        s->in_use = false;
+        gFreeSessions.push_back((uint32_t)handle);
+        return 1.0;
+    }
+
     // CONNECT
-    EXPORT_API double DLLConnect(const char* address, double port_double) {
-        int port = (int)port_double;
-        
+
+    // starts connecting without blocking, SessionPollConnect tells when it is done.
+    // Host names are looked up on a thread and cached for a minute, the addresses
+    // (IPv4 and IPv6) are raced a little apart and the first to connect is kept
+    EXPORT_API double SessionConnectAsync(double handle, const char* address, double port_double, double timeout_ms) {
+        ClientSession* s = FindSession(handle);
+        if (!s || address == nullptr) return 0.0;
+
         // Cleanup previous connection if necessary
-        if (gSocket != -1) { CLOSE_SOCKET(gSocket); gSocket = -1; }
-        
+        CloseSession(*s);
+
         #ifdef _WIN32
             WSADATA wsaData;
-            if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return -1.0; 
+            if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) return -1.0;
         #endif
+        s->wsaStarted = true;
 
-        SocketHandle sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == INVALID_SOCKET) {
-            #ifdef _WIN32
-                WSACleanup();
-            #endif
-            return 0.0;
-        }
+        ConnectRace& c = s->connect;
+        c.host = address;
+        c.port = (uint16_t)port_double;
+        c.addresses.clear();
+        c.next = 0;
+        c.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64_t)timeout_ms);
+        c.nextAttempt = std::chrono::steady_clock::now();
 
-        struct hostent* host = gethostbyname(address);
-        if (host == nullptr) {
-            CLOSE_SOCKET(sock);
-            #ifdef _WIN32
-                WSACleanup();
-            #endif
-            return 1.0; // Host not found error
+        // an IP address or a name looked up not long ago needs no lookup
+        if (ResolveHost(c.host, AI_NUMERICHOST, c.addresses) || CachedAddresses(c.host, c.addresses)) {
+            c.state = CONNECT_RACING;
+            return 1.0;
         }
 
-        sockaddr_in sendSockAddr;
-        memset((char*)&sendSockAddr, 0, sizeof(sendSockAddr));
-        sendSockAddr.sin_family = AF_INET;
-        memcpy(&sendSockAddr.sin_addr, host->h_addr_list[0], host->h_length);
-        sendSockAddr.sin_port = htons(port);
+        std::shared_ptr<PendingResolve> resolve = std::make_shared<PendingResolve>();
+        c.resolve = resolve;
+        c.state = CONNECT_RESOLVING;
+        std::string host = c.host;
+        std::thread([resolve, host] {
+            std::vector<ResolvedAddress> addresses;
+            if (ResolveHost(host, 0, addresses)) CacheAddresses(host, addresses);
+            std::lock_guard<std::mutex> lock(resolve->mutex);
+            resolve->addresses = addresses;
+            resolve->done = true;
+            resolve->ready.notify_all();
+        }).detach();
+        return 1.0;
+    }
 
-        if (connect(sock, (sockaddr*)&sendSockAddr, sizeof(sendSockAddr)) != 0) {
-            CLOSE_SOCKET(sock);
-            #ifdef _WIN32
-                WSACleanup();
-            #endif
-            return 2.0; // Connection failed
-        }
+    // 0 still connecting, 1 connected, 2 could not connect (refused, unreachable or timed out), 3 host not found
+    EXPORT_API double SessionPollConnect(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return 2.0;
+        return StepConnect(*s, 0);
+    }
 
-        gSocket = sock;
-        return 1.0; 
+    // blocking connect, at most CONNECT_TIMEOUT_MS
+    EXPORT_API double SessionConnect(double handle, const char* address, double port_double) {
+        double started = SessionConnectAsync(handle, address, port_double, CONNECT_TIMEOUT_MS);
+        if (started != 1.0) return started;
+        ClientSession* s = FindSession(handle);
+        double result;
+        while ((result = StepConnect(*s, CONNECT_TIMEOUT_MS)) == 0.0) {}
+        return result;
     }
 
     //LOBBY TEXT FUNCTIONS
-    
-    EXPORT_API double SendLobbyMessage(const char* msg) {
-        if (gSocket == -1) return 5.0;
+
+    EXPORT_API double SessionSendLobbyMessage(double handle, const char* msg) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return 5.0;
+        if (s->lobbyBinary) return SendLobbyText(*s, msg) ? 1.0 : 4.0;
         std::string message(msg);
-        
+
         // Send the message, assuming the GML adds the necessary "\n"
-        if (send(gSocket, message.c_str(), message.length(), 0) < 0) return 4.0;
+        if (send(s->sock, message.c_str(), message.length(), 0) < 0) return 4.0;
         return 1.0;
     }
 
-    
-    EXPORT_API double ReadLobbyMessage(char* buffer_out, double max_len) {
-        if (gSocket == -1) return 0.0;
-        //Try to read new data into the persistent buffer
-        
-        //NON-BLOCKING  using select
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(gSocket, &readfds);
-        struct timeval timeout = {0, 0}; 
-
-        if (select(gSocket + 1, &readfds, NULL, NULL, &timeout) > 0) {
-            char temp_buffer[1024];
-            memset(temp_buffer, 0, 1024);
-            
-            // Read data without waiting.
-            int bytes = recv(gSocket, temp_buffer, 1024, 0);
-
-            if (bytes > 0) {
-                //send to output buffer
-                int to_copy = (bytes < (int)max_len - 1) ? bytes : (int)max_len - 1;
-                memcpy(buffer_out, temp_buffer, to_copy);
-                buffer_out[to_copy] = '\0'; // Null-terminate
-                return (double)to_copy;
-            } else if (bytes == 0) {
-                // Socket disconnected
-                gSocket = -1;
-                return -1.0; 
+
+    // NON-BLOCKING: the next whole line the server sent, with its "\n", or 0 if none
+    // has arrived yet. Only takes off the socket when no line is waiting already
+    EXPORT_API double SessionReadLobbyMessage(double handle, char* buffer_out, double max_len) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || max_len < 2 || s->lobbyBinary) return 0.0;
+        if (s->lobbyRead >= s->lobbyLines) FillLobby(*s);
+
+        const char* line;
+        size_t len;
+        if (!NextLobbyLine(*s, line, len)) {
+            if (!s->lobbyClosed) return 0.0; // No complete message found yet
+            // Socket disconnected
+            s->sock = -1;
+            return -1.0;
+        }
+        //send to output buffer, a line too long for it is cut
+        size_t to_copy = std::min(len, (size_t)max_len - 2);
+        memcpy(buffer_out, line, to_copy);
+        buffer_out[to_copy++] = '\n';
+        buffer_out[to_copy] = '\0'; // Null-terminate
+        return (double)to_copy;
+    }
+
+    // NON-BLOCKING: every whole line waiting, in one call (layout in client.h).
+    // Returns how many, 0 if none, -1 once the server hung up and all lines are read
+    EXPORT_API double SessionReadLobbyMessages(double handle, char* buffer_out, double size) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || size < 16 || s->lobbyBinary) return 0.0;
+        FillLobby(*s);
+
+        // the text goes after the offset table, so first see how many lines fit
+        static std::vector<std::pair<size_t, size_t>> picked;
+        picked.clear();
+        size_t capacity = (size_t)size;
+        size_t text = 0;
+        while (true) {
+            size_t before = s->lobbyRead;
+            const char* line;
+            size_t len;
+            if (!NextLobbyLine(*s, line, len)) break;
+            if ((picked.size() + 2) * sizeof(uint32_t) + text + len + 1 > capacity) {
+                if (!picked.empty()) {
+                    s->lobbyRead = before; // left for the next call
+                    break;
+                }
+                len = capacity - 2 * sizeof(uint32_t) - 1; // one line bigger than the whole buffer is cut
             }
+            picked.emplace_back(line - s->lobbyIn.data(), len);
+            text += len + 1;
+        }
+
+        uint32_t count = picked.size();
+        if (count == 0) {
+            if (!s->lobbyClosed) return 0.0;
+            s->sock = -1;
+            return -1.0;
+        }
+        memcpy(buffer_out, &count, sizeof(count));
+        uint32_t end = (count + 1) * sizeof(uint32_t);
+        for (uint32_t i = 0; i < count; i++) {
+            memcpy(buffer_out + (i + 1) * sizeof(uint32_t), &end, sizeof(end));
+            memcpy(buffer_out + end, s->lobbyIn.data() + picked[i].first, picked[i].second);
+            end += picked[i].second;
+            buffer_out[end++] = '\0';
+        }
+        return count;
+    }
+
+    // switches the session to binary lobby frames, best right after connecting.
+    // The server confirms with a REPLY_WELCOME
+    EXPORT_API double SessionUseBinaryLobby(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return 5.0;
+        if (s->lobbyBinary) return 1.0;
+        // lines already framed were read as text, what follows them is ours
+        s->lobbyIn.erase(0, s->lobbyLines);
+        s->lobbyRead = 0;
+        s->lobbyLines = 0;
+        s->lobbyBinary = true;
+        s->lobbyGreeting = true;
+        char hello = (char)LOBBY_BINARY_HELLO;
+        if (!SendAll(*s, &hello, 1)) return 4.0;
+        return 1.0;
+    }
+
+    EXPORT_API double SessionSendLobbyCommand(double handle, double type, double number, const char* text) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || !s->lobbyBinary) return 5.0;
+        if (!SendLobbyFrame(*s, (uint8_t)type, (uint32_t)number, text ? text : "", text ? strlen(text) : 0)) return 4.0;
+        return 1.0;
+    }
+
+    // NON-BLOCKING: the type of the next reply, its fields stay until the next call
+    EXPORT_API double SessionReadLobbyReply(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || !s->lobbyBinary) return 0.0;
+        if (s->lobbyRead >= s->lobbyLines) FillLobby(*s);
+        int type = NextLobbyReply(*s);
+        if (type == 0 && s->lobbyClosed) {
+            s->sock = -1;
+            return -1.0;
+        }
+        return type;
+    }
+
+    EXPORT_API double SessionLobbyReplyCount(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return 0.0;
+        return (double)std::max(s->replyInts.size(), s->replyStrings.size());
+    }
+
+    EXPORT_API double SessionLobbyReplyInt(double handle, double index) {
+        ClientSession* s = FindSession(handle);
+        if (!s || index < 0 || index >= s->replyInts.size()) return 0.0;
+        return s->replyInts[(size_t)index];
+    }
+
+    EXPORT_API double SessionLobbyReplyString(double handle, double index, char* buffer_out, double max_len) {
+        ClientSession* s = FindSession(handle);
+        if (!s || max_len < 1) return 0.0;
+        if (index < 0 || index >= s->replyStrings.size()) {
+            buffer_out[0] = '\0';
+            return 0.0;
+        }
+        const auto& str = s->replyStrings[(size_t)index];
+        size_t len = std::min((size_t)str.second, (size_t)max_len - 1);
+        memcpy(buffer_out, s->replyText.data() + str.first, len);
+        buffer_out[len] = '\0';
+        return (double)len;
+    }
+
+    // answers MATCH_START, asking for the MATCH_FEATURE_* bits in features
+    // (1 UDP, 2 packed frames, 4 tick numbers, any sum). The server may turn any of them down
+    EXPORT_API double SessionSendMatchAck(double handle, double features) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return 5.0;
+        uint32_t asked = (uint32_t)features;
+        string ack = "ACK";
+        if (asked & MATCH_FEATURE_UDP) ack += " UDP";
+        if (asked & MATCH_FEATURE_COMPRESS) ack += " COMPRESS";
+        if (asked & MATCH_FEATURE_TICKS) ack += " TICKS";
+        s->askedFeatures = asked != 0;
+        LobbyToInbox(*s);
+        if (s->lobbyBinary) {
+            // a binary ACK always gets the accepted mask back. The lobby after the match is binary too
+            s->askedFeatures = true;
+            if (!SendLobbyFrame(*s, LOBBY_ACK, asked, nullptr, 0)) return 4.0;
+            return 1.0;
         }
-        return 0.0; // No complete message found yet
+        if (!SendText(s->sock, ack)) return 4.0;
+        return 1.0;
     }
-    
+
     // using ack to make the switch to other network style
-    EXPORT_API double WaitForGameStart() {
-        if (gSocket == -1) return -1.0;
+    EXPORT_API double SessionWaitForGameStart(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return -1.0;
 
         uint32_t my_player_id = 99;
-        
-        if (!RecieveData((char*)&my_player_id, sizeof(my_player_id))) {
+
+        if (!RecieveData(*s, (char*)&my_player_id, sizeof(my_player_id))) {
             return -2.0;
         }
-        return (double)my_player_id;
+
+        uint32_t accepted = 0;
+        uint16_t udp_port = 0;
+        uint32_t token = 0;
+        if (s->askedFeatures) {
+            s->askedFeatures = false;
+            if (!RecieveData(*s, (char*)&accepted, sizeof(accepted))) return -2.0;
+            if (accepted & MATCH_FEATURE_UDP) {
+                if (!RecieveData(*s, (char*)&udp_port, sizeof(udp_port)) ||
+                    !RecieveData(*s, (char*)&token, sizeof(token))) return -2.0;
+            }
+        }
+        return FinishGameStart(*s, my_player_id, accepted, udp_port, token);
     }
 
     // adds command to internal queue to be sent on next SendStep
-    EXPORT_API void AddLocalCommand(double unit_id, double cmd_type, double tx, double ty) {
+    EXPORT_API void SessionAddLocalCommand(double handle, double unit_id, double cmd_type, double tx, double ty) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return;
         Command cmd;
         cmd.unit_id = (uint32_t)unit_id;
         cmd.command_type = (uint32_t)cmd_type;
-        cmd.unit_type = 0; 
+        cmd.unit_type = 0;
         cmd.target_x = tx;
         cmd.target_y = ty;
-        gCommandBuffer.push_back(cmd);
+        QueueCommand(*s, cmd);
     }
     //specific command helpers
-    EXPORT_API void addPlaceCommand(double unit_type, double tx, double ty) {
+    EXPORT_API void SessionAddPlaceCommand(double handle, double unit_type, double tx, double ty) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return;
         Command cmd;
         cmd.unit_id = 0;
-        cmd.command_type = 3; 
+        cmd.command_type = 3;
         cmd.unit_type = (uint32_t)unit_type;
         cmd.target_x = tx;
         cmd.target_y = ty;
-        gCommandBuffer.push_back(cmd);
+        QueueCommand(*s, cmd);
     }
 
-    EXPORT_API void addEndGameCommand(double winner_id) {
+    EXPORT_API void SessionAddEndGameCommand(double handle, double winner_id) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return;
+        Command cmd;
+        cmd.unit_id = 0;
+        cmd.command_type = 4;
+        cmd.unit_type = 0;
+        cmd.target_x = winner_id;
+        cmd.target_y = 0;
+        QueueCommand(*s, cmd);
+    }
+
+    // tells the server one of our units is gone so its id can be reused
+    EXPORT_API void SessionAddUnitDiedCommand(double handle, double unit_id) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return;
         Command cmd;
-        cmd.unit_id = 0; 
-        cmd.command_type = 4; 
+        cmd.unit_id = (uint32_t)unit_id;
+        cmd.command_type = 5;
         cmd.unit_type = 0;
-        cmd.target_x = winner_id; 
+        cmd.target_x = 0;
         cmd.target_y = 0;
-        gCommandBuffer.push_back(cmd);
+        QueueCommand(*s, cmd);
     }
 
     //BLOCKING: sends all of the queued commands to the server and waits for acknowledgment
-    EXPORT_API double SendStep() {
-        if (gSocket == -1) return 0.0;
+    EXPORT_API double SessionSendStep(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return 0.0;
+        if (s->udpSocket != INVALID_SOCKET) return UdpSendStep(*s);
+
+        if (!SendTcpStep(*s)) return 0.0;
+        if (!ReceiveFrame(*s)) return 0.0;
+        return 1.0;
+    }
+
+    // hash of the game state after the last frame applied, sent with the next SendStep
+    // and compared with the other player's by the server. Two 32 bit halves since a
+    // GameMaker real can't hold all 64 bits
+    EXPORT_API void SessionSetStateHash(double handle, double hash_hi, double hash_lo) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return;
+        s->stateHash = ((uint64_t)(uint32_t)hash_hi << 32) | (uint32_t)hash_lo;
+        s->hasStateHash = true;
+    }
 
-        uint32_t command_count = static_cast<uint32_t>(gCommandBuffer.size());
-        if (send(gSocket, (char*)&command_count, sizeof(command_count), 0) == SOCKET_ERROR) return 0.0;
 
-        if (command_count > 0) {
-            int local_data_size = command_count * sizeof(Command);
-            if (send(gSocket, (const char*)gCommandBuffer.data(), local_data_size, 0) < 0) return 0.0;
+    //checks to see if there are unprocessed commands from the last SendStep
+    EXPORT_API double SessionHasUnprocessedCommands(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return 0.0;
+        return s->nextUnprocessed < s->unprocessedCommands.size() ? 1.0 : 0.0;
+    }
+    // retrieves the next unprocessed command into the provided buffer
+    EXPORT_API double SessionGetNextCommand(double handle, const char* buffer_address) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->nextUnprocessed >= s->unprocessedCommands.size()) return 0.0;
+
+        const Command& cmd = s->unprocessedCommands[s->nextUnprocessed++];
+
+        uint8_t* p_buffer = (uint8_t*)buffer_address;
+        memcpy(p_buffer, &cmd, sizeof(Command));
+
+        return 1.0;
+    }
+    // shared buffer mode, see client.h. size is the buffer's size in bytes, 0 turns the mode off.
+    // Returns how many commands each region holds, 0 if the buffer is too small
+    EXPORT_API double SessionRegisterCommandBuffer(double handle, const char* buffer_address, double size) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return 0.0;
+        s->shared = nullptr;
+        s->sharedCapacity = 0;
+        if (buffer_address == nullptr || size < SHARED_OUT_COMMANDS + 2 * sizeof(Command)) return 0.0;
+
+        s->shared = (char*)buffer_address;
+        s->sharedCapacity = (uint32_t)((size - SHARED_OUT_COMMANDS) / (2 * sizeof(Command)));
+        SharedSet(*s, SHARED_OUT_COUNT, 0);
+        SharedSet(*s, SHARED_IN_COUNT, 0);
+        SharedSet(*s, SHARED_CAPACITY, s->sharedCapacity);
+        // commands added before the switch still go out with the next step
+        std::vector<Command> queued;
+        queued.swap(s->commandBuffer);
+        for (const Command& cmd : queued) QueueCommand(*s, cmd);
+        return s->sharedCapacity;
+    }
+
+    // ASYNC: for one thread driving many sessions (bots, load tests). Start the wait
+    // on each session, then call PollSessions until SessionResult says it is done
+
+    // WaitForGameStart without blocking, after SessionSendMatchAck.
+    // SessionPlayerId has the id once SessionResult is 1
+    EXPORT_API double SessionWaitForGameStartAsync(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || s->pending != PENDING_NONE) return 0.0;
+        s->pending = PENDING_GAME_START;
+        s->result = 0;
+        s->playerId = -1;
+        return 1.0;
+    }
+
+    // SendStep without blocking: the step goes out now, the frame arrives through PollSessions.
+    // A UDP match has its own resend loop, so there this is the blocking SendStep
+    EXPORT_API double SessionSendStepAsync(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1 || s->pending != PENDING_NONE) return 0.0;
+        if (s->udpSocket != INVALID_SOCKET) {
+            s->result = UdpSendStep(*s) == 1.0 ? 1 : -1;
+            return 1.0;
         }
+        if (!SendTcpStep(*s)) return 0.0;
+        s->pending = PENDING_FRAME;
+        s->result = 0;
+        return 1.0;
+    }
 
-        uint32_t num_acked_commands = 0;
-        if (!RecieveData((char*)&num_acked_commands, sizeof(num_acked_commands))) return 0.0;
+    // waits up to timeout_ms for any session with an async call going, reads what arrived
+    // and finishes the calls that have all their bytes. Returns how many finished
+    EXPORT_API double PollSessions(double timeout_ms) {
+        static std::vector<PollFd> fds;
+        static std::vector<ClientSession*> polled;
+        fds.clear();
+        polled.clear();
+        int finished = 0;
+        for (auto& slot : gSessions) {
+            ClientSession& s = *slot;
+            if (!s.in_use || s.pending == PENDING_NONE) continue;
+            if (TryFinishPending(s)) {
+                finished++;
+                continue;
+            }
+            PollFd fd = {};
+            fd.fd = s.sock;
+            fd.events = POLLIN;
+            fds.push_back(fd);
+            polled.push_back(&s);
+        }
+        if (fds.empty()) return finished;
 
-        unprocessedCommands.clear();
-        if (num_acked_commands > 0) {
-            int acked_data_size = num_acked_commands * sizeof(Command);
-            unprocessedCommands.resize(num_acked_commands);
-            if (!RecieveData((char*)unprocessedCommands.data(), acked_data_size)) return 0.0;
+        int ready = PollSockets(fds.data(), fds.size(), finished > 0 ? 0 : (int)timeout_ms);
+        if (ready <= 0) return finished;
+        char buffer[65536];
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!fds[i].revents) continue;
+            ClientSession& s = *polled[i];
+            int bytes = recv(s.sock, buffer, sizeof(buffer), 0);
+            if (bytes <= 0) {
+                s.pending = PENDING_NONE;
+                s.result = -1;
+                finished++;
+                continue;
+            }
+            s.inbox.insert(s.inbox.end(), buffer, buffer + bytes);
+            if (TryFinishPending(s)) finished++;
         }
+        return finished;
+    }
+
+    // the last async call of the session: 0 still waiting, 1 done, -1 failed (connection lost)
+    EXPORT_API double SessionResult(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return -1.0;
+        return s->result;
+    }
 
-        gCommandBuffer.clear();
-        return 1.0; 
+    EXPORT_API double SessionPlayerId(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return -1.0;
+        return s->playerId;
     }
 
+    // TICK PACING: the game runs at its frame rate and the match at a tick rate ratio
+    // times slower. Commands added over ratio render frames go out as one step
+
+    EXPORT_API double SessionSetTickRatio(double handle, double ratio) {
+        ClientSession* s = FindSession(handle);
+        if (!s || ratio < 1) return 0.0;
+        s->tickRatio = (uint32_t)ratio;
+        return 1.0;
+    }
+
+    // call once every render frame instead of SendStep. Every tickRatio-th call submits
+    // what was added since the last submission, a frame still on its way delays that
+    // until it is in rather than blocking. Returns the number of the frame that came in
+    // during this call (its commands are ready to read), 0 if none, -1 if the connection is gone
+    EXPORT_API double SessionFrameStep(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s || s->sock == -1) return -1.0;
+        double ready = 0.0;
+        if (s->stepInFlight) {
+            int done;
+            if (s->acceptedFeatures & MATCH_FEATURE_UDP) {
+                done = UdpPoll(*s, 0);
+            } else {
+                // PollSessions may have finished it already
+                if (s->pending == PENDING_FRAME) ReadPendingNow(*s);
+                done = s->pending == PENDING_NONE ? s->result : 0;
+            }
+            if (done < 0) return -1.0;
+            if (done > 0) {
+                s->stepInFlight = false;
+                ready = s->frameTick;
+            }
+        }
+
+        if (++s->framesSinceSubmit >= s->tickRatio) {
+            s->framesSinceSubmit = 0;
+            s->submitDue = true;
+        }
+        if (s->submitDue && !s->stepInFlight) {
+            // the frame is picked up by a later call, so it can't overwrite the one just reported
+            if (s->acceptedFeatures & MATCH_FEATURE_UDP) UdpSubmit(*s);
+            else if (s->pending != PENDING_NONE || !SessionSendStepAsync(handle)) return -1.0;
+            s->submitDue = false;
+            s->stepInFlight = true;
+        }
+        return ready;
+    }
+
+    // number of the last frame handed to the game, frames count from 1
+    EXPORT_API double SessionGetFrameTick(double handle) {
+        ClientSession* s = FindSession(handle);
+        if (!s) return 0.0;
+        return s->frameTick;
+    }
+
+    // THE DEFAULT SESSION: the original API, every call goes to session 0
+
+    EXPORT_API double DLLConnect(const char* address, double port_double) {
+        return SessionConnect(0, address, port_double);
+    }
+
+    EXPORT_API double ConnectAsync(const char* address, double port_double, double timeout_ms) {
+        return SessionConnectAsync(0, address, port_double, timeout_ms);
+    }
+
+    EXPORT_API double PollConnect() {
+        return SessionPollConnect(0);
+    }
+
+    EXPORT_API double SendLobbyMessage(const char* msg) {
+        return SessionSendLobbyMessage(0, msg);
+    }
+
+    EXPORT_API double ReadLobbyMessage(char* buffer_out, double max_len) {
+        return SessionReadLobbyMessage(0, buffer_out, max_len);
+    }
+
+    EXPORT_API double ReadLobbyMessages(char* buffer_out, double size) {
+        return SessionReadLobbyMessages(0, buffer_out, size);
+    }
+
+    EXPORT_API double UseBinaryLobby() {
+        return SessionUseBinaryLobby(0);
+    }
+
+    EXPORT_API double SendLobbyCommand(double type, double number, const char* text) {
+        return SessionSendLobbyCommand(0, type, number, text);
+    }
+
+    EXPORT_API double ReadLobbyReply() {
+        return SessionReadLobbyReply(0);
+    }
+
+    EXPORT_API double LobbyReplyCount() {
+        return SessionLobbyReplyCount(0);
+    }
+
+    EXPORT_API double LobbyReplyInt(double index) {
+        return SessionLobbyReplyInt(0, index);
+    }
+
+    EXPORT_API double LobbyReplyString(double index, char* buffer_out, double max_len) {
+        return SessionLobbyReplyString(0, index, buffer_out, max_len);
+    }
+
+    EXPORT_API double SendMatchAck(double features) {
+        return SessionSendMatchAck(0, features);
+    }
+
+    EXPORT_API double WaitForGameStart() {
+        return SessionWaitForGameStart(0);
+    }
+
+    EXPORT_API void AddLocalCommand(double unit_id, double cmd_type, double tx, double ty) {
+        SessionAddLocalCommand(0, unit_id, cmd_type, tx, ty);
+    }
+
+    EXPORT_API void addPlaceCommand(double unit_type, double tx, double ty) {
+        SessionAddPlaceCommand(0, unit_type, tx, ty);
+    }
+
+    EXPORT_API void addEndGameCommand(double winner_id) {
+        SessionAddEndGameCommand(0, winner_id);
+    }
+
+    EXPORT_API void addUnitDiedCommand(double unit_id) {
+        SessionAddUnitDiedCommand(0, unit_id);
+    }
+
+    EXPORT_API double SendStep() {
+        return SessionSendStep(0);
+    }
+
+    EXPORT_API void SetStateHash(double hash_hi, double hash_lo) {
+        SessionSetStateHash(0, hash_hi, hash_lo);
+    }
 
-    //checks to see if there are unprocessed commands from the last SendStep
     EXPORT_API double hasUnprocessedCommands() {
-        return !unprocessedCommands.empty() ? 1.0 : 0.0;
+        return SessionHasUnprocessedCommands(0);
     }
-    // retrieves the next unprocessed command into the provided buffer
+
     EXPORT_API double GetNextCommand(const char* buffer_address) {
-        if (unprocessedCommands.empty()) return 0.0; 
-        
-        Command cmd = unprocessedCommands.front();
-        unprocessedCommands.erase(unprocessedCommands.begin()); 
+        return SessionGetNextCommand(0, buffer_address);
+    }
 
-        uint8_t* p_buffer = (uint8_t*)buffer_address;
-        memcpy(p_buffer, &cmd, sizeof(Command));
-        
-        return 1.0; 
+    EXPORT_API double RegisterCommandBuffer(const char* buffer_address, double size) {
+        return SessionRegisterCommandBuffer(0, buffer_address, size);
+    }
+
+    EXPORT_API double SetTickRatio(double ratio) {
+        return SessionSetTickRatio(0, ratio);
+    }
+
+    EXPORT_API double FrameStep() {
+        return SessionFrameStep(0);
+    }
+
+    EXPORT_API double GetFrameTick() {
+        return SessionGetFrameTick(0);
     }
+
     EXPORT_API void Cleanup() {
-        if (gSocket != -1) {
-            CLOSE_SOCKET(gSocket);
-            gSocket = -1;
-        }
-        #ifdef _WIN32
-            WSACleanup();
-        #endif
+        CloseSession(DefaultSession());
     }
-}
\ No newline at end of file
+}
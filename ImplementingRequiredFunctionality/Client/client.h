@@ -20,7 +20,9 @@
     #include <unistd.h>
     #include <netdb.h> 
     #include <cstring> 
-    #include <sys/select.h> // Required for select() on Mac
+    #include <poll.h> // poll() for the session poller, select() is limited to FD_SETSIZE
+    #include <fcntl.h> // non-blocking connect
+    #include <cerrno>
     typedef int SocketHandle;
     #define INVALID_SOCKET -1
     #define SOCKET_ERROR -1
@@ -31,6 +33,12 @@
 #include <cstdint> 
 #include <vector>
 
+// Unit ids are handed out per match: player p owns ids
+// [p * UNIT_SLOTS_PER_PLAYER, (p + 1) * UNIT_SLOTS_PER_PLAYER) and id 0 is never used,
+// so units can live in a flat array indexed by unit_id. Ids of units reported
+// with addUnitDiedCommand get reused for later Place commands.
+const uint32_t UNIT_SLOTS_PER_PLAYER = 4096;
+
 #pragma pack(push, 1)
 struct Command {
     uint32_t unit_id;
@@ -41,25 +49,197 @@ struct Command {
 };
 #pragma pack(pop)
 
+// Set in the uint32 count SendStep uploads when the 8 byte state hash from
+// SetStateHash follows it, same as Server/shared.h
+const uint32_t TICK_HAS_HASH = 0x80000000u;
+// Set in the count when the uint32 number of the frame the commands are for follows it
+// (before the hash). Only sent once the server accepted MATCH_FEATURE_TICKS
+const uint32_t TICK_HAS_TAG = 0x40000000u;
+
+// Optional UDP match transport, same wire format as Server/udp_lockstep.h.
+// Ask for it with SendMatchAck(1) instead of sending "ACK" yourself, everything
+// else (WaitForGameStart, SendStep, GetNextCommand) is used exactly as over TCP
+const uint32_t MATCH_FEATURE_UDP = 1;
+
+// Optional packing of big tick frames, same format as Server/frame_codec.h. Ask for it
+// with SendMatchAck(2) (or 3 for UDP too), SendStep unpacks the frames by itself.
+// A packed frame's count has FRAME_COMPRESSED set and a uint32 packed size follows it
+const uint32_t MATCH_FEATURE_COMPRESS = 2;
+const uint32_t FRAME_COMPRESSED = 0x80000000u;
+
+// Optional tick numbers, SendMatchAck(4) (add it to the others). Steps are tagged with the
+// frame they are for and each frame's count has FRAME_TICK_TAGGED set with its uint32
+// number right after the count (before a packed size). GetFrameTick has the last one
+const uint32_t MATCH_FEATURE_TICKS = 4;
+const uint32_t FRAME_TICK_TAGGED = 0x40000000u;
+
+// Shared buffer mode. Instead of one AddLocalCommand call per command and
+// GetNextCommand per received one, the game registers one of its buffers with
+// RegisterCommandBuffer(buffer_get_address(buf), buffer_get_size(buf)) once and then
+// works on it in place. The DLL keeps using the buffer until Cleanup or another
+// RegisterCommandBuffer, so it must not be deleted or resized meanwhile.
+//  - outbound region: the game writes Commands (28 bytes each, packed) at SHARED_OUT_COMMANDS
+//    and their number at SHARED_OUT_COUNT. SendStep sends them straight from the buffer
+//    and sets the count back to 0. The Add*Command functions also write there
+//  - inbound region: after SendStep the frame's Commands are at SHARED_OUT_COMMANDS +
+//    capacity * 28 and their number at SHARED_IN_COUNT. A frame bigger than the region
+//    leaves the rest for GetNextCommand
+// Both regions hold the same number of commands (written at SHARED_CAPACITY), the server
+// takes at most 512 a player a tick by default, so about 60KB covers a full frame.
+// All counts are u32. The 12 bytes before SHARED_OUT_COMMANDS belong to the DLL
+const uint32_t SHARED_OUT_COUNT = 0;
+const uint32_t SHARED_IN_COUNT = 4;
+const uint32_t SHARED_CAPACITY = 8;
+const uint32_t SHARED_OUT_COMMANDS = 24;
+
+// Optional binary lobby, same format as Server/lobby_protocol.h. Call UseBinaryLobby
+// right after connecting, then send with SendLobbyCommand(type, number, text) and read
+// with ReadLobbyReply, which returns the reply type and keeps its fields for
+// LobbyReplyInt/LobbyReplyString:
+//   REGISTERED, LOGGED_IN: int 0 wins, string 0 name    ERROR: int 0 the LobbyError code
+//   GAMES: ints room ids           CREATED: int 0 room     ECHO, STATS, TRACE: string 0
+//   CHAT: string 0 name, string 1 text    LEADERBOARD: int i wins, string i name, best first
+// SendLobbyMessage still takes text commands and sends them as frames, PINGs are
+// answered by the DLL like in text mode. ReadLobbyMessage(s) read nothing in this mode
+const uint8_t LOBBY_BINARY_HELLO = 0xB1;
+
+enum LobbyCommandType {
+    LOBBY_REGISTER = 1, // text: the name
+    LOBBY_LIST,
+    LOBBY_CREATE,
+    LOBBY_JOIN,         // number: the room
+    LOBBY_CHAT,         // text
+    LOBBY_LEADERBOARD,
+    LOBBY_EXIT,
+    LOBBY_UNREGISTER,
+    LOBBY_STATS,
+    LOBBY_TRACE,
+    LOBBY_PING,
+    LOBBY_PONG,
+    LOBBY_ACK,          // number: the MATCH_FEATURE_* bits, SendMatchAck sends it for you
+};
+
+enum LobbyReplyType {
+    REPLY_WELCOME = 64,
+    REPLY_REGISTERED,
+    REPLY_LOGGED_IN,
+    REPLY_ERROR,
+    REPLY_GAMES,
+    REPLY_CREATED,
+    REPLY_MATCH_START,
+    REPLY_ECHO,
+    REPLY_CHAT,
+    REPLY_LEADERBOARD,
+    REPLY_STATS,
+    REPLY_TRACE,
+    REPLY_GOODBYE,
+    REPLY_UNREGISTERED,
+    REPLY_PING,
+    REPLY_PONG,
+};
+
+#pragma pack(push, 1)
+struct UdpInputHeader {
+    uint32_t token;
+    uint32_t frame_ack;
+    uint32_t first_tick;
+    uint32_t tick_count;
+};
+
+struct UdpFrameHeader {
+    uint32_t input_ack;
+    uint32_t first_tick;
+    uint32_t tick_count;
+};
+#pragma pack(pop)
+
 extern "C" {
     // 1. CONNECT ONLY
+    // 1 connected, 2 could not connect, 3 host not found. Gives up after 10 seconds
     EXPORT_API double DLLConnect(const char* address, double port_double);
+    // same without blocking the game: start it, then call PollConnect every step
+    // until it is not 0 (same results as DLLConnect)
+    EXPORT_API double ConnectAsync(const char* address, double port_double, double timeout_ms);
+    EXPORT_API double PollConnect();
     
     // 2. LOBBY FUNCTIONS
     EXPORT_API double SendLobbyMessage(const char* msg);
-    EXPORT_API double ReadLobbyMessage(char* buffer_out, double max_len);
+    EXPORT_API double ReadLobbyMessage(char* buffer_out, double max_len); // one whole line with its "\n", 0 if none yet
+    // Every whole line waiting at once. buffer_out gets a u32 count, then count u32
+    // offsets (from the start of the buffer) of the lines, each without its line break
+    // and null terminated. Lines that don't fit stay for the next call
+    EXPORT_API double ReadLobbyMessages(char* buffer_out, double size);
+    // binary lobby, see above. ReadLobbyReply: the reply type, 0 if none yet, -1 once the server hung up
+    EXPORT_API double UseBinaryLobby();
+    EXPORT_API double SendLobbyCommand(double type, double number, const char* text);
+    EXPORT_API double ReadLobbyReply();
+    EXPORT_API double LobbyReplyCount(); // of ints or strings, whichever the reply has more of
+    EXPORT_API double LobbyReplyInt(double index);
+    EXPORT_API double LobbyReplyString(double index, char* buffer_out, double max_len); // its length, null terminated
     
     // 3. START GAME
+    EXPORT_API double SendMatchAck(double features); // answers MATCH_START, optionally asking for UDP (1), packed frames (2), tick numbers (4)
     EXPORT_API double WaitForGameStart();
 
     // 4. GAME FUNCTIONS
     EXPORT_API void AddLocalCommand(double unit_id, double cmd_type, double tx, double ty);
     EXPORT_API void addPlaceCommand(double unit_type, double tx, double ty);
     EXPORT_API void addEndGameCommand(double winner_id);
+    EXPORT_API void addUnitDiedCommand(double unit_id);
+    EXPORT_API void SetStateHash(double hash_hi, double hash_lo); // optional, for the next SendStep only
     EXPORT_API double SendStep();
     EXPORT_API double hasUnprocessedCommands();
     EXPORT_API double GetNextCommand(const char* buffer_address);
+    EXPORT_API double RegisterCommandBuffer(const char* buffer_address, double size); // shared buffer mode, see above
+    // Tick pacing. Instead of SendStep every frame call FrameStep once per render frame:
+    // commands added over ratio frames go out as one step without ever waiting for the
+    // server. FrameStep returns the number of a frame whose commands just came in, 0 if
+    // none did this frame, -1 if the connection is gone
+    EXPORT_API double SetTickRatio(double ratio);
+    EXPORT_API double FrameStep();
+    EXPORT_API double GetFrameTick(); // number of the last frame received, from 1
     EXPORT_API void Cleanup();
+
+    // 5. SESSIONS
+    // Everything above works on the default session (handle 0). For more connections in
+    // one process (bots, load tests) create sessions and pass the handle as the first
+    // argument, each Session* call behaves like the function of the same name.
+    EXPORT_API double CreateSession();
+    EXPORT_API double DestroySession(double handle);
+    EXPORT_API double SessionConnect(double handle, const char* address, double port_double);
+    EXPORT_API double SessionConnectAsync(double handle, const char* address, double port_double, double timeout_ms);
+    EXPORT_API double SessionPollConnect(double handle);
+    EXPORT_API double SessionSendLobbyMessage(double handle, const char* msg);
+    EXPORT_API double SessionReadLobbyMessage(double handle, char* buffer_out, double max_len);
+    EXPORT_API double SessionReadLobbyMessages(double handle, char* buffer_out, double size);
+    EXPORT_API double SessionUseBinaryLobby(double handle);
+    EXPORT_API double SessionSendLobbyCommand(double handle, double type, double number, const char* text);
+    EXPORT_API double SessionReadLobbyReply(double handle);
+    EXPORT_API double SessionLobbyReplyCount(double handle);
+    EXPORT_API double SessionLobbyReplyInt(double handle, double index);
+    EXPORT_API double SessionLobbyReplyString(double handle, double index, char* buffer_out, double max_len);
+    EXPORT_API double SessionSendMatchAck(double handle, double features);
+    EXPORT_API double SessionWaitForGameStart(double handle);
+    EXPORT_API void SessionAddLocalCommand(double handle, double unit_id, double cmd_type, double tx, double ty);
+    EXPORT_API void SessionAddPlaceCommand(double handle, double unit_type, double tx, double ty);
+    EXPORT_API void SessionAddEndGameCommand(double handle, double winner_id);
+    EXPORT_API void SessionAddUnitDiedCommand(double handle, double unit_id);
+    EXPORT_API void SessionSetStateHash(double handle, double hash_hi, double hash_lo);
+    EXPORT_API double SessionSendStep(double handle);
+    EXPORT_API double SessionHasUnprocessedCommands(double handle);
+    EXPORT_API double SessionGetNextCommand(double handle, const char* buffer_address);
+    EXPORT_API double SessionRegisterCommandBuffer(double handle, const char* buffer_address, double size);
+    EXPORT_API double SessionSetTickRatio(double handle, double ratio);
+    EXPORT_API double SessionFrameStep(double handle);
+    EXPORT_API double SessionGetFrameTick(double handle);
+
+    // Non-blocking versions of WaitForGameStart and SendStep, so one thread can drive
+    // all sessions: start them, then call PollSessions until SessionResult is not 0
+    EXPORT_API double SessionWaitForGameStartAsync(double handle);
+    EXPORT_API double SessionSendStepAsync(double handle);
+    EXPORT_API double PollSessions(double timeout_ms); // how many async calls finished
+    EXPORT_API double SessionResult(double handle);    // 0 waiting, 1 done, -1 failed
+    EXPORT_API double SessionPlayerId(double handle);  // after SessionWaitForGameStartAsync
 }
 
 #endif // CLIENT_H
\ No newline at end of file
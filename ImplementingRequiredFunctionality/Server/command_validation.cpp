@@ -0,0 +1,213 @@
+#include "command_validation.h"
+#include "unit_ids.h"
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+using namespace std;
+
+// per command result bits written by the kernels
+static const uint8_t FLAG_BAD_TYPE = 1;
+static const uint8_t FLAG_NOT_OWNED = 2;
+static const uint8_t FLAG_NOT_FINITE = 4;
+static const uint8_t FLAG_OFF_MAP = 8;
+
+static const uint32_t LAST_COMMAND_TYPE = COMMAND_TYPE_UNIT_DIED;
+static const int UNIT_OWNER_SHIFT = 12;
+static_assert((1u << UNIT_OWNER_SHIFT) == UNIT_SLOTS_PER_PLAYER, "owner shift must match the id block size");
+
+struct Columns {
+    const uint32_t* ids;
+    const uint32_t* types;
+    const double* xs;
+    const double* ys;
+    uint8_t* flags;
+    uint32_t player;
+    double width;
+    double height;
+};
+
+static void checkScalar(const Columns& c, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++) {
+        uint8_t f = 0;
+        if (c.types[i] - 1 >= LAST_COMMAND_TYPE) f |= FLAG_BAD_TYPE;
+        if ((c.ids[i] >> UNIT_OWNER_SHIFT) != c.player || c.ids[i] == 0) f |= FLAG_NOT_OWNED;
+        double x = c.xs[i];
+        double y = c.ys[i];
+        if (!isfinite(x) || !isfinite(y)) f |= FLAG_NOT_FINITE;
+        if (!(x >= 0 && x <= c.width && y >= 0 && y <= c.height)) f |= FLAG_OFF_MAP;
+        c.flags[i] = f;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// turns per lane masks (one bit per command) into the flags column
+static inline void storeFlags(uint8_t* out, int lanes, int badType, int notOwned, int finite, int onMap) {
+    for (int k = 0; k < lanes; k++) {
+        out[k] = (uint8_t)((((badType >> k) & 1) * FLAG_BAD_TYPE) |
+                           (((notOwned >> k) & 1) * FLAG_NOT_OWNED) |
+                           ((((finite >> k) & 1) ^ 1) * FLAG_NOT_FINITE) |
+                           ((((onMap >> k) & 1) ^ 1) * FLAG_OFF_MAP));
+    }
+}
+
+// 4 commands per step
+__attribute__((target("sse2")))
+static size_t checkSse2(const Columns& c, size_t n) {
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i sign = _mm_set1_epi32((int)0x80000000);
+    const __m128i lastType = _mm_set1_epi32((int)((LAST_COMMAND_TYPE - 1) ^ 0x80000000));
+    const __m128i player = _mm_set1_epi32((int)c.player);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128d zeroD = _mm_setzero_pd();
+    const __m128d width = _mm_set1_pd(c.width);
+    const __m128d height = _mm_set1_pd(c.height);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        // unsigned (type - 1) > LAST - 1, done as a signed compare with the sign bit flipped
+        __m128i t = _mm_xor_si128(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)(c.types + i)), one), sign);
+        int badType = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(t, lastType)));
+
+        __m128i id = _mm_loadu_si128((const __m128i*)(c.ids + i));
+        __m128i owned = _mm_andnot_si128(_mm_cmpeq_epi32(id, zero),
+                                         _mm_cmpeq_epi32(_mm_srli_epi32(id, UNIT_OWNER_SHIFT), player));
+        int notOwned = _mm_movemask_ps(_mm_castsi128_ps(owned)) ^ 0xF;
+
+        int finite = 0;
+        int onMap = 0;
+        for (int half = 0; half < 2; half++) {
+            __m128d x = _mm_loadu_pd(c.xs + i + half * 2);
+            __m128d y = _mm_loadu_pd(c.ys + i + half * 2);
+            // v - v is 0 for finite values and NaN for NaN/inf
+            __m128d fin = _mm_and_pd(_mm_cmpeq_pd(_mm_sub_pd(x, x), zeroD),
+                                     _mm_cmpeq_pd(_mm_sub_pd(y, y), zeroD));
+            __m128d in = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(x, zeroD), _mm_cmple_pd(x, width)),
+                                    _mm_and_pd(_mm_cmpge_pd(y, zeroD), _mm_cmple_pd(y, height)));
+            finite |= _mm_movemask_pd(fin) << (half * 2);
+            onMap |= _mm_movemask_pd(in) << (half * 2);
+        }
+        storeFlags(c.flags + i, 4, badType, notOwned, finite, onMap);
+    }
+    return i;
+}
+
+// 8 commands per step
+__attribute__((target("avx2")))
+static size_t checkAvx2(const Columns& c, size_t n) {
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i lastType = _mm256_set1_epi32((int)(LAST_COMMAND_TYPE - 1));
+    const __m256i player = _mm256_set1_epi32((int)c.player);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256d zeroD = _mm256_setzero_pd();
+    const __m256d width = _mm256_set1_pd(c.width);
+    const __m256d height = _mm256_set1_pd(c.height);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // type - 1 is in range exactly when min(type - 1, LAST - 1) == type - 1
+        __m256i t = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(c.types + i)), one);
+        __m256i typeOk = _mm256_cmpeq_epi32(_mm256_min_epu32(t, lastType), t);
+        int badType = _mm256_movemask_ps(_mm256_castsi256_ps(typeOk)) ^ 0xFF;
+
+        __m256i id = _mm256_loadu_si256((const __m256i*)(c.ids + i));
+        __m256i owned = _mm256_andnot_si256(_mm256_cmpeq_epi32(id, zero),
+                                            _mm256_cmpeq_epi32(_mm256_srli_epi32(id, UNIT_OWNER_SHIFT), player));
+        int notOwned = _mm256_movemask_ps(_mm256_castsi256_ps(owned)) ^ 0xFF;
+
+        int finite = 0;
+        int onMap = 0;
+        for (int half = 0; half < 2; half++) {
+            __m256d x = _mm256_loadu_pd(c.xs + i + half * 4);
+            __m256d y = _mm256_loadu_pd(c.ys + i + half * 4);
+            __m256d fin = _mm256_and_pd(_mm256_cmp_pd(_mm256_sub_pd(x, x), zeroD, _CMP_EQ_OQ),
+                                        _mm256_cmp_pd(_mm256_sub_pd(y, y), zeroD, _CMP_EQ_OQ));
+            __m256d in = _mm256_and_pd(
+                _mm256_and_pd(_mm256_cmp_pd(x, zeroD, _CMP_GE_OQ), _mm256_cmp_pd(x, width, _CMP_LE_OQ)),
+                _mm256_and_pd(_mm256_cmp_pd(y, zeroD, _CMP_GE_OQ), _mm256_cmp_pd(y, height, _CMP_LE_OQ)));
+            finite |= _mm256_movemask_pd(fin) << (half * 4);
+            onMap |= _mm256_movemask_pd(in) << (half * 4);
+        }
+        storeFlags(c.flags + i, 8, badType, notOwned, finite, onMap);
+    }
+    return i;
+}
+#endif
+
+ValidationKernel bestValidationKernel() {
+#ifdef HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) return KERNEL_AVX2;
+    if (__builtin_cpu_supports("sse2")) return KERNEL_SSE2;
+#endif
+    return KERNEL_SCALAR;
+}
+
+const char* validationKernelName(ValidationKernel kernel) {
+    switch (kernel) {
+        case KERNEL_AVX2: return "avx2";
+        case KERNEL_SSE2: return "sse2";
+        default: return "scalar";
+    }
+}
+
+CommandValidator::CommandValidator(double mapWidth, double mapHeight, uint32_t maxPerTick, pmr::memory_resource* memory)
+    : kernel(bestValidationKernel()), mapWidth(mapWidth), mapHeight(mapHeight), maxPerTick(maxPerTick),
+      ids(memory), types(memory), xs(memory), ys(memory), flags(memory) {}
+
+void CommandValidator::validate(pmr::vector<Command>& cmds, int player) {
+    if (cmds.size() > maxPerTick) {
+        totalRejected += cmds.size() - maxPerTick;
+        cmds.resize(maxPerTick);
+    }
+    size_t n = cmds.size();
+    if (n == 0) return;
+
+    // 1. AoS -> SoA
+    ids.resize(n);
+    types.resize(n);
+    xs.resize(n);
+    ys.resize(n);
+    flags.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        ids[i] = cmds[i].unit_id;
+        types[i] = cmds[i].command_type;
+        xs[i] = cmds[i].target_x;
+        ys[i] = cmds[i].target_y;
+    }
+
+    // 2. column kernels, whatever is left over goes through the scalar one
+    Columns c = { ids.data(), types.data(), xs.data(), ys.data(), flags.data(),
+                  (uint32_t)player, mapWidth, mapHeight };
+    size_t done = 0;
+#ifdef HAVE_X86_KERNELS
+    if (kernel == KERNEL_AVX2) done = checkAvx2(c, n);
+    else if (kernel == KERNEL_SSE2) done = checkSse2(c, n);
+#endif
+    checkScalar(c, done, n);
+
+    // 3. act on the flags, which checks matter depends on the command type
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint8_t f = flags[i];
+        uint32_t type = types[i];
+        bool positional = type == COMMAND_TYPE_MOVE || type == COMMAND_TYPE_ATTACK || type == COMMAND_TYPE_PLACE;
+        bool needsOwnUnit = type == COMMAND_TYPE_MOVE || type == COMMAND_TYPE_ATTACK || type == COMMAND_TYPE_UNIT_DIED;
+
+        if ((f & FLAG_BAD_TYPE) || (f & FLAG_NOT_FINITE) || (needsOwnUnit && (f & FLAG_NOT_OWNED))) {
+            totalRejected++;
+            continue;
+        }
+        Command cmd = cmds[i];
+        if (positional && (f & FLAG_OFF_MAP)) {
+            cmd.target_x = min(max(cmd.target_x, 0.0), mapWidth);
+            cmd.target_y = min(max(cmd.target_y, 0.0), mapHeight);
+            totalClamped++;
+        }
+        cmds[kept++] = cmd;
+    }
+    cmds.resize(kept);
+}
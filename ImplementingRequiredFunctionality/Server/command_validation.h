@@ -0,0 +1,60 @@
+#ifndef COMMAND_VALIDATION_H
+#define COMMAND_VALIDATION_H
+
+#include "shared.h"
+#include "state_blob.h"
+
+// Anti-cheat pass over the commands one player sent for a tick, run before
+// anything is forwarded to the other player.
+// The commands are split into structure of arrays columns (ids, types, xs, ys)
+// so the checks run as vector kernels over whole columns:
+//  - command_type is one we know (1..5)
+//  - Move/Attack/UnitDied name a unit in the sender's own id block (unit_ids.h)
+//  - target_x/target_y are finite and inside the map
+// Then one scalar pass drops what is invalid and clamps positions that are finite but off the map.
+// Anything past maxPerTick commands is dropped too.
+
+enum ValidationKernel {
+    KERNEL_SCALAR,
+    KERNEL_SSE2,
+    KERNEL_AVX2,
+};
+
+// best kernel this cpu can run
+ValidationKernel bestValidationKernel();
+const char* validationKernelName(ValidationKernel kernel);
+
+class CommandValidator {
+public:
+    CommandValidator(double mapWidth, double mapHeight, uint32_t maxPerTick,
+                     pmr::memory_resource* memory = pmr::get_default_resource());
+
+    // filters cmds in place
+    void validate(pmr::vector<Command>& cmds, int player);
+
+    uint64_t rejected() const { return totalRejected; }
+    uint64_t clamped() const { return totalClamped; }
+
+    // the columns are scratch, only the totals carry over
+    void save(BlobWriter& out) const { out.put(totalRejected); out.put(totalClamped); }
+    bool load(BlobReader& in) { return in.get(totalRejected) && in.get(totalClamped); }
+
+    ValidationKernel kernel;
+
+private:
+    double mapWidth;
+    double mapHeight;
+    uint32_t maxPerTick;
+
+    // columns are kept between ticks so a match does not reallocate them
+    pmr::vector<uint32_t> ids;
+    pmr::vector<uint32_t> types;
+    pmr::vector<double> xs;
+    pmr::vector<double> ys;
+    pmr::vector<uint8_t> flags;
+
+    uint64_t totalRejected = 0;
+    uint64_t totalClamped = 0;
+};
+
+#endif
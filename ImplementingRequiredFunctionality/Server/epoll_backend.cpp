@@ -0,0 +1,222 @@
+#ifdef __linux__
+
+#include "io_backend.h"
+#include "metrics.h"
+#include <unordered_map>
+#include <deque>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+// Readiness based backend. Reads happen when epoll says a socket is readable,
+// queued sends are written with one sendmsg per socket before every epoll_wait
+// and the rest waits for EPOLLOUT if the socket buffer is full.
+class EpollBackend : public IoBackend {
+public:
+    EpollBackend() : ep(epoll_create1(0)) {}
+    ~EpollBackend() { if (ep >= 0) close(ep); }
+
+    bool ok() const { return ep >= 0; }
+    const char* name() const { return "epoll"; }
+
+    bool watchAccept(int fd) {
+        // acceptAll drains the backlog until EAGAIN, accepted sockets stay blocking
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        listenFd = fd;
+        return control(EPOLL_CTL_ADD, fd, EPOLLIN);
+    }
+
+    bool watchRecv(int fd) {
+        Conn& c = conns[fd];
+        c.reading = true;
+        return update(fd, c);
+    }
+
+    void unwatch(int fd) {
+        if (fd == listenFd && fd >= 0) {
+            control(EPOLL_CTL_DEL, fd, 0);
+            listenFd = -1;
+            ready.push_back({ IO_RECV_DONE, fd, -ECANCELED, nullptr });
+            return;
+        }
+        auto it = conns.find(fd);
+        if (it == conns.end() || !it->second.reading) return;
+        stopReading(fd, it->second, -ECANCELED);
+    }
+
+    void send(int fd, const iovec* iov, int iovcnt) {
+        Conn& c = conns[fd];
+        c.out.emplace_back();
+        for (int i = 0; i < iovcnt; i++) {
+            const char* p = (const char*)iov[i].iov_base;
+            c.out.back().insert(c.out.back().end(), p, p + iov[i].iov_len);
+        }
+        dirty.push_back(fd);
+    }
+
+    int wait(vector<IoEvent>& events, int timeoutMs) {
+        events.clear();
+        events.swap(ready);
+        for (int fd : dirty) flush(fd, events);
+        dirty.clear();
+
+        epoll_event evs[64];
+        addMetric(g_Metrics.ioSyscalls, 1);
+        int n = epoll_wait(ep, evs, 64, events.empty() ? timeoutMs : 0);
+        if ((int)recvBuffers.size() < n) recvBuffers.resize(n);
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+            if (fd == listenFd) {
+                acceptAll(events);
+                continue;
+            }
+            auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+            Conn& c = it->second;
+            if ((evs[i].events & EPOLLOUT) && !c.out.empty()) flush(fd, events);
+            if (c.reading && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                vector<char>& buf = recvBuffers[i];
+                buf.resize(RECV_SIZE);
+                addMetric(g_Metrics.ioSyscalls, 1);
+                int r = recv(fd, buf.data(), buf.size(), MSG_DONTWAIT);
+                if (r > 0) events.push_back({ IO_RECEIVED, fd, r, buf.data() });
+                else if (r == 0) stopReading(fd, c, 0);
+                else if (errno != EAGAIN && errno != EWOULDBLOCK) stopReading(fd, c, -errno);
+            }
+        }
+        moveReady(events);
+        return events.size();
+    }
+
+private:
+    static const size_t RECV_SIZE = 16 * 1024;
+
+    struct Conn {
+        bool reading = false;
+        bool registered = false;
+        bool wantOut = false;
+        deque<vector<char>> out; // queued sends, front may be partly written
+        size_t outOffset = 0;
+    };
+
+    int ep;
+    int listenFd = -1;
+    unordered_map<int, Conn> conns;
+    vector<int> dirty;                 // sockets with new queued sends
+    vector<IoEvent> ready;             // events produced outside of wait()
+    vector<vector<char>> recvBuffers;  // one per readable socket in the current batch
+
+    uint32_t interest(const Conn& c) const {
+        return (c.reading ? (uint32_t)EPOLLIN : 0) | (c.wantOut ? (uint32_t)EPOLLOUT : 0);
+    }
+
+    bool control(int op, int fd, uint32_t events) {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events;
+        ev.data.fd = fd;
+        addMetric(g_Metrics.ioSyscalls, 1);
+        return epoll_ctl(ep, op, fd, &ev) == 0;
+    }
+
+    // brings the epoll registration of fd in line with what we want from it.
+    // A closed fd drops out of epoll on its own, so a number reused since
+    // then may need an ADD where we remember a registration
+    bool update(int fd, Conn& c) {
+        if (c.reading || c.wantOut) {
+            int op = c.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+            bool done = control(op, fd, interest(c));
+            if (!done && (errno == ENOENT || errno == EEXIST))
+                done = control(op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, interest(c));
+            c.registered = done;
+            return done;
+        }
+        if (c.registered) control(EPOLL_CTL_DEL, fd, 0);
+        c.registered = false;
+        return true;
+    }
+
+    void stopReading(int fd, Conn& c, int result) {
+        c.reading = false;
+        update(fd, c);
+        ready.push_back({ IO_RECV_DONE, fd, result, nullptr });
+    }
+
+    void moveReady(vector<IoEvent>& events) {
+        events.insert(events.end(), ready.begin(), ready.end());
+        ready.clear();
+    }
+
+    void acceptAll(vector<IoEvent>& events) {
+        while (true) {
+            addMetric(g_Metrics.ioSyscalls, 1);
+            int fd = accept(listenFd, NULL, NULL);
+            if (fd < 0) break;
+            events.push_back({ IO_ACCEPTED, fd, 0, nullptr });
+        }
+    }
+
+    // writes as much of fd's queue as the socket takes, in one sendmsg
+    void flush(int fd, vector<IoEvent>& events) {
+        auto it = conns.find(fd);
+        if (it == conns.end()) return;
+        Conn& c = it->second;
+        while (!c.out.empty()) {
+            iovec iov[16];
+            int count = 0;
+            for (size_t k = 0; k < c.out.size() && count < 16; k++, count++) {
+                size_t skip = k == 0 ? c.outOffset : 0;
+                iov[count].iov_base = c.out[k].data() + skip;
+                iov[count].iov_len = c.out[k].size() - skip;
+            }
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            addMetric(g_Metrics.ioSyscalls, 1);
+            ssize_t r = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (r < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                int err = -errno;
+                for (size_t k = 0; k < c.out.size(); k++) events.push_back({ IO_SENT, fd, err, nullptr });
+                c.out.clear();
+                c.outOffset = 0;
+                break;
+            }
+            // retire every fully written send
+            size_t left = r;
+            while (!c.out.empty() && left >= c.out.front().size() - c.outOffset) {
+                left -= c.out.front().size() - c.outOffset;
+                events.push_back({ IO_SENT, fd, (int)c.out.front().size(), nullptr });
+                c.out.pop_front();
+                c.outOffset = 0;
+            }
+            // a short write means the socket buffer is full, wait for EPOLLOUT
+            if (left > 0) {
+                c.outOffset += left;
+                break;
+            }
+        }
+        bool wantOut = !c.out.empty();
+        if (wantOut != c.wantOut) {
+            c.wantOut = wantOut;
+            update(fd, c);
+        }
+    }
+};
+
+IoBackend* CreateEpollBackend() {
+    EpollBackend* backend = new EpollBackend();
+    if (!backend->ok()) {
+        delete backend;
+        return nullptr;
+    }
+    return backend;
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "executor.h"
+#include "shared.h"
+#include "liveness.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+Executor* g_Executor = nullptr;
+
+void Waiter::wake() {
+    if (!parked) return;
+    coroutine_handle<> h = parked;
+    parked = nullptr;
+    g_Executor->schedule(h);
+}
+
+void Connection::sendReply(string_view reply, bool droppable) {
+    iovec iov = {(void*)reply.data(), reply.size()};
+    send(&iov, 1, droppable);
+}
+
+void Connection::send(const iovec* iov, int iovcnt, bool droppable) {
+    if (released) return;
+    size_t bytes = 0;
+    for (int i = 0; i < iovcnt; i++) bytes += iov[i].iov_len;
+    if (!backlog.admit(bytes, droppable)) {
+        // releasing here would pull the connection from under its session, let it see EOF instead
+        if (backlog.overflowed()) shutdown(fd, SHUT_RDWR);
+        return;
+    }
+    g_Executor->backend().send(fd, iov, iovcnt);
+    sendsOut++;
+}
+
+Task<bool> readLine(Connection& c, string_view& line) {
+    while (!c.reader.nextLine(line)) {
+        if (c.eof || c.reader.overflowed()) co_return false;
+        co_await c.input;
+    }
+    co_return true;
+}
+
+Task<bool> readMessage(Connection& c, string_view& message) {
+    while (!c.reader.nextMessage(message)) {
+        if (c.eof || c.reader.overflowed()) co_return false;
+        co_await c.input;
+    }
+    co_return true;
+}
+
+Task<bool> readBytes(Connection& c, char* out, size_t len) {
+    while (c.reader.buffered() < len) {
+        if (c.eof) co_return false;
+        co_await c.input;
+    }
+    memcpy(out, c.reader.peek(), len);
+    c.reader.consume(len);
+    co_return true;
+}
+
+// Owns a spawned task: starts right away and frees its frame (and the task) when done
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        suspend_never initial_suspend() noexcept { return {}; }
+        suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { terminate(); }
+    };
+};
+
+static DetachedTask runDetached(Task<> task) {
+    co_await task;
+}
+
+void Executor::spawn(Task<> task) {
+    runDetached(move(task));
+}
+
+void Executor::release(Connection& c) {
+    if (c.released) return;
+    c.released = true;
+    io.unwatch(c.fd);
+    tryClose(c);
+}
+
+void Executor::tryClose(Connection& c) {
+    // the backend may still touch the socket until it reported both directions done
+    if (!c.released || !c.eof || c.sendsOut > 0) return;
+    int fd = c.fd;
+    forgetConnection(fd);
+    close(fd);
+    conns.erase(fd);
+}
+
+void Executor::run(Task<> (*session)(Connection&)) {
+    g_Executor = this;
+    vector<IoEvent> events;
+    while (true) {
+        while (!ready.empty()) {
+            coroutine_handle<> h = ready.front();
+            ready.pop_front();
+            h.resume();
+        }
+
+        // the heartbeat timers of every connection run here too (liveness.h)
+        io.wait(events, livenessWaitMs());
+        for (const IoEvent& ev : events) {
+            if (ev.type == IO_ACCEPTED) {
+                unique_ptr<Connection>& slot = conns[ev.fd];
+                slot.reset(new Connection());
+                slot->fd = ev.fd;
+                Connection& c = *slot;
+                if (!io.watchRecv(ev.fd)) {
+                    cerr << "[EXECUTOR] Could not watch " << ev.fd << endl;
+                    c.eof = true;
+                }
+                spawn(session(c));
+                continue;
+            }
+
+            auto it = conns.find(ev.fd);
+            if (it == conns.end()) continue;
+            Connection& c = *it->second;
+            if (ev.type == IO_RECEIVED) {
+                c.reader.append(ev.data, ev.result);
+                connectionActive(ev.fd);
+                // its session is not keeping up with what it sends, cut it off (rate_limit.h)
+                if (!c.flooded && c.reader.buffered() > maxBufferedInput()) {
+                    c.flooded = true;
+                    cerr << "[EXECUTOR] " << ev.fd << " sent too much without waiting, disconnecting it" << endl;
+                    addMetric(g_Metrics.inputFloodDisconnects, 1);
+                    shutdown(ev.fd, SHUT_RDWR);
+                }
+                c.input.wake();
+            } else if (ev.type == IO_RECV_DONE) {
+                c.eof = true;
+                c.input.wake();
+                tryClose(c);
+            } else if (ev.type == IO_SENT) {
+                c.sendsOut--;
+                c.backlog.sent();
+                c.input.wake(); // a session waiting for its replies to go out
+                tryClose(c);
+            }
+        }
+        // after the events, bytes that just came in still count
+        runLivenessTimers();
+    }
+}
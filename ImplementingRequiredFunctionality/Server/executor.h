@@ -0,0 +1,158 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include "io_backend.h"
+#include "line_reader.h"
+#include "output_queue.h"
+#include <coroutine>
+#include <exception>
+#include <memory>
+#include <unordered_map>
+#include <deque>
+#include <string>
+
+using namespace std;
+
+// Single threaded coroutine runtime for --coroutines. Every session is a Task
+// with a frame of a few hundred bytes instead of a pthread with its own stack,
+// and all of them share one IoBackend. Nothing here is thread safe, everything
+// runs on the thread that called Executor::run.
+
+class Executor;
+extern Executor* g_Executor; // the running executor, set by Executor::run
+
+//  TASKS
+// Lazily started coroutine. co_await starts it and resumes the awaiting
+// coroutine when it finishes (symmetric transfer, so deep chains don't grow the stack)
+template <class T> class Task;
+
+struct TaskPromiseBase {
+    coroutine_handle<> continuation;
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class P> coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept {
+            coroutine_handle<> next = h.promise().continuation;
+            return next ? next : noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { terminate(); }
+};
+
+template <class T = void> class Task {
+public:
+    struct promise_type : TaskPromiseBase {
+        T value{};
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_value(T v) { value = move(v); }
+    };
+
+    Task(Task&& other) noexcept : h(other.h) { other.h = nullptr; }
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+        h.promise().continuation = caller;
+        return h;
+    }
+    T await_resume() { return move(h.promise().value); }
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : h(handle) {}
+    coroutine_handle<promise_type> h;
+};
+
+template <> class Task<void> {
+public:
+    struct promise_type : TaskPromiseBase {
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        void return_void() {}
+    };
+
+    Task(Task&& other) noexcept : h(other.h) { other.h = nullptr; }
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+        h.promise().continuation = caller;
+        return h;
+    }
+    void await_resume() {}
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : h(handle) {}
+    coroutine_handle<promise_type> h;
+};
+
+//  WAITER
+// One coroutine parks on it with co_await until someone calls wake().
+// The wakeup goes through the executor's ready queue, never inline
+class Waiter {
+public:
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(coroutine_handle<> h) noexcept { parked = h; }
+    void await_resume() noexcept {}
+    void wake();
+
+private:
+    coroutine_handle<> parked;
+};
+
+//  CONNECTIONS
+// A client socket owned by the executor. Everything received is appended to
+// reader right away, the lobby pops lines from it and the match pops frames
+struct Connection {
+    int fd;
+    LineReader reader;
+    Waiter input;        // woken on new bytes, finished sends, EOF and anything else a session waits for
+    bool eof = false;    // the backend stopped reading (closed, error or released)
+    bool released = false;
+    int sendsOut = 0;
+    bool flooded = false; // shut down for sending more than maxBufferedInput (rate_limit.h)
+    SendBacklog backlog{ lobbyPolicy() }; // the caps of what sendsOut holds (output_queue.h)
+
+    // queues one LobbyWriter reply as it is, the lobby's SendReply. droppable for broadcasts
+    void sendReply(string_view reply, bool droppable = false);
+    // over its caps the connection is shut down, the session sees EOF
+    void send(const iovec* iov, int iovcnt, bool droppable = false);
+};
+
+// suspends until reader holds a complete line, false on EOF or an over long line.
+// line points into the reader and is only valid until the next co_await
+Task<bool> readLine(Connection& c, string_view& line);
+// the same for a line or a frame, whichever the connection negotiated (LineReader::nextMessage)
+Task<bool> readMessage(Connection& c, string_view& message);
+// suspends until reader holds len bytes and copies them to out, false on EOF
+Task<bool> readBytes(Connection& c, char* out, size_t len);
+
+class Executor {
+public:
+    explicit Executor(IoBackend& io) : io(io) {}
+
+    // runs forever. Every accepted connection gets session(connection) as its own task,
+    // the listening socket must already be watched by the backend
+    void run(Task<> (*session)(Connection&));
+
+    // starts a detached task right away, it cleans up after itself
+    void spawn(Task<> task);
+    void schedule(coroutine_handle<> h) { ready.push_back(h); }
+    // the session is done with c: stop reading and close it once its sends are out
+    void release(Connection& c);
+
+    IoBackend& backend() { return io; }
+    // every open connection by fd, for lobby wide broadcasts
+    const unordered_map<int, unique_ptr<Connection>>& connections() const { return conns; }
+
+private:
+    IoBackend& io;
+    unordered_map<int, unique_ptr<Connection>> conns;
+    deque<coroutine_handle<>> ready;
+
+    void tryClose(Connection& c);
+};
+
+#endif
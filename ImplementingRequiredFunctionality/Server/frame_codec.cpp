@@ -0,0 +1,149 @@
+#include "frame_codec.h"
+#include "metrics.h"
+#include <cstddef>
+
+using namespace std;
+
+static void putVarint(pmr::string& out, uint32_t v) {
+    while (v >= 0x80) {
+        out.push_back((char)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char)v);
+}
+
+static bool getVarint(const char*& p, const char* end, uint32_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 35 && p < end; shift += 7) {
+        uint8_t b = (uint8_t)*p++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint32_t zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t unzigzag(uint32_t v) {
+    return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+// one column of doubles, each XORed with the previous one
+static void packDoubles(const Command* cmds, uint32_t count, size_t offset, pmr::string& out) {
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t bits;
+        memcpy(&bits, (const char*)&cmds[i] + offset, sizeof(bits));
+        uint64_t x = bits ^ prev;
+        prev = bits;
+        if (x == 0) {
+            out.push_back((char)0x80); // 8 zero bytes on top, nothing follows
+            continue;
+        }
+        int lead = __builtin_clzll(x) / 8;
+        int trail = __builtin_ctzll(x) / 8;
+        out.push_back((char)(lead << 4 | trail));
+        for (int b = trail; b < 8 - lead; b++) out.push_back((char)(x >> (b * 8)));
+    }
+}
+
+static bool unpackDoubles(const char*& p, const char* end, uint32_t count, size_t offset, Command* out) {
+    uint64_t prev = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (p >= end) return false;
+        uint8_t control = (uint8_t)*p++;
+        int lead = control >> 4;
+        int trail = control & 0xf;
+        if (lead + trail > 8 || end - p < 8 - lead - trail) return false;
+        uint64_t x = 0;
+        for (int b = trail; b < 8 - lead; b++) x |= (uint64_t)(uint8_t)*p++ << (b * 8);
+        prev ^= x;
+        memcpy((char*)&out[i] + offset, &prev, sizeof(prev));
+    }
+    return true;
+}
+
+void packCommands(const Command* cmds, uint32_t count, pmr::string& out) {
+    out.clear();
+
+    uint32_t prevId = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        putVarint(out, zigzag((int32_t)(cmds[i].unit_id - prevId)));
+        prevId = cmds[i].unit_id;
+    }
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run = 1;
+        while (i + run < count && cmds[i + run].command_type == cmds[i].command_type &&
+               cmds[i + run].unit_type == cmds[i].unit_type)
+            run++;
+        putVarint(out, run);
+        putVarint(out, cmds[i].command_type);
+        putVarint(out, cmds[i].unit_type);
+        i += run;
+    }
+
+    packDoubles(cmds, count, offsetof(Command, target_x), out);
+    packDoubles(cmds, count, offsetof(Command, target_y), out);
+}
+
+bool unpackCommands(const char* data, size_t len, uint32_t count, Command* out) {
+    const char* p = data;
+    const char* end = data + len;
+
+    uint32_t prevId = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t delta;
+        if (!getVarint(p, end, delta)) return false;
+        prevId += (uint32_t)unzigzag(delta);
+        out[i].unit_id = prevId;
+    }
+
+    for (uint32_t i = 0; i < count;) {
+        uint32_t run, type, unitType;
+        if (!getVarint(p, end, run) || !getVarint(p, end, type) || !getVarint(p, end, unitType)) return false;
+        if (run == 0 || run > count - i) return false;
+        for (uint32_t k = 0; k < run; k++, i++) {
+            out[i].command_type = type;
+            out[i].unit_type = unitType;
+        }
+    }
+
+    if (!unpackDoubles(p, end, count, offsetof(Command, target_x), out)) return false;
+    if (!unpackDoubles(p, end, count, offsetof(Command, target_y), out)) return false;
+    return p == end;
+}
+
+void PackedFrame::build(const pmr::vector<Command>& frame, bool wanted, size_t minBytes, uint32_t tick) {
+    count = frame.size();
+    this->tick = tick;
+    size_t plain = sizeof(count) + count * sizeof(Command);
+    packed = false;
+    if (!wanted || plain < minBytes) return;
+    packCommands(frame.data(), count, bytes);
+    // the packed form only goes out when it really is smaller
+    packed = 2 * sizeof(uint32_t) + bytes.size() < plain;
+}
+
+int PackedFrame::parts(const pmr::vector<Command>& frame, uint32_t features, iovec iov[2]) {
+    bool compressed = packed && (features & MATCH_FEATURE_COMPRESS);
+    int words = 0;
+    header[words++] = count | (compressed ? FRAME_COMPRESSED : 0);
+    if (features & MATCH_FEATURE_TICKS) {
+        header[0] |= FRAME_TICK_TAGGED;
+        header[words++] = tick;
+    }
+    if (compressed) {
+        header[words++] = bytes.size();
+        iov[0] = { header, words * sizeof(uint32_t) };
+        iov[1] = { (void*)bytes.data(), bytes.size() };
+        addMetric(g_Metrics.framesCompressed, 1);
+        addMetric(g_Metrics.compressionBytesSaved, count * sizeof(Command) - bytes.size() - sizeof(uint32_t));
+        return 2;
+    }
+    iov[0] = { header, words * sizeof(uint32_t) };
+    iov[1] = { (void*)frame.data(), count * sizeof(Command) };
+    return count > 0 ? 2 : 1;
+}
@@ -0,0 +1,53 @@
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include "shared.h"
+#include "lobby_protocol.h"
+#include <sys/uio.h>
+
+// Optional compression of the tick frames the server broadcasts, for players
+// that asked for MATCH_FEATURE_COMPRESS in their ACK (lobby_protocol.h).
+// A big late game frame is hundreds of Commands that mostly share their type and
+// aim at nearby spots, so the frame is packed column by column:
+//  - unit ids as zigzag varint deltas from the previous one (tiny once compaction sorted them)
+//  - command_type and unit_type as runs: varint length, varint type, varint unit type
+//  - target_x, then target_y, each XORed with the one before it. A control byte holds how
+//    many zero bytes the XOR has at the top (high nibble) and bottom (low nibble),
+//    only the bytes in between follow
+// Everything is lossless, doubles come back bit for bit.
+//
+// On the wire a packed frame is uint32 (count | FRAME_COMPRESSED), uint32 packed size,
+// then the packed bytes. Frames under --compress-min-bytes, or that would not get
+// smaller, go out as the usual count + commands even to those players.
+// Client/client.cpp has the decoder for the game side.
+const uint32_t FRAME_COMPRESSED = 0x80000000u;
+// Players with MATCH_FEATURE_TICKS get this set in the count too, with the uint32 frame
+// number right after the count (before the packed size of a packed frame)
+const uint32_t FRAME_TICK_TAGGED = 0x40000000u;
+
+// out is overwritten with the packed commands
+void packCommands(const Command* cmds, uint32_t count, pmr::string& out);
+// false if data is not exactly count packed commands
+bool unpackCommands(const char* data, size_t len, uint32_t count, Command* out);
+
+// One finalized frame on its way to both players of a match, packed at most once
+class PackedFrame {
+public:
+    explicit PackedFrame(pmr::memory_resource* memory = pmr::get_default_resource()) : bytes(memory) {}
+
+    // packs frame when someone wants it packed and it has at least minBytes on the wire.
+    // tick is the frame's number, for the players that get it tagged
+    void build(const pmr::vector<Command>& frame, bool wanted, size_t minBytes, uint32_t tick);
+    // iovecs of the frame for a player with the accepted MATCH_FEATURE_* bits in features,
+    // returns how many. Valid until the next build or parts
+    int parts(const pmr::vector<Command>& frame, uint32_t features, iovec iov[2]);
+
+private:
+    uint32_t count = 0;
+    uint32_t tick = 0;
+    uint32_t header[3] = { 0, 0, 0 }; // count and its flags, frame number, packed size
+    bool packed = false;
+    pmr::string bytes;
+};
+
+#endif
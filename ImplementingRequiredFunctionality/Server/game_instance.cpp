@@ -1,23 +1,33 @@
 #include "game_instance.h"
 #include "shared.h"
+#include "tick_processor.h"
+#include "udp_lockstep.h"
+#include "metrics.h"
+#include "io_backend.h"
+#include "lobby.h"
+#include "output_queue.h"
+#include "liveness.h"
+#include "rate_limit.h"
+#include "frame_codec.h"
+#include "trace.h"
 #include <iostream>
 #include <vector>
 #include <cstring>
+#include <cerrno>
+#include <algorithm>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
-#include <atomic>
 
 using namespace std;
 
-// Atomic counter for Unit IDs (Started at 1000)
-static atomic<uint32_t> g_NextUnitID(1000);
-
 //  Helpers
 static bool SendData(int sock, const char *buffer, int size)
 {
     int total_sent = 0;
     while (total_sent < size)
     {
+        addMetric(g_Metrics.ioSyscalls, 1);
         int result = send(sock, buffer + total_sent, size - total_sent, 0);
         if (result <= 0)
             return false;
@@ -26,11 +36,73 @@ static bool SendData(int sock, const char *buffer, int size)
     return true;
 }
 
-static bool RecvData(int sock, char *buffer, int expected_size)
+//  Frames on their way to both players of a blocking match. Writes never block,
+//  so one player that stops reading can't hold up the other one's frames, and
+//  every wait for input keeps flushing (output_queue.h)
+struct MatchOutput
+{
+    int socks[2];
+    OutputQueue queues[2] = {OutputQueue(SLOW_DISCONNECT), OutputQueue(SLOW_DISCONNECT)};
+
+    MatchOutput(int clientSockets[2]) : socks{clientSockets[0], clientSockets[1]} {}
+
+    // queues one frame for player i and writes what its socket takes
+    bool sendTo(int i, const iovec *iov, int iovcnt)
+    {
+        if (!queues[i].push(iov, iovcnt) || !queues[i].flush(socks[i]))
+            return drop(i);
+        return true;
+    }
+
+    // blocks until sock can be read, writing queued frames as the players take them
+    bool waitReadable(int sock)
+    {
+        while (!queues[0].empty() || !queues[1].empty())
+        {
+            pollfd fds[3] = {{sock, POLLIN, 0}};
+            int count = 1;
+            int timeout = -1;
+            for (int i = 0; i < 2; ++i)
+            {
+                if (queues[i].empty())
+                    continue;
+                fds[count++] = {socks[i], POLLOUT, 0};
+                int left = queues[i].msUntilStall();
+                if (left >= 0 && (timeout < 0 || left < timeout))
+                    timeout = left;
+            }
+            addMetric(g_Metrics.ioSyscalls, 1);
+            if (poll(fds, count, timeout) < 0 && errno != EINTR)
+                return false;
+            // flush also notices a player whose queue stopped moving
+            for (int i = 0; i < 2; ++i)
+            {
+                if (!queues[i].empty() && !queues[i].flush(socks[i]))
+                    return drop(i);
+            }
+            if (fds[0].revents)
+                return true;
+        }
+        return true; // nothing to write, a plain blocking recv will do
+    }
+
+    // cuts off player i, the lobby finds the socket closed
+    bool drop(int i)
+    {
+        cerr << "[GAME_INSTANCE] Player " << i << " is not taking its ticks, disconnecting it" << endl;
+        shutdown(socks[i], SHUT_RDWR);
+        return false;
+    }
+};
+
+static bool RecvData(int sock, char *buffer, int expected_size, MatchOutput *out = nullptr)
 {
     int bytes_received = 0;
     while (bytes_received < expected_size)
     {
+        if (out && !out->waitReadable(sock))
+            return false;
+        addMetric(g_Metrics.ioSyscalls, 1);
         int result = recv(sock, buffer + bytes_received, expected_size - bytes_received, 0);
         if (result <= 0)
             return false;
@@ -39,133 +111,566 @@ static bool RecvData(int sock, char *buffer, int expected_size)
     return true;
 }
 
-//  Main Game Loop
-void *HandleMatch(void *args)
+// RecvData, but bytes a hot restart carried over from the old server come first
+static bool RecvCarried(int sock, string &carried, char *buffer, int expected_size, MatchOutput &out)
 {
-    MatchArgs *match_args = static_cast<MatchArgs *>(args);
-    int client1_sock = match_args->client1_sock;
-    int client2_sock = match_args->client2_sock;
-    int gameId = match_args->gameId;
-    delete match_args;
-
-    int clientSockets[2] = {client1_sock, client2_sock};
-
-    const uint32_t COMMAND_TYPE_PLACE = 3;
-    const uint32_t COMMAND_TYPE_END_GAME = 4;
-
-    cout << "[GAME_INSTANCE] Match Started: " << client1_sock << " vs " << client2_sock << endl;
+    int from_carried = min((size_t)expected_size, carried.size());
+    memcpy(buffer, carried.data(), from_carried);
+    carried.erase(0, from_carried);
+    return RecvData(sock, buffer + from_carried, expected_size - from_carried, &out);
+}
 
-    //HANDSHAKE (Send Player IDs)
-    uint32_t p1_id = 0;
-    uint32_t p2_id = 1;
-    usleep(100000); // slight delay to ensure clients are ready
-    if (!SendData(client1_sock, (const char *)&p1_id, sizeof(p1_id)))
-    {
-        cerr << "[GAME_INSTANCE] Error sending Handshake to P1" << endl;
-        close(client1_sock);
-        close(client2_sock);
-        return NULL;
-    }
-    if (!SendData(client2_sock, (const char *)&p2_id, sizeof(p2_id)))
+// hands the match to the new server between two ticks, returns if the restart was called off.
+// carried is what was already read of the next tick, unsent what the players did not get yet
+static void parkMatch(int clientSockets[2], int gameId, const TickProcessor &ticks, const uint32_t features[2],
+                      const string carried[2], const string unsent[2])
+{
+    ParkedSession session;
+    session.kind = PARKED_MATCH;
+    session.roomId = gameId;
+    for (int i = 0; i < 2; ++i)
     {
-        cerr << "[GAME_INSTANCE] Error sending Handshake to P2" << endl;
-        close(client1_sock);
-        close(client2_sock);
-        return NULL;
+        session.socks[i] = clientSockets[i];
+        session.pending[i] = carried[i];
+        session.unsent[i] = unsent[i];
     }
+    BlobWriter state;
+    ticks.save(state);
+    state.put(features[0]);
+    state.put(features[1]);
+    session.match = move(state.bytes);
+    parkForRestart(move(session));
+}
 
-    //LOCKSTEP LOOP
-    bool match_running = true;
-    while (match_running)
+//  Lockstep over the lobby TCP connections. true when the match ended with EndGame.
+//  features: the MATCH_FEATURE_* bits each player got, for how its frames go out (frame_codec.h)
+static bool RunTcpMatch(int clientSockets[2], int gameId, TickProcessor &ticks, const uint32_t features[2],
+                        string carried[2], const string unsent[2])
+{
+    // the match's buffers come out of its own memory (match_memory.h)
+    pmr::vector<Command> requests[2] = {pmr::vector<Command>(ticks.memory()), pmr::vector<Command>(ticks.memory())};
+    pmr::vector<Command> finalized_commands(ticks.memory());
+    PackedFrame frame(ticks.memory());
+    MatchOutput out(clientSockets);
+    for (int i = 0; i < 2; ++i)
+        out.queues[i].push(unsent[i]);
+
+    while (true)
     {
-        vector<Command> requests[2];
-        bool match_error = false;
+        // between two ticks nothing is half read, unsent frames go along
+        if (restartPending())
+        {
+            string queued[2] = {out.queues[0].unsent(), out.queues[1].unsent()};
+            parkMatch(clientSockets, gameId, ticks, features, carried, queued);
+        }
 
         //recive both players commands
         for (int i = 0; i < 2; ++i)
         {
+            TRACE_SPAN(i == 0 ? "recv-p1" : "recv-p2", gameId);
             uint32_t count = 0;
-            if (!RecvData(clientSockets[i], (char *)&count, sizeof(count)))
+            if (!RecvCarried(clientSockets[i], carried[i], (char *)&count, sizeof(count), out))
+                return false;
+            if (!tickCountAllowed(count & ~TICK_FLAGS))
+            {
+                cerr << "[GAME_INSTANCE] Player " << i << " sent a tick of " << (count & ~TICK_FLAGS)
+                     << " commands, disconnecting it" << endl;
+                shutdown(clientSockets[i], SHUT_RDWR);
+                return false;
+            }
+            if (count & TICK_HAS_TAG)
             {
-                match_error = true;
-                break;
+                uint32_t tag;
+                if (!RecvCarried(clientSockets[i], carried[i], (char *)&tag, sizeof(tag), out))
+                    return false;
+                ticks.setTickTag(i, tag);
             }
+            if (count & TICK_HAS_HASH)
+            {
+                uint64_t hash;
+                if (!RecvCarried(clientSockets[i], carried[i], (char *)&hash, sizeof(hash), out))
+                    return false;
+                ticks.setStateHash(i, hash);
+            }
+            count &= ~TICK_FLAGS;
             int data_size = count * sizeof(Command);
             requests[i].resize(count);
-            if (!RecvData(clientSockets[i], (char *)requests[i].data(), data_size))
+            if (!RecvCarried(clientSockets[i], carried[i], (char *)requests[i].data(), data_size, out))
+                return false;
+            // its tick is in, it is not the one the match waits for
+            watchConnection(clientSockets[i], LIVE_PAUSED);
+        }
+
+        bool game_over_signal;
+        {
+            TRACE_SPAN("process", gameId);
+            game_over_signal = ticks.buildFrame(requests, finalized_commands);
+            frame.build(finalized_commands, (features[0] | features[1]) & MATCH_FEATURE_COMPRESS,
+                        g_Config.compressMinBytes, ticks.frameNumber());
+        }
+        // over --match-memory-mb, it ends before it can grow any further
+        if (ticks.memoryExceeded())
+        {
+            shutdown(clientSockets[0], SHUT_RDWR);
+            shutdown(clientSockets[1], SHUT_RDWR);
+            return false;
+        }
+
+        //Sends all finalized commands to both clients, count and commands in one write
+        for (int i = 0; i < 2; ++i)
+        {
+            TRACE_SPAN(i == 0 ? "broadcast-p1" : "broadcast-p2", gameId);
+            iovec iov[2];
+            if (!out.sendTo(i, iov, frame.parts(finalized_commands, features[i], iov)))
+                return false;
+        }
+        ticks.frameSent(finalized_commands);
+        // both players owe us their next tick now
+        watchConnection(clientSockets[0], LIVE_MATCH);
+        watchConnection(clientSockets[1], LIVE_MATCH);
+
+        if (game_over_signal)
+        {
+            // the lobby writes to these sockets next, the last frame has to be out first
+            for (int i = 0; i < 2; ++i)
             {
-                match_error = true;
-                break;
+                if (!out.queues[i].drain(clientSockets[i], g_Config.slowPlayerMs))
+                    out.drop(i);
             }
+            return true;
         }
+    }
+}
 
-        if (match_error)
-            break;
+//  Bytes of one player's connection until a whole tick (uint32 count, the
+//  optional tick tag and state hash, commands) is here
+struct TickReader
+{
+    pmr::vector<char> bytes;
 
-        vector<Command> finalized_commands;
-        bool game_over_signal = false;
+    explicit TickReader(pmr::memory_resource *memory) : bytes(memory) {}
 
-        //Process commands and assign IDs
-        for (int i = 0; i < 2; ++i)
+    // count, tag and hash, the part of a tick before its commands
+    size_t headerSize(uint32_t count) const
+    {
+        return sizeof(count) + ((count & TICK_HAS_TAG) ? sizeof(uint32_t) : 0) +
+               ((count & TICK_HAS_HASH) ? sizeof(uint64_t) : 0);
+    }
+
+    bool ready() const
+    {
+        uint32_t count;
+        if (bytes.size() < sizeof(count))
+            return false;
+        memcpy(&count, bytes.data(), sizeof(count));
+        size_t header = headerSize(count);
+        if (bytes.size() < header)
+            return false;
+        return (bytes.size() - header) / sizeof(Command) >= (count & ~TICK_FLAGS);
+    }
+
+    // a tick over --max-tick-commands, or more waiting than a player should ever send ahead
+    bool oversized() const
+    {
+        uint32_t count;
+        if (bytes.size() >= sizeof(count))
         {
-            for (Command &cmd : requests[i])
-            {
+            memcpy(&count, bytes.data(), sizeof(count));
+            if (!tickCountAllowed(count & ~TICK_FLAGS))
+                return true;
+        }
+        if (bytes.size() <= maxBufferedInput())
+            return false;
+        addMetric(g_Metrics.inputFloodDisconnects, 1);
+        return true;
+    }
 
-                // P1 uses 1000s, P2 uses 2000s
-                if (cmd.command_type == COMMAND_TYPE_PLACE)
-                {
-                    uint32_t base_id = g_NextUnitID++;
-                    cmd.unit_id = base_id + (i * 1000);
-                }
+    // the commands of player's tick to out, its tag and hash to ticks
+    void take(int player, pmr::vector<Command> &out, TickProcessor &ticks)
+    {
+        uint32_t count;
+        memcpy(&count, bytes.data(), sizeof(count));
+        size_t header = headerSize(count);
+        size_t at = sizeof(count);
+        if (count & TICK_HAS_TAG)
+        {
+            uint32_t tag;
+            memcpy(&tag, bytes.data() + at, sizeof(tag));
+            ticks.setTickTag(player, tag);
+            at += sizeof(tag);
+        }
+        if (count & TICK_HAS_HASH)
+        {
+            uint64_t hash;
+            memcpy(&hash, bytes.data() + at, sizeof(hash));
+            ticks.setStateHash(player, hash);
+        }
+        count &= ~TICK_FLAGS;
+        out.resize(count);
+        memcpy(out.data(), bytes.data() + header, count * sizeof(Command));
+        bytes.erase(bytes.begin(), bytes.begin() + header + count * sizeof(Command));
+    }
+};
 
-                if (cmd.command_type == COMMAND_TYPE_END_GAME)
-                {
-                    game_over_signal = true;
-                }
+//  Same lockstep as RunTcpMatch on an IoBackend: both sockets are read as data
+//  arrives and a tick's broadcast to both players goes to the kernel in one batch
+static bool RunBackendMatch(IoBackend &io, int clientSockets[2], int gameId, TickProcessor &ticks,
+                            const uint32_t features[2], string carried[2], const string unsent[2])
+{
+    TickReader readers[2] = {TickReader(ticks.memory()), TickReader(ticks.memory())};
+    PackedFrame frame(ticks.memory());
+    // the backend queues the frames, these only keep count (output_queue.h)
+    SendBacklog backlogs[2] = {SendBacklog(SLOW_DISCONNECT), SendBacklog(SLOW_DISCONNECT)};
+    pmr::vector<Command> requests[2] = {pmr::vector<Command>(ticks.memory()), pmr::vector<Command>(ticks.memory())};
+    pmr::vector<Command> finalized_commands(ticks.memory());
+    vector<IoEvent> events;
+    bool game_over = false;
+    bool lost = false;
+    bool pausing = false; // hot restart: reads stopped, waiting for the backend to let go of both sockets
+    int reading = 0;  // sockets that have not reported IO_RECV_DONE yet
+    int sends_out = 0;
+    bool waiting[2] = {true, true}; // the next tick of this player is not in yet (liveness.h)
 
-                finalized_commands.push_back(cmd);
-            }
+    // a player that does not take its frames, or sends far too much, is cut off: the shutdown
+    // fails its queued sends and ends its reads, so the backend lets go of both sockets soon after
+    auto dropPlayer = [&](int i, const char *why)
+    {
+        cerr << "[GAME_INSTANCE] Player " << i << " " << why << ", disconnecting it" << endl;
+        shutdown(clientSockets[i], SHUT_RDWR);
+        if (!lost)
+        {
+            lost = true;
+            io.unwatch(clientSockets[0]);
+            io.unwatch(clientSockets[1]);
+        }
+    };
+    auto sendFrame = [&](int i, const iovec *iov, int iovcnt)
+    {
+        size_t bytes = 0;
+        for (int k = 0; k < iovcnt; ++k)
+            bytes += iov[k].iov_len;
+        if (!backlogs[i].admit(bytes))
+        {
+            dropPlayer(i, "is not taking its ticks");
+            return;
         }
+        io.send(clientSockets[i], iov, iovcnt);
+        sends_out++;
+    };
 
-        //Sends all finalized commands to both clients
-        uint32_t total_count = finalized_commands.size();
-        int total_data_size = total_count * sizeof(Command);
+    for (int i = 0; i < 2; ++i)
+    {
+        readers[i].bytes.assign(carried[i].begin(), carried[i].end());
+        if (io.watchRecv(clientSockets[i]))
+            reading++;
+        else
+            lost = true;
+        // frames the old server could not get out before a hot restart
+        if (!unsent[i].empty())
+        {
+            iovec iov = {(void *)unsent[i].data(), unsent[i].size()};
+            sendFrame(i, &iov, 1);
+        }
+    }
 
-        for (int i = 0; i < 2; ++i)
+    while (true)
+    {
+        if (!game_over && !lost && !pausing && readers[0].ready() && readers[1].ready())
         {
-            if (!SendData(clientSockets[i], (const char *)&total_count, sizeof(total_count)) ||
-                !SendData(clientSockets[i], (const char *)finalized_commands.data(), total_data_size))
+            // the reads happen in the backend, this covers the tick from both being in to its sends queued
+            TRACE_SPAN("process", gameId);
+            for (int i = 0; i < 2; ++i)
+                readers[i].take(i, requests[i], ticks);
+            game_over = ticks.buildFrame(requests, finalized_commands);
+            if (ticks.memoryExceeded())
+            {
+                dropPlayer(0, "is in a match over --match-memory-mb");
+                dropPlayer(1, "is in a match over --match-memory-mb");
+                continue;
+            }
+
+            // the lobby reads these sockets again after the match, stop before the
+            // last frame goes out so nothing the client sends next is swallowed here
+            if (game_over)
+            {
+                io.unwatch(clientSockets[0]);
+                io.unwatch(clientSockets[1]);
+            }
+
+            frame.build(finalized_commands, (features[0] | features[1]) & MATCH_FEATURE_COMPRESS, g_Config.compressMinBytes,
+                        ticks.frameNumber());
+            for (int i = 0; i < 2 && !lost; ++i)
+            {
+                TRACE_SPAN(i == 0 ? "broadcast-p1" : "broadcast-p2", gameId);
+                iovec iov[2];
+                sendFrame(i, iov, frame.parts(finalized_commands, features[i], iov));
+            }
+            ticks.frameSent(finalized_commands);
+            for (int i = 0; i < 2; ++i)
             {
-                match_error = true;
-                break;
+                waiting[i] = true;
+                watchConnection(clientSockets[i], LIVE_MATCH);
             }
+            continue;
         }
 
-        if (match_error)
-            break;
+        // the backend has to be done with both sockets before they go back to the lobby
+        if ((game_over || lost) && reading == 0 && sends_out == 0)
+            return game_over && !lost;
 
-        // D. Check Game Over
-        if (game_over_signal)
+        // same for a hot restart, what was already read of the next tick goes along
+        if (!game_over && !lost && !pausing && restartPending())
+        {
+            pausing = true;
+            io.unwatch(clientSockets[0]);
+            io.unwatch(clientSockets[1]);
+        }
+        if (pausing && !lost && reading == 0 && sends_out == 0)
         {
-            // set the winner in the user data
-            pthread_mutex_lock(&g_LobbyMutex);
-            g_AllUsers[connected_Users[client1_sock].username].numWins += 1;
-            pthread_mutex_unlock(&g_LobbyMutex);
-            cout << "[GAME_INSTANCE] End Game signal received. Closing match." << endl;
-            match_running = false;
+            string pending[2];
+            for (int i = 0; i < 2; ++i)
+                pending[i].assign(readers[i].bytes.begin(), readers[i].bytes.end());
+            string nothing_unsent[2]; // sends_out is 0
+            parkMatch(clientSockets, gameId, ticks, features, pending, nothing_unsent);
+
+            // called off, read on
+            pausing = false;
+            for (int i = 0; i < 2; ++i)
+            {
+                if (io.watchRecv(clientSockets[i]))
+                    reading++;
+                else
+                    lost = true;
+            }
+            if (lost)
+            {
+                io.unwatch(clientSockets[0]);
+                io.unwatch(clientSockets[1]);
+            }
+            continue;
+        }
+
+        // the wait ends in time to notice a player whose frames stopped moving
+        int timeout = -1;
+        for (int i = 0; i < 2; ++i)
+        {
+            int left = backlogs[i].msUntilStall();
+            if (left >= 0 && (timeout < 0 || left < timeout))
+                timeout = left;
+        }
+        io.wait(events, timeout);
+        for (const IoEvent &ev : events)
+        {
+            int p = ev.fd == clientSockets[0] ? 0 : 1;
+            if (ev.type == IO_RECEIVED)
+            {
+                readers[p].bytes.insert(readers[p].bytes.end(), ev.data, ev.data + ev.result);
+                if (!lost && readers[p].oversized())
+                    dropPlayer(p, "sent more than a tick may have");
+                else if (waiting[p] && readers[p].ready())
+                {
+                    // its tick is in, only the other one can hold up the match now
+                    waiting[p] = false;
+                    watchConnection(clientSockets[p], LIVE_PAUSED);
+                }
+            }
+            else if (ev.type == IO_RECV_DONE)
+            {
+                reading--;
+                if (pausing && ev.result == -ECANCELED)
+                    continue;
+                if (!game_over && !lost)
+                {
+                    cerr << "[GAME_INSTANCE] Player " << p << " closed its connection" << endl;
+                    lost = true;
+                    io.unwatch(clientSockets[1 - p]);
+                }
+            }
+            else if (ev.type == IO_SENT)
+            {
+                sends_out--;
+                backlogs[p].sent();
+                if (ev.result < 0 && !lost)
+                {
+                    cerr << "[GAME_INSTANCE] Sending a tick to player " << p << " failed" << endl;
+                    lost = true;
+                    io.unwatch(clientSockets[0]);
+                    io.unwatch(clientSockets[1]);
+                }
+            }
+        }
+        for (int i = 0; i < 2; ++i)
+        {
+            if (backlogs[i].stalled())
+                dropPlayer(i, "is not taking its ticks");
         }
     }
+}
+
+//  TCP lockstep on whichever backend the server runs
+static bool RunTcpLockstep(int clientSockets[2], int gameId, TickProcessor &ticks, const uint32_t features[2],
+                           string carried[2], const string unsent[2])
+{
+    // a match only ever has two sockets, so its rings stay small
+    IoBackend *io = g_Config.ioBackend == "blocking" ? nullptr : CreateIoBackend(g_Config.ioBackend, 16);
+    if (!io)
+        return RunTcpMatch(clientSockets, gameId, ticks, features, carried, unsent);
+    bool game_over = RunBackendMatch(*io, clientSockets, gameId, ticks, features, carried, unsent);
+    delete io;
+    return game_over;
+}
+
+// D. Check Game Over
+static void EndMatch(int clientSockets[2], int gameId, bool game_over, TickProcessor &ticks)
+{
+    int client1_sock = clientSockets[0];
+    if (game_over)
+    {
+        // set the winner in the user data, the session holds its id
+        addWin(sessionUser(client1_sock));
+        cout << "[GAME_INSTANCE] End Game signal received. Closing match." << endl;
+    }
+
+    ticks.report();
 
     cout << "[GAME_INSTANCE] Match ended. Sending broadcast." << endl;
     //get the game and send the cond signal
-    pthread_mutex_lock(&g_LobbyMutex);
-    for (auto& game : g_Games) {
-        if (game.id == gameId) {
-            pthread_cond_broadcast(&game.gameOverCond);
-            game.isActive = false;
-            break;
+    closeRoom(gameId);
+}
+
+// the match could not start. Both lobby sessions find their socket shut down and close it
+static void AbandonMatch(int clientSockets[2], int gameId, UdpMatch &udp, TickProcessor &ticks)
+{
+    shutdown(clientSockets[0], SHUT_RDWR);
+    shutdown(clientSockets[1], SHUT_RDWR);
+    CloseUdpMatch(udp);
+    EndMatch(clientSockets, gameId, false, ticks);
+}
+
+//  Main Game Loop
+void HandleMatch(const MatchArgs &match_args)
+{
+    int client1_sock = match_args.client1_sock;
+    int client2_sock = match_args.client2_sock;
+    int gameId = match_args.gameId;
+    const MatchAck *acks = match_args.acks;
+
+    int clientSockets[2] = {client1_sock, client2_sock};
+
+    // validation, unit ids and compaction for this match, and the memory all of it lives in
+    TickProcessor ticks;
+    ticks.setMatchId(gameId);
+
+    addMetric(g_Metrics.matchesStarted, 1);
+    // every tick is a heartbeat from here on
+    watchConnection(client1_sock, LIVE_MATCH);
+    watchConnection(client2_sock, LIVE_MATCH);
+
+    cout << "[GAME_INSTANCE] Match Started: " << client1_sock << " vs " << client2_sock << endl;
+
+    // UDP only when the server allows it and both players asked for it
+    UdpMatch udp;
+    bool use_udp = g_Config.allowUdp &&
+                   (acks[0].features & MATCH_FEATURE_UDP) && (acks[1].features & MATCH_FEATURE_UDP);
+    if (use_udp && !OpenUdpMatch(udp))
+    {
+        cerr << "[GAME_INSTANCE] Could not open a UDP socket, staying on TCP" << endl;
+        use_udp = false;
+    }
+    // what each player gets. Packed frames are a TCP thing, a UDP datagram window is
+    // small anyway. UDP datagrams always carry tick numbers, so TICKS is free there
+    uint32_t features[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        features[i] = acks[i].features & MATCH_FEATURE_TICKS;
+        if (use_udp)
+            features[i] |= MATCH_FEATURE_UDP;
+        else if (g_Config.compressFrames)
+            features[i] |= acks[i].features & MATCH_FEATURE_COMPRESS;
+    }
+
+    //HANDSHAKE (Send Player IDs)
+    {
+        TRACE_SPAN("handshake-ids", gameId);
+        uint32_t p1_id = 0;
+        uint32_t p2_id = 1;
+        usleep(100000); // slight delay to ensure clients are ready
+        if (!SendData(client1_sock, (const char *)&p1_id, sizeof(p1_id)))
+        {
+            cerr << "[GAME_INSTANCE] Error sending Handshake to P1" << endl;
+            AbandonMatch(clientSockets, gameId, udp, ticks);
+            return;
+        }
+        if (!SendData(client2_sock, (const char *)&p2_id, sizeof(p2_id)))
+        {
+            cerr << "[GAME_INSTANCE] Error sending Handshake to P2" << endl;
+            AbandonMatch(clientSockets, gameId, udp, ticks);
+            return;
         }
+
+        // clients that listed features in their ACK also get what was accepted
+        for (int i = 0; i < 2; ++i)
+        {
+            if (!acks[i].extended)
+                continue;
+            bool sent = SendData(clientSockets[i], (const char *)&features[i], sizeof(features[i]));
+            if (sent && use_udp)
+            {
+                sent = SendData(clientSockets[i], (const char *)&udp.port, sizeof(udp.port)) &&
+                       SendData(clientSockets[i], (const char *)&udp.tokens[i], sizeof(udp.tokens[i]));
+            }
+            if (!sent)
+            {
+                cerr << "[GAME_INSTANCE] Error sending match features to P" << i + 1 << endl;
+                AbandonMatch(clientSockets, gameId, udp, ticks);
+                return;
+            }
+        }
+    }
+
+    //LOCKSTEP LOOP
+    bool game_over;
+    if (use_udp)
+    {
+        cout << "[GAME_INSTANCE] Running match over UDP port " << udp.port << endl;
+        // the UDP socket and its resend state can't be handed to a new server
+        pinForRestart(true);
+        // RunUdpMatch has its own timeout, the TCP sockets stay quiet meanwhile
+        watchConnection(client1_sock, LIVE_PAUSED);
+        watchConnection(client2_sock, LIVE_PAUSED);
+        game_over = RunUdpMatch(udp, clientSockets, ticks);
+        pinForRestart(false);
+        CloseUdpMatch(udp);
     }
-    pthread_mutex_unlock(&g_LobbyMutex);
-    return NULL;
-}
\ No newline at end of file
+    else
+    {
+        string carried[2], unsent[2];
+        game_over = RunTcpLockstep(clientSockets, gameId, ticks, features, carried, unsent);
+    }
+
+    EndMatch(clientSockets, gameId, game_over, ticks);
+}
+
+void ResumeMatch(const ParkedSession &session)
+{
+    int clientSockets[2] = {session.socks[0], session.socks[1]};
+    string carried[2] = {session.pending[0], session.pending[1]};
+    TickProcessor ticks;
+    ticks.setMatchId(session.roomId);
+    watchConnection(clientSockets[0], LIVE_MATCH);
+    watchConnection(clientSockets[1], LIVE_MATCH);
+    BlobReader state(session.match.data(), session.match.size());
+    uint32_t features[2] = {0, 0};
+    bool game_over = false;
+    if (ticks.load(state) && state.get(features[0]) && state.get(features[1]))
+    {
+        cout << "[GAME_INSTANCE] Match " << session.roomId << " resumed after a hot restart" << endl;
+        game_over = RunTcpLockstep(clientSockets, session.roomId, ticks, features, carried, session.unsent);
+    }
+    else
+    {
+        // both processes agreed on RESTART_VERSION, so this is a bug in a save/load pair
+        cerr << "[GAME_INSTANCE] Could not read the state of match " << session.roomId << ", ending it" << endl;
+    }
+    EndMatch(clientSockets, session.roomId, game_over, ticks);
+}
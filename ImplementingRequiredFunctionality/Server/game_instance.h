@@ -1,13 +1,19 @@
 #ifndef GAME_INSTANCE_H
 #define GAME_INSTANCE_H
 
+#include "lobby_protocol.h"
+#include "hot_restart.h"
+
 struct MatchArgs {
     int client1_sock;
     int client2_sock;
     int gameId;
+    MatchAck acks[2]; // what each player asked for in its ACK line
 };
 
-// The main loop for the actual game
-void* HandleMatch(void* args);
+// The main loop for the actual game, on the host's lobby thread
+void HandleMatch(const MatchArgs& args);
+// the rest of a TCP match the old server handed over between two ticks (hot_restart.h)
+void ResumeMatch(const ParkedSession& session);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,633 @@
+#include "hot_restart.h"
+#include "lobby.h"
+#include "metrics.h"
+#include "state_blob.h"
+#include "output_queue.h"
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static const uint32_t RESTART_MAGIC = 0x48535452; // "RTSH"
+// bump whenever the layout below or of any save() changes, two builds only hand
+// over when they agree on it (the new one refuses and the old one carries on)
+static const uint32_t RESTART_VERSION = 11;
+static const int RESTART_CHILD_FD = 3;          // the new process's end of the socket
+static const int RESTART_STARTUP_MS = 5000;     // new process has this long to say it's ready
+static const int RESTART_PARK_MS = 2000;        // sessions have this long to reach a safe point
+static const int RESTART_ADOPT_MS = 5000;       // and the new process this long to take them
+static const size_t RESTART_CHUNK = 32 * 1024;  // state bytes per message
+static const size_t RESTART_FDS_PER_MSG = 250;  // the kernel takes at most 253 per message
+
+// every message on the restart socket starts with the totals, then up to
+// RESTART_CHUNK state bytes, with up to RESTART_FDS_PER_MSG sockets attached
+struct RestartMessage {
+    uint32_t stateBytes;
+    uint32_t fdCount;
+};
+
+// the STATS counters carry over, in this order
+static atomic<uint64_t> ServerMetrics::* const CARRIED_METRICS[] = {
+    &ServerMetrics::matchesStarted, &ServerMetrics::ticks, &ServerMetrics::commandsReceived,
+    &ServerMetrics::commandsBroadcast, &ServerMetrics::compactionCommandsSaved,
+    &ServerMetrics::compactionBytesSaved, &ServerMetrics::commandsRejected, &ServerMetrics::commandsClamped,
+    &ServerMetrics::commandsSimRejected, &ServerMetrics::ioSyscalls, &ServerMetrics::stateHashesChecked,
+    &ServerMetrics::desyncs, &ServerMetrics::slowConsumerDisconnects, &ServerMetrics::lobbyLinesDropped,
+    &ServerMetrics::pingsSent, &ServerMetrics::idleDisconnects, &ServerMetrics::handshakeTimeouts,
+    &ServerMetrics::framesCompressed, &ServerMetrics::compressionBytesSaved, &ServerMetrics::tickTagMismatches,
+    &ServerMetrics::chatThrottled, &ServerMetrics::commandsThrottled, &ServerMetrics::oversizedTicks,
+    &ServerMetrics::inputFloodDisconnects, &ServerMetrics::matchMemoryCapped,
+};
+
+static pthread_mutex_t g_RestartMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_RestartCond = PTHREAD_COND_INITIALIZER;
+static atomic<bool> g_Pausing{false};
+static uint64_t g_PauseRound = 0; // bumped when a restart is called off, parked threads wait for it
+static int g_Sessions = 0;        // lobby threads alive
+static int g_Pinned = 0;
+static int g_ListenSock = -1;     // set once the accept loop parked
+static vector<ParkedSession> g_Parked;
+
+static pthread_t g_MainThread;
+static vector<string> g_ExecArgs; // how we were started, without --resume-fd
+
+bool restartPending() {
+    return g_Pausing.load(memory_order_relaxed);
+}
+
+// waits until the current pause is over, g_RestartMutex held
+static void waitForResume() {
+    uint64_t round = g_PauseRound;
+    pthread_cond_broadcast(&g_RestartCond);
+    while (g_PauseRound == round) pthread_cond_wait(&g_RestartCond, &g_RestartMutex);
+}
+
+void parkForRestart(ParkedSession session) {
+    pthread_mutex_lock(&g_RestartMutex);
+    if (g_Pausing) {
+        g_Parked.push_back(move(session));
+        waitForResume();
+    }
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+void parkAcceptLoop(int listenSock) {
+    pthread_mutex_lock(&g_RestartMutex);
+    if (g_Pausing) {
+        g_ListenSock = listenSock;
+        waitForResume();
+    }
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+void restartSessionStarted() {
+    pthread_mutex_lock(&g_RestartMutex);
+    g_Sessions++;
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+void restartSessionEnded() {
+    pthread_mutex_lock(&g_RestartMutex);
+    g_Sessions--;
+    pthread_cond_broadcast(&g_RestartCond);
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+void pinForRestart(bool pinned) {
+    pthread_mutex_lock(&g_RestartMutex);
+    g_Pinned += pinned ? 1 : -1;
+    pthread_cond_broadcast(&g_RestartCond);
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+static void wakeMainThread(int) {} // only there so accept() returns EINTR
+
+// true when every session and the accept loop parked in time
+static bool pauseSessions() {
+    g_Pausing = true;
+    // joiners sleep on the match cond, wake them so they see the flag
+    pthread_mutex_lock(&g_LobbyMutex);
+    pthread_cond_broadcast(&g_MatchOverCond);
+    pthread_mutex_unlock(&g_LobbyMutex);
+
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(RESTART_PARK_MS);
+    bool parked = false;
+    pthread_mutex_lock(&g_RestartMutex);
+    while (true) {
+        if (g_Pinned > 0) {
+            cerr << "[RESTART] A UDP match started, calling the restart off" << endl;
+            break;
+        }
+        if (g_ListenSock >= 0 && (int)g_Parked.size() == g_Sessions) {
+            parked = true;
+            break;
+        }
+        if (chrono::steady_clock::now() >= deadline) {
+            cerr << "[RESTART] Only " << g_Parked.size() << " of " << g_Sessions
+                 << " sessions reached a safe point, calling the restart off" << endl;
+            break;
+        }
+        // a signal that lands just before accept() is lost, so keep knocking
+        if (g_ListenSock < 0) pthread_kill(g_MainThread, SIGUSR1);
+        timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10 * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&g_RestartCond, &g_RestartMutex, &until);
+    }
+    pthread_mutex_unlock(&g_RestartMutex);
+    return parked;
+}
+
+// everyone carries on where they parked
+static void resumeSessions() {
+    pthread_mutex_lock(&g_RestartMutex);
+    g_Parked.clear();
+    g_ListenSock = -1;
+    g_Pausing = false;
+    g_PauseRound++;
+    pthread_cond_broadcast(&g_RestartCond);
+    pthread_mutex_unlock(&g_RestartMutex);
+}
+
+// one byte from the other process, false on anything else or after timeoutMs
+static bool recvSignal(int sock, char expected, int timeoutMs) {
+    pollfd p = { sock, POLLIN, 0 };
+    int r;
+    do { r = poll(&p, 1, timeoutMs); } while (r < 0 && errno == EINTR);
+    char c;
+    return r > 0 && recv(sock, &c, 1, 0) == 1 && c == expected;
+}
+
+static bool sendSignal(int sock, char c) {
+    return send(sock, &c, 1, MSG_NOSIGNAL) == 1;
+}
+
+// fork + exec of the binary we were started from, with its end of the socket at RESTART_CHILD_FD
+static pid_t spawnNewServer(int childEnd) {
+    vector<string> args = g_ExecArgs;
+    args.push_back("--resume-fd");
+    args.push_back(to_string(RESTART_CHILD_FD));
+    vector<char*> argv;
+    for (string& a : args) argv.push_back(&a[0]);
+    argv.push_back(nullptr);
+    long maxFd = sysconf(_SC_OPEN_MAX);
+    cout.flush();
+
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    // only async signal safe calls from here to exec, the other threads' locks are frozen in this copy
+    if (childEnd != RESTART_CHILD_FD) dup2(childEnd, RESTART_CHILD_FD);
+    // every socket the new process needs comes over the restart socket, drop the inherited copies
+    if (close_range(RESTART_CHILD_FD + 1, ~0U, 0) < 0) {
+        for (long fd = RESTART_CHILD_FD + 1; fd < maxFd; fd++) close(fd);
+    }
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execvp(argv[0], argv.data());
+    _exit(127);
+}
+
+static void abandonChild(pid_t child) {
+    kill(child, SIGKILL);
+    waitpid(child, NULL, 0);
+}
+
+static int fdIndex(map<int, int>& index, vector<int>& fds, int fd) {
+    if (fd < 0) return -1;
+    auto it = index.find(fd);
+    if (it != index.end()) return it->second;
+    index[fd] = fds.size();
+    fds.push_back(fd);
+    return fds.size() - 1;
+}
+
+// the whole server as the new process will see it. Every session is parked, g_RestartMutex held
+static void buildState(BlobWriter& out, vector<int>& fds) {
+    map<int, int> index;
+    fdIndex(index, fds, g_ListenSock);
+    for (const ParkedSession& s : g_Parked) {
+        fdIndex(index, fds, s.socks[0]);
+        fdIndex(index, fds, s.socks[1]);
+    }
+
+    out.put(RESTART_MAGIC);
+    out.put(RESTART_VERSION);
+    for (auto field : CARRIED_METRICS) out.put((g_Metrics.*field).load());
+
+    pthread_mutex_lock(&g_LobbyMutex);
+    out.put((int32_t)nextRoomId());
+    // the whole table with the removed slots and generations, so user ids mean the same in the new process
+    out.put((uint32_t)g_Users.size());
+    for (const User& u : g_Users) {
+        out.putString(u.username);
+        out.put((int32_t)u.numWins);
+        out.put((uint8_t)u.removed);
+        out.put(u.generation);
+    }
+    out.put((uint32_t)g_FreeUsers.size());
+    for (uint32_t slot : g_FreeUsers) out.put(slot);
+
+    // logged in connections, by socket
+    vector<pair<int, UserId>> connected;
+    for (int sock = 0; sock < (int)connected_Users.size(); sock++) {
+        if (connected_Users[sock] != NO_USER && index.count(sock)) connected.push_back({ index[sock], connected_Users[sock] });
+    }
+    out.put((uint32_t)connected.size());
+    for (const auto& c : connected) {
+        out.put((int32_t)c.first);
+        out.put((uint32_t)c.second);
+    }
+
+    // rooms that are still open or playing, finished ones are only history
+    vector<const GameRoom*> rooms;
+    for (const GameRoom& g : g_Games) {
+        if (g.isActive && index.count(g.hostSocket)) rooms.push_back(&g);
+    }
+    out.put((uint32_t)rooms.size());
+    for (const GameRoom* g : rooms) {
+        out.put((int32_t)g->id);
+        out.put((int32_t)index[g->hostSocket]);
+        out.put((int32_t)(index.count(g->joinerSocket) ? index[g->joinerSocket] : -1));
+        out.put((uint8_t)g->isFull);
+        out.putString(g->joinerPending);
+        out.put((uint8_t)g->joinerFormat);
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+
+    out.put((uint32_t)g_Parked.size());
+    for (const ParkedSession& s : g_Parked) {
+        out.put((uint8_t)s.kind);
+        for (int i = 0; i < 2; i++) out.put((int32_t)fdIndex(index, fds, s.socks[i]));
+        out.put((int32_t)s.roomId);
+        for (int i = 0; i < 2; i++) out.putString(s.pending[i]);
+        string unsent[2] = { s.unsent[0], s.unsent[1] };
+        // a lobby session's replies and broadcasts still sit in its outbox, a match queues its own frames
+        if (s.kind != PARKED_MATCH) unsent[0] = outboxUnsent(s.socks[0]);
+        for (int i = 0; i < 2; i++) out.putString(unsent[i]);
+        out.putString(s.match);
+        out.put((uint8_t)s.format);
+    }
+}
+
+static bool sendState(int sock, const string& state, const vector<int>& fds) {
+    size_t sentBytes = 0, sentFds = 0;
+    do {
+        RestartMessage header = { (uint32_t)state.size(), (uint32_t)fds.size() };
+        size_t bytes = min(RESTART_CHUNK, state.size() - sentBytes);
+        size_t count = min(RESTART_FDS_PER_MSG, fds.size() - sentFds);
+        iovec iov[2] = {
+            { &header, sizeof(header) },
+            { (void*)(state.data() + sentBytes), bytes },
+        };
+
+        vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (count > 0) {
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+            memcpy(CMSG_DATA(cmsg), fds.data() + sentFds, count * sizeof(int));
+        }
+        if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(header) + bytes)) return false;
+        sentBytes += bytes;
+        sentFds += count;
+    } while (sentBytes < state.size() || sentFds < fds.size());
+    return true;
+}
+
+static void hotRestart() {
+    pthread_mutex_lock(&g_RestartMutex);
+    bool pinned = g_Pinned > 0;
+    pthread_mutex_unlock(&g_RestartMutex);
+    if (pinned) {
+        cerr << "[RESTART] UDP matches can't be handed over, try again once they are over" << endl;
+        return;
+    }
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, pair) < 0) {
+        cerr << "[RESTART] socketpair failed" << endl;
+        return;
+    }
+    pid_t child = spawnNewServer(pair[1]);
+    close(pair[1]);
+    int sock = pair[0];
+    if (child < 0) {
+        cerr << "[RESTART] fork failed" << endl;
+        close(sock);
+        return;
+    }
+
+    // the new binary starts up while everyone here keeps playing
+    if (!recvSignal(sock, 'R', RESTART_STARTUP_MS)) {
+        cerr << "[RESTART] New server (pid " << child << ") did not start, carrying on" << endl;
+        abandonChild(child);
+        close(sock);
+        return;
+    }
+
+    auto paused = chrono::steady_clock::now();
+    bool handed = false;
+    size_t sessions = 0;
+    if (pauseSessions()) {
+        BlobWriter state;
+        vector<int> fds;
+        pthread_mutex_lock(&g_RestartMutex);
+        buildState(state, fds);
+        sessions = g_Parked.size();
+        pthread_mutex_unlock(&g_RestartMutex);
+        handed = sendState(sock, state.bytes, fds) && recvSignal(sock, 'A', RESTART_ADOPT_MS);
+        if (!handed) cerr << "[RESTART] New server (pid " << child << ") did not take over, carrying on" << endl;
+    }
+    if (!handed) {
+        // it may hold our sockets already, it has to be gone before anyone here touches them again
+        abandonChild(child);
+        close(sock);
+        resumeSessions();
+        return;
+    }
+
+    auto ms = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - paused).count() / 1000.0;
+    cout << "[RESTART] Handed " << sessions << " sessions to pid " << child << ", paused for " << ms << " ms" << endl;
+    cout.flush();
+    // the sockets live on in the new process, nothing here may close or write to them
+    _exit(0);
+}
+
+static void* RestartThread(void*) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    while (true) {
+        int sig;
+        if (sigwait(&set, &sig) != 0) continue;
+        cout << "[RESTART] SIGUSR2 received, starting a new server" << endl;
+        if (g_Config.coroutines || g_Config.workers > 1) {
+            cerr << "[RESTART] Hot restart is not available with --coroutines or --workers" << endl;
+            continue;
+        }
+        hotRestart();
+    }
+    return NULL;
+}
+
+void StartHotRestart(int argc, char* argv[]) {
+    for (int i = 0; i < argc; i++) {
+        if (string(argv[i]) == "--resume-fd" && i + 1 < argc) {
+            i++;
+            continue;
+        }
+        g_ExecArgs.push_back(argv[i]);
+    }
+    g_MainThread = pthread_self();
+
+    // blocked here, so every thread created from now on has it blocked and only sigwait sees it
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct sigaction wake;
+    memset(&wake, 0, sizeof(wake));
+    wake.sa_handler = wakeMainThread; // no SA_RESTART, a blocked accept() has to give up
+    sigaction(SIGUSR1, &wake, NULL);
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, RestartThread, NULL) == 0) pthread_detach(t);
+    else cerr << "[RESTART] Could not start the restart thread, SIGUSR2 does nothing" << endl;
+}
+
+// NEW PROCESS
+
+static bool recvState(int sock, string& state, vector<int>& fds) {
+    RestartMessage total = { 0, 0 };
+    bool first = true;
+    vector<char> buffer(sizeof(RestartMessage) + RESTART_CHUNK);
+    vector<char> control(CMSG_SPACE(RESTART_FDS_PER_MSG * sizeof(int)));
+    while (first || state.size() < total.stateBytes || fds.size() < total.fdCount) {
+        pollfd p = { sock, POLLIN, 0 };
+        if (poll(&p, 1, RESTART_ADOPT_MS) <= 0) return false;
+
+        iovec iov = { buffer.data(), buffer.size() };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        ssize_t r = recvmsg(sock, &msg, 0);
+        // collect the sockets first, whatever else is wrong they have to be closed by the caller
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* received = (const int*)CMSG_DATA(cmsg);
+            fds.insert(fds.end(), received, received + count);
+        }
+        if (r < (ssize_t)sizeof(RestartMessage) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) return false;
+
+        RestartMessage header;
+        memcpy(&header, buffer.data(), sizeof(header));
+        if (first) total = header;
+        first = false;
+        state.append(buffer.data() + sizeof(header), r - sizeof(header));
+        if (state.size() > total.stateBytes || fds.size() > total.fdCount) return false;
+    }
+    return true;
+}
+
+struct RestoredRoom {
+    GameRoom room;
+    int hostIndex, joinerIndex;
+};
+
+struct RestoredUser {
+    int index;
+    UserId user;
+};
+
+// reads the whole state before anything is touched, false if it does not add up
+static bool parseState(BlobReader& in, size_t fdCount, int& nextRoom, vector<uint64_t>& metrics,
+                       vector<User>& users, deque<uint32_t>& freeUsers, vector<RestoredUser>& connected,
+                       vector<RestoredRoom>& rooms, vector<ParkedSession>& sessions, vector<int>& indexes) {
+    uint32_t magic = 0, version = 0;
+    in.get(magic);
+    in.get(version);
+    if (magic != RESTART_MAGIC || version != RESTART_VERSION) {
+        cerr << "[RESTART] The old server speaks restart version " << version << ", this one " << RESTART_VERSION << endl;
+        return false;
+    }
+    for (uint64_t& m : metrics) in.get(m);
+
+    int32_t next = 0;
+    in.get(next);
+    nextRoom = next;
+    uint32_t count = 0;
+    in.get(count);
+    if (count > MAX_USERS) return false;
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        User u;
+        int32_t wins = 0;
+        uint8_t removed = 0;
+        in.getString(u.username);
+        in.get(wins);
+        in.get(removed);
+        in.get(u.generation);
+        u.numWins = wins;
+        u.removed = removed != 0;
+        users.push_back(u);
+    }
+    in.get(count);
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        uint32_t slot = 0;
+        in.get(slot);
+        if (slot >= users.size() || !users[slot].removed) return false;
+        freeUsers.push_back(slot);
+    }
+
+    auto validIndex = [&](int32_t idx, bool optional) {
+        return (optional && idx == -1) || (idx > 0 && (size_t)idx < fdCount); // 0 is the listening socket
+    };
+
+    in.get(count);
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        int32_t idx = -1;
+        uint32_t user = NO_USER;
+        RestoredUser c;
+        in.get(idx);
+        in.get(user);
+        // a removed user's id stays valid here, it just finds nobody
+        if (!validIndex(idx, false) || userSlot(user) >= users.size()) return false;
+        c.user = user;
+        c.index = idx;
+        connected.push_back(c);
+    }
+
+    in.get(count);
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        int32_t id = 0, host = -1, joiner = -1;
+        uint8_t full = 0;
+        RestoredRoom r;
+        in.get(id);
+        in.get(host);
+        in.get(joiner);
+        in.get(full);
+        in.getString(r.room.joinerPending);
+        uint8_t format = 0;
+        in.get(format);
+        if (!validIndex(host, false) || !validIndex(joiner, true) || format > LOBBY_BINARY) return false;
+        r.room.joinerFormat = (LobbyFormat)format;
+        r.room.id = id;
+        r.room.isFull = full != 0;
+        r.room.isActive = true;
+        r.hostIndex = host;
+        r.joinerIndex = joiner;
+        rooms.push_back(r);
+    }
+
+    in.get(count);
+    for (uint32_t i = 0; i < count && in.ok(); i++) {
+        ParkedSession s;
+        uint8_t kind = 0;
+        int32_t idx[2] = { -1, -1 }, room = -1;
+        in.get(kind);
+        in.get(idx[0]);
+        in.get(idx[1]);
+        in.get(room);
+        in.getString(s.pending[0]);
+        in.getString(s.pending[1]);
+        in.getString(s.unsent[0]);
+        in.getString(s.unsent[1]);
+        in.getString(s.match);
+        uint8_t format = 0;
+        in.get(format);
+        if (format > LOBBY_BINARY) return false;
+        s.format = (LobbyFormat)format;
+        if (kind >= PARKED_KIND_COUNT || !validIndex(idx[0], false) || !validIndex(idx[1], kind != PARKED_MATCH))
+            return false;
+        s.kind = (ParkedKind)kind;
+        s.roomId = room;
+        indexes.push_back(idx[0]);
+        indexes.push_back(idx[1]);
+        sessions.push_back(move(s));
+    }
+    return in.done();
+}
+
+bool ResumeFromRestart(int fd, int& listenSock) {
+    string state;
+    vector<int> fds;
+    int nextRoom = 1;
+    vector<uint64_t> metrics(sizeof(CARRIED_METRICS) / sizeof(CARRIED_METRICS[0]));
+    vector<User> users;
+    deque<uint32_t> freeUsers;
+    vector<RestoredUser> connected;
+    vector<RestoredRoom> rooms;
+    vector<ParkedSession> sessions;
+    vector<int> indexes; // two per session
+
+    bool ok = sendSignal(fd, 'R') && recvState(fd, state, fds) && !fds.empty();
+    if (ok) {
+        BlobReader in(state.data(), state.size());
+        ok = parseState(in, fds.size(), nextRoom, metrics, users, freeUsers, connected, rooms, sessions, indexes);
+    }
+    // once the old process has the answer it exits, from here on everything is ours
+    if (!ok || !sendSignal(fd, 'A')) {
+        for (int s : fds) close(s);
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    auto sockAt = [&](int idx) { return idx < 0 ? -1 : fds[idx]; };
+    listenSock = fds[0];
+    // the epoll accept loop makes it non blocking, the blocking one needs it blocking again
+    fcntl(listenSock, F_SETFL, fcntl(listenSock, F_GETFL) & ~O_NONBLOCK);
+    for (size_t i = 0; i < metrics.size(); i++) (g_Metrics.*CARRIED_METRICS[i]).store(metrics[i]);
+    restoreNextRoomId(nextRoom);
+
+    pthread_mutex_lock(&g_LobbyMutex);
+    g_Users = move(users);
+    g_FreeUsers = move(freeUsers);
+    g_UserIds.clear();
+    for (uint32_t slot = 0; slot < g_Users.size(); slot++) {
+        const User& u = g_Users[slot];
+        if (!u.removed) g_UserIds[u.username] = makeUserId(slot, u.generation);
+    }
+    for (const RestoredUser& c : connected) logIn(sockAt(c.index), c.user);
+    for (RestoredRoom& r : rooms) {
+        r.room.hostSocket = sockAt(r.hostIndex);
+        r.room.joinerSocket = sockAt(r.joinerIndex);
+        g_Games.push_back(r.room);
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+
+    for (size_t i = 0; i < sessions.size(); i++) {
+        sessions[i].socks[0] = sockAt(indexes[2 * i]);
+        sessions[i].socks[1] = sockAt(indexes[2 * i + 1]);
+        ResumeSession(sessions[i]);
+    }
+    cout << "[RESTART] Took over " << sessions.size() << " sessions and " << rooms.size() << " rooms" << endl;
+    return true;
+}
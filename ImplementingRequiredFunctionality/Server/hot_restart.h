@@ -0,0 +1,61 @@
+#ifndef HOT_RESTART_H
+#define HOT_RESTART_H
+
+#include "shared.h"
+
+// kill -USR2 <server pid> upgrades the server without dropping anyone. The
+// server starts its binary again (same path and options, plus --resume-fd) and
+// hands the new process everything that is live:
+//  - the listening socket
+//  - every lobby connection, its username and the unread part of its last line
+//  - waiting rooms, their hosts and joiners
+//  - running TCP matches with their TickProcessor state and the bytes of the
+//    next tick that were already read
+// Sockets go over a Unix socket with SCM_RIGHTS, everything else as one state
+// blob (state_blob.h). Every session stops itself at its next safe point (top
+// of the lobby loop, between two ticks) and the new process picks it up right
+// there, so a match sees one late tick and nothing else. If the new process
+// does not take over in time, everything simply carries on in the old one.
+//
+// Not available with --workers or --coroutines, and refused while a UDP match runs.
+
+enum ParkedKind : uint8_t {
+    PARKED_LOBBY,  // in the lobby loop
+    PARKED_HOST,   // waiting in its room after CREATE
+    PARKED_JOINER, // waiting for its room's match to end
+    PARKED_MATCH,  // host thread running the match, socks[1] is the joiner
+    PARKED_KIND_COUNT,
+};
+
+struct ParkedSession {
+    ParkedKind kind = PARKED_LOBBY;
+    int socks[2] = { -1, -1 };
+    int roomId = -1;
+    string pending[2]; // bytes read from socks[i] that nothing has used yet
+    string unsent[2];  // bytes queued for socks[i] that did not go out yet (output_queue.h)
+    string match;      // PARKED_MATCH: TickProcessor::save
+    LobbyFormat format = LOBBY_TEXT; // what socks[0] speaks in the lobby
+};
+
+// Call first thing in main, before any other thread exists: blocks SIGUSR2 in
+// every thread and starts the one that waits for it
+void StartHotRestart(int argc, char* argv[]);
+
+// true while a restart wants every session to stop at its next safe point
+bool restartPending();
+// a session at a safe point hands itself over. Returns if the restart was called
+// off and the session just carries on. If it went through the process exits instead
+void parkForRestart(ParkedSession session);
+// the accept loop's version: the main thread stops accepting on listenSock until it returns
+void parkAcceptLoop(int listenSock);
+// one per lobby thread, so a restart knows how many sessions to wait for
+void restartSessionStarted();
+void restartSessionEnded();
+// around sessions that can't be moved (UDP matches), restarts are refused while any runs
+void pinForRestart(bool pinned);
+
+// --resume-fd: takes over what the old process sends on fd, restores the lobby
+// and starts a thread per session. false if nothing usable arrived
+bool ResumeFromRestart(int fd, int& listenSock);
+
+#endif
@@ -0,0 +1,16 @@
+#include "io_backend.h"
+
+using namespace std;
+
+#ifdef __linux__
+IoBackend* CreateEpollBackend();
+IoBackend* CreateUringBackend(unsigned queueDepth);
+#endif
+
+IoBackend* CreateIoBackend(const string& name, unsigned queueDepth) {
+#ifdef __linux__
+    if (name == "epoll") return CreateEpollBackend();
+    if (name == "uring") return CreateUringBackend(queueDepth);
+#endif
+    return nullptr;
+}
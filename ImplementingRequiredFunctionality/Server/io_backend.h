@@ -0,0 +1,54 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <vector>
+#include <string>
+#include <sys/uio.h>
+
+using namespace std;
+
+// Completion style socket I/O used by the accept loop and the TCP match loop
+// when the server runs with --io-backend epoll|uring. "blocking" keeps the
+// original one-syscall-per-call path and does not go through this interface.
+//
+// Work is only queued by the calls below. wait() hands everything queued to the
+// kernel in one batch (one io_uring_enter for uring) and returns what completed.
+
+enum IoEventType {
+    IO_ACCEPTED,  // fd is a new connection on the watched listening socket
+    IO_RECEIVED,  // result bytes at data, valid until the next wait()
+    IO_RECV_DONE, // backend stopped reading fd: result is 0 on EOF, -errno on error, -ECANCELED after unwatch
+    IO_SENT,      // one send() finished: result is the byte count or -errno
+};
+
+struct IoEvent {
+    IoEventType type;
+    int fd;
+    int result;
+    const char* data;
+};
+
+class IoBackend {
+public:
+    virtual ~IoBackend() {}
+    virtual const char* name() const = 0;
+
+    // keeps producing IO_ACCEPTED for every new connection on listenFd
+    virtual bool watchAccept(int listenFd) = 0;
+    // keeps producing IO_RECEIVED for fd until IO_RECV_DONE
+    virtual bool watchRecv(int fd) = 0;
+    // stop reading fd, an IO_RECV_DONE follows once the backend is really done with it.
+    // Works on the listening socket too: no IO_ACCEPTED for it after its IO_RECV_DONE
+    virtual void unwatch(int fd) = 0;
+    // queues the bytes (copied) to go out on fd in order
+    virtual void send(int fd, const iovec* iov, int iovcnt) = 0;
+    // submits everything queued and waits up to timeoutMs (-1 forever) for events
+    virtual int wait(vector<IoEvent>& events, int timeoutMs) = 0;
+};
+
+// "epoll" or "uring". nullptr when the platform or kernel does not support it.
+// queueDepth sizes the uring rings and its recv buffers (4KB each), a match only
+// needs a few while the accept loop uses the default
+IoBackend* CreateIoBackend(const string& name, unsigned queueDepth = 64);
+
+#endif
@@ -0,0 +1,81 @@
+#include "line_reader.h"
+#include <cstring>
+#include <algorithm>
+#include <sys/socket.h>
+
+using namespace std;
+
+void LineReader::reserveTail(size_t n) {
+    if (start == end) {
+        // everything was consumed, reuse the buffer from the front for free
+        start = scan = end = 0;
+    } else if (buf.size() - end < n && start > 0) {
+        // slide the partial line down before deciding to grow
+        memmove(buf.data(), buf.data() + start, end - start);
+        end -= start;
+        scan -= start;
+        start = 0;
+    }
+    if (buf.size() - end < n) {
+        buf.resize(max(buf.size() * 2, end + n));
+    }
+}
+
+int LineReader::fill(int sock) {
+    reserveTail(READ_CHUNK);
+    int bytes = recv(sock, buf.data() + end, buf.size() - end, 0);
+    if (bytes > 0) end += bytes;
+    return bytes;
+}
+
+void LineReader::append(const char* data, size_t len) {
+    reserveTail(len);
+    memcpy(buf.data() + end, data, len);
+    end += len;
+}
+
+bool LineReader::nextLine(string_view& line) {
+    const char* base = buf.data();
+    const char* nl = (const char*)memchr(base + scan, '\n', end - scan);
+    if (nl == nullptr) {
+        scan = end;
+        return false;
+    }
+    size_t lineEnd = nl - base;
+    size_t len = lineEnd - start;
+    if (len > 0 && base[lineEnd - 1] == '\r') len--;
+    line = string_view(base + start, len);
+    start = scan = lineEnd + 1;
+    return true;
+}
+
+bool LineReader::readLine(int sock, string_view& line) {
+    while (!nextLine(line)) {
+        if (overflowed()) return false;
+        if (fill(sock) <= 0) return false;
+    }
+    return true;
+}
+
+bool LineReader::nextFrame(string_view& frame) {
+    uint32_t len;
+    if (end - start < sizeof(len)) return false;
+    memcpy(&len, buf.data() + start, sizeof(len));
+    // a frame has at least its type, and it has to fit where a line would
+    if (len == 0 || len > MAX_LINE - sizeof(len)) {
+        badFrame = true;
+        return false;
+    }
+    if (end - start - sizeof(len) < len) return false;
+    frame = string_view(buf.data() + start + sizeof(len), len);
+    consume(sizeof(len) + len);
+    return true;
+}
+
+bool LineReader::readMessage(int sock, string_view& message) {
+    while (!nextMessage(message)) {
+        if (overflowed()) return false;
+        if (fill(sock) <= 0) return false;
+    }
+    return true;
+}
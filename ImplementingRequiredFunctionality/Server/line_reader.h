@@ -0,0 +1,62 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include "lobby_protocol.h"
+#include <vector>
+#include <string_view>
+#include <cstddef>
+
+using namespace std;
+
+// Per-connection input buffer for the lobby protocol.
+// Bytes from recv are appended at the tail and complete '\n' terminated lines
+// (or length prefixed frames, once the client switched to LOBBY_BINARY) are popped
+// from the head, so one read can yield many commands and a command split across
+// reads waits until the rest of it arrives.
+class LineReader {
+public:
+    static const size_t READ_CHUNK = 4096;
+    static const size_t MAX_LINE = 64 * 1024; // longest line we accept before giving up on the client
+
+    // recv whatever is available into the buffer. Same return value as recv
+    int fill(int sock);
+    // copy bytes in directly (bytes that were read somewhere else, benchmarks)
+    void append(const char* data, size_t len);
+
+    // pops the next complete line without the '\n' (or "\r\n").
+    // The view points into the buffer and is only valid until the next fill/append
+    bool nextLine(string_view& line);
+    // blocking version for the handshake paths: recv until a full line is there
+    bool readLine(int sock, string_view& line);
+
+    // pops the next complete frame: its type byte and payload, without the length
+    bool nextFrame(string_view& frame);
+    // a line or a frame, whichever the connection speaks
+    bool nextMessage(string_view& message) { return format() == LOBBY_BINARY ? nextFrame(message) : nextLine(message); }
+    bool readMessage(int sock, string_view& message);
+    LobbyFormat format() const { return frameMode ? LOBBY_BINARY : LOBBY_TEXT; }
+    void setFormat(LobbyFormat format) { frameMode = format == LOBBY_BINARY; }
+
+    // true once a partial line grew past MAX_LINE, or a frame said it would
+    bool overflowed() const { return badFrame || end - start > MAX_LINE; }
+    size_t buffered() const { return end - start; }
+
+    // raw access for the binary match phase that follows the ACK line on the same connection
+    const char* peek() const { return buf.data() + start; }
+    void consume(size_t n) {
+        start += n;
+        if (scan < start) scan = start;
+    }
+
+private:
+    vector<char> buf;
+    size_t start = 0; // first byte not handed out yet
+    size_t scan = 0;  // everything in [start, scan) is known to have no '\n'
+    size_t end = 0;   // one past the last received byte
+    bool frameMode = false;
+    bool badFrame = false;
+
+    void reserveTail(size_t n);
+};
+
+#endif
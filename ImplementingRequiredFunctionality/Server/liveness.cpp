@@ -0,0 +1,156 @@
+#include "liveness.h"
+#include "timer_wheel.h"
+#include "shared.h"
+#include "metrics.h"
+#include "hot_restart.h"
+#include <memory>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+// One per watched connection
+struct Liveness {
+    TimerNode timer; // first member, a fired node is its Liveness
+    int sock;
+    LivenessPhase phase;
+    uint64_t since;      // ticks, when the phase started
+    uint64_t lastActive; // ticks, last bytes in
+    uint64_t pingedAt;   // ticks, last PING we sent (lobby)
+};
+
+static pthread_mutex_t g_LivenessMutex = PTHREAD_MUTEX_INITIALIZER;
+static TimerWheel* g_Wheel = nullptr; // created by StartLiveness
+static unordered_map<int, unique_ptr<Liveness>> g_Watched; // by socket
+static void (*g_SendPing)(int sock) = nullptr;
+
+static uint64_t nowTick() {
+    uint64_t ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    return ms / LIVENESS_TICK_MS;
+}
+
+static uint64_t ticks(int ms) {
+    return (ms + LIVENESS_TICK_MS - 1) / LIVENESS_TICK_MS;
+}
+
+// a lobby connection that said something since our last PING (the PONG can't come in the tick before it)
+static bool answered(const Liveness& live) {
+    return live.lastActive >= live.pingedAt;
+}
+
+// when the timer of live has to look at it next
+static uint64_t dueTick(const Liveness& live) {
+    if (live.phase == LIVE_HANDSHAKE) return live.since + ticks(g_Config.handshakeTimeoutMs);
+    uint64_t idle = live.lastActive + ticks(g_Config.idleTimeoutMs);
+    if (live.phase != LIVE_LOBBY) return idle;
+    if (answered(live)) return live.lastActive + ticks(g_Config.heartbeatMs);
+    // a PONG can't be seen without the timer firing, so it looks again a heartbeat after the PING
+    uint64_t recheck = live.pingedAt + ticks(g_Config.heartbeatMs);
+    return recheck > g_Wheel->now() ? min(idle, recheck) : idle;
+}
+
+// Wheel locked. Bytes that came in since the timer was armed just push it back
+static void fireLiveness(TimerNode* node) {
+    Liveness& live = *(Liveness*)node;
+    if (live.phase == LIVE_PAUSED) return;
+    uint64_t due = dueTick(live);
+    if (due > g_Wheel->now()) {
+        g_Wheel->arm(node, due);
+        return;
+    }
+
+    if (live.phase == LIVE_LOBBY && answered(live)) {
+        live.pingedAt = g_Wheel->now();
+        g_SendPing(live.sock);
+        addMetric(g_Metrics.pingsSent, 1);
+        g_Wheel->arm(node, dueTick(live));
+        return;
+    }
+
+    if (live.phase == LIVE_HANDSHAKE) {
+        cerr << "[LOBBY] Connection " << live.sock << " did not finish the match handshake in "
+             << g_Config.handshakeTimeoutMs << " ms, disconnecting it" << endl;
+        addMetric(g_Metrics.handshakeTimeouts, 1);
+    } else {
+        cerr << (live.phase == LIVE_MATCH ? "[GAME_INSTANCE] Player " : "[LOBBY] Connection ") << live.sock
+             << " silent for " << g_Config.idleTimeoutMs << " ms, disconnecting it" << endl;
+        addMetric(g_Metrics.idleDisconnects, 1);
+    }
+    // its session sees EOF, the timer stays off until someone watches it again
+    shutdown(live.sock, SHUT_RDWR);
+}
+
+void watchConnection(int sock, LivenessPhase phase) {
+    pthread_mutex_lock(&g_LivenessMutex);
+    unique_ptr<Liveness>& slot = g_Watched[sock];
+    if (!slot) {
+        slot.reset(new Liveness());
+        slot->timer.fire = fireLiveness;
+        slot->sock = sock;
+    }
+    Liveness& live = *slot;
+    live.phase = phase;
+    live.since = live.lastActive = nowTick();
+    live.pingedAt = 0;
+    if (phase == LIVE_PAUSED) g_Wheel->cancel(&live.timer);
+    else g_Wheel->arm(&live.timer, dueTick(live));
+    pthread_mutex_unlock(&g_LivenessMutex);
+}
+
+void connectionActive(int sock) {
+    pthread_mutex_lock(&g_LivenessMutex);
+    auto it = g_Watched.find(sock);
+    if (it != g_Watched.end()) it->second->lastActive = nowTick();
+    pthread_mutex_unlock(&g_LivenessMutex);
+}
+
+void forgetConnection(int sock) {
+    pthread_mutex_lock(&g_LivenessMutex);
+    auto it = g_Watched.find(sock);
+    if (it != g_Watched.end()) {
+        g_Wheel->cancel(&it->second->timer);
+        g_Watched.erase(it);
+    }
+    pthread_mutex_unlock(&g_LivenessMutex);
+}
+
+int livenessWaitMs() {
+    pthread_mutex_lock(&g_LivenessMutex);
+    uint64_t wait = g_Wheel->ticksUntilNext();
+    pthread_mutex_unlock(&g_LivenessMutex);
+    return wait == 0 ? -1 : (int)(wait * LIVENESS_TICK_MS);
+}
+
+void runLivenessTimers() {
+    pthread_mutex_lock(&g_LivenessMutex);
+    g_Wheel->advance(nowTick());
+    pthread_mutex_unlock(&g_LivenessMutex);
+}
+
+static void* RunLivenessThread(void*) {
+    while (true) {
+        // a timer armed while we sleep is a few seconds out, waking every 100ms at most is plenty
+        int wait = livenessWaitMs();
+        if (wait < 0 || wait > 10 * LIVENESS_TICK_MS) wait = 10 * LIVENESS_TICK_MS;
+        usleep(wait * 1000);
+        // the sockets are being handed to a new server, none of them may be shut down meanwhile
+        if (restartPending()) continue;
+        runLivenessTimers();
+    }
+    return NULL;
+}
+
+void StartLiveness(void (*sendPing)(int sock), bool ownThread) {
+    g_SendPing = sendPing;
+    g_Wheel = new TimerWheel(nowTick());
+    if (!ownThread) return;
+    pthread_t t;
+    if (pthread_create(&t, NULL, RunLivenessThread, NULL) != 0) {
+        cerr << "Could not start the liveness thread, idle connections won't time out" << endl;
+        return;
+    }
+    pthread_detach(t);
+}
@@ -0,0 +1,47 @@
+#ifndef LIVENESS_H
+#define LIVENESS_H
+
+#include <cstdint>
+
+// Heartbeats and timeouts for every client connection, so a dead or stuck
+// peer can't hold a session thread, a room or a match forever. All connections
+// share one TimerWheel (timer_wheel.h) with a timer each. Bytes coming in only
+// stamp the connection and its timer catches up when it fires, so a chatty
+// lobby connection costs no timer work at all.
+//
+// What a timer does depends on the phase its connection is in:
+//  - lobby: silent for --heartbeat-ms gets a "PING" line, the client answers "PONG"
+//    (client.cpp does it by itself). Silent for --idle-timeout-ms is disconnected
+//  - handshake: from MATCH_START until the match starts, --handshake-timeout-ms all
+//    together. A client that keeps talking but never ACKs still runs out
+//  - match: lockstep has its own heartbeat, a player has --idle-timeout-ms from a
+//    frame going out to its next tick. The one whose tick is already in is paused,
+//    it is only waiting on the other one
+// Disconnecting is a shutdown() of the socket, whoever reads it sees EOF and
+// cleans up the usual way (same as output_queue.h)
+
+enum LivenessPhase : uint8_t {
+    LIVE_LOBBY,
+    LIVE_HANDSHAKE,
+    LIVE_MATCH,
+    LIVE_PAUSED, // nothing expected from it for now (a tick already in, a UDP match with its own timeout)
+};
+
+const int LIVENESS_TICK_MS = 10; // resolution of the timers
+
+// sendPing queues a "PING" line on the connection. The thread per client server
+// runs the timers on a thread of its own, --coroutines from the executor's loop
+void StartLiveness(void (*sendPing)(int sock), bool ownThread);
+
+// (re)starts the timer of sock for phase, counting from now
+void watchConnection(int sock, LivenessPhase phase);
+// bytes came in on sock
+void connectionActive(int sock);
+// before sock is closed or handed away, its number may be reused right after
+void forgetConnection(int sock);
+
+// --coroutines: how long the executor may wait (-1 forever) and the timers that are due by now
+int livenessWaitMs();
+void runLivenessTimers();
+
+#endif
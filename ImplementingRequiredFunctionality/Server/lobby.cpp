@@ -1,10 +1,19 @@
 #include "lobby.h"
 #include "game_instance.h"
 #include "shared.h"
+#include "line_reader.h"
+#include "lobby_protocol.h"
+#include "metrics.h"
+#include "shared_lobby.h"
+#include "output_queue.h"
+#include "liveness.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "match_memory.h"
 #include <iostream>
-#include <sstream>
 #include <cstring>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <algorithm>
 
@@ -13,49 +22,384 @@ using namespace std;
 // Global ID counter for rooms
 static int g_GameIDCounter = 1;
 
-string generateLeaderboard() {
-    // 1. Copy users and sort (Requires the lock)
+// GOODBYE and friends get this long to go out before the socket is closed
+static const int LOBBY_CLOSE_DRAIN_MS = 1000;
+
+// the session is done with sock, nothing of it may outlive the close (the number gets reused)
+static void closeLobbySocket(int sock) {
+    forgetConnection(sock);
+    closeOutbox(sock);
     pthread_mutex_lock(&g_LobbyMutex);
+    logOut(sock);
+    pthread_mutex_unlock(&g_LobbyMutex);
+    close(sock);
+}
+
+int nextRoomId() {
+    return g_GameIDCounter;
+}
+
+void restoreNextRoomId(int id) {
+    g_GameIDCounter = id;
+}
+
+// hands this thread's session to the new server, returns if the restart was called off
+static void parkSession(ParkedKind kind, int sock, int roomId, const LineReader& reader) {
+    ParkedSession session;
+    session.kind = kind;
+    session.socks[0] = sock;
+    session.roomId = roomId;
+    session.pending[0].assign(reader.peek(), reader.buffered());
+    session.format = reader.format();
+    parkForRestart(move(session));
+}
+
+string_view generateLeaderboard(LobbyWriter& reply) {
+    // 1. Copy users and sort (Requires the lock)
     vector<User> topUsers;
-    for (const auto& pair : g_AllUsers) {
-        topUsers.push_back(pair.second);
+    if (g_SharedLobby) {
+        topUsers = sharedUsers();
+    } else {
+        pthread_mutex_lock(&g_LobbyMutex);
+        for (const User& u : g_Users) {
+            if (!u.removed) topUsers.push_back(u);
+        }
+        pthread_mutex_unlock(&g_LobbyMutex);
     }
-    pthread_mutex_unlock(&g_LobbyMutex);
 
     // Sort by numWins descending
     sort(topUsers.begin(), topUsers.end(), [](const User& a, const User& b) {
         return a.numWins > b.numWins;
     });
 
-    // 2. Build the output string
-    string leaderboard = "LEADERBOARD:";
-    int count = 0;
+    // 2. Build the reply
+    LobbyRank top[3];
+    size_t count = 0;
     for (const auto& u : topUsers) {
         if (count >= 3) break; // Take only top 3
-        leaderboard += u.username + " - Wins: " + to_string(u.numWins) + "|";
-        count++;
+        top[count++] = LobbyRank{ u.username, u.numWins };
     }
-    return leaderboard;
+    return reply.leaderboard(top, count);
 }
 
-void* HandleClientLobby(void* arg) {
-    int mySock = *(int*)arg;
-    delete (int*)arg;
-    
-    char buffer[1024];
-    bool inLobby = true;
-    bool shouldCloseSocket = true; // Default to true, set to false if we pass socket to Game
+string_view registerUser(int sock, const string& user, LobbyWriter& reply) {
+    // names go into other users' replies as they are, one rule for both formats
+    if (!validUserName(user)) return reply.error(LOBBY_ERROR_BAD_NAME);
+    if (g_SharedLobby) {
+        // the name and its wins live in the shared table, every worker sees them
+        int wins;
+        bool created;
+        UserId id = sharedLogin(user, wins, created);
+        if (id == NO_USER) return reply.error(LOBBY_ERROR_USER_TABLE);
+        pthread_mutex_lock(&g_LobbyMutex);
+        logIn(sock, id);
+        pthread_mutex_unlock(&g_LobbyMutex);
+        return reply.user(created, user, wins);
+    }
 
-    SendText(mySock, "WELCOME. Commands: REGISTER <user>, LIST, CREATE, JOIN <id>");
-    
-    //send Leaderboard // Probably should wait until they ack? //TODO SEEMS RISKY
+    pthread_mutex_lock(&g_LobbyMutex);
+    // the only place a name gets hashed, the session keeps the id from here on
+    bool created;
+    UserId id = internUser(user, 0, &created);
+    if (id == NO_USER) {
+        pthread_mutex_unlock(&g_LobbyMutex);
+        return reply.error(LOBBY_ERROR_USER_TABLE);
+    }
+    logIn(sock, id);
+    string_view sendMsg = reply.user(created, user, findUser(id)->numWins);
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return sendMsg;
+}
 
-    //string leaderboard = generateLeaderboard();
-    //SendText(mySock, leaderboard);
+bool isRegistered(int sock) {
+    pthread_mutex_lock(&g_LobbyMutex);
+    bool registered = loggedInUser(sock) != NO_USER;
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return registered;
+}
+
+UserId sessionUser(int sock) {
+    pthread_mutex_lock(&g_LobbyMutex);
+    UserId id = loggedInUser(sock);
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return id;
+}
+
+string userName(UserId id) {
+    if (g_SharedLobby) return sharedUserName(id);
+    User* u = findUser(id);
+    return u ? u->username : string();
+}
+
+void addWin(UserId id) {
+    TRACE_SPAN("add-win", g_SharedLobby != nullptr);
+    if (g_SharedLobby) {
+        sharedAddWin(id);
+        return;
+    }
+    pthread_mutex_lock(&g_LobbyMutex);
+    // a user that unregistered while still logged in elsewhere gets nothing
+    if (User* u = findUser(id)) u->numWins += 1;
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+void removeUser(UserId id) {
+    forgetChat(id); // the id is dead, a bucket per REGISTER/UNREGISTER would pile up
+    if (g_SharedLobby) {
+        sharedRemoveUser(id);
+        return;
+    }
+    pthread_mutex_lock(&g_LobbyMutex);
+    if (User* u = findUser(id)) {
+        u->removed = true;
+        g_UserIds.erase(u->username);
+        string().swap(u->username);
+        g_FreeUsers.push_back(userSlot(id));
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+string_view listGames(LobbyWriter& reply) {
+    if (g_SharedLobby) {
+        vector<int> ids = sharedWaitingRooms();
+        return reply.games(ids.data(), ids.size());
+    }
+    static thread_local vector<int> ids; // kept, LIST comes often
+    ids.clear();
+    pthread_mutex_lock(&g_LobbyMutex);
+    for (const auto& g : g_Games) {
+        if (!g.isFull && g.isActive) {
+            ids.push_back(g.id);
+        }
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return reply.games(ids.data(), ids.size());
+}
+
+int createRoom(int hostSock) {
+    // with --workers the id has to be unique across processes
+    int sharedID = g_SharedLobby ? sharedCreateRoom() : 0;
+    if (sharedID < 0) return -1;
+    pthread_mutex_lock(&g_LobbyMutex);
+    int newID = g_SharedLobby ? sharedID : g_GameIDCounter++;
+    GameRoom room = { .id = newID, .hostSocket = hostSock, .joinerSocket = -1, .isFull = false, .isActive = true,
+                      .joinerPending = {}, .joinerFormat = LOBBY_TEXT };
+    g_Games.push_back(room);
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return newID;
+}
+
+bool joinRoom(int id, int joinerSock, LobbyFormat joinerFormat, int* hostWorker) {
+    if (g_SharedLobby) {
+        int worker = sharedJoinRoom(id);
+        if (worker < 0) return false;
+        if (hostWorker) *hostWorker = worker;
+        if (worker != g_WorkerId) return true; // the caller hands the joiner over
+    }
+    pthread_mutex_lock(&g_LobbyMutex);
+    bool found = false;
+    for (auto& g : g_Games) {
+        if (g.id == id && !g.isFull && g.isActive) {
+            g.joinerSocket = joinerSock;
+            g.joinerFormat = joinerFormat;
+            g.isFull = true;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return found;
+}
+
+void closeRoom(int id) {
+    if (g_SharedLobby) sharedCloseRoom(id);
+    pthread_mutex_lock(&g_LobbyMutex);
+    for (auto& game : g_Games) {
+        if (game.id == id) {
+            game.isActive = false;
+            break;
+        }
+    }
+    pthread_cond_broadcast(&g_MatchOverCond);
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+// the host of a waiting room left. false when a joiner got in first, the handshake finds out then
+static bool cancelWaitingRoom(int id) {
+    if (g_SharedLobby && !sharedCancelRoom(id)) return false;
+    pthread_mutex_lock(&g_LobbyMutex);
+    bool cancelled = false;
+    for (auto& g : g_Games) {
+        if (g.id == id && !g.isFull) {
+            g.isActive = false;
+            cancelled = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+    return cancelled;
+}
+
+// the joiner's side of a room: nothing to do until the host's thread finished the match
+static void waitForMatchEnd(int gameId, int sock, const LineReader& reader) {
+    pthread_mutex_lock(&g_LobbyMutex);
+    while (true) {
+        bool active = false;
+        for (const auto& g : g_Games) {
+            if (g.id == gameId) { active = g.isActive; break; }
+        }
+        if (!active) break;
+        if (restartPending()) {
+            // the match moves to the new server between two ticks, the joiner goes with it
+            pthread_mutex_unlock(&g_LobbyMutex);
+            parkSession(PARKED_JOINER, sock, gameId, reader);
+            pthread_mutex_lock(&g_LobbyMutex);
+            continue;
+        }
+        pthread_cond_wait(&g_MatchOverCond, &g_LobbyMutex);
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+// the ACK handshake failed, nobody keeps playing in this room. The joiner's
+// thread wakes up to its socket shut down and closes it itself
+static void abortHandshake(const GameRoom& room) {
+    shutdown(room.joinerSocket, SHUT_RDWR);
+    closeLobbySocket(room.hostSocket);
+    closeRoom(room.id);
+}
+
+// the answer to MATCH_START. PONGs for heartbeats sent before it may come first
+static bool readMatchAck(int sock, LineReader& reader, MatchAck& ack) {
+    string_view line;
+    while (reader.readMessage(sock, line)) {
+        LobbyRequest req;
+        parseRequest(reader.format(), line, req);
+        if (req.cmd == LOBBY_PONG || req.cmd == LOBBY_PING) continue;
+        // any other line is taken for the ACK, as it always was
+        ack = reader.format() == LOBBY_BINARY ? req.ack : parseMatchAck(line);
+        return true;
+    }
+    return false;
+}
+
+// the host's socket while it waits for a joiner: up to 10ms for it to say something
+// (a PONG most likely, it stays buffered until the ACK is read). false once it hung up
+static bool hostStillThere(int sock, LineReader& reader) {
+    pollfd p = { sock, POLLIN, 0 };
+    if (poll(&p, 1, 10) <= 0) return true;
+    if (reader.fill(sock) <= 0 || reader.overflowed()) return false;
+    connectionActive(sock);
+    return true;
+}
+
+// CREATE: waits for a joiner and then runs the match on this thread.
+// false when the host's socket is already closed (it left or the handshake failed)
+static bool HostRoom(int mySock, int roomId, LineReader& reader) {
+    LobbyWriter reply(reader.format());
+    bool hostGone = false;
+    while (true) {
+        // 100ms polling, in steps so a hot restart does not wait on it (matches are paused meanwhile)
+        for (int i = 0; i < 10 && !restartPending(); i++) {
+            if (hostGone) usleep(10000);
+            else hostGone = !hostStillThere(mySock, reader);
+        }
+        if (restartPending()) parkSession(PARKED_HOST, mySock, roomId, reader);
+        if (hostGone && cancelWaitingRoom(roomId)) {
+            cout << "[LOBBY] Host " << mySock << " left room " << roomId << " before anyone joined." << endl;
+            closeLobbySocket(mySock);
+            return false;
+        }
+        flushOutbox(mySock);
+        pthread_mutex_lock(&g_LobbyMutex);// VERY LONG LOCK DANGER ZONE
+        GameRoom myRoom;
+        bool haveRoom = false;
+        for (auto& g : g_Games) {
+            if (g.id == roomId) { myRoom = g; haveRoom = true; break; }
+        }
+        pthread_mutex_unlock(&g_LobbyMutex);
+        if (!haveRoom) {
+            // Room was deleted, probably due to disconnection
+            SendReply(mySock, reply.error(LOBBY_ERROR_ROOM_CLOSED));
+            return true;
+        }
+        if (myRoom.isFull) {
+            // Match found! From here on the two have --handshake-timeout-ms to get it going
+            watchConnection(myRoom.hostSocket, LIVE_HANDSHAKE);
+            watchConnection(myRoom.joinerSocket, LIVE_HANDSHAKE);
+            SendReply(mySock, reply.matchStart());
+
+            // both MATCH_STARTs have to be out before anyone can ACK, the joiner's thread is parked
+            {
+                TRACE_SPAN("handshake-drain", myRoom.id);
+                if (!drainOutbox(myRoom.hostSocket, g_Config.slowPlayerMs) ||
+                    !drainOutbox(myRoom.joinerSocket, g_Config.slowPlayerMs)) {
+                    cerr << "[LOBBY] A player of room " << myRoom.id << " is not reading, match cancelled." << endl;
+                    abortHandshake(myRoom);
+                    return false;
+                }
+            }
+            
+            // 1. Wait for Host's ACK
+            MatchAck hostAck;
+            {
+                TRACE_SPAN("handshake-ack-host", myRoom.id);
+                if (!readMatchAck(myRoom.hostSocket, reader, hostAck)) {
+                    cerr << "[LOBBY] Host " << myRoom.hostSocket << " disconnected during ACK handshake." << endl;
+                    abortHandshake(myRoom);
+                    return false;
+                }
+            }
+
+            // 2. Wait for Joiner's ACK (joiner thread is parked, so we frame its socket here)
+            LineReader joinerReader;
+            joinerReader.setFormat(myRoom.joinerFormat);
+            joinerReader.append(myRoom.joinerPending.data(), myRoom.joinerPending.size());
+            MatchAck joinerAck;
+            {
+                TRACE_SPAN("handshake-ack-joiner", myRoom.id);
+                if (!readMatchAck(myRoom.joinerSocket, joinerReader, joinerAck)) {
+                    cerr << "[LOBBY] Joiner " << myRoom.joinerSocket << " disconnected during ACK handshake." << endl;
+                    abortHandshake(myRoom);
+                    return false;
+                }
+            }
+
+            // Host thread takes over as the Game Server thread
+            MatchArgs args{ myRoom.hostSocket, myRoom.joinerSocket, myRoom.id, { hostAck, joinerAck } };
+            
+            
+            // TRANSITION TO GAME
+            HandleMatch(args); 
+            //We want to make a new thread for a game instance
+            // then we want to wait until game is over and continue;
+            //For both creator and joiner we want to wait until game is over
+            //only shared variable is the myRoom struct which we should have some signal in to indicate game over
+            //make a conditional variable and brodcast on game over
+            //host will continue on its own after the game instance ends
+            return true;
+        }
+    }
+}
+
+// The lobby loop of one connection, until it leaves or disconnects. A new
+// connection (negotiate) may switch to binary frames with its first byte
+static void RunLobbySession(int mySock, LineReader& reader, bool negotiate = false) { // reader holds partial lines between reads
+    LobbyWriter reply(reader.format());
+    string_view line;
+    bool inLobby = true;
+    bool shouldCloseSocket = true; // Default to true, set to false if we pass socket to Game
+    TokenBucket input(g_Config.lobbyBytesPerSec, g_Config.lobbyBytesBurst); // a flooding client is cut off (rate_limit.h)
+    watchConnection(mySock, LIVE_LOBBY);
 
     while (inLobby) {
         usleep(10000); // 10 milliseconds sleep 
-        memset(buffer, 0, 1024);
+        if (restartPending()) parkSession(PARKED_LOBBY, mySock, -1, reader);
+        // what a slow client could not take yet. Its next commands wait until it did
+        if (outboxPending(mySock)) {
+            if (!flushOutbox(mySock)) break; // it had to go
+            if (outboxPending(mySock)) continue;
+        }
 
         // I want this call to be nonblocking so that even if no messages are recieve, we can send chat updates and leaderboard updates.
         //So we will use select to check for data before calling recv
@@ -64,196 +408,269 @@ void* HandleClientLobby(void* arg) {
         FD_SET(mySock, &readfds);
         timeval timeout = {0, 0}; // Non-blocking
         int ready = select(mySock + 1, &readfds, NULL, NULL, &timeout);
-        if (ready > 0 && FD_ISSET(mySock, &readfds)) {
-            cout << "[LOBBY] Prrocessed from " << mySock << ": " << buffer << endl;
-            int bytes = recv(mySock, buffer, 1024, 0);
-            if (bytes <= 0) break; 
+        if (ready <= 0 || !FD_ISSET(mySock, &readfds)) continue;
+
+        int bytes = reader.fill(mySock);
+        if (bytes <= 0) break; 
+        connectionActive(mySock);
+        if (!input.take(bytes)) {
+            SendReply(mySock, reply.error(LOBBY_ERROR_TOO_MUCH_INPUT));
+            addMetric(g_Metrics.inputFloodDisconnects, 1);
+            break;
+        }
+        if (negotiate) {
+            negotiate = false;
+            if ((uint8_t)reader.peek()[0] == LOBBY_BINARY_HELLO) {
+                reader.consume(1);
+                reader.setFormat(LOBBY_BINARY);
+                setOutboxFormat(mySock, LOBBY_BINARY);
+                reply.format = LOBBY_BINARY;
+                SendReply(mySock, reply.welcome());
+            }
+        }
 
-            cout << "[LOBBY] Received from " << mySock << ": " << buffer << endl;
+        // one read can carry several commands, handle every complete line we have
+        while (inLobby && reader.nextMessage(line)) {
+            LobbyRequest req;
+            if (!parseRequest(reader.format(), line, req)) continue; // blank line
+            LobbyCommand cmd = req.cmd;
+            if (cmd == LOBBY_PONG) continue; // our heartbeat came back, connectionActive saw it
+            logRequest(mySock, reader.format(), line);
 
-            string input(buffer);
-            stringstream ss(input);
-            string cmd;
-            ss >> cmd;
+            if (cmd == LOBBY_PING) {
+                SendReply(mySock, reply.pong());
+                continue;
+            }
 
             //  1. REGISTER 
-            if (cmd == "REGISTER") {
-                string user;
-                ss >> user;   
-                pthread_mutex_lock(&g_LobbyMutex);
-                string sendMsg;
-                //add to g_AllUsers and add to connected_Users
-                if (g_AllUsers.count(user)) {
-                    // User exists, just assign session data
-                    connected_Users[mySock] = g_AllUsers[user];
-                    sendMsg = "OK LOGGED_IN " + user + ". Wins: " + to_string(g_AllUsers[user].numWins);
-                    
-                } else {
-                    g_AllUsers[user] = User{user, 0};
-                    connected_Users[mySock] = g_AllUsers[user];
-                    sendMsg = "OK Registered " + user + ". Wins: 0";
-                }
-                pthread_mutex_unlock(&g_LobbyMutex);
-                SendText(mySock, sendMsg);
+            if (cmd == LOBBY_REGISTER) {
+                string user(req.arg);
+                SendReply(mySock, registerUser(mySock, user, reply));
                 continue;
             }
 
             //check if registered
-            pthread_mutex_lock(&g_LobbyMutex);
-            bool isRegistered = connected_Users.find(mySock) == connected_Users.end();
-            pthread_mutex_unlock(&g_LobbyMutex);
-
-            if(isRegistered){
-                SendText(mySock, "ERROR Please REGISTER first.");
+            if(!isRegistered(mySock)){
+                SendReply(mySock, reply.error(LOBBY_ERROR_NOT_REGISTERED));
+                continue;
+            }
+            if (req.bad) {
+                SendReply(mySock, reply.error(LOBBY_ERROR_BAD_REQUEST));
                 continue;
             }
             
             //  2. LIST 
-            if (cmd == "LIST") {
-                pthread_mutex_lock(&g_LobbyMutex);
-                string list = "GAMES:\n";
-                for (const auto& g : g_Games) {
-                    if (!g.isFull && g.isActive) {
-                        list += "ID: " + to_string(g.id) + " | Status: WAIT\n";
-                    }
-                }
-                pthread_mutex_unlock(&g_LobbyMutex);
-                SendText(mySock, list);
+            if (cmd == LOBBY_LIST) {
+                SendReply(mySock, listGames(reply));
             }
             //  3. CREATE 
-            else if (cmd == "CREATE") {
-                int newID = g_GameIDCounter++;
-                GameRoom room = { newID, mySock, -1, false, true };
-                pthread_mutex_lock(&g_LobbyMutex);
-                g_Games.push_back(room);
-                pthread_mutex_unlock(&g_LobbyMutex);
+            else if (cmd == LOBBY_CREATE) {
+                int newID = createRoom(mySock);
+                if (newID < 0) {
+                    SendReply(mySock, reply.error(LOBBY_ERROR_TOO_MANY_ROOMS));
+                    continue;
+                }
 
-                SendText(mySock, "CREATED " + to_string(newID) + " WAIT...");
+                SendReply(mySock, reply.created(newID));
 
                 // HOST WAITING LOOP
-                while (true) {
-                    usleep(100000); // 100ms polling
-                    pthread_mutex_lock(&g_LobbyMutex);// VERY LONG LOCK DANGER ZONE
-                    GameRoom myRoom;
-                    bool haveRoom = false;
-                    for (auto& g : g_Games) {
-                        if (g.id == newID) { myRoom = g; haveRoom = true; break; }
-                    }
-                    pthread_mutex_unlock(&g_LobbyMutex);
-                    if (!haveRoom) {
-                        // Room was deleted, probably due to disconnection
-                        SendText(mySock, "ERROR Room closed.");
-                        break;
-                    }
-                    if (myRoom.isFull) {
-                        // Match found!
-                        SendText(mySock, "MATCH_START");
-                        
-                        char readyBuffer[1024];
-
-                        // 1. Wait for Host's ACK
-                        memset(readyBuffer, 0, 1024);
-                        if (recv(myRoom.hostSocket, readyBuffer, 1024, 0) <= 0) {
-                            cerr << "[LOBBY] Host " << myRoom.hostSocket << " disconnected during ACK handshake." << endl;
-                            close(myRoom.hostSocket); close(myRoom.joinerSocket); // Close both on failure
-                            return NULL; 
-                        }
-
-                        // 2. Wait for Joiner's ACK
-                        memset(readyBuffer, 0, 1024);
-                        if (recv(myRoom.joinerSocket, readyBuffer, 1024, 0) <= 0) {
-                            cerr << "[LOBBY] Joiner " << myRoom.joinerSocket << " disconnected during ACK handshake." << endl;
-                            close(myRoom.hostSocket); close(myRoom.joinerSocket);
-                            return NULL;
-                        }
-
-                        // Host thread takes over as the Game Server thread
-                        MatchArgs* args = new MatchArgs{ myRoom.hostSocket, myRoom.joinerSocket, myRoom.id };
-                        
-                        
-                        // TRANSITION TO GAME
-                        HandleMatch(args); 
-                        //We want to make a new thread for a game instance
-                        // then we want to wait until game is over and continue;
-                        //For both creator and joiner we want to wait until game is over
-                        //only shared variable is the myRoom struct which we should have some signal in to indicate game over
-                        //make a conditional variable and brodcast on game over
-                        //host will continue on its own after the game instance ends
-                        break;
-                    }
-                }
+                if (!HostRoom(mySock, newID, reader)) return;
+                watchConnection(mySock, LIVE_LOBBY);
             }
             //  4. JOIN 
-            else if (cmd == "JOIN") {
-                int joinID;
-                ss >> joinID;
-                
-                pthread_mutex_lock(&g_LobbyMutex);
-                bool found = false;
-                pthread_cond_t* gameOverCond;
-                for (auto& g : g_Games) {
-                    if (g.id == joinID && !g.isFull) {
-                        g.joinerSocket = mySock;
-                        g.isFull = true;
-                        found = true;
-                        gameOverCond = &g.gameOverCond;
-                        break;
-                    }
-                }
-                pthread_mutex_unlock(&g_LobbyMutex);
+            else if (cmd == LOBBY_JOIN) {
+                int joinID = req.room;
                 
-                if (!found) {SendText(mySock, "ERROR Game full/missing.");
-                }else{
-                    SendText(mySock, "MATCH_START");
-                    
+                int hostWorker = g_WorkerId;
+                if (!joinRoom(joinID, mySock, reader.format(), &hostWorker)) {SendReply(mySock, reply.error(LOBBY_ERROR_GAME_FULL));
+                }else if (hostWorker != g_WorkerId) {
+                    // the room lives in another worker, this connection moves there for good
+                    SendReply(mySock, reply.matchStart());
                     pthread_mutex_lock(&g_LobbyMutex);
-                    GameRoom* myRoomPtr;
-                    for (auto& g : g_Games) {
-                        if (g.id == joinID) { myRoomPtr = &g; break;
-                        }
+                    UserId user = loggedInUser(mySock);
+                    logOut(mySock);
+                    pthread_mutex_unlock(&g_LobbyMutex);
+                    // the other worker writes to the socket from now on, our queue goes first
+                    forgetConnection(mySock);
+                    if (!drainOutbox(mySock, g_Config.slowPlayerMs) ||
+                        !SendJoinerToWorker(hostWorker, mySock, joinID, user, reader.format(), string_view(reader.peek(), reader.buffered()))) {
+                        cerr << "[LOBBY] Could not hand " << mySock << " to worker " << hostWorker << endl;
+                        sharedReopenRoom(joinID);
                     }
+                    inLobby = false; // our copy of the socket is closed below, the other worker has its own
+                    break;
+                }else{
+                    watchConnection(mySock, LIVE_HANDSHAKE); // no PING may follow MATCH_START
+                    SendReply(mySock, reply.matchStart());
                     // Wait for game over signal
-                    pthread_cond_wait(&(myRoomPtr->gameOverCond), &g_LobbyMutex);
-                    pthread_mutex_unlock(&g_LobbyMutex);
+                    waitForMatchEnd(joinID, mySock, reader);
+                    watchConnection(mySock, LIVE_LOBBY);
                 }
             }
             //  5. CHAT 
-            else if (cmd == "CHAT") {
-                string msg;
-                getline(ss, msg);
-                SendText(mySock, "ECHO: " + msg);
+            else if (cmd == LOBBY_CHAT) {
+                UserId user = sessionUser(mySock);
+                // every line goes out to the whole lobby, so a user only gets a few a second
+                if (!allowChat(user)) {
+                    SendReply(mySock, reply.error(LOBBY_ERROR_SLOW_DOWN));
+                    continue;
+                }
+                SendReply(mySock, reply.echo(req.arg));
                 //send to all connected users 
                 pthread_mutex_lock(&g_LobbyMutex);
-                sendToAllInLobby("CHAT " + connected_Users[mySock].username + ": " + msg);
+                string name = userName(user);
+                sendToAllInLobby(name, req.arg);
                 pthread_mutex_unlock(&g_LobbyMutex);
-            }else if(cmd == "LEADERBOARD"){
-                string leaderboard = generateLeaderboard();
-                SendText(mySock, leaderboard);
-            }else if(cmd == "EXIT"){
-                SendText(mySock, "GOODBYE");
+                // with --workers the rest of the lobby is in the other processes
+                if (g_SharedLobby) SendChatToWorkers(name, req.arg);
+            }else if(cmd == LOBBY_LEADERBOARD){
+                SendReply(mySock, generateLeaderboard(reply));
+            }else if(cmd == LOBBY_STATS){
+                SendReply(mySock, reply.stats(formatMetrics() + formatMatchMemory()));
+            }else if(cmd == LOBBY_TRACE){
+                SendReply(mySock, reply.trace(RequestTrace(mySock)));
+            }else if(cmd == LOBBY_EXIT){
+                SendReply(mySock, reply.goodbye());
                 pthread_mutex_lock(&g_LobbyMutex);
-                connected_Users.erase(mySock);
+                logOut(mySock);
                 pthread_mutex_unlock(&g_LobbyMutex);
                 inLobby = false;
                 shouldCloseSocket = true;
                 break;
-            }else if(cmd == "UNREGISTER"){
-                SendText(mySock, "UNREGISTERED");
+            }else if(cmd == LOBBY_UNREGISTER){
+                SendReply(mySock, reply.unregistered());
                 pthread_mutex_lock(&g_LobbyMutex);
-                g_AllUsers.erase(connected_Users[mySock].username);
-                connected_Users.erase(mySock);
+                UserId user = loggedInUser(mySock);
+                logOut(mySock);
                 pthread_mutex_unlock(&g_LobbyMutex);
+                removeUser(user);
+                inLobby = false;
                 break;
             }
             else {
-                SendText(mySock, "ERROR Unknown command.");
+                SendReply(mySock, reply.error(LOBBY_ERROR_UNKNOWN_COMMAND));
             }
             
         }
+
+        if (reader.overflowed()) {
+            SendReply(mySock, reply.error(LOBBY_ERROR_TOO_LONG));
+            break;
+        }
     }
 
     if (shouldCloseSocket) {
-        close(mySock);
+        drainOutbox(mySock, LOBBY_CLOSE_DRAIN_MS);
+        closeLobbySocket(mySock);
+    }
+}
+
+void* HandleClientLobby(void* arg) {
+    int mySock = *(int*)arg;
+    delete (int*)arg;
+
+    openOutbox(mySock);
+    LobbyWriter reply;
+    SendReply(mySock, reply.welcome()); // always text, the client has not said yet what it speaks
+    
+    //send Leaderboard // Probably should wait until they ack? //TODO SEEMS RISKY
+
+    //string leaderboard = generateLeaderboard();
+    //SendText(mySock, leaderboard);
+
+    LineReader reader;
+    RunLobbySession(mySock, reader, true);
+    restartSessionEnded(); // counted by the accept loop when it started us
+    return NULL;
+}
+
+struct AdoptedJoiner {
+    int sock;
+    int roomId;
+    LobbyFormat format;
+};
+
+// a joiner handed over by another worker: sits out the match like a local joiner, then stays in our lobby
+static void* HandleAdoptedJoiner(void* arg) {
+    AdoptedJoiner joiner = *(AdoptedJoiner*)arg;
+    delete (AdoptedJoiner*)arg;
+    openOutbox(joiner.sock, joiner.format);
+    watchConnection(joiner.sock, LIVE_HANDSHAKE); // it got MATCH_START from the other worker
+    LineReader reader;
+    reader.setFormat(joiner.format);
+    waitForMatchEnd(joiner.roomId, joiner.sock, reader);
+    RunLobbySession(joiner.sock, reader);
+    return NULL;
+}
+
+void AdoptJoiner(int sock, int roomId, UserId user, LobbyFormat format, string_view pending) {
+    pthread_mutex_lock(&g_LobbyMutex);
+    bool found = false;
+    for (auto& g : g_Games) {
+        if (g.id == roomId && !g.isFull && g.isActive) {
+            g.joinerSocket = sock;
+            g.joinerPending.assign(pending.data(), pending.size());
+            g.joinerFormat = format;
+            g.isFull = true;
+            found = true;
+            break;
+        }
     }
+    if (found) logIn(sock, user); // shared table ids mean the same in every worker
+    pthread_mutex_unlock(&g_LobbyMutex);
+
+    if (!found) {
+        cerr << "[LOBBY] Handed over joiner " << sock << " for missing room " << roomId << endl;
+        close(sock);
+        return;
+    }
+    cout << "[LOBBY] Joiner " << userName(user) << " came over from another worker for room " << roomId << endl;
+
+    AdoptedJoiner* arg = new AdoptedJoiner{sock, roomId, format};
+    pthread_t t;
+    if (pthread_create(&t, NULL, HandleAdoptedJoiner, arg) != 0) {
+        delete arg;
+        close(sock);
+    } else {
+        pthread_detach(t);
+    }
+}
+// a session the old server handed over at one of its safe points, carries on from there
+static void* HandleResumedSession(void* arg) {
+    ParkedSession* session = (ParkedSession*)arg;
+    int sock = session->socks[0];
+    LineReader reader;
+    reader.setFormat(session->format);
+    reader.append(session->pending[0].data(), session->pending[0].size());
+    openOutbox(sock, session->format);
+    // a match carries its own unsent frames (ResumeMatch)
+    if (session->kind != PARKED_MATCH && !session->unsent[0].empty()) outboxSend(sock, session->unsent[0], false);
+
+    bool stay = true;
+    if (session->kind == PARKED_HOST) {
+        watchConnection(sock, LIVE_LOBBY);
+        stay = HostRoom(sock, session->roomId, reader);
+    } else if (session->kind == PARKED_JOINER) {
+        waitForMatchEnd(session->roomId, sock, reader);
+    } else if (session->kind == PARKED_MATCH) {
+        ResumeMatch(*session); // the host's lobby goes on below once it is over
+    }
+    delete session;
+    if (stay) RunLobbySession(sock, reader);
+    restartSessionEnded();
     return NULL;
-}
\ No newline at end of file
+}
+
+void ResumeSession(const ParkedSession& session) {
+    restartSessionStarted();
+    ParkedSession* arg = new ParkedSession(session);
+    pthread_t t;
+    if (pthread_create(&t, NULL, HandleResumedSession, arg) != 0) {
+        cerr << "[LOBBY] Could not start a thread for handed over socket " << session.socks[0] << endl;
+        close(session.socks[0]);
+        delete arg;
+        restartSessionEnded();
+    } else {
+        pthread_detach(t);
+    }
+}
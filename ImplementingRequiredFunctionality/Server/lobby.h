@@ -1,7 +1,43 @@
 #ifndef LOBBY_H
 #define LOBBY_H
 
+#include <string>
+#include <string_view>
+#include "hot_restart.h"
+#include "lobby_protocol.h"
+
+using namespace std;
+
 // The thread function for handling a player in the menu
 void* HandleClientLobby(void* arg);
 
-#endif
\ No newline at end of file
+// Lobby state changes shared by the thread and the coroutine sessions (session_tasks.h).
+// They take g_LobbyMutex themselves and return the reply to send, built with reply
+string_view registerUser(int sock, const string& user, LobbyWriter& reply);
+bool isRegistered(int sock);
+string_view listGames(LobbyWriter& reply);
+string_view generateLeaderboard(LobbyWriter& reply);
+// adds a waiting room hosted by hostSock and returns its id
+int createRoom(int hostSock);
+// false when the room does not exist or is already full. With --workers the room
+// may be hosted by another worker, hostWorker tells which (shared_lobby.h)
+bool joinRoom(int id, int joinerSock, LobbyFormat joinerFormat, int* hostWorker = nullptr);
+// the room is over: nobody can join it anymore and its joiner's thread wakes up
+void closeRoom(int id);
+// who is logged in on sock, NO_USER if nobody
+UserId sessionUser(int sock);
+// the name behind id. Without --workers it wants g_LobbyMutex held
+string userName(UserId id);
+// ids come from the session, a removed user gets nothing
+void addWin(UserId id);
+void removeUser(UserId id);
+// takes over a joiner socket another worker passed us for room roomId
+void AdoptJoiner(int sock, int roomId, UserId user, LobbyFormat format, string_view pending);
+
+// hot restart (hot_restart.h): the room id counter moves to the new process,
+// which runs each handed over session on a thread of its own
+int nextRoomId();
+void restoreNextRoomId(int id);
+void ResumeSession(const ParkedSession& session);
+
+#endif
@@ -0,0 +1,356 @@
+#include "lobby_protocol.h"
+#include <charconv>
+#include <cstring>
+#include <iostream>
+
+using namespace std;
+
+LobbyCommand parseLobbyCommand(string_view word) {
+    switch (word.size()) {
+        case 4:
+            switch (word[0]) {
+                case 'L': return word == "LIST" ? LOBBY_LIST : LOBBY_UNKNOWN;
+                case 'J': return word == "JOIN" ? LOBBY_JOIN : LOBBY_UNKNOWN;
+                case 'C': return word == "CHAT" ? LOBBY_CHAT : LOBBY_UNKNOWN;
+                case 'E': return word == "EXIT" ? LOBBY_EXIT : LOBBY_UNKNOWN;
+                case 'P': return word == "PING" ? LOBBY_PING : word == "PONG" ? LOBBY_PONG : LOBBY_UNKNOWN;
+            }
+            break;
+        case 3:
+            return word == "ACK" ? LOBBY_ACK : LOBBY_UNKNOWN;
+        case 5:
+            return word == "STATS" ? LOBBY_STATS : word == "TRACE" ? LOBBY_TRACE : LOBBY_UNKNOWN;
+        case 6:
+            return word == "CREATE" ? LOBBY_CREATE : LOBBY_UNKNOWN;
+        case 8:
+            return word == "REGISTER" ? LOBBY_REGISTER : LOBBY_UNKNOWN;
+        case 10:
+            return word == "UNREGISTER" ? LOBBY_UNREGISTER : LOBBY_UNKNOWN;
+        case 11:
+            return word == "LEADERBOARD" ? LOBBY_LEADERBOARD : LOBBY_UNKNOWN;
+    }
+    return LOBBY_UNKNOWN;
+}
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+string_view nextToken(string_view& rest) {
+    size_t i = 0;
+    while (i < rest.size() && isSpace(rest[i])) i++;
+    size_t j = i;
+    while (j < rest.size() && !isSpace(rest[j])) j++;
+    string_view token = rest.substr(i, j - i);
+    rest.remove_prefix(j);
+    return token;
+}
+
+MatchAck parseMatchAck(string_view line) {
+    MatchAck ack = { false, 0 };
+    string_view rest = line;
+    nextToken(rest); // "ACK"
+    for (string_view token = nextToken(rest); !token.empty(); token = nextToken(rest)) {
+        ack.extended = true;
+        if (token == "UDP") ack.features |= MATCH_FEATURE_UDP;
+        else if (token == "COMPRESS") ack.features |= MATCH_FEATURE_COMPRESS;
+        else if (token == "TICKS") ack.features |= MATCH_FEATURE_TICKS;
+    }
+    return ack;
+}
+
+bool parseInt(string_view token, int& out) {
+    const char* first = token.data();
+    const char* last = token.data() + token.size();
+    auto result = from_chars(first, last, out);
+    return result.ec == errc() && result.ptr == last && first != last;
+}
+
+bool validUserName(string_view name) {
+    if (name.empty()) return false;
+    for (char c : name) {
+        if ((unsigned char)c <= ' ' || (unsigned char)c >= 0x7f || c == '|') return false;
+    }
+    return true;
+}
+
+bool validChatText(string_view text) {
+    for (char c : text) {
+        if (((unsigned char)c < ' ' && c != '\t') || c == 0x7f) return false;
+    }
+    return true;
+}
+
+bool parseTextRequest(string_view line, LobbyRequest& req) {
+    string_view rest = line;
+    string_view word = nextToken(rest);
+    if (word.empty()) return false;
+    req = LobbyRequest();
+    req.cmd = parseLobbyCommand(word);
+    switch (req.cmd) {
+        case LOBBY_REGISTER:
+            req.arg = nextToken(rest);
+            break;
+        case LOBBY_JOIN:
+            parseInt(nextToken(rest), req.room);
+            break;
+        case LOBBY_CHAT:
+            req.arg = rest;
+            req.bad = !validChatText(rest); // a '\r' in the middle of the line
+            break;
+        default:
+            break;
+    }
+    return true;
+}
+
+// bounds checked reads off the front of a frame's payload
+static bool takeInt(string_view& in, uint32_t& v) {
+    if (in.size() < sizeof(v)) return false;
+    memcpy(&v, in.data(), sizeof(v));
+    in.remove_prefix(sizeof(v));
+    return true;
+}
+
+static bool takeString(string_view& in, string_view& s) {
+    uint32_t len;
+    if (!takeInt(in, len) || in.size() < len) return false;
+    s = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
+
+void parseBinaryRequest(string_view frame, LobbyRequest& req) {
+    req = LobbyRequest();
+    if (frame.empty()) return;
+    uint8_t type = frame[0];
+    string_view in = frame.substr(1);
+    uint32_t v = 0;
+    bool ok = true;
+    switch (type) {
+        case LOBBY_REGISTER:
+            // the name is checked by registerUser, like a text one
+            ok = takeString(in, req.arg);
+            break;
+        case LOBBY_CHAT:
+            ok = takeString(in, req.arg);
+            req.bad = ok && !validChatText(req.arg);
+            break;
+        case LOBBY_JOIN:
+            ok = takeInt(in, v);
+            req.room = (int32_t)v;
+            break;
+        case LOBBY_ACK:
+            ok = takeInt(in, v);
+            req.ack.features = v;
+            break;
+        default:
+            ok = type > LOBBY_UNKNOWN && type <= LOBBY_ACK;
+    }
+    if (ok) req.cmd = (LobbyCommand)type;
+}
+
+bool parseRequest(LobbyFormat format, string_view message, LobbyRequest& req) {
+    if (format == LOBBY_TEXT) return parseTextRequest(message, req);
+    parseBinaryRequest(message, req);
+    return true;
+}
+
+void logRequest(int sock, LobbyFormat format, string_view message) {
+    if (format == LOBBY_TEXT) cout << "[LOBBY] Received from " << sock << ": " << message << endl;
+    else cout << "[LOBBY] Received from " << sock << ": binary type " << (int)(uint8_t)message[0] << ", " << message.size() << " bytes" << endl;
+}
+
+void LobbyWriter::begin(LobbyReplyType type) {
+    buf.clear();
+    if (format == LOBBY_BINARY) {
+        buf.append(LOBBY_FRAME_HEADER, '\0'); // the length, filled in by finish
+        buf.push_back((char)type);
+    }
+}
+
+string_view LobbyWriter::finish() {
+    if (format == LOBBY_BINARY) {
+        uint32_t len = buf.size() - LOBBY_FRAME_HEADER;
+        memcpy(&buf[0], &len, sizeof(len));
+    } else {
+        buf.push_back('\n');
+    }
+    return buf;
+}
+
+void LobbyWriter::number(int64_t n) {
+    char digits[24];
+    auto result = to_chars(digits, digits + sizeof(digits), n);
+    buf.append(digits, result.ptr - digits);
+}
+
+void LobbyWriter::putInt(uint32_t v) {
+    buf.append((const char*)&v, sizeof(v));
+}
+
+void LobbyWriter::putString(string_view s) {
+    putInt(s.size());
+    buf.append(s);
+}
+
+// a reply that is only its type
+string_view LobbyWriter::bare(LobbyReplyType type, string_view line) {
+    begin(type);
+    if (format == LOBBY_TEXT) text(line);
+    return finish();
+}
+
+string_view LobbyWriter::welcome() {
+    return bare(REPLY_WELCOME, "WELCOME. Commands: REGISTER <user>, LIST, CREATE, JOIN <id>");
+}
+
+string_view LobbyWriter::user(bool isNew, string_view name, int wins) {
+    begin(isNew ? REPLY_REGISTERED : REPLY_LOGGED_IN);
+    if (format == LOBBY_BINARY) {
+        putInt(wins);
+        putString(name);
+    } else {
+        text(isNew ? "OK Registered " : "OK LOGGED_IN ");
+        text(name);
+        text(". Wins: ");
+        number(wins);
+    }
+    return finish();
+}
+
+static const char* errorText(LobbyError code) {
+    switch (code) {
+        case LOBBY_ERROR_USER_TABLE: return "Username too long or user table full.";
+        case LOBBY_ERROR_NOT_REGISTERED: return "Please REGISTER first.";
+        case LOBBY_ERROR_TOO_MANY_ROOMS: return "Too many rooms.";
+        case LOBBY_ERROR_GAME_FULL: return "Game full/missing.";
+        case LOBBY_ERROR_SLOW_DOWN: return "Slow down.";
+        case LOBBY_ERROR_UNKNOWN_COMMAND: return "Unknown command.";
+        case LOBBY_ERROR_TOO_LONG: return "Line too long.";
+        case LOBBY_ERROR_TOO_MUCH_INPUT: return "Too much input.";
+        case LOBBY_ERROR_ROOM_CLOSED: return "Room closed.";
+        case LOBBY_ERROR_BAD_NAME: return "Invalid username.";
+        case LOBBY_ERROR_BAD_REQUEST: return "Invalid argument.";
+    }
+    return "";
+}
+
+string_view LobbyWriter::error(LobbyError code) {
+    begin(REPLY_ERROR);
+    if (format == LOBBY_BINARY) {
+        putInt(code);
+    } else {
+        text("ERROR ");
+        text(errorText(code));
+    }
+    return finish();
+}
+
+string_view LobbyWriter::games(const int* ids, size_t count) {
+    begin(REPLY_GAMES);
+    if (format == LOBBY_BINARY) {
+        putInt(count);
+        for (size_t i = 0; i < count; i++) putInt(ids[i]);
+    } else {
+        // the list has always ended in an empty line
+        text("GAMES:\n");
+        for (size_t i = 0; i < count; i++) {
+            text("ID: ");
+            number(ids[i]);
+            text(" | Status: WAIT\n");
+        }
+    }
+    return finish();
+}
+
+string_view LobbyWriter::created(int room) {
+    begin(REPLY_CREATED);
+    if (format == LOBBY_BINARY) {
+        putInt(room);
+    } else {
+        text("CREATED ");
+        number(room);
+        text(" WAIT...");
+    }
+    return finish();
+}
+
+string_view LobbyWriter::matchStart() {
+    return bare(REPLY_MATCH_START, "MATCH_START");
+}
+
+string_view LobbyWriter::echo(string_view message) {
+    begin(REPLY_ECHO);
+    if (format == LOBBY_BINARY) {
+        putString(message);
+    } else {
+        text("ECHO: ");
+        text(message);
+    }
+    return finish();
+}
+
+string_view LobbyWriter::chat(string_view name, string_view message) {
+    begin(REPLY_CHAT);
+    if (format == LOBBY_BINARY) {
+        putString(name);
+        putString(message);
+    } else {
+        text("CHAT ");
+        text(name);
+        text(": ");
+        text(message);
+    }
+    return finish();
+}
+
+string_view LobbyWriter::leaderboard(const LobbyRank* ranks, size_t count) {
+    begin(REPLY_LEADERBOARD);
+    if (format == LOBBY_BINARY) {
+        putInt(count);
+        for (size_t i = 0; i < count; i++) {
+            putInt(ranks[i].wins);
+            putString(ranks[i].name);
+        }
+    } else {
+        text("LEADERBOARD:");
+        for (size_t i = 0; i < count; i++) {
+            text(ranks[i].name);
+            text(" - Wins: ");
+            number(ranks[i].wins);
+            text("|");
+        }
+    }
+    return finish();
+}
+
+string_view LobbyWriter::stats(string_view report) {
+    begin(REPLY_STATS);
+    if (format == LOBBY_BINARY) putString(report);
+    else text(report);
+    return finish();
+}
+
+string_view LobbyWriter::trace(string_view report) {
+    begin(REPLY_TRACE);
+    if (format == LOBBY_BINARY) putString(report);
+    else text(report);
+    return finish();
+}
+
+string_view LobbyWriter::goodbye() {
+    return bare(REPLY_GOODBYE, "GOODBYE");
+}
+
+string_view LobbyWriter::unregistered() {
+    return bare(REPLY_UNREGISTERED, "UNREGISTERED");
+}
+
+string_view LobbyWriter::ping() {
+    return bare(REPLY_PING, "PING");
+}
+
+string_view LobbyWriter::pong() {
+    return bare(REPLY_PONG, "PONG");
+}
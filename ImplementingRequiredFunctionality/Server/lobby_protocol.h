@@ -0,0 +1,171 @@
+#ifndef LOBBY_PROTOCOL_H
+#define LOBBY_PROTOCOL_H
+
+#include <string_view>
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+// Every command the lobby understands. The values are the message types of the
+// binary protocol (below), never renumber them
+enum LobbyCommand {
+    LOBBY_UNKNOWN = 0,
+    LOBBY_REGISTER,
+    LOBBY_LIST,
+    LOBBY_CREATE,
+    LOBBY_JOIN,
+    LOBBY_CHAT,
+    LOBBY_LEADERBOARD,
+    LOBBY_EXIT,
+    LOBBY_UNREGISTER,
+    LOBBY_STATS,
+    LOBBY_TRACE, // writes the span rings to the --trace file (trace.h)
+    LOBBY_PING, // the client checks on us, answered with PONG
+    LOBBY_PONG, // answer to our heartbeat (liveness.h), nothing to do
+    LOBBY_ACK,  // the answer to MATCH_START, only valid in the handshake
+};
+
+// Maps a command word to its enum. Switches on length and first letter so a
+// lookup is at most one memcmp and never allocates
+LobbyCommand parseLobbyCommand(string_view word);
+
+// Splits the next whitespace separated token off the front of rest
+string_view nextToken(string_view& rest);
+
+// Whole token must be a base 10 int
+bool parseInt(string_view token, int& out);
+
+// Optional match features a client can ask for after MATCH_START, e.g. "ACK UDP".
+// A plain "ACK" gets the original handshake (just the player id). A client that
+// lists anything after ACK is also sent the uint32 mask of what was accepted.
+const uint32_t MATCH_FEATURE_UDP = 1; // lockstep over UDP with redundant windows (udp_lockstep.h)
+const uint32_t MATCH_FEATURE_COMPRESS = 2; // big tick frames come packed (frame_codec.h), TCP matches only
+const uint32_t MATCH_FEATURE_TICKS = 4; // uploads and frames carry their tick number (TICK_HAS_TAG, FRAME_TICK_TAGGED)
+
+struct MatchAck {
+    bool extended;     // the client listed features, so it expects the accepted mask
+    uint32_t features; // MATCH_FEATURE_* bits it asked for
+};
+
+MatchAck parseMatchAck(string_view line);
+
+//  BINARY LOBBY PROTOCOL
+// A client that sends LOBBY_BINARY_HELLO as its very first byte talks in frames
+// instead of lines from then on. The text WELCOME line is already out by then, the
+// server confirms the switch with a binary REPLY_WELCOME. Every message is
+//   uint32 length (of what follows), uint8 type, payload
+// Numbers are little endian int32/uint32, a string is a uint32 length and its bytes.
+// Commands use the LobbyCommand values as type:
+//   REGISTER: string name   JOIN: int32 room   CHAT: string text   ACK: uint32 features
+//   everything else: no payload
+// A binary ACK always gets the accepted feature mask back, like "ACK <features>"
+enum LobbyFormat : uint8_t {
+    LOBBY_TEXT = 0,
+    LOBBY_BINARY,
+};
+
+const uint8_t LOBBY_BINARY_HELLO = 0xB1; // never the start of a text command
+const size_t LOBBY_FRAME_HEADER = 4;     // the length in front of every frame
+
+// Replies, each with its text form and its binary payload
+enum LobbyReplyType : uint8_t {
+    REPLY_WELCOME = 64,  // "WELCOME. Commands: ..."      -
+    REPLY_REGISTERED,    // "OK Registered <name>. ..."   int32 wins, string name
+    REPLY_LOGGED_IN,     // "OK LOGGED_IN <name>. ..."    int32 wins, string name
+    REPLY_ERROR,         // "ERROR <text>"                int32 LobbyError
+    REPLY_GAMES,         // "GAMES:\nID: <id> | ..."      uint32 count, int32 room ids
+    REPLY_CREATED,       // "CREATED <id> WAIT..."        int32 room
+    REPLY_MATCH_START,   // "MATCH_START"                 -
+    REPLY_ECHO,          // "ECHO: <text>"                string text
+    REPLY_CHAT,          // "CHAT <name>: <text>"         string name, string text
+    REPLY_LEADERBOARD,   // "LEADERBOARD:<name> - ..."    uint32 count, then int32 wins, string name each
+    REPLY_STATS,         // "STATS:..."                   string, the text form
+    REPLY_TRACE,         // "TRACE ..."                   string, the text form
+    REPLY_GOODBYE,       // "GOODBYE"                     -
+    REPLY_UNREGISTERED,  // "UNREGISTERED"                -
+    REPLY_PING,          // "PING", answer with LOBBY_PONG
+    REPLY_PONG,          // "PONG"                        -
+};
+
+enum LobbyError : uint8_t {
+    LOBBY_ERROR_USER_TABLE = 1, // "Username too long or user table full."
+    LOBBY_ERROR_NOT_REGISTERED,
+    LOBBY_ERROR_TOO_MANY_ROOMS,
+    LOBBY_ERROR_GAME_FULL,
+    LOBBY_ERROR_SLOW_DOWN,
+    LOBBY_ERROR_UNKNOWN_COMMAND,
+    LOBBY_ERROR_TOO_LONG, // line or frame
+    LOBBY_ERROR_TOO_MUCH_INPUT,
+    LOBBY_ERROR_ROOM_CLOSED,
+    LOBBY_ERROR_BAD_NAME,
+    LOBBY_ERROR_BAD_REQUEST, // a known command with an argument it does not take
+};
+
+// One command in either format. The views point into the reader's buffer
+struct LobbyRequest {
+    LobbyCommand cmd = LOBBY_UNKNOWN;
+    string_view arg;         // REGISTER's name, CHAT's text (as typed, so with its leading space in text)
+    int room = -1;           // JOIN
+    MatchAck ack = { true, 0 };
+    bool bad = false;        // cmd is right but its argument is not allowed, answered with LOBBY_ERROR_BAD_REQUEST
+};
+
+// A user name is one token of printable ASCII without '|', the LEADERBOARD text
+// separates entries with it. Checked by registerUser for both formats
+bool validUserName(string_view name);
+// CHAT text has no control bytes (tabs are fine), so a text reply carrying it stays one line.
+// Both parsers set req.bad for text that fails it
+bool validChatText(string_view text);
+
+// false for a blank line
+bool parseTextRequest(string_view line, LobbyRequest& req);
+// type and payload of one frame (LineReader::nextFrame). Malformed is LOBBY_UNKNOWN
+void parseBinaryRequest(string_view frame, LobbyRequest& req);
+// either of them, for a message of a connection that speaks format
+bool parseRequest(LobbyFormat format, string_view message, LobbyRequest& req);
+// the "Received from" log line of both lobby loops
+void logRequest(int sock, LobbyFormat format, string_view message);
+
+struct LobbyRank {
+    string_view name;
+    int32_t wins;
+};
+
+// Builds replies in one format. The buffer is kept, so once it has grown nothing
+// allocates. Each call replaces the last reply and returns it, only valid until the next
+class LobbyWriter {
+public:
+    explicit LobbyWriter(LobbyFormat format = LOBBY_TEXT) : format(format) {}
+
+    LobbyFormat format;
+
+    string_view welcome();
+    string_view user(bool isNew, string_view name, int wins);
+    string_view error(LobbyError code);
+    string_view games(const int* ids, size_t count);
+    string_view created(int room);
+    string_view matchStart();
+    string_view echo(string_view text);
+    string_view chat(string_view name, string_view text);
+    string_view leaderboard(const LobbyRank* ranks, size_t count);
+    string_view stats(string_view text);
+    string_view trace(string_view text);
+    string_view goodbye();
+    string_view unregistered();
+    string_view ping();
+    string_view pong();
+
+private:
+    string buf;
+
+    void begin(LobbyReplyType type);
+    string_view finish();
+    void text(string_view s) { buf.append(s); }
+    void number(int64_t n);
+    void putInt(uint32_t v);
+    void putString(string_view s);
+    string_view bare(LobbyReplyType type, string_view line);
+};
+
+#endif
@@ -1,5 +1,14 @@
 #include "lobby.h"
 #include "shared.h"
+#include "io_backend.h"
+#include "metrics.h"
+#include "session_tasks.h"
+#include "shared_lobby.h"
+#include "hot_restart.h"
+#include "liveness.h"
+#include "line_reader.h"
+#include "output_queue.h"
+#include "trace.h"
 #include <iostream>
 #include <cstring>
 #include <vector>
@@ -8,6 +17,9 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <signal.h>
+#include <cerrno>
+#include <sys/wait.h>
+#include <cstdlib>
 
 using namespace std;
 
@@ -21,8 +33,8 @@ void cleanup_and_exit(int sig) {
     
     // Iterate over a copy of the keys to avoid issues if the original map changes
     vector<int> sockets_to_close;
-    for(const auto& pair : connected_Users) {
-        sockets_to_close.push_back(pair.first);
+    for(int sock = 0; sock < (int)connected_Users.size(); sock++) {
+        if (connected_Users[sock] != NO_USER) sockets_to_close.push_back(sock);
     }
     pthread_mutex_unlock(&g_LobbyMutex);
 
@@ -32,26 +44,207 @@ void cleanup_and_exit(int sig) {
     }
     
     cout << "\nServer shutting down..." << endl;
-    saveAllUsers();
+    if (g_WorkerId < 0) saveAllUsers(); // workers leave users.bin to the parent, it has everyone's wins
+    if (!g_Config.tracePath.empty()) cout << WriteTrace() << endl;
     if (g_server_sock != -1) close(g_server_sock);
     exit(0);
 }
 
-int main(int argc, char* argv[]) {
-    //Load all users from file
-    getAllUsers();
+static vector<pid_t> g_WorkerPids;
 
-    cout << "Loaded " << g_AllUsers.size() << " persistent users." << endl;
+// --workers parent: pass the signal on, wait for every worker, then save the shared users
+void stop_workers(int sig) {
+    cout << "\nSignal " << sig << " received. Stopping " << g_WorkerPids.size() << " workers..." << endl;
+    for (pid_t pid : g_WorkerPids) kill(pid, SIGINT);
+    while (wait(NULL) > 0) {}
+    ExportSharedUsers();
+    saveAllUsers();
+    exit(0);
+}
+
+// Forks the --workers processes. Returns in every worker with g_WorkerId set,
+// the parent stays here until they are all gone
+static void forkWorkers(int count) {
+    for (int i = 0; i < count; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "fork failed, running " << i << " workers" << endl;
+            break;
+        }
+        if (pid == 0) {
+            g_WorkerId = i;
+            g_WorkerPids.clear();
+            return;
+        }
+        g_WorkerPids.push_back(pid);
+    }
 
+    signal(SIGINT, stop_workers);
+    cout << "Started " << g_WorkerPids.size() << " workers on port " << g_Config.port << endl;
+    while (true) {
+        pid_t pid = wait(NULL);
+        if (pid < 0 && errno == EINTR) continue;
+        if (pid < 0) break;
+        cerr << "Worker " << pid << " exited" << endl;
+    }
+    ExportSharedUsers();
+    saveAllUsers();
+    exit(0);
+}
 
-    signal(SIGINT, cleanup_and_exit);
+static void printUsage(const char* prog) {
+    cerr << "Usage: " << prog << " [--port N] [--compact-ticks] [--no-validate] [--map-size W H] [--max-commands N] [--udp] [--simulate] [--io-backend blocking|epoll|uring] [--coroutines] [--workers N] [--out-queue BYTES FRAMES] [--slow-player-ms N] [--slow-lobby drop|coalesce|disconnect] [--heartbeat-ms N] [--idle-timeout-ms N] [--handshake-timeout-ms N] [--no-compress] [--compress-min-bytes N] [--max-tick-commands N] [--commands-per-sec N] [--chat-rate PER_SEC BURST] [--lobby-bytes PER_SEC BURST] [--match-memory-mb N] [--trace FILE]" << endl;
+}
 
-    int port = 8080;
+// Fills g_Config from the command line, false on anything we don't understand
+static bool parseArgs(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            g_Config.port = atoi(argv[++i]);
+        } else if (arg == "--compact-ticks") {
+            g_Config.compactTicks = true;
+        } else if (arg == "--no-validate") {
+            g_Config.validateCommands = false;
+        } else if (arg == "--map-size" && i + 2 < argc) {
+            g_Config.mapWidth = atof(argv[++i]);
+            g_Config.mapHeight = atof(argv[++i]);
+        } else if (arg == "--max-commands" && i + 1 < argc) {
+            g_Config.maxCommandsPerTick = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--udp") {
+            g_Config.allowUdp = true;
+        } else if (arg == "--simulate") {
+            g_Config.simulate = true;
+        } else if (arg == "--io-backend" && i + 1 < argc) {
+            g_Config.ioBackend = argv[++i];
+            if (g_Config.ioBackend != "blocking" && g_Config.ioBackend != "epoll" && g_Config.ioBackend != "uring") {
+                cerr << "Unknown io backend " << g_Config.ioBackend << endl;
+                return false;
+            }
+        } else if (arg == "--coroutines") {
+            g_Config.coroutines = true;
+        } else if (arg == "--workers" && i + 1 < argc) {
+            g_Config.workers = atoi(argv[++i]);
+            if (g_Config.workers < 1) {
+                cerr << "--workers needs at least 1" << endl;
+                return false;
+            }
+        } else if (arg == "--out-queue" && i + 2 < argc) {
+            g_Config.outQueueBytes = strtoul(argv[++i], NULL, 10);
+            g_Config.outQueueFrames = strtoul(argv[++i], NULL, 10);
+            if (g_Config.outQueueBytes == 0 || g_Config.outQueueFrames == 0) {
+                cerr << "--out-queue needs at least 1 byte and 1 frame" << endl;
+                return false;
+            }
+        } else if (arg == "--slow-player-ms" && i + 1 < argc) {
+            g_Config.slowPlayerMs = atoi(argv[++i]);
+            if (g_Config.slowPlayerMs < 1) {
+                cerr << "--slow-player-ms needs at least 1" << endl;
+                return false;
+            }
+        } else if (arg == "--slow-lobby" && i + 1 < argc) {
+            g_Config.slowLobby = argv[++i];
+            if (g_Config.slowLobby != "drop" && g_Config.slowLobby != "coalesce" && g_Config.slowLobby != "disconnect") {
+                cerr << "Unknown slow lobby policy " << g_Config.slowLobby << endl;
+                return false;
+            }
+        } else if (arg == "--heartbeat-ms" && i + 1 < argc) {
+            g_Config.heartbeatMs = atoi(argv[++i]);
+        } else if (arg == "--idle-timeout-ms" && i + 1 < argc) {
+            g_Config.idleTimeoutMs = atoi(argv[++i]);
+        } else if (arg == "--handshake-timeout-ms" && i + 1 < argc) {
+            g_Config.handshakeTimeoutMs = atoi(argv[++i]);
+            if (g_Config.handshakeTimeoutMs < 1) {
+                cerr << "--handshake-timeout-ms needs at least 1" << endl;
+                return false;
+            }
+        } else if (arg == "--no-compress") {
+            g_Config.compressFrames = false;
+        } else if (arg == "--compress-min-bytes" && i + 1 < argc) {
+            g_Config.compressMinBytes = strtoul(argv[++i], NULL, 10);
+        } else if (arg == "--max-tick-commands" && i + 1 < argc) {
+            g_Config.maxTickCommands = (uint32_t)atoi(argv[++i]);
+        } else if (arg == "--commands-per-sec" && i + 1 < argc) {
+            g_Config.commandsPerSec = atof(argv[++i]);
+        } else if (arg == "--chat-rate" && i + 2 < argc) {
+            g_Config.chatPerSec = atof(argv[++i]);
+            g_Config.chatBurst = atof(argv[++i]);
+        } else if (arg == "--lobby-bytes" && i + 2 < argc) {
+            g_Config.lobbyBytesPerSec = atof(argv[++i]);
+            g_Config.lobbyBytesBurst = atof(argv[++i]);
+            // one read has to fit
+            if (g_Config.lobbyBytesPerSec > 0 && g_Config.lobbyBytesBurst < LineReader::READ_CHUNK) {
+                cerr << "--lobby-bytes needs a burst of at least " << LineReader::READ_CHUNK << endl;
+                return false;
+            }
+        } else if (arg == "--match-memory-mb" && i + 1 < argc) {
+            g_Config.matchMemoryLimit = strtoul(argv[++i], NULL, 10) << 20;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            g_Config.tracePath = argv[++i];
+        } else if (arg == "--resume-fd" && i + 1 < argc) {
+            // only passed by a hot restart to the process it starts (hot_restart.h)
+            g_Config.resumeFd = atoi(argv[++i]);
+        } else {
+            cerr << "Unknown option " << arg << endl;
+            return false;
+        }
+    }
+    // a client gets its PING and some time to answer before it counts as gone
+    if (g_Config.heartbeatMs < 1 || g_Config.idleTimeoutMs <= g_Config.heartbeatMs) {
+        cerr << "--idle-timeout-ms has to be longer than --heartbeat-ms" << endl;
+        return false;
+    }
+    return true;
+}
+
+// the heartbeat of a lobby connection, through its output queue like any other line
+static void pingLobby(int sock) {
+    // the liveness thread is the only caller, one writer per format is enough
+    static LobbyWriter writers[2] = { LobbyWriter(LOBBY_TEXT), LobbyWriter(LOBBY_BINARY) };
+    SendReply(sock, writers[outboxFormat(sock)].ping());
+}
+
+// Spawn a Lobby Thread for the new client
+static void startLobby(int clientSock) {
+    cout << "New Client Connected: " << clientSock << endl;
+
+    int* arg = new int(clientSock);
+    pthread_t t;
+    restartSessionStarted(); // before the thread runs, a restart must not miss it
+    // We call the function from lobby.cpp
+    if (pthread_create(&t, NULL, HandleClientLobby, arg) != 0) {
+        cerr << "Failed to create thread" << endl;
+        delete arg;
+        close(clientSock);
+        restartSessionEnded();
+    } else {
+        pthread_detach(t);
+    }
+}
+
+// hot restart: once the listening socket is handed over nothing may be accepted
+// here anymore, so the backend lets go of it before the accept loop parks
+static void parkBackendAccept(IoBackend& io) {
+    io.unwatch(g_server_sock);
+    vector<IoEvent> events;
+    bool stopped = false;
+    while (!stopped) {
+        io.wait(events, -1);
+        for (const IoEvent& ev : events) {
+            if (ev.type == IO_ACCEPTED) startLobby(ev.fd);
+            else if (ev.type == IO_RECV_DONE && ev.fd == g_server_sock) stopped = true;
+        }
+    }
+    parkAcceptLoop(g_server_sock);
+    io.watchAccept(g_server_sock); // the restart was called off
+}
+
+static bool openListeningSocket(int port) {
     g_server_sock = socket(AF_INET, SOCK_STREAM, 0);
     
     if (g_server_sock < 0) {
         cerr << "Socket creation failed" << endl;
-        return 1;
+        return false;
     }
 
     sockaddr_in serverAddress;
@@ -62,37 +255,121 @@ int main(int argc, char* argv[]) {
 
     int opt = 1;
     setsockopt(g_server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // every worker binds its own socket to the port and the kernel balances new connections
+    if (g_Config.workers > 1) setsockopt(g_server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
     if (bind(g_server_sock, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
         cerr << "Bind failed on port " << port << endl;
-        return 1;
+        return false;
     }
 
     if (listen(g_server_sock, 100) < 0) {
         cerr << "Listen failed" << endl;
+        return false;
+    }
+    return true;
+}
+
+// uring falls back to epoll on kernels without it, epoll to the blocking loop
+static IoBackend* openIoBackend() {
+    while (g_Config.ioBackend != "blocking") {
+        IoBackend* io = CreateIoBackend(g_Config.ioBackend);
+        if (io) return io;
+        string fallback = g_Config.ioBackend == "uring" ? "epoll" : "blocking";
+        cerr << "io backend " << g_Config.ioBackend << " not available, using " << fallback << endl;
+        g_Config.ioBackend = fallback;
+    }
+    return nullptr;
+}
+
+int main(int argc, char* argv[]) {
+    if (!parseArgs(argc, argv)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+    // coroutine rooms live in the executor, a joiner can't be handed to another process
+    if (g_Config.coroutines && g_Config.workers > 1) {
+        cerr << "--workers runs the thread per client lobby, it can't be combined with --coroutines" << endl;
+        return 1;
+    }
+    // the executor runs on a backend, pick the best one unless one was asked for
+    if (g_Config.coroutines && g_Config.ioBackend == "blocking") g_Config.ioBackend = "uring";
+    // before any other thread exists, they all inherit SIGHUP and SIGUSR2 blocked
+    if (!g_Config.tracePath.empty()) StartTracing(g_Config.tracePath);
+    StartHotRestart(argc, argv);
+
+    //Load all users from file
+    getAllUsers();
+
+    cout << "Loaded " << g_UserIds.size() << " persistent users." << endl;
+
+
+    if (g_Config.workers > 1) {
+        if (!CreateSharedLobby(g_Config.workers)) {
+            cerr << "Could not set up the shared lobby" << endl;
+            return 1;
+        }
+        forkWorkers(g_Config.workers);
+    }
+    // in every worker (threads don't survive the fork) and before any session can start.
+    // The coroutine executor runs its own timers (session_tasks.cpp)
+    if (!g_Config.coroutines) StartLiveness(pingLobby, true);
+    if (g_Config.workers > 1) StartHandoffListener();
+
+    signal(SIGINT, cleanup_and_exit);
+
+    int port = g_Config.port;
+    if (g_Config.resumeFd >= 0) {
+        // started by a hot restart: the listening socket, the users and every session come from the old server
+        if (!ResumeFromRestart(g_Config.resumeFd, g_server_sock)) {
+            cerr << "Could not take over from the old server" << endl;
+            return 1;
+        }
+    } else if (!openListeningSocket(port)) {
         return 1;
     }
 
     cout << " RTS SERVER ONLINE " << endl;
     cout << "Listening on port " << port << endl;
+    if (g_WorkerId >= 0) cout << "Worker " << g_WorkerId << " (pid " << getpid() << ")" << endl;
+
+    IoBackend* io = openIoBackend();
+    if (io && !io->watchAccept(g_server_sock)) {
+        cerr << "io backend " << io->name() << " can't watch the listening socket, using blocking" << endl;
+        delete io;
+        io = nullptr;
+        g_Config.ioBackend = "blocking";
+    }
+    cout << "I/O backend: " << g_Config.ioBackend << endl;
+
+    if (io && g_Config.coroutines) {
+        cout << "Sessions run as coroutines" << endl;
+        RunCoroutineServer(*io);
+    } else if (g_Config.coroutines) {
+        cerr << "--coroutines needs the epoll or uring backend, running a thread per client" << endl;
+        StartLiveness(pingLobby, true);
+    }
+
+    if (io) {
+        vector<IoEvent> events;
+        while (true) {
+            if (restartPending()) parkBackendAccept(*io);
+            io->wait(events, -1);
+            for (const IoEvent& ev : events) {
+                if (ev.type == IO_ACCEPTED) startLobby(ev.fd);
+            }
+        }
+    }
 
     while (true) {
+        if (restartPending()) {
+            parkAcceptLoop(g_server_sock);
+            continue;
+        }
+        addMetric(g_Metrics.ioSyscalls, 1);
         int clientSock = accept(g_server_sock, NULL, NULL);
         if (clientSock < 0) continue;
-        
-        cout << "New Client Connected: " << clientSock << endl;
-
-        // Spawn a Lobby Thread for the new client
-        int* arg = new int(clientSock);
-        pthread_t t;
-        // We call the function from lobby.cpp
-        if (pthread_create(&t, NULL, HandleClientLobby, arg) != 0) {
-            cerr << "Failed to create thread" << endl;
-            delete arg;
-            close(clientSock);
-        } else {
-            pthread_detach(t);
-        }
+        startLobby(clientSock);
     }
     return 0;
 }
\ No newline at end of file
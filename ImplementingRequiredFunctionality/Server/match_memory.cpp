@@ -0,0 +1,74 @@
+#include "match_memory.h"
+#include "shared.h"
+#include "metrics.h"
+#include <iostream>
+#include <pthread.h>
+
+using namespace std;
+
+static pthread_mutex_t g_MatchMemoryMutex = PTHREAD_MUTEX_INITIALIZER;
+static MatchMemory* g_LiveMatches = nullptr;
+
+MatchMemory::MatchMemory() : pool(&heap) {
+    heap.owner = this;
+    pthread_mutex_lock(&g_MatchMemoryMutex);
+    next = g_LiveMatches;
+    g_LiveMatches = this;
+    pthread_mutex_unlock(&g_MatchMemoryMutex);
+}
+
+MatchMemory::~MatchMemory() {
+    pthread_mutex_lock(&g_MatchMemoryMutex);
+    MatchMemory** at = &g_LiveMatches;
+    while (*at != this) at = &(*at)->next;
+    *at = next;
+    pthread_mutex_unlock(&g_MatchMemoryMutex);
+    // every chunk goes back at once, whatever the containers did not give back themselves
+    pool.release();
+}
+
+void* MatchMemory::do_allocate(size_t size, size_t align) {
+    void* p = pool.allocate(size, align);
+    used += size;
+    return p;
+}
+
+void MatchMemory::do_deallocate(void* p, size_t size, size_t align) {
+    pool.deallocate(p, size, align);
+    used -= size;
+}
+
+void* MatchMemory::CountedHeap::do_allocate(size_t size, size_t align) {
+    void* p = pmr::new_delete_resource()->allocate(size, align);
+    size_t now = bytes.load(memory_order_relaxed) + size;
+    bytes.store(now, memory_order_relaxed);
+    addMetric(g_Metrics.matchMemoryBytes, size);
+    if (now > peak) {
+        peak = now;
+        maxMetric(g_Metrics.matchMemoryPeakBytes, now);
+    }
+    if (!over && g_Config.matchMemoryLimit && now > g_Config.matchMemoryLimit) {
+        over = true;
+        addMetric(g_Metrics.matchMemoryCapped, 1);
+        cerr << "[GAME_INSTANCE] Match " << owner->matchId << " holds " << now / 1024
+             << " KB, over --match-memory-mb, ending it" << endl;
+    }
+    return p;
+}
+
+void MatchMemory::CountedHeap::do_deallocate(void* p, size_t size, size_t align) {
+    pmr::new_delete_resource()->deallocate(p, size, align);
+    bytes.store(bytes.load(memory_order_relaxed) - size, memory_order_relaxed);
+    subMetric(g_Metrics.matchMemoryBytes, size);
+}
+
+string formatMatchMemory() {
+    string out = "match_memory_by_match=";
+    pthread_mutex_lock(&g_MatchMemoryMutex);
+    for (const MatchMemory* m = g_LiveMatches; m; m = m->next) {
+        out += to_string(m->matchId) + ":" + to_string(m->heapBytes());
+        if (m->next) out += ",";
+    }
+    pthread_mutex_unlock(&g_MatchMemoryMutex);
+    return out + "|";
+}
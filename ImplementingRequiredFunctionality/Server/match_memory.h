@@ -0,0 +1,67 @@
+#ifndef MATCH_MEMORY_H
+#define MATCH_MEMORY_H
+
+#include <memory_resource>
+#include <atomic>
+#include <string>
+#include <cstddef>
+
+using namespace std;
+
+// What one match allocates: its tick buffers, frame history, the UDP windows and the
+// validation, compaction and simulation scratch. The TickProcessor of a match owns
+// one and every container of the match takes it as its pmr::memory_resource.
+// Blocks are pooled by size (a vector that grows and shrinks every tick keeps reusing
+// the same few), the pool takes its chunks from the heap and gives them all back in one
+// go when the match ends.
+//
+// What a match holds from the heap is counted per match (STATS match_memory_by_match)
+// and for the server (match_memory_bytes). A match going over --match-memory-mb is
+// flagged, its loop ends it at the next tick. One tick can't add much on top, its
+// size is already capped by --max-tick-commands.
+class MatchMemory : public pmr::memory_resource {
+public:
+    MatchMemory();
+    ~MatchMemory();
+    MatchMemory(const MatchMemory&) = delete;
+    MatchMemory& operator=(const MatchMemory&) = delete;
+
+    // the room id STATS shows it under
+    void setMatchId(int id) { matchId = id; }
+
+    size_t heapBytes() const { return heap.bytes.load(memory_order_relaxed); } // from the heap right now
+    size_t peakBytes() const { return heap.peak; }
+    size_t inUse() const { return used; } // handed out to containers, the rest is pooled
+    bool exceeded() const { return heap.over; }
+
+private:
+    // the heap with a count and the ceiling, under the pool
+    struct CountedHeap : public pmr::memory_resource {
+        MatchMemory* owner;
+        atomic<size_t> bytes{0}; // read by STATS on other threads
+        size_t peak = 0;
+        bool over = false;
+
+        void* do_allocate(size_t size, size_t align) override;
+        void do_deallocate(void* p, size_t size, size_t align) override;
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+
+    CountedHeap heap; // before pool, the pool hands its chunks back to it when it goes
+    pmr::unsynchronized_pool_resource pool;
+    size_t used = 0;
+    int matchId = -1;
+    MatchMemory* next = nullptr; // live matches of this process, for STATS
+
+    void* do_allocate(size_t size, size_t align) override;
+    void do_deallocate(void* p, size_t size, size_t align) override;
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    friend string formatMatchMemory();
+};
+
+// the STATS field of the matches this process runs right now,
+// "match_memory_by_match=id:bytes,...|"
+string formatMatchMemory();
+
+#endif
@@ -0,0 +1,256 @@
+#include "match_sim.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+static const uint32_t UNIT_ID_LIMIT = MATCH_PLAYERS * UNIT_SLOTS_PER_PLAYER;
+
+// indexed by the unit_type of a Place, accept() turns down anything past the end
+static const UnitType UNIT_TYPES[] = {
+    // speed  range   hp      damage  cost
+    { 2.0f,  16.0f,  100.0f, 1.0f,   3.0f }, // 0 melee
+    { 1.5f,  48.0f,  60.0f,  0.8f,   4.0f }, // 1 ranged
+    { 1.0f,  24.0f,  300.0f, 2.0f,   6.0f }, // 2 heavy
+    { 3.0f,  12.0f,  40.0f,  0.5f,   2.0f }, // 3 scout
+};
+static const uint32_t UNIT_TYPE_COUNT = sizeof(UNIT_TYPES) / sizeof(UNIT_TYPES[0]);
+
+const UnitType& unitTypeStats(uint32_t unit_type) {
+    return UNIT_TYPES[min(unit_type, UNIT_TYPE_COUNT - 1)]; // only a guard, Places are checked first
+}
+
+const char* simRejectName(SimReject reason) {
+    switch (reason) {
+        case SIM_REJECT_UNKNOWN_UNIT: return "unknown_unit";
+        case SIM_REJECT_DEAD_UNIT: return "dead_unit";
+        case SIM_REJECT_OUT_OF_RANGE: return "out_of_range";
+        case SIM_REJECT_MANA: return "mana";
+        case SIM_REJECT_BAD_POSITION: return "bad_position";
+        default: return "?";
+    }
+}
+
+// 1024 buckets, a few times the units of a busy match
+MatchSimulation::MatchSimulation(const SimRules& rules, pmr::memory_resource* memory)
+    : ids(memory), owners(memory), xs(memory), ys(memory), destXs(memory), destYs(memory), hps(memory),
+      speeds(memory), ranges(memory), damages(memory), attackMove(memory), slotOf(UNIT_ID_LIMIT, -1, memory),
+      rules(rules), grid(SIM_GRID_CELL, 10, memory), damageTaken(memory), engaged(memory) {
+    for (int p = 0; p < MATCH_PLAYERS; p++) manaLeft[p] = rules.manaStart;
+}
+
+uint64_t MatchSimulation::rejectedTotal() const {
+    uint64_t total = 0;
+    for (uint64_t n : rejectCounts) total += n;
+    return total;
+}
+
+void MatchSimulation::step(pmr::vector<Command>& frame, pmr::vector<uint32_t>& rejectedPlaces) {
+    size_t kept = 0;
+    for (size_t i = 0; i < frame.size(); i++) {
+        const Command& cmd = frame[i];
+        if (!accept(cmd)) {
+            if (cmd.command_type == COMMAND_TYPE_PLACE) rejectedPlaces.push_back(cmd.unit_id);
+            continue;
+        }
+        frame[kept++] = cmd;
+    }
+    frame.resize(kept);
+
+    fight();
+    move();
+    for (int p = 0; p < MATCH_PLAYERS; p++) manaLeft[p] = min(rules.manaMax, manaLeft[p] + rules.manaPerTick);
+}
+
+void MatchSimulation::save(BlobWriter& out) const {
+    out.putVector(ids);
+    out.putVector(owners);
+    out.putVector(xs);
+    out.putVector(ys);
+    out.putVector(destXs);
+    out.putVector(destYs);
+    out.putVector(hps);
+    out.putVector(speeds);
+    out.putVector(ranges);
+    out.putVector(damages);
+    out.putVector(attackMove);
+    out.putVector(slotOf);
+    out.put(rules);
+    out.put(manaLeft);
+    out.put(rejectCounts);
+}
+
+bool MatchSimulation::load(BlobReader& in) {
+    in.getVector(ids);
+    in.getVector(owners);
+    in.getVector(xs);
+    in.getVector(ys);
+    in.getVector(destXs);
+    in.getVector(destYs);
+    in.getVector(hps);
+    in.getVector(speeds);
+    in.getVector(ranges);
+    in.getVector(damages);
+    in.getVector(attackMove);
+    in.getVector(slotOf);
+    in.get(rules);
+    in.get(manaLeft);
+    in.get(rejectCounts);
+    if (!in.ok() || slotOf.size() != UNIT_ID_LIMIT) return false;
+    // every column has one entry per unit and every slot points inside them
+    size_t n = ids.size();
+    for (size_t size : { owners.size(), xs.size(), ys.size(), destXs.size(), destYs.size(), hps.size(),
+                         speeds.size(), ranges.size(), damages.size(), attackMove.size() }) {
+        if (size != n) return false;
+    }
+    for (int32_t slot : slotOf) {
+        if (slot >= (int32_t)n) return false;
+    }
+    for (uint32_t id : ids) {
+        if (id >= UNIT_ID_LIMIT) return false;
+    }
+    return true;
+}
+
+bool MatchSimulation::reject(SimReject reason) {
+    rejectCounts[reason]++;
+    return false;
+}
+
+// applies one command to the state, false if the state does not allow it
+bool MatchSimulation::accept(const Command& cmd) {
+    uint32_t id = cmd.unit_id;
+    bool finite = isfinite(cmd.target_x) && isfinite(cmd.target_y);
+
+    switch (cmd.command_type) {
+    case COMMAND_TYPE_PLACE: {
+        // the id came from the match's UnitIdAllocator, so it is in range
+        if (!finite) return reject(SIM_REJECT_BAD_POSITION);
+        // no card, no cost to charge: it must not pass as the cheapest one
+        if (cmd.unit_type >= UNIT_TYPE_COUNT) return reject(SIM_REJECT_UNKNOWN_UNIT);
+        int owner = UnitIdAllocator::ownerOf(id);
+        float cost = unitTypeStats(cmd.unit_type).cost;
+        if (manaLeft[owner] < cost) return reject(SIM_REJECT_MANA);
+        manaLeft[owner] -= cost;
+        addUnit(id, cmd);
+        return true;
+    }
+    case COMMAND_TYPE_MOVE:
+    case COMMAND_TYPE_ATTACK: {
+        int32_t slot = id < UNIT_ID_LIMIT ? slotOf[id] : -1;
+        if (slot < 0) return reject(SIM_REJECT_UNKNOWN_UNIT);
+        if (hps[slot] <= 0) return reject(SIM_REJECT_DEAD_UNIT);
+        if (!finite) return reject(SIM_REJECT_BAD_POSITION);
+        float x = (float)cmd.target_x, y = (float)cmd.target_y;
+        bool attack = cmd.command_type == COMMAND_TYPE_ATTACK;
+        if (attack) {
+            float dx = x - xs[slot], dy = y - ys[slot];
+            float reach = ranges[slot] + rules.attackSlack;
+            if (dx * dx + dy * dy > reach * reach) return reject(SIM_REJECT_OUT_OF_RANGE);
+        }
+        destXs[slot] = x;
+        destYs[slot] = y;
+        attackMove[slot] = attack;
+        return true;
+    }
+    case COMMAND_TYPE_UNIT_DIED:
+        // the TickProcessor only lets owners report their own live units
+        removeUnit(id);
+        return true;
+    default:
+        return true;
+    }
+}
+
+void MatchSimulation::addUnit(uint32_t id, const Command& place) {
+    removeUnit(id); // never happens with a working allocator, but keep the columns consistent
+    const UnitType& type = unitTypeStats(place.unit_type);
+    slotOf[id] = ids.size();
+    ids.push_back(id);
+    owners.push_back(UnitIdAllocator::ownerOf(id));
+    xs.push_back((float)place.target_x);
+    ys.push_back((float)place.target_y);
+    destXs.push_back(xs.back());
+    destYs.push_back(ys.back());
+    hps.push_back(type.hp);
+    speeds.push_back(type.speed);
+    ranges.push_back(type.range);
+    damages.push_back(type.damage);
+    attackMove.push_back(1); // fresh units defend themselves
+}
+
+void MatchSimulation::removeUnit(uint32_t id) {
+    if (id >= UNIT_ID_LIMIT || slotOf[id] < 0) return;
+    int32_t slot = slotOf[id];
+    // the last unit takes the slot, so the columns stay dense
+    auto fill = [slot](auto& column) {
+        column[slot] = column.back();
+        column.pop_back();
+    };
+    fill(ids);
+    fill(owners);
+    fill(xs);
+    fill(ys);
+    fill(destXs);
+    fill(destYs);
+    fill(hps);
+    fill(speeds);
+    fill(ranges);
+    fill(damages);
+    fill(attackMove);
+    slotOf[id] = -1;
+    if ((size_t)slot < ids.size()) slotOf[ids[slot]] = slot;
+}
+
+// every live unit that is idle or attack moving hits the closest enemy in its range.
+// Damage is summed first and applied after, so the order units are visited in does not matter
+void MatchSimulation::fight() {
+    uint32_t n = ids.size();
+    grid.build(xs.data(), ys.data(), n);
+    damageTaken.assign(n, 0.0f);
+    engaged.assign(n, 0);
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (hps[i] <= 0 || !attackMove[i]) continue;
+        float x = xs[i], y = ys[i];
+        uint8_t owner = owners[i];
+        float best = ranges[i] * ranges[i];
+        int32_t target = -1;
+        grid.query(x, y, ranges[i], [&](uint32_t j) {
+            if (owners[j] == owner || hps[j] <= 0) return;
+            float dx = xs[j] - x, dy = ys[j] - y;
+            float d2 = dx * dx + dy * dy;
+            // ties go to the lower index, buckets may list a unit twice or in any order
+            if (d2 < best || (d2 == best && (target < 0 || (int32_t)j < target))) {
+                best = d2;
+                target = j;
+            }
+        });
+        if (target >= 0) {
+            damageTaken[target] += damages[i];
+            engaged[i] = 1;
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i++) hps[i] -= damageTaken[i];
+}
+
+// units that did not fight walk towards their destination, arriving turns them back to attack move
+void MatchSimulation::move() {
+    uint32_t n = ids.size();
+    for (uint32_t i = 0; i < n; i++) {
+        if (hps[i] <= 0 || engaged[i]) continue;
+        float dx = destXs[i] - xs[i], dy = destYs[i] - ys[i];
+        float d2 = dx * dx + dy * dy;
+        float speed = speeds[i];
+        if (d2 <= speed * speed) {
+            xs[i] = destXs[i];
+            ys[i] = destYs[i];
+            attackMove[i] = 1;
+        } else {
+            float scale = speed / sqrtf(d2);
+            xs[i] += dx * scale;
+            ys[i] += dy * scale;
+        }
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef MATCH_SIM_H
+#define MATCH_SIM_H
+
+#include "shared.h"
+#include "unit_ids.h"
+#include "spatial_grid.h"
+
+// Headless model of a match, fed every finalized frame when the server runs
+// with --simulate. It knows where each unit is and how much mana each player
+// has, so it can drop orders the relay alone has to trust:
+//  - Move/Attack for a unit that was never placed or that the simulation killed
+//  - Attack whose target point is out of the unit's range
+//  - Place the player cannot afford
+// Units walk to their Move/Attack point, units that are idle or attack moving
+// hit the closest enemy in range, mana regenerates every tick.
+//
+// Units live in a dense structure of arrays (one column per field, a unit is
+// an index into all of them) and range checks go through a SpatialGrid rebuilt
+// every tick, so a step is a few linear passes over the columns.
+
+// What the simulation knows about a unit_type. Has to agree with the game's own
+// unit definitions, see UNIT_TYPES in match_sim.cpp
+struct UnitType {
+    float speed;  // map units per tick
+    float range;
+    float hp;
+    float damage; // per tick while in range
+    float cost;   // mana
+};
+
+const UnitType& unitTypeStats(uint32_t unit_type);
+
+// match wide numbers, the defaults are what the game uses
+struct SimRules {
+    float manaStart = 5.0f;
+    float manaMax = 10.0f;
+    float manaPerTick = 1.0f / 30; // one per second at 30 ticks/sec
+    // clients see the other player's units one frame late, an Attack may aim this far past the range
+    float attackSlack = 32.0f;
+};
+
+const float SIM_GRID_CELL = 64.0f; // about the longest range, so a query covers 3x3 cells
+
+enum SimReject {
+    SIM_REJECT_UNKNOWN_UNIT, // not placed yet, already reported dead, or a Place of a unit_type with no card
+    SIM_REJECT_DEAD_UNIT,    // killed in the simulation
+    SIM_REJECT_OUT_OF_RANGE,
+    SIM_REJECT_MANA,
+    SIM_REJECT_BAD_POSITION, // not finite, only reachable with --no-validate
+    SIM_REJECT_COUNT,
+};
+
+const char* simRejectName(SimReject reason);
+
+class MatchSimulation {
+public:
+    explicit MatchSimulation(const SimRules& rules = SimRules(),
+                             pmr::memory_resource* memory = pmr::get_default_resource());
+
+    // drops the commands of frame the current state does not allow, then
+    // advances the state by one tick. Ids of dropped Places are added to
+    // rejectedPlaces so the caller can give them back to its UnitIdAllocator
+    void step(pmr::vector<Command>& frame, pmr::vector<uint32_t>& rejectedPlaces);
+
+    uint32_t unitCount() const { return ids.size(); }
+    float mana(int player) const { return manaLeft[player]; }
+    uint64_t rejected(SimReject reason) const { return rejectCounts[reason]; }
+    uint64_t rejectedTotal() const;
+
+    // hot restart (hot_restart.h). The grid and the combat scratch are rebuilt every step
+    void save(BlobWriter& out) const;
+    bool load(BlobReader& in);
+
+private:
+    // unit columns, dense: a unit that dies in the simulation stays (with hp <= 0)
+    // until its owner reports UnitDied, then the last unit is moved into its slot
+    pmr::vector<uint32_t> ids;
+    pmr::vector<uint8_t> owners;
+    pmr::vector<float> xs, ys;
+    pmr::vector<float> destXs, destYs;
+    pmr::vector<float> hps;
+    pmr::vector<float> speeds, ranges, damages;
+    pmr::vector<uint8_t> attackMove; // 1 after Attack, 0 after Move (which ignores enemies)
+    pmr::vector<int32_t> slotOf;     // unit id -> index in the columns, -1 if not simulated
+
+    SimRules rules;
+    float manaLeft[MATCH_PLAYERS];
+    SpatialGrid grid;
+    pmr::vector<float> damageTaken;   // scratch for the combat pass
+    pmr::vector<uint8_t> engaged;     // had an enemy in range this tick, does not move
+    uint64_t rejectCounts[SIM_REJECT_COUNT] = {};
+
+    bool accept(const Command& cmd);
+    bool reject(SimReject reason);
+    void addUnit(uint32_t id, const Command& place);
+    void removeUnit(uint32_t id);
+    void fight();
+    void move();
+};
+
+#endif
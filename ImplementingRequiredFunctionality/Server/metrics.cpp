@@ -0,0 +1,58 @@
+#include "metrics.h"
+#include <new>
+#include <sys/mman.h>
+
+using namespace std;
+
+// Lives in a MAP_SHARED mapping made before main runs, so the --workers
+// processes forked later all count into the same counters and STATS on any
+// of them shows the whole server
+static ServerMetrics* mapMetrics() {
+    void* mem = mmap(NULL, sizeof(ServerMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return new ServerMetrics();
+    return new (mem) ServerMetrics();
+}
+
+ServerMetrics& g_Metrics = *mapMetrics();
+
+static void appendMetric(string& out, const char* name, const atomic<uint64_t>& value) {
+    out += name;
+    out += "=";
+    out += to_string(value.load(memory_order_relaxed));
+    out += "|";
+}
+
+string formatMetrics() {
+    string out = "STATS:";
+    appendMetric(out, "matches_started", g_Metrics.matchesStarted);
+    appendMetric(out, "ticks", g_Metrics.ticks);
+    appendMetric(out, "commands_received", g_Metrics.commandsReceived);
+    appendMetric(out, "commands_broadcast", g_Metrics.commandsBroadcast);
+    appendMetric(out, "compaction_commands_saved", g_Metrics.compactionCommandsSaved);
+    appendMetric(out, "compaction_bytes_saved", g_Metrics.compactionBytesSaved);
+    appendMetric(out, "commands_rejected", g_Metrics.commandsRejected);
+    appendMetric(out, "commands_clamped", g_Metrics.commandsClamped);
+    appendMetric(out, "commands_sim_rejected", g_Metrics.commandsSimRejected);
+    appendMetric(out, "io_syscalls", g_Metrics.ioSyscalls);
+    appendMetric(out, "state_hashes_checked", g_Metrics.stateHashesChecked);
+    appendMetric(out, "desyncs", g_Metrics.desyncs);
+    appendMetric(out, "out_queue_bytes", g_Metrics.outQueueBytes);
+    appendMetric(out, "out_queue_frames", g_Metrics.outQueueFrames);
+    appendMetric(out, "out_queue_peak_bytes", g_Metrics.outQueuePeakBytes);
+    appendMetric(out, "slow_consumer_disconnects", g_Metrics.slowConsumerDisconnects);
+    appendMetric(out, "lobby_lines_dropped", g_Metrics.lobbyLinesDropped);
+    appendMetric(out, "pings_sent", g_Metrics.pingsSent);
+    appendMetric(out, "idle_disconnects", g_Metrics.idleDisconnects);
+    appendMetric(out, "handshake_timeouts", g_Metrics.handshakeTimeouts);
+    appendMetric(out, "frames_compressed", g_Metrics.framesCompressed);
+    appendMetric(out, "compression_bytes_saved", g_Metrics.compressionBytesSaved);
+    appendMetric(out, "tick_tag_mismatches", g_Metrics.tickTagMismatches);
+    appendMetric(out, "chat_throttled", g_Metrics.chatThrottled);
+    appendMetric(out, "commands_throttled", g_Metrics.commandsThrottled);
+    appendMetric(out, "oversized_ticks", g_Metrics.oversizedTicks);
+    appendMetric(out, "input_flood_disconnects", g_Metrics.inputFloodDisconnects);
+    appendMetric(out, "match_memory_bytes", g_Metrics.matchMemoryBytes);
+    appendMetric(out, "match_memory_peak_bytes", g_Metrics.matchMemoryPeakBytes);
+    appendMetric(out, "match_memory_capped", g_Metrics.matchMemoryCapped);
+    return out;
+}
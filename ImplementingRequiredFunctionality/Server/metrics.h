@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Server wide counters. Match threads bump them with relaxed atomics,
+// the lobby STATS command reads them
+struct ServerMetrics {
+    atomic<uint64_t> matchesStarted{0};
+    atomic<uint64_t> ticks{0};
+    atomic<uint64_t> commandsReceived{0};
+    atomic<uint64_t> commandsBroadcast{0};
+    atomic<uint64_t> compactionCommandsSaved{0};
+    atomic<uint64_t> compactionBytesSaved{0};
+    atomic<uint64_t> commandsRejected{0};
+    atomic<uint64_t> commandsClamped{0};
+    atomic<uint64_t> commandsSimRejected{0}; // dropped by --simulate (match_sim.h)
+    atomic<uint64_t> ioSyscalls{0}; // socket syscalls of accept and the TCP match loops (io_backend.h)
+    atomic<uint64_t> stateHashesChecked{0}; // ticks where both players sent a state hash
+    atomic<uint64_t> desyncs{0}; // matches whose players' state hashes diverged
+    // output queues (output_queue.h). The first three are gauges, what is queued right now
+    atomic<uint64_t> outQueueBytes{0};
+    atomic<uint64_t> outQueueFrames{0};
+    atomic<uint64_t> outQueuePeakBytes{0}; // deepest single queue so far
+    atomic<uint64_t> slowConsumerDisconnects{0};
+    atomic<uint64_t> lobbyLinesDropped{0}; // broadcasts a slow lobby connection never got
+    // heartbeats and timeouts (liveness.h)
+    atomic<uint64_t> pingsSent{0};
+    atomic<uint64_t> idleDisconnects{0};
+    atomic<uint64_t> handshakeTimeouts{0};
+    // tick frames sent packed to players that asked for it (frame_codec.h)
+    atomic<uint64_t> framesCompressed{0};
+    atomic<uint64_t> compressionBytesSaved{0};
+    atomic<uint64_t> tickTagMismatches{0}; // uploads tagged for another frame than the one they went into
+    // what clients were kept from costing (rate_limit.h)
+    atomic<uint64_t> chatThrottled{0};    // CHAT lines over the user's rate, not broadcast
+    atomic<uint64_t> commandsThrottled{0}; // commands over a player's --commands-per-sec
+    atomic<uint64_t> oversizedTicks{0};   // tick uploads over --max-tick-commands, the player was disconnected
+    atomic<uint64_t> inputFloodDisconnects{0}; // connections over --lobby-bytes or with too much unread input
+    // what matches hold from the heap (match_memory.h). The first two are gauges
+    atomic<uint64_t> matchMemoryBytes{0};
+    atomic<uint64_t> matchMemoryPeakBytes{0}; // most one match ever held
+    atomic<uint64_t> matchMemoryCapped{0};    // matches ended for going over --match-memory-mb
+};
+
+extern ServerMetrics& g_Metrics; // shared by every --workers process (metrics.cpp)
+
+inline void addMetric(atomic<uint64_t>& counter, uint64_t n) {
+    counter.fetch_add(n, memory_order_relaxed);
+}
+
+inline void subMetric(atomic<uint64_t>& gauge, uint64_t n) {
+    gauge.fetch_sub(n, memory_order_relaxed);
+}
+
+// raises gauge to value if it is lower
+inline void maxMetric(atomic<uint64_t>& gauge, uint64_t value) {
+    uint64_t seen = gauge.load(memory_order_relaxed);
+    while (seen < value && !gauge.compare_exchange_weak(seen, value, memory_order_relaxed)) {}
+}
+
+// One line in the same "name=value|" style as the leaderboard
+string formatMetrics();
+
+#endif
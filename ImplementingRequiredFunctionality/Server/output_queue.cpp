@@ -0,0 +1,336 @@
+#include "output_queue.h"
+#include "metrics.h"
+#include <memory>
+#include <iostream>
+#include <chrono>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+static uint64_t nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool fits(size_t queuedBytes, size_t queuedFrames, size_t bytes) {
+    return queuedBytes + bytes <= g_Config.outQueueBytes && queuedFrames < g_Config.outQueueFrames;
+}
+
+static int stallLeft(uint64_t lastProgress) {
+    uint64_t waited = nowMs() - lastProgress;
+    return waited >= (uint64_t)g_Config.slowPlayerMs ? 0 : (int)(g_Config.slowPlayerMs - waited);
+}
+
+SlowConsumerPolicy lobbyPolicy() {
+    if (g_Config.slowLobby == "drop") return SLOW_DROP;
+    if (g_Config.slowLobby == "disconnect") return SLOW_DISCONNECT;
+    return SLOW_COALESCE;
+}
+
+//  OUTPUT QUEUE
+OutputQueue::~OutputQueue() {
+    subMetric(g_Metrics.outQueueBytes, queuedBytes);
+    subMetric(g_Metrics.outQueueFrames, frames.size());
+}
+
+bool OutputQueue::push(const iovec* iov, int iovcnt, bool droppable) {
+    string bytes;
+    for (int i = 0; i < iovcnt; i++) bytes.append((const char*)iov[i].iov_base, iov[i].iov_len);
+    return push(bytes, droppable);
+}
+
+bool OutputQueue::push(const string& bytes, bool droppable) {
+    if (failed) return false;
+    if (bytes.empty()) return true;
+    if (!fits(queuedBytes, frames.size(), bytes.size())) {
+        if (!droppable || policy == SLOW_DISCONNECT) return giveUp();
+        if (policy == SLOW_DROP || !makeRoom(bytes.size())) {
+            addMetric(g_Metrics.lobbyLinesDropped, 1);
+            return true;
+        }
+    }
+
+    if (frames.empty()) lastProgress = nowMs();
+    frames.push_back({ bytes, droppable });
+    queuedBytes += bytes.size();
+    addMetric(g_Metrics.outQueueBytes, bytes.size());
+    addMetric(g_Metrics.outQueueFrames, 1);
+    maxMetric(g_Metrics.outQueuePeakBytes, queuedBytes);
+    return true;
+}
+
+// SLOW_COALESCE: drops queued droppable frames, oldest first, until bytes fit.
+// The front one may be half written already and has to stay
+bool OutputQueue::makeRoom(size_t bytes) {
+    for (size_t i = offset > 0 ? 1 : 0; i < frames.size() && !fits(queuedBytes, frames.size(), bytes);) {
+        if (!frames[i].droppable) {
+            i++;
+            continue;
+        }
+        queuedBytes -= frames[i].bytes.size();
+        subMetric(g_Metrics.outQueueBytes, frames[i].bytes.size());
+        subMetric(g_Metrics.outQueueFrames, 1);
+        addMetric(g_Metrics.lobbyLinesDropped, 1);
+        frames.erase(frames.begin() + i);
+    }
+    return fits(queuedBytes, frames.size(), bytes);
+}
+
+void OutputQueue::popFront() {
+    size_t left = frames.front().bytes.size() - offset;
+    queuedBytes -= left;
+    subMetric(g_Metrics.outQueueBytes, left);
+    subMetric(g_Metrics.outQueueFrames, 1);
+    frames.pop_front();
+    offset = 0;
+}
+
+bool OutputQueue::giveUp() {
+    if (!failed) addMetric(g_Metrics.slowConsumerDisconnects, 1);
+    failed = true;
+    return false;
+}
+
+bool OutputQueue::flush(int fd) {
+    if (failed) return false;
+    while (!frames.empty()) {
+        iovec iov[16];
+        int count = 0;
+        for (size_t k = 0; k < frames.size() && count < 16; k++, count++) {
+            size_t skip = k == 0 ? offset : 0;
+            iov[count].iov_base = (void*)(frames[k].bytes.data() + skip);
+            iov[count].iov_len = frames[k].bytes.size() - skip;
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        addMetric(g_Metrics.ioSyscalls, 1);
+        ssize_t r = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                failed = true; // gone, not slow
+                return false;
+            }
+            // socket buffer full, the rest waits for the next flush
+            if (msUntilStall() == 0) return giveUp();
+            return true;
+        }
+
+        lastProgress = nowMs();
+        size_t left = r;
+        while (!frames.empty() && left >= frames.front().bytes.size() - offset) {
+            left -= frames.front().bytes.size() - offset;
+            popFront();
+        }
+        if (left > 0) {
+            offset += left;
+            queuedBytes -= left;
+            subMetric(g_Metrics.outQueueBytes, left);
+        }
+    }
+    return true;
+}
+
+bool OutputQueue::drain(int fd, int timeoutMs) {
+    uint64_t deadline = nowMs() + timeoutMs;
+    while (true) {
+        if (!flush(fd)) return false;
+        if (frames.empty()) return true;
+        uint64_t now = nowMs();
+        if (now >= deadline) return giveUp();
+        pollfd p = { fd, POLLOUT, 0 };
+        addMetric(g_Metrics.ioSyscalls, 1);
+        poll(&p, 1, (int)(deadline - now));
+    }
+}
+
+int OutputQueue::msUntilStall() const {
+    if (policy != SLOW_DISCONNECT || frames.empty()) return -1;
+    return stallLeft(lastProgress);
+}
+
+string OutputQueue::unsent() const {
+    string out;
+    for (size_t k = 0; k < frames.size(); k++) {
+        size_t skip = k == 0 ? offset : 0;
+        out.append(frames[k].bytes, skip, string::npos);
+    }
+    return out;
+}
+
+//  SEND BACKLOG
+SendBacklog::~SendBacklog() {
+    subMetric(g_Metrics.outQueueBytes, queuedBytes);
+    subMetric(g_Metrics.outQueueFrames, sizes.size());
+}
+
+bool SendBacklog::admit(size_t bytes, bool droppable) {
+    if (over) return false;
+    if (!fits(queuedBytes, sizes.size(), bytes)) {
+        if (!droppable || policy == SLOW_DISCONNECT) return giveUp();
+        addMetric(g_Metrics.lobbyLinesDropped, 1);
+        return false;
+    }
+    if (sizes.empty()) lastProgress = nowMs();
+    sizes.push_back(bytes);
+    queuedBytes += bytes;
+    addMetric(g_Metrics.outQueueBytes, bytes);
+    addMetric(g_Metrics.outQueueFrames, 1);
+    maxMetric(g_Metrics.outQueuePeakBytes, queuedBytes);
+    return true;
+}
+
+void SendBacklog::sent() {
+    if (sizes.empty()) return;
+    queuedBytes -= sizes.front();
+    subMetric(g_Metrics.outQueueBytes, sizes.front());
+    subMetric(g_Metrics.outQueueFrames, 1);
+    sizes.pop_front();
+    lastProgress = nowMs();
+}
+
+int SendBacklog::msUntilStall() const {
+    if (policy != SLOW_DISCONNECT || sizes.empty() || over) return -1;
+    return stallLeft(lastProgress);
+}
+
+bool SendBacklog::stalled() {
+    if (msUntilStall() != 0) return false;
+    giveUp();
+    return true;
+}
+
+bool SendBacklog::giveUp() {
+    if (!over) addMetric(g_Metrics.slowConsumerDisconnects, 1);
+    over = true;
+    return false;
+}
+
+//  LOBBY OUTBOXES
+struct Outbox {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    OutputQueue queue{ lobbyPolicy() };
+    bool shut = false;
+    LobbyFormat format = LOBBY_TEXT;
+};
+
+// by socket. Lock order: g_LobbyMutex (broadcasts hold it), g_OutboxMutex, an Outbox's mutex
+static unordered_map<int, shared_ptr<Outbox>> g_Outboxes;
+static pthread_mutex_t g_OutboxMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static shared_ptr<Outbox> findOutbox(int sock) {
+    pthread_mutex_lock(&g_OutboxMutex);
+    auto it = g_Outboxes.find(sock);
+    shared_ptr<Outbox> box = it == g_Outboxes.end() ? nullptr : it->second;
+    pthread_mutex_unlock(&g_OutboxMutex);
+    return box;
+}
+
+// the queue gave up on sock, its session finds out from the EOF. Box locked
+static bool shutDown(int sock, Outbox& box) {
+    if (!box.shut) {
+        cerr << "[LOBBY] Connection " << sock << " can't take what we send, disconnecting it" << endl;
+        shutdown(sock, SHUT_RDWR);
+        box.shut = true;
+    }
+    return false;
+}
+
+void openOutbox(int sock, LobbyFormat format) {
+    shared_ptr<Outbox> box = make_shared<Outbox>();
+    box->format = format;
+    pthread_mutex_lock(&g_OutboxMutex);
+    g_Outboxes[sock] = box;
+    pthread_mutex_unlock(&g_OutboxMutex);
+}
+
+void closeOutbox(int sock) {
+    pthread_mutex_lock(&g_OutboxMutex);
+    g_Outboxes.erase(sock);
+    pthread_mutex_unlock(&g_OutboxMutex);
+}
+
+void setOutboxFormat(int sock, LobbyFormat format) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return;
+    pthread_mutex_lock(&box->mutex);
+    box->format = format;
+    pthread_mutex_unlock(&box->mutex);
+}
+
+LobbyFormat outboxFormat(int sock) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return LOBBY_TEXT;
+    pthread_mutex_lock(&box->mutex);
+    LobbyFormat format = box->format;
+    pthread_mutex_unlock(&box->mutex);
+    return format;
+}
+
+bool outboxSend(int sock, string_view reply, bool droppable) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) {
+        // not a lobby connection (yet), the old blocking write
+        return send(sock, reply.data(), reply.size(), MSG_NOSIGNAL) > 0;
+    }
+    pthread_mutex_lock(&box->mutex);
+    bool ok = !box->shut && box->queue.push(string(reply), droppable) && box->queue.flush(sock);
+    if (!ok) shutDown(sock, *box);
+    pthread_mutex_unlock(&box->mutex);
+    return ok;
+}
+
+bool flushOutbox(int sock) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return true;
+    pthread_mutex_lock(&box->mutex);
+    bool ok = !box->shut && box->queue.flush(sock);
+    if (!ok) shutDown(sock, *box);
+    pthread_mutex_unlock(&box->mutex);
+    return ok;
+}
+
+bool outboxPending(int sock) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return false;
+    pthread_mutex_lock(&box->mutex);
+    bool pending = !box->queue.empty();
+    pthread_mutex_unlock(&box->mutex);
+    return pending;
+}
+
+bool drainOutbox(int sock, int timeoutMs) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return true;
+    uint64_t deadline = nowMs() + timeoutMs;
+    while (true) {
+        pthread_mutex_lock(&box->mutex);
+        bool ok = !box->shut && box->queue.flush(sock);
+        bool done = ok && box->queue.empty();
+        uint64_t now = nowMs();
+        if (ok && !done && now >= deadline) {
+            addMetric(g_Metrics.slowConsumerDisconnects, 1);
+            ok = false;
+        }
+        if (!ok) shutDown(sock, *box);
+        pthread_mutex_unlock(&box->mutex);
+        if (!ok || done) return ok;
+
+        // broadcasts keep going to the box while we wait, only the poll is unlocked
+        pollfd p = { sock, POLLOUT, 0 };
+        addMetric(g_Metrics.ioSyscalls, 1);
+        poll(&p, 1, (int)(deadline - now));
+    }
+}
+
+string outboxUnsent(int sock) {
+    shared_ptr<Outbox> box = findOutbox(sock);
+    if (!box) return "";
+    pthread_mutex_lock(&box->mutex);
+    string unsent = box->queue.unsent();
+    pthread_mutex_unlock(&box->mutex);
+    return unsent;
+}
@@ -0,0 +1,126 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include "shared.h"
+#include "lobby_protocol.h"
+#include <deque>
+#include <sys/uio.h>
+
+// Connections write through a bounded queue instead of a blocking send(), so a
+// client that stops reading (its receive window is full) can't hold up the other
+// player of its match or a lobby broadcast. Writes never block, what the socket
+// does not take stays queued until it is writable again. Every queue is capped
+// in bytes and frames (--out-queue), what happens to a connection that runs into
+// the caps is its SlowConsumerPolicy:
+//  - players are disconnected, a lockstep match can't skip frames. Also after
+//    --slow-player-ms without a byte going out
+//  - lobby connections follow --slow-lobby, broadcasts (CHAT) are droppable,
+//    replies to the connection's own commands never are
+
+enum SlowConsumerPolicy : uint8_t {
+    SLOW_DISCONNECT, // over the caps or stalled: the connection goes
+    SLOW_DROP,       // a droppable frame that does not fit is dropped
+    SLOW_COALESCE,   // a droppable frame that does not fit pushes out the oldest queued droppable ones
+};
+
+// what --slow-lobby asks for
+SlowConsumerPolicy lobbyPolicy();
+
+// Frames waiting to go out on one socket. Not thread safe, the lobby outboxes below lock around it
+class OutputQueue {
+public:
+    explicit OutputQueue(SlowConsumerPolicy policy) : policy(policy) {}
+    ~OutputQueue();
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    // queues one frame (a tick, a lobby line). false when the connection is over its
+    // caps and has to go, a droppable frame the policy gave up on is not a failure
+    bool push(const iovec* iov, int iovcnt, bool droppable = false);
+    bool push(const string& bytes, bool droppable = false);
+    // writes what fd takes right now. false on a write error or once a SLOW_DISCONNECT
+    // queue has not moved for --slow-player-ms
+    bool flush(int fd);
+    // flushes until empty, waiting for fd to be writable. false on error or after timeoutMs
+    bool drain(int fd, int timeoutMs);
+
+    bool empty() const { return frames.empty(); }
+    // ms left before a SLOW_DISCONNECT queue counts as stalled, -1 if it can't stall right now
+    int msUntilStall() const;
+    // everything not written yet, for a hot restart
+    string unsent() const;
+
+private:
+    struct Frame {
+        string bytes;
+        bool droppable;
+    };
+
+    SlowConsumerPolicy policy;
+    deque<Frame> frames;
+    size_t offset = 0;        // bytes of frames.front() already written
+    size_t queuedBytes = 0;
+    uint64_t lastProgress = 0; // ms, last write or when the queue stopped being empty
+    bool failed = false;
+
+    bool makeRoom(size_t bytes);
+    void popFront();
+    bool giveUp();
+};
+
+// The same caps for sends an IoBackend queues itself (io_backend.h), where the
+// bytes are out of our hands: counts sends that have no IO_SENT yet.
+// SLOW_COALESCE can't take anything back from the backend and drops like SLOW_DROP
+class SendBacklog {
+public:
+    explicit SendBacklog(SlowConsumerPolicy policy) : policy(policy) {}
+    ~SendBacklog();
+    SendBacklog(const SendBacklog&) = delete;
+    SendBacklog& operator=(const SendBacklog&) = delete;
+
+    // true when a send of bytes may go to the backend. false for a droppable send that
+    // does not fit (dropped) and for anything once overflowed()
+    bool admit(size_t bytes, bool droppable = false);
+    // the oldest admitted send got its IO_SENT
+    void sent();
+
+    // the connection went over its caps and has to go
+    bool overflowed() const { return over; }
+    // ms left before a SLOW_DISCONNECT backlog counts as stalled, -1 if it can't stall right now
+    int msUntilStall() const;
+    // true (and overflowed() from now on) once it did
+    bool stalled();
+
+private:
+    SlowConsumerPolicy policy;
+    deque<size_t> sizes;
+    size_t queuedBytes = 0;
+    uint64_t lastProgress = 0;
+    bool over = false;
+
+    bool giveUp();
+};
+
+//  LOBBY OUTBOXES
+// Thread per client lobby: one OutputQueue per connection, shared by the session's
+// own replies (SendReply) and everyone's broadcasts. The session thread flushes it
+// while it polls its socket. A connection that has to go is shut down, its
+// session sees the EOF and cleans up as usual
+void openOutbox(int sock, LobbyFormat format = LOBBY_TEXT);
+// before the session closes sock, the number may be reused right after
+void closeOutbox(int sock);
+// what the connection speaks, for those who write to it without its session (broadcasts, PINGs)
+void setOutboxFormat(int sock, LobbyFormat format);
+LobbyFormat outboxFormat(int sock);
+// queues a whole reply (a line with its '\n' or a frame) and writes what fits.
+// false when sock is being shut down
+bool outboxSend(int sock, string_view reply, bool droppable);
+// false when sock is being shut down
+bool flushOutbox(int sock);
+bool outboxPending(int sock);
+// before someone else writes to sock directly (a match, a handoff)
+bool drainOutbox(int sock, int timeoutMs);
+// what the outbox has not written yet, for a hot restart
+string outboxUnsent(int sock);
+
+#endif
@@ -0,0 +1,81 @@
+#include "rate_limit.h"
+#include "shared.h"
+#include "metrics.h"
+#include "line_reader.h"
+#include <algorithm>
+
+using namespace std;
+
+void TokenBucket::configure(double rate, double burst) {
+    this->rate = rate;
+    this->burst = burst;
+    tokens = burst;
+    last = chrono::steady_clock::now();
+}
+
+void TokenBucket::refill() {
+    auto now = chrono::steady_clock::now();
+    tokens = min(burst, tokens + chrono::duration<double>(now - last).count() * rate);
+    last = now;
+}
+
+bool TokenBucket::take(double n) {
+    if (rate <= 0) return true;
+    refill();
+    if (tokens < n) return false;
+    tokens -= n;
+    return true;
+}
+
+uint32_t TokenBucket::takeUpTo(uint32_t n) {
+    if (rate <= 0) return n;
+    refill();
+    uint32_t got = (uint32_t)min((double)n, max(tokens, 0.0));
+    tokens -= got;
+    return got;
+}
+
+void TokenBucket::save(BlobWriter& out) const {
+    double level = min(burst, tokens + chrono::duration<double>(chrono::steady_clock::now() - last).count() * rate);
+    out.put(level);
+}
+
+bool TokenBucket::load(BlobReader& in) {
+    double level = 0;
+    if (!in.get(level)) return false;
+    tokens = min(burst, level);
+    last = chrono::steady_clock::now();
+    return true;
+}
+
+bool tickCountAllowed(uint32_t count) {
+    if (count <= g_Config.maxTickCommands) return true;
+    addMetric(g_Metrics.oversizedTicks, 1);
+    return false;
+}
+
+size_t maxBufferedInput() {
+    // count, tag and hash in front of the commands
+    size_t tick = 2 * sizeof(uint32_t) + sizeof(uint64_t) + (size_t)g_Config.maxTickCommands * sizeof(Command);
+    return max((size_t)LineReader::MAX_LINE, 2 * tick);
+}
+
+static pthread_mutex_t g_ChatMutex = PTHREAD_MUTEX_INITIALIZER;
+static unordered_map<uint32_t, TokenBucket> g_ChatBuckets; // by user id
+
+bool allowChat(uint32_t user) {
+    pthread_mutex_lock(&g_ChatMutex);
+    auto it = g_ChatBuckets.find(user);
+    if (it == g_ChatBuckets.end())
+        it = g_ChatBuckets.emplace(user, TokenBucket(g_Config.chatPerSec, g_Config.chatBurst)).first;
+    bool allowed = it->second.take(1);
+    pthread_mutex_unlock(&g_ChatMutex);
+    if (!allowed) addMetric(g_Metrics.chatThrottled, 1);
+    return allowed;
+}
+
+void forgetChat(uint32_t user) {
+    pthread_mutex_lock(&g_ChatMutex);
+    g_ChatBuckets.erase(user);
+    pthread_mutex_unlock(&g_ChatMutex);
+}
@@ -0,0 +1,55 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include "state_blob.h"
+
+using namespace std;
+
+// What one client can make the server spend. Token buckets pace what a client
+// does over time (CHAT lines, lobby bytes, match commands), the caps bound what a
+// single upload can make the server allocate and are checked before anything is.
+// Going over a bucket drops what did not fit (CHAT, commands) or disconnects the
+// client (lobby bytes, caps), every case is counted in STATS (metrics.h).
+
+// rate tokens a second, at most burst of them saved up, starts full. A rate of 0 never runs out
+class TokenBucket {
+public:
+    TokenBucket() = default;
+    TokenBucket(double rate, double burst) { configure(rate, burst); }
+    void configure(double rate, double burst);
+
+    // takes n tokens if there are that many
+    bool take(double n);
+    // takes as many whole tokens as there are, at most n. Returns how many
+    uint32_t takeUpTo(uint32_t n);
+
+    // the level for a hot restart, rate and burst come from the new process's config
+    void save(BlobWriter& out) const;
+    bool load(BlobReader& in);
+
+private:
+    double rate = 0;
+    double burst = 0;
+    double tokens = 0;
+    chrono::steady_clock::time_point last;
+
+    void refill();
+};
+
+// false (and counted) when a tick upload's count, flags masked off, is over --max-tick-commands
+bool tickCountAllowed(uint32_t count);
+// the most input a connection may have buffered without it being handled: one lobby
+// line or two whole ticks. More is a client that keeps sending without waiting
+size_t maxBufferedInput();
+
+// one CHAT line of user (a UserId, shared.h). The bucket is shared by all its connections and
+// outlives them, so reconnecting does not refill it. Per process with --workers
+bool allowChat(uint32_t user);
+// drops the bucket of a user that unregistered
+void forgetChat(uint32_t user);
+
+#endif
@@ -0,0 +1,334 @@
+#include "session_tasks.h"
+#include "executor.h"
+#include "lobby.h"
+#include "shared.h"
+#include "lobby_protocol.h"
+#include "tick_processor.h"
+#include "metrics.h"
+#include "liveness.h"
+#include "frame_codec.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "match_memory.h"
+#include <iostream>
+#include <unordered_map>
+#include <sys/socket.h>
+
+using namespace std;
+
+// What the two sessions of a room share while it waits for a joiner and plays
+struct CoRoom {
+    Connection* host;
+    Connection* joiner = nullptr;
+    bool over = false;
+    bool aborted = false; // the ACK handshake failed, neither session goes back to the lobby
+    Waiter matchOver; // the joiner's session parks here during the match
+};
+
+// rooms by id, node based so a CoRoom never moves while a session points at it
+static unordered_map<int, CoRoom> g_CoRooms;
+
+// CHAT goes to every registered connection that is not in a match, like sendToAllInLobby.
+// Encoded once per format, only if someone speaks it
+static void broadcastChat(string_view from, string_view text) {
+    cout << "[LOBBY] Broadcasting to all in lobby: CHAT " << from << ": " << text << endl;
+    static LobbyWriter writers[2] = { LobbyWriter(LOBBY_TEXT), LobbyWriter(LOBBY_BINARY) };
+    string_view encoded[2];
+    pthread_mutex_lock(&g_LobbyMutex);
+    for (const auto& pair : g_Executor->connections()) {
+        int sock = pair.first;
+        if (loggedInUser(sock) == NO_USER || isInGame(sock)) continue;
+        LobbyFormat f = pair.second->reader.format();
+        if (encoded[f].empty()) encoded[f] = writers[f].chat(from, text);
+        pair.second->sendReply(encoded[f], true);
+    }
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+// one tick of player i: uint32 count, the frame number if TICK_HAS_TAG is set, the state
+// hash if TICK_HAS_HASH is set, then the commands
+static Task<bool> readFrame(Connection& c, int i, TickProcessor& ticks, pmr::vector<Command>& out) {
+    uint32_t count;
+    if (!co_await readBytes(c, (char*)&count, sizeof(count))) co_return false;
+    // checked before anything is read or allocated for it
+    if (!tickCountAllowed(count & ~TICK_FLAGS)) {
+        cerr << "[GAME_INSTANCE] Player " << i << " sent a tick of " << (count & ~TICK_FLAGS) << " commands, disconnecting it" << endl;
+        shutdown(c.fd, SHUT_RDWR);
+        co_return false;
+    }
+    if (count & TICK_HAS_TAG) {
+        uint32_t tag;
+        if (!co_await readBytes(c, (char*)&tag, sizeof(tag))) co_return false;
+        ticks.setTickTag(i, tag);
+    }
+    if (count & TICK_HAS_HASH) {
+        uint64_t hash;
+        if (!co_await readBytes(c, (char*)&hash, sizeof(hash))) co_return false;
+        ticks.setStateHash(i, hash);
+    }
+    count &= ~TICK_FLAGS;
+    out.resize(count);
+    if (!co_await readBytes(c, (char*)out.data(), count * sizeof(Command))) co_return false;
+    // its tick is in, it is not the one the match waits for (liveness.h)
+    watchConnection(c.fd, LIVE_PAUSED);
+    co_return true;
+}
+
+// HandleMatch on the executor. true when the match ended with EndGame
+static Task<bool> playMatch(Connection* players[2], MatchAck acks[2], int roomId) {
+    TickProcessor ticks;
+    ticks.setMatchId(roomId);
+    addMetric(g_Metrics.matchesStarted, 1);
+    for (int i = 0; i < 2; ++i) watchConnection(players[i]->fd, LIVE_MATCH);
+    cout << "[GAME_INSTANCE] Match Started: " << players[0]->fd << " vs " << players[1]->fd << endl;
+
+    //HANDSHAKE (player id, then the accepted features for clients that asked).
+    // No delay needed here, the id just waits in the socket until the client reads it
+    uint32_t features[2];
+    for (uint32_t i = 0; i < 2; ++i) {
+        // UDP matches need their own blocking loop, so this mode always stays on TCP
+        features[i] = acks[i].features & MATCH_FEATURE_TICKS;
+        if (g_Config.compressFrames) features[i] |= acks[i].features & MATCH_FEATURE_COMPRESS;
+        iovec iov[2] = {
+            {&i, sizeof(i)},
+            {&features[i], sizeof(features[i])},
+        };
+        players[i]->send(iov, acks[i].extended ? 2 : 1);
+    }
+
+    pmr::vector<Command> requests[2] = {pmr::vector<Command>(ticks.memory()), pmr::vector<Command>(ticks.memory())};
+    pmr::vector<Command> frame(ticks.memory());
+    PackedFrame packed(ticks.memory());
+    bool game_over = false;
+    while (!game_over) {
+        bool lost = false;
+        for (int i = 0; i < 2 && !lost; ++i) lost = !co_await readFrame(*players[i], i, ticks, requests[i]);
+        if (lost) break;
+
+        // no span may cross a co_await, the reads above can't be traced here
+        {
+            TRACE_SPAN("process", players[0]->fd);
+            game_over = ticks.buildFrame(requests, frame);
+            packed.build(frame, (features[0] | features[1]) & MATCH_FEATURE_COMPRESS, g_Config.compressMinBytes, ticks.frameNumber());
+        }
+        // over --match-memory-mb, both lobby sessions find their connection shut down
+        if (ticks.memoryExceeded()) {
+            for (int i = 0; i < 2; ++i) shutdown(players[i]->fd, SHUT_RDWR);
+            game_over = false;
+            break;
+        }
+        {
+            TRACE_SPAN("broadcast", players[0]->fd);
+            for (int i = 0; i < 2; ++i) {
+                iovec iov[2];
+                players[i]->send(iov, packed.parts(frame, features[i], iov));
+                watchConnection(players[i]->fd, LIVE_MATCH);
+            }
+        }
+        ticks.frameSent(frame);
+    }
+
+    ticks.report();
+    co_return game_over;
+}
+
+// CREATE: wait for a joiner, run the ACK handshake and the match, then back to the lobby.
+// false when the handshake failed and the host's session has to end
+static Task<bool> hostRoom(Connection& c, LobbyWriter& reply) {
+    int id = createRoom(c.fd);
+    CoRoom& room = g_CoRooms[id];
+    room.host = &c;
+    c.sendReply(reply.created(id));
+
+    // JOIN wakes our input, so does anything the host sends or a disconnect
+    while (!room.joiner && !c.eof) co_await c.input;
+    if (!room.joiner) {
+        closeRoom(id);
+        g_CoRooms.erase(id);
+        co_return true;
+    }
+
+    Connection* players[2] = {&c, room.joiner};
+    for (int i = 0; i < 2; ++i) watchConnection(players[i]->fd, LIVE_HANDSHAKE);
+    c.sendReply(reply.matchStart());
+
+    MatchAck acks[2];
+    bool ready = true;
+    for (int i = 0; i < 2 && ready; ++i) {
+        string_view ack;
+        LobbyRequest req;
+        // PONGs for heartbeats sent before MATCH_START may come first
+        req.cmd = LOBBY_PONG;
+        while (ready && (req.cmd == LOBBY_PONG || req.cmd == LOBBY_PING)) {
+            ready = co_await readMessage(*players[i], ack);
+            if (ready && !parseRequest(players[i]->reader.format(), ack, req)) req.cmd = LOBBY_PONG; // blank line
+        }
+        if (ready) acks[i] = players[i]->reader.format() == LOBBY_BINARY ? req.ack : parseMatchAck(ack);
+        else cerr << "[LOBBY] " << (i == 0 ? "Host " : "Joiner ") << players[i]->fd << " disconnected during ACK handshake." << endl;
+    }
+
+    if (!ready) {
+        // like abortHandshake: nobody plays in this room, and an ACK that is half read or
+        // still buffered must not be taken for a lobby command. Both sessions wake up to
+        // their sockets shut down and end
+        shutdown(room.joiner->fd, SHUT_RDWR);
+        shutdown(c.fd, SHUT_RDWR);
+        room.aborted = true;
+    }
+
+    if (ready && co_await playMatch(players, acks, id)) {
+        // set the winner in the user data
+        addWin(sessionUser(c.fd));
+        cout << "[GAME_INSTANCE] End Game signal received. Closing match." << endl;
+    }
+
+    cout << "[GAME_INSTANCE] Match ended. Sending broadcast." << endl;
+    closeRoom(id);
+    room.over = true;
+    room.matchOver.wake(); // the joiner drops the room when it wakes up
+    co_return ready;
+}
+
+// JOIN: fill the room and sleep until the host's side of it finished the match.
+// false when the handshake failed and the joiner's session has to end
+static Task<bool> joinRoomTask(Connection& c, int id, LobbyWriter& reply) {
+    auto it = g_CoRooms.find(id);
+    if (it == g_CoRooms.end() || it->second.joiner || !joinRoom(id, c.fd, c.reader.format())) {
+        c.sendReply(reply.error(LOBBY_ERROR_GAME_FULL));
+        co_return true;
+    }
+    CoRoom& room = it->second;
+    watchConnection(c.fd, LIVE_HANDSHAKE); // no PING may follow MATCH_START
+    c.sendReply(reply.matchStart());
+    room.joiner = &c;
+    room.host->input.wake();
+
+    while (!room.over) co_await room.matchOver;
+    bool backToLobby = !room.aborted;
+    g_CoRooms.erase(id);
+    co_return backToLobby;
+}
+
+// HandleClientLobby as a coroutine: one per connection, for its whole life
+static Task<> LobbySession(Connection& c) {
+    int mySock = c.fd;
+    LobbyWriter reply;
+    c.sendReply(reply.welcome());
+
+    // the first byte picks the protocol, like RunLobbySession
+    while (!c.reader.buffered() && !c.eof) co_await c.input;
+    if (c.reader.buffered() && (uint8_t)c.reader.peek()[0] == LOBBY_BINARY_HELLO) {
+        c.reader.consume(1);
+        c.reader.setFormat(LOBBY_BINARY);
+        reply.format = LOBBY_BINARY;
+        c.sendReply(reply.welcome());
+    }
+
+    string_view line;
+    bool inLobby = true;
+    TokenBucket input(g_Config.lobbyBytesPerSec, g_Config.lobbyBytesBurst);
+    watchConnection(mySock, LIVE_LOBBY);
+    while (inLobby) {
+        // replies the client has not taken yet hold back its next commands
+        while (c.sendsOut > 0 && !c.eof) co_await c.input;
+        if (!co_await readMessage(c, line)) break;
+        if (!input.take(line.size() + (reply.format == LOBBY_BINARY ? LOBBY_FRAME_HEADER : 1))) {
+            c.sendReply(reply.error(LOBBY_ERROR_TOO_MUCH_INPUT));
+            if (!c.flooded) addMetric(g_Metrics.inputFloodDisconnects, 1); // the executor may have counted it
+            break;
+        }
+
+        LobbyRequest req;
+        if (!parseRequest(reply.format, line, req)) continue; // blank line
+        LobbyCommand cmd = req.cmd;
+        if (cmd == LOBBY_PONG) continue; // our heartbeat came back, the executor saw the bytes
+        logRequest(mySock, reply.format, line);
+
+        if (cmd == LOBBY_PING) {
+            c.sendReply(reply.pong());
+            continue;
+        }
+        if (cmd == LOBBY_REGISTER) {
+            c.sendReply(registerUser(mySock, string(req.arg), reply));
+            continue;
+        }
+        if (!isRegistered(mySock)) {
+            c.sendReply(reply.error(LOBBY_ERROR_NOT_REGISTERED));
+            continue;
+        }
+        if (req.bad) {
+            c.sendReply(reply.error(LOBBY_ERROR_BAD_REQUEST));
+            continue;
+        }
+
+        // line and req.arg point into the reader, take what we need before the next co_await
+        switch (cmd) {
+        case LOBBY_LIST:
+            c.sendReply(listGames(reply));
+            break;
+        case LOBBY_CREATE:
+            inLobby = co_await hostRoom(c, reply);
+            watchConnection(mySock, LIVE_LOBBY);
+            break;
+        case LOBBY_JOIN:
+            inLobby = co_await joinRoomTask(c, req.room, reply);
+            watchConnection(mySock, LIVE_LOBBY);
+            break;
+        case LOBBY_CHAT: {
+            UserId user = sessionUser(mySock);
+            if (!allowChat(user)) {
+                c.sendReply(reply.error(LOBBY_ERROR_SLOW_DOWN));
+                break;
+            }
+            c.sendReply(reply.echo(req.arg));
+            pthread_mutex_lock(&g_LobbyMutex);
+            string name = userName(user);
+            pthread_mutex_unlock(&g_LobbyMutex);
+            broadcastChat(name, req.arg);
+            break;
+        }
+        case LOBBY_LEADERBOARD:
+            c.sendReply(generateLeaderboard(reply));
+            break;
+        case LOBBY_STATS:
+            c.sendReply(reply.stats(formatMetrics() + formatMatchMemory()));
+            break;
+        case LOBBY_TRACE:
+            c.sendReply(reply.trace(RequestTrace(mySock)));
+            break;
+        case LOBBY_EXIT:
+            c.sendReply(reply.goodbye());
+            inLobby = false;
+            break;
+        case LOBBY_UNREGISTER:
+            c.sendReply(reply.unregistered());
+            removeUser(sessionUser(mySock));
+            inLobby = false;
+            break;
+        default:
+            c.sendReply(reply.error(LOBBY_ERROR_UNKNOWN_COMMAND));
+        }
+    }
+
+    if (c.reader.overflowed()) c.sendReply(reply.error(LOBBY_ERROR_TOO_LONG));
+
+    // the fd is about to be reused by the next accept, so forget whoever was on it
+    pthread_mutex_lock(&g_LobbyMutex);
+    logOut(mySock);
+    pthread_mutex_unlock(&g_LobbyMutex);
+    g_Executor->release(c);
+}
+
+// the heartbeat of a lobby connection, queued behind its replies
+static void pingConnection(int sock) {
+    auto it = g_Executor->connections().find(sock);
+    if (it == g_Executor->connections().end()) return;
+    static LobbyWriter writers[2] = { LobbyWriter(LOBBY_TEXT), LobbyWriter(LOBBY_BINARY) };
+    it->second->sendReply(writers[it->second->reader.format()].ping());
+}
+
+void RunCoroutineServer(IoBackend& io) {
+    Executor executor(io);
+    StartLiveness(pingConnection, false); // the executor's loop runs the timers
+    executor.run(LobbySession);
+}
@@ -0,0 +1,14 @@
+#ifndef SESSION_TASKS_H
+#define SESSION_TASKS_H
+
+#include "io_backend.h"
+
+// --coroutines: the lobby (HandleClientLobby) and the TCP match (HandleMatch)
+// as coroutines on one thread (executor.h) instead of a pthread per client.
+// Same text protocol and match wire format. Matches always stay on TCP here,
+// a client asking for UDP gets an accepted mask of 0.
+//
+// Takes over the calling thread for good, io must already watch the listening socket
+void RunCoroutineServer(IoBackend& io);
+
+#endif
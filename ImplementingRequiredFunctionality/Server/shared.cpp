@@ -1,12 +1,19 @@
 #include "shared.h"
+#include "lobby.h"
+#include "output_queue.h"
+#include "trace.h"
 vector<GameRoom> g_Games;
-unordered_map<string, User> g_AllUsers; //maps username to user
-unordered_map<int, User> connected_Users; // maps socket to users
+vector<User> g_Users;
+deque<uint32_t> g_FreeUsers;
+unordered_map<string, UserId> g_UserIds;
+vector<UserId> connected_Users;
 pthread_mutex_t g_LobbyMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_MatchOverCond = PTHREAD_COND_INITIALIZER;
+ServerConfig g_Config;
 
-bool SendText(int sock, string msg){
-    msg += "\n";
-    return send(sock, msg.c_str(), msg.length(), 0) > 0;
+bool SendReply(int sock, string_view reply){
+    // never blocks, a client that doesn't read gets queued (output_queue.h)
+    return outboxSend(sock, reply, false);
 }
 
 static bool readString(FILE* fd, std::string& str) {
@@ -30,6 +37,7 @@ static bool writeString(FILE* fd, const std::string& str) {
 void getAllUsers(){
     //if file exists, load from file
     //else return empty map
+    TRACE_SPAN("load-users", 0);
     string fname = "users.bin";
     FILE* fd = fopen(fname.c_str(),"rb");
     if(!fd){
@@ -57,8 +65,7 @@ void getAllUsers(){
             return;
         }
         
-        // Insert into map using username as the key
-        g_AllUsers[u.username] = u;
+        internUser(u.username, u.numWins);
     }
 
     fclose(fd);
@@ -66,6 +73,7 @@ void getAllUsers(){
 }
 
 void saveAllUsers() {
+    TRACE_SPAN("save-users", (int32_t)g_UserIds.size());
     string fname = "users.bin";
     
     // Use "wb" (write binary)
@@ -76,15 +84,15 @@ void saveAllUsers() {
     }
 
     // 1. Write the number of elements in the map
-    uint32_t mapSize = g_AllUsers.size();
+    uint32_t mapSize = g_UserIds.size();
     if (fwrite(&mapSize, sizeof(mapSize), 1, fd) != 1) {
         fclose(fd);
         return;
     }
     
     // 2. Write each user sequentially
-    for (const auto& pair : g_AllUsers) {
-        const User& u = pair.second;
+    for (const User& u : g_Users) {
+        if (u.removed) continue;
         
         // A. Write the username (string helper handles length + data)
         if (!writeString(fd, u.username)) {
@@ -102,6 +110,55 @@ void saveAllUsers() {
     // Clean up
     fclose(fd);
 }
+static UserId slotId(uint32_t slot) {
+    return makeUserId(slot, g_Users[slot].generation);
+}
+
+UserId internUser(const string& name, int numWins, bool* created) {
+    if (created) *created = false;
+    auto it = g_UserIds.find(name);
+    if (it != g_UserIds.end()) return it->second;
+    uint32_t slot;
+    if (!g_FreeUsers.empty()) {
+        slot = g_FreeUsers.front();
+        g_FreeUsers.pop_front();
+        User& u = g_Users[slot];
+        u.username = name;
+        u.numWins = numWins;
+        u.removed = false;
+        u.generation++; // a removed user's sessions must not find the new one
+    } else {
+        if (g_Users.size() >= MAX_USERS) return NO_USER;
+        slot = g_Users.size();
+        g_Users.push_back(User{name, numWins});
+    }
+    UserId id = slotId(slot);
+    g_UserIds.emplace(name, id);
+    if (created) *created = true;
+    return id;
+}
+
+User* findUser(UserId id) {
+    uint32_t slot = userSlot(id);
+    if (id == NO_USER || slot >= g_Users.size()) return nullptr;
+    User& u = g_Users[slot];
+    if (u.removed || u.generation != userGeneration(id)) return nullptr;
+    return &u;
+}
+
+UserId loggedInUser(int sock) {
+    return sock >= 0 && (size_t)sock < connected_Users.size() ? connected_Users[sock] : NO_USER;
+}
+
+void logIn(int sock, UserId id) {
+    if ((size_t)sock >= connected_Users.size()) connected_Users.resize(sock + 1, NO_USER);
+    connected_Users[sock] = id;
+}
+
+void logOut(int sock) {
+    if (sock >= 0 && (size_t)sock < connected_Users.size()) connected_Users[sock] = NO_USER;
+}
+
 bool isInGame(int sock){ // checks if the socket is in an active game
     for(const auto& game : g_Games){
         if(game.isActive){
@@ -112,13 +169,18 @@ bool isInGame(int sock){ // checks if the socket is in an active game
     }
     return false;
 }
-void sendToAllInLobby(const string& message){ //Assumes that I have a mutex
-    cout << "[LOBBY] Broadcasting to all in lobby: " << message << endl;
-    for(const auto& pair : connected_Users){
-        cout << "[LOBBY] Sending to " << pair.second.username << ": " << message << endl;
-        int sock = pair.first;
+void sendToAllInLobby(string_view from, string_view message){ //Assumes that I have a mutex
+    cout << "[LOBBY] Broadcasting to all in lobby: CHAT " << from << ": " << message << endl;
+    // encoded once per format, not per user
+    static thread_local LobbyWriter writers[2] = { LobbyWriter(LOBBY_TEXT), LobbyWriter(LOBBY_BINARY) };
+    string_view encoded[2];
+    for(int sock = 0; sock < (int)connected_Users.size(); sock++){
+        if(connected_Users[sock] == NO_USER) continue;
+        cout << "[LOBBY] Sending to " << userName(connected_Users[sock]) << endl;
         if(sock && !isInGame(sock)){
-            SendText(sock, message);
+            LobbyFormat format = outboxFormat(sock);
+            if (encoded[format].empty()) encoded[format] = writers[format].chat(from, message);
+            outboxSend(sock, encoded[format], true); // CHAT is what a slow client may miss
         }
     }
 }
@@ -2,6 +2,8 @@
 #define SHARED_H
 
 #include <vector>
+#include <deque>
+#include <memory_resource>
 #include <string>
 #include <pthread.h>
 #include <cstdint>
@@ -11,20 +13,70 @@
 #include <cstring>
 #include <iostream>
 #include <sys/socket.h>
+#include "lobby_protocol.h"
 
 using namespace std;
 
 //  RTS PROTOCOL STRUCTURES 
 #pragma pack(push, 1)
 struct Command {
-    uint32_t unit_id;      // 0 means no id yet 
-    uint32_t command_type; // 1=Move, 2=Attack, 3=Place, 4=EndGame
+    uint32_t unit_id;      // 0 means no id yet, owner is unit_id / UNIT_SLOTS_PER_PLAYER (unit_ids.h)
+    uint32_t command_type; // 1=Move, 2=Attack, 3=Place, 4=EndGame, 5=UnitDied
     uint32_t unit_type;    // Used only for place command
     double target_x;
     double target_y;
 };
 #pragma pack(pop)
 
+const uint32_t COMMAND_TYPE_MOVE = 1;
+const uint32_t COMMAND_TYPE_ATTACK = 2;
+const uint32_t COMMAND_TYPE_PLACE = 3;
+const uint32_t COMMAND_TYPE_END_GAME = 4;
+const uint32_t COMMAND_TYPE_UNIT_DIED = 5;
+
+// Set in the count a client sends with its tick: a uint64 hash of its game state
+// after the last frame it applied follows the count, before the commands.
+// The server compares both players' hashes to catch desyncs (tick_processor.h)
+const uint32_t TICK_HAS_HASH = 0x80000000u;
+// Set by clients that got MATCH_FEATURE_TICKS: the uint32 number of the frame the
+// commands are for comes right after the count (before the hash). Frames count from 1
+const uint32_t TICK_HAS_TAG = 0x40000000u;
+const uint32_t TICK_FLAGS = TICK_HAS_HASH | TICK_HAS_TAG;
+
+//  SERVER OPTIONS (set from the command line in main.cpp)
+struct ServerConfig {
+    int port = 8080;
+    bool compactTicks = false; // coalesce each tick's commands before broadcast (tick_compaction.h)
+    bool validateCommands = true; // anti-cheat checks on every received command (command_validation.h)
+    double mapWidth = 65536;  // positions are clamped to [0, mapWidth] x [0, mapHeight]
+    double mapHeight = 65536;
+    uint32_t maxCommandsPerTick = 512; // per player, the rest of a tick is dropped
+    bool allowUdp = false; // matches may run over UDP when both players ask (udp_lockstep.h)
+    string ioBackend = "blocking"; // blocking, epoll or uring for accept and TCP matches (io_backend.h)
+    bool simulate = false; // headless model of each match that drops orders its state does not allow (match_sim.h)
+    bool coroutines = false; // every session and match as a coroutine on the main thread (session_tasks.h)
+    int workers = 1; // processes sharing the port and the lobby (shared_lobby.h)
+    int resumeFd = -1; // set in a process started by a hot restart (hot_restart.h)
+    size_t outQueueBytes = 256 * 1024; // caps of every connection's output queue (output_queue.h)
+    size_t outQueueFrames = 256;
+    int slowPlayerMs = 3000; // a player whose queue does not move this long is disconnected
+    string slowLobby = "coalesce"; // drop, coalesce or disconnect lobby connections with a full queue
+    int heartbeatMs = 10000; // a silent lobby connection gets a PING after this long (liveness.h)
+    int idleTimeoutMs = 30000; // lobby connections and players silent this long are disconnected
+    int handshakeTimeoutMs = 10000; // from MATCH_START until the match runs
+    bool compressFrames = true; // players that ask get big tick frames packed (frame_codec.h)
+    size_t compressMinBytes = 512; // smaller frames always go out as they are
+    // what one client may cost (rate_limit.h)
+    uint32_t maxTickCommands = 4096; // a tick upload with more is refused before anything is allocated
+    double commandsPerSec = 20000;   // per player, commands over it are dropped. 0 is no limit
+    double chatPerSec = 2;           // CHAT lines of one user
+    double chatBurst = 10;
+    double lobbyBytesPerSec = 16384; // a lobby connection sending more is disconnected
+    double lobbyBytesBurst = 65536;
+    size_t matchMemoryLimit = 64 << 20; // heap one match may hold before it is ended, 0 is no limit (match_memory.h)
+    string tracePath; // span timeline written by the TRACE command, empty when tracing is off (trace.h)
+};
+
 //  LOBBY STRUCTURES 
 struct GameRoom {
     int id;
@@ -32,38 +84,77 @@ struct GameRoom {
     int joinerSocket;
     bool isFull;
     bool isActive;
-    pthread_cond_t gameOverCond = PTHREAD_COND_INITIALIZER;
+    string joinerPending; // lobby bytes the joiner sent past JOIN, when it came from another worker
+    LobbyFormat joinerFormat = LOBBY_TEXT; // the host's thread reads the joiner's ACK
 };
 
+// One layout for both user tables: the slot in the low USER_SLOT_BITS, the slot's
+// generation above, so an old session of a removed user can't credit whoever gets
+// the slot next. The slot indexes g_Users, with --workers the shared table (shared_lobby.h)
+typedef uint32_t UserId;
+typedef uint8_t UserGeneration; // bumped when a slot is taken again
+const UserId NO_USER = UINT32_MAX;
+const int USER_SLOT_BITS = 24;
+const uint32_t USER_SLOT_MASK = (1u << USER_SLOT_BITS) - 1;
+// the last slot is never handed out, at generation 255 its id would be NO_USER
+const uint32_t MAX_USERS = USER_SLOT_MASK;
+static_assert(USER_SLOT_BITS + 8 * sizeof(UserGeneration) == 8 * sizeof(UserId), "a UserId is slot and generation");
+
+inline UserId makeUserId(uint32_t slot, UserGeneration generation) {
+    return slot | (UserId)generation << USER_SLOT_BITS;
+}
+inline uint32_t userSlot(UserId id) { return id & USER_SLOT_MASK; }
+inline UserGeneration userGeneration(UserId id) { return id >> USER_SLOT_BITS; }
+
 struct User {
     string username;
     int numWins;
+    bool removed = false; // UNREGISTER, the slot goes on g_FreeUsers
+    UserGeneration generation = 0;
 };
 
 
 //  GLOBAL SHARED STATE 
 //USER MANAGEMENT
-extern unordered_map<string, User> g_AllUsers; //maps username to user
-extern unordered_map<int, User> connected_Users; // maps socket to user
+extern vector<User> g_Users;                  // by slot
+extern deque<uint32_t> g_FreeUsers;           // removed slots, oldest first so generations wrap late
+extern unordered_map<string, UserId> g_UserIds; // live names only, looked up at REGISTER and nowhere else
+extern vector<UserId> connected_Users;        // by socket, NO_USER when nobody is logged in on it
 // use both g_games and connected_Users to figure out who is in lobby
 
 
 //GAME MANAGEMENT
 extern vector<GameRoom> g_Games;
 
+extern ServerConfig g_Config;
+
 //MULTITHREADING MANAGEMENT
 extern pthread_mutex_t g_LobbyMutex;
+// broadcast with g_LobbyMutex held whenever a room stops being active
+extern pthread_cond_t g_MatchOverCond;
 
 // Method to load and save userState
 void getAllUsers();
 void saveAllUsers();
 
-//method to send message to all users in lobby
-void sendToAllInLobby(const string& message);
+// all of these want g_LobbyMutex held
+// id of name, added with numWins if it is new. NO_USER when the table is full
+UserId internUser(const string& name, int numWins, bool* created = nullptr);
+// the user behind id, null when it was removed
+User* findUser(UserId id);
+UserId loggedInUser(int sock);
+void logIn(int sock, UserId id);
+void logOut(int sock);
+
+//method to send a CHAT line to all users in lobby, each in its own format
+void sendToAllInLobby(string_view from, string_view message);
+// true while sock is the host or joiner of an active room
+bool isInGame(int sock);
 
 
 //helpers for all
-bool SendText(int sock, string msg);
+// one reply built with a LobbyWriter (lobby_protocol.h)
+bool SendReply(int sock, string_view reply);
 
 
 #endif // SHARED_H
\ No newline at end of file
@@ -0,0 +1,368 @@
+#include "shared_lobby.h"
+#include "lobby.h"
+#include "line_reader.h"
+#include <iostream>
+#include <array>
+#include <new>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+SharedLobby* g_SharedLobby = nullptr;
+int g_WorkerId = -1;
+
+// handoff socket pair per worker: worker i receives on [i][0], everyone sends on [i][1].
+// Created before the fork, so every process has the same descriptors
+static vector<array<int, 2>> g_Handoff;
+
+enum HandoffKind : uint8_t {
+    HANDOFF_JOINER = 0, // a socket comes with it
+    HANDOFF_CHAT,       // pendingLen bytes of sender name, the text after them
+};
+
+struct HandoffHeader {
+    int32_t roomId;
+    uint32_t user; // UserId, the same slot in every worker
+    uint32_t pendingLen;
+    uint8_t format; // LobbyFormat the joiner negotiated
+    uint8_t kind;
+};
+
+// the biggest message: a CHAT line with its sender
+static const size_t HANDOFF_MAX_MESSAGE = sizeof(HandoffHeader) + max(HANDOFF_MAX_PENDING, SHARED_NAME_MAX + LineReader::MAX_LINE);
+
+static void lockShared() {
+    // a worker died holding the lock: the tables are only ever changed a field at
+    // a time, take them over as they are
+    if (pthread_mutex_lock(&g_SharedLobby->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&g_SharedLobby->mutex);
+}
+
+static void unlockShared() {
+    pthread_mutex_unlock(&g_SharedLobby->mutex);
+}
+
+static uint32_t nameHash(const string& name) {
+    uint32_t h = 2166136261u; // FNV-1a
+    for (unsigned char c : name) h = (h ^ c) * 16777619u;
+    return h;
+}
+
+// slot of name, or where it would go (first removed slot on the way, else the
+// first never used one). -1 when the table is full. Lock held
+static int findUserSlot(const string& name, bool& found) {
+    found = false;
+    int reuse = -1;
+    uint32_t mask = SHARED_MAX_USERS - 1;
+    uint32_t at = nameHash(name) & mask;
+    for (uint32_t probe = 0; probe < SHARED_MAX_USERS; probe++, at = (at + 1) & mask) {
+        SharedUser& u = g_SharedLobby->users[at];
+        if (!u.used) return reuse >= 0 ? reuse : (int)at;
+        if (u.removed) {
+            if (reuse < 0) reuse = at;
+        } else if (name == u.name) {
+            found = true;
+            return at;
+        }
+    }
+    return reuse;
+}
+
+// slot of name, added with 0 wins if it is new. -1 when it does not fit. Lock held
+static int loginSlot(const string& name) {
+    if (name.size() >= SHARED_NAME_MAX) return -1;
+    bool found;
+    int slot = findUserSlot(name, found);
+    if (slot >= 0 && !found) {
+        SharedUser& u = g_SharedLobby->users[slot];
+        memcpy(u.name, name.c_str(), name.size() + 1);
+        u.numWins = 0;
+        if (u.used) u.generation++; // a removed user's sessions must not find the new one
+        u.used = 1;
+        u.removed = 0;
+        g_SharedLobby->userCount++;
+    }
+    return slot;
+}
+
+bool CreateSharedLobby(int workers) {
+    void* mem = mmap(NULL, sizeof(SharedLobby), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) return false;
+    g_SharedLobby = new (mem) SharedLobby(); // zeroed by mmap, the constructor keeps it that way
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&g_SharedLobby->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    g_SharedLobby->nextRoomId = 1;
+
+    for (const User& u : g_Users) {
+        if (u.removed) continue;
+        int slot = loginSlot(u.username);
+        if (slot < 0) {
+            cerr << "[LOBBY] User " << u.username << " does not fit the shared user table, skipped" << endl;
+            continue;
+        }
+        g_SharedLobby->users[slot].numWins = u.numWins;
+    }
+
+    g_Handoff.resize(workers);
+    for (auto& pair : g_Handoff) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pair.data()) < 0) return false;
+    }
+    return true;
+}
+
+void ExportSharedUsers() {
+    lockShared();
+    g_Users.clear();
+    g_FreeUsers.clear();
+    g_UserIds.clear();
+    for (const SharedUser& u : g_SharedLobby->users) {
+        if (u.used && !u.removed) internUser(u.name, u.numWins);
+    }
+    unlockShared();
+}
+
+static UserId slotId(int slot) {
+    return makeUserId(slot, g_SharedLobby->users[slot].generation);
+}
+
+// the slot behind id, null when its user is gone. Lock held
+static SharedUser* idSlot(UserId id) {
+    uint32_t slot = userSlot(id);
+    if (id == NO_USER || slot >= SHARED_MAX_USERS) return nullptr;
+    SharedUser& u = g_SharedLobby->users[slot];
+    if (!u.used || u.removed || u.generation != userGeneration(id)) return nullptr;
+    return &u;
+}
+
+UserId sharedLogin(const string& name, int& numWins, bool& created) {
+    lockShared();
+    uint32_t before = g_SharedLobby->userCount;
+    int slot = loginSlot(name);
+    UserId id = NO_USER;
+    if (slot >= 0) {
+        numWins = g_SharedLobby->users[slot].numWins;
+        id = slotId(slot);
+    }
+    created = g_SharedLobby->userCount != before;
+    unlockShared();
+    return id;
+}
+
+void sharedAddWin(UserId id) {
+    lockShared();
+    if (SharedUser* u = idSlot(id)) u->numWins += 1;
+    unlockShared();
+}
+
+void sharedRemoveUser(UserId id) {
+    lockShared();
+    if (SharedUser* u = idSlot(id)) {
+        u->removed = 1;
+        g_SharedLobby->userCount--;
+    }
+    unlockShared();
+}
+
+string sharedUserName(UserId id) {
+    string name;
+    lockShared();
+    if (SharedUser* u = idSlot(id)) name = u->name;
+    unlockShared();
+    return name;
+}
+
+vector<User> sharedUsers() {
+    vector<User> users;
+    lockShared();
+    users.reserve(g_SharedLobby->userCount);
+    for (const SharedUser& u : g_SharedLobby->users) {
+        if (u.used && !u.removed) users.push_back(User{ u.name, u.numWins });
+    }
+    unlockShared();
+    return users;
+}
+
+int sharedCreateRoom() {
+    int id = -1;
+    lockShared();
+    for (SharedRoom& room : g_SharedLobby->rooms) {
+        if (room.state != SHARED_ROOM_FREE) continue;
+        id = g_SharedLobby->nextRoomId++;
+        room.id = id;
+        room.worker = g_WorkerId;
+        room.state = SHARED_ROOM_WAITING;
+        break;
+    }
+    unlockShared();
+    return id;
+}
+
+int sharedJoinRoom(int id) {
+    int worker = -1;
+    lockShared();
+    for (SharedRoom& room : g_SharedLobby->rooms) {
+        if (room.id == id && room.state == SHARED_ROOM_WAITING) {
+            room.state = SHARED_ROOM_FULL;
+            worker = room.worker;
+            break;
+        }
+    }
+    unlockShared();
+    return worker;
+}
+
+static bool setRoomState(int id, uint8_t from, uint8_t to) {
+    bool found = false;
+    lockShared();
+    for (SharedRoom& room : g_SharedLobby->rooms) {
+        if (room.id == id && room.state == from) {
+            room.state = to;
+            found = true;
+            break;
+        }
+    }
+    unlockShared();
+    return found;
+}
+
+void sharedReopenRoom(int id) {
+    setRoomState(id, SHARED_ROOM_FULL, SHARED_ROOM_WAITING);
+}
+
+void sharedCloseRoom(int id) {
+    setRoomState(id, SHARED_ROOM_FULL, SHARED_ROOM_FREE);
+}
+
+bool sharedCancelRoom(int id) {
+    return setRoomState(id, SHARED_ROOM_WAITING, SHARED_ROOM_FREE);
+}
+
+vector<int> sharedWaitingRooms() {
+    vector<int> ids;
+    lockShared();
+    for (const SharedRoom& room : g_SharedLobby->rooms) {
+        if (room.state == SHARED_ROOM_WAITING) ids.push_back(room.id);
+    }
+    unlockShared();
+    return ids;
+}
+
+bool SendJoinerToWorker(int worker, int sock, int roomId, UserId user, LobbyFormat format, string_view pending) {
+    if (worker < 0 || worker >= (int)g_Handoff.size() || pending.size() > HANDOFF_MAX_PENDING)
+        return false;
+
+    HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    header.roomId = roomId;
+    header.user = user;
+    header.pendingLen = pending.size();
+    header.format = format;
+    header.kind = HANDOFF_JOINER;
+    iovec iov[2] = {
+        { &header, sizeof(header) },
+        { (void*)pending.data(), pending.size() },
+    };
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+    return sendmsg(g_Handoff[worker][1], &msg, MSG_NOSIGNAL) == (ssize_t)(sizeof(header) + pending.size());
+}
+
+void SendChatToWorkers(string_view from, string_view text) {
+    HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    header.pendingLen = from.size();
+    header.kind = HANDOFF_CHAT;
+    iovec iov[3] = {
+        { &header, sizeof(header) },
+        { (void*)from.data(), from.size() },
+        { (void*)text.data(), text.size() },
+    };
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    for (int worker = 0; worker < (int)g_Handoff.size(); worker++) {
+        if (worker == g_WorkerId) continue;
+        // never wait on a busy worker from a lobby thread
+        if (sendmsg(g_Handoff[worker][1], &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+            cerr << "[LOBBY] CHAT did not reach worker " << worker << ": " << strerror(errno) << endl;
+    }
+}
+
+// CHAT from another worker, for the lobby connections of this one
+static void receiveChat(const HandoffHeader& header, string_view body) {
+    if (header.pendingLen > body.size()) return;
+    string_view from = body.substr(0, header.pendingLen);
+    string_view text = body.substr(header.pendingLen);
+    pthread_mutex_lock(&g_LobbyMutex);
+    sendToAllInLobby(from, text);
+    pthread_mutex_unlock(&g_LobbyMutex);
+}
+
+static void* HandoffListener(void*) {
+    int in = g_Handoff[g_WorkerId][0];
+    vector<char> buffer(HANDOFF_MAX_MESSAGE);
+    while (true) {
+        char control[CMSG_SPACE(sizeof(int))];
+        iovec iov = { buffer.data(), buffer.size() };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t r = recvmsg(in, &msg, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            cerr << "[LOBBY] Handoff socket failed, no more joiners from other workers" << endl;
+            return NULL;
+        }
+
+        int sock = -1;
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&sock, CMSG_DATA(cmsg), sizeof(int));
+        HandoffHeader header;
+        if ((size_t)r < sizeof(header)) {
+            if (sock >= 0) close(sock);
+            continue;
+        }
+        memcpy(&header, buffer.data(), sizeof(header));
+        if (header.kind == HANDOFF_CHAT) {
+            if (sock >= 0) close(sock);
+            receiveChat(header, string_view(buffer.data() + sizeof(header), r - sizeof(header)));
+            continue;
+        }
+        if (sock < 0) continue;
+        size_t pending = min((size_t)header.pendingLen, (size_t)r - sizeof(header));
+        LobbyFormat format = header.format == LOBBY_BINARY ? LOBBY_BINARY : LOBBY_TEXT;
+        AdoptJoiner(sock, header.roomId, header.user, format, string_view(buffer.data() + sizeof(header), pending));
+    }
+}
+
+void StartHandoffListener() {
+    pthread_t t;
+    if (pthread_create(&t, NULL, HandoffListener, NULL) == 0) pthread_detach(t);
+    else cerr << "[LOBBY] Could not start the handoff thread" << endl;
+}
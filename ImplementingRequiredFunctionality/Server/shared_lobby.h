@@ -0,0 +1,90 @@
+#ifndef SHARED_LOBBY_H
+#define SHARED_LOBBY_H
+
+#include "shared.h"
+#include <string_view>
+
+// --workers N: the server forks N processes that each accept on the same port
+// (SO_REUSEPORT, the kernel spreads new connections over them). Users and rooms
+// live in one MAP_SHARED segment created before the fork, behind a process shared
+// mutex, so every worker sees the same names, wins and waiting rooms.
+// Sessions and matches stay in the process that accepted them. A JOIN that
+// lands on another worker than the room's host passes the joiner's socket to the
+// host's worker (SCM_RIGHTS over a Unix socket), the match and the joiner's
+// lobby session continue there. CHAT lines go over the same sockets to every
+// other worker, which passes them on to its own lobby connections.
+
+const size_t SHARED_NAME_MAX = 64;        // bytes of a username, including the terminating 0
+const uint32_t SHARED_MAX_USERS = 16384;  // power of two, open addressing by name hash
+static_assert(SHARED_MAX_USERS <= MAX_USERS, "a shared slot has to fit a UserId");
+const uint32_t SHARED_MAX_ROOMS = 4096;
+const size_t HANDOFF_MAX_PENDING = 4096;  // lobby bytes read past the JOIN line that can follow the socket
+
+enum SharedRoomState : uint8_t {
+    SHARED_ROOM_FREE = 0,
+    SHARED_ROOM_WAITING,
+    SHARED_ROOM_FULL,
+};
+
+struct SharedUser {
+    char name[SHARED_NAME_MAX];
+    int32_t numWins;
+    uint8_t used;    // slot was ever taken, lookups probe past it
+    uint8_t removed; // UNREGISTER, the slot can be taken again
+    UserGeneration generation; // bumped when the slot is taken again, part of the UserId
+};
+
+struct SharedRoom {
+    int32_t id;
+    int32_t worker; // hosting worker
+    uint8_t state;
+};
+
+struct SharedLobby {
+    pthread_mutex_t mutex; // process shared and robust, a crashed worker does not wedge the others
+    int32_t nextRoomId;
+    uint32_t userCount;
+    SharedUser users[SHARED_MAX_USERS];
+    SharedRoom rooms[SHARED_MAX_ROOMS];
+};
+
+extern SharedLobby* g_SharedLobby; // null unless running with --workers
+extern int g_WorkerId;             // index of this worker, -1 in the parent and without --workers
+
+// maps the segment and the handoff sockets, and copies g_Users in. Call before forking
+bool CreateSharedLobby(int workers);
+// copies the shared users back into g_Users, for saveAllUsers in the parent
+void ExportSharedUsers();
+
+// USERS. A UserId here is a slot of this table in the layout of shared.h, so an id
+// held by a session goes stale once its user unregisters and the slot is taken by
+// someone else. Only sharedLogin looks at the name.
+// NO_USER when the table is full or the name does not fit
+UserId sharedLogin(const string& name, int& numWins, bool& created);
+void sharedAddWin(UserId id);
+void sharedRemoveUser(UserId id);
+// empty for a stale id
+string sharedUserName(UserId id);
+vector<User> sharedUsers();
+
+// ROOMS. Ids are unique across workers, -1 when the table is full
+int sharedCreateRoom();
+// reserves a waiting room for a joiner, returns the hosting worker or -1
+int sharedJoinRoom(int id);
+// puts a room reserved by sharedJoinRoom back to waiting (the handoff failed)
+void sharedReopenRoom(int id);
+void sharedCloseRoom(int id);
+// a waiting room whose host left, false when a joiner reserved it first
+bool sharedCancelRoom(int id);
+vector<int> sharedWaitingRooms();
+
+// HANDOFF. Passes sock, who it is and what was read past its JOIN line to worker.
+// The caller closes its own copy of sock afterwards
+bool SendJoinerToWorker(int worker, int sock, int roomId, UserId user, LobbyFormat format, string_view pending);
+// a CHAT line for the lobby connections of every other worker. Dropped for a worker
+// whose handoff socket is full, like a slow client misses CHAT
+void SendChatToWorkers(string_view from, string_view text);
+// thread that takes in joiners for the rooms this worker hosts, and other workers' CHAT
+void StartHandoffListener();
+
+#endif
@@ -0,0 +1,27 @@
+#include "spatial_grid.h"
+#include <algorithm>
+
+using namespace std;
+
+SpatialGrid::SpatialGrid(float cellSize, uint32_t bucketBits, pmr::memory_resource* memory)
+    : inverseCell(1.0f / cellSize), mask((1u << bucketBits) - 1), cellStart((1u << bucketBits) + 1, 0, memory),
+      entries(memory), pointBucket(memory) {}
+
+void SpatialGrid::build(const float* xs, const float* ys, uint32_t count) {
+    pointBucket.resize(count);
+    entries.resize(count);
+    fill(cellStart.begin(), cellStart.end(), 0);
+
+    // count per bucket, shifted by one so the prefix sum gives each bucket's start
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t b = bucketOf(cellOf(xs[i]), cellOf(ys[i]));
+        pointBucket[i] = b;
+        cellStart[b + 1]++;
+    }
+    for (size_t b = 1; b < cellStart.size(); b++) cellStart[b] += cellStart[b - 1];
+
+    // scatter, using cellStart[b] as the write cursor and shifting it back afterwards
+    for (uint32_t i = 0; i < count; i++) entries[cellStart[pointBucket[i]]++] = i;
+    for (size_t b = cellStart.size() - 1; b > 0; b--) cellStart[b] = cellStart[b - 1];
+    cellStart[0] = 0;
+}
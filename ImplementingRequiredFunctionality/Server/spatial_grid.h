@@ -0,0 +1,60 @@
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include <cstdint>
+#include <cmath>
+#include <vector>
+#include <memory_resource>
+
+using namespace std;
+
+// Uniform grid over the map, hashed into a fixed number of buckets so its size
+// does not depend on the map size. Rebuilt from scratch every tick with a
+// counting sort: points of one bucket end up next to each other in entries,
+// so a query walks a few short contiguous runs instead of chasing pointers.
+// Different cells can share a bucket, a query may visit points outside the
+// cells it asked for (and the same point twice), callers check the distance.
+class SpatialGrid {
+public:
+    // bucketBits: 2^bucketBits buckets, a few times the usual point count works well
+    SpatialGrid(float cellSize, uint32_t bucketBits, pmr::memory_resource* memory = pmr::get_default_resource());
+
+    // indexes points 0..count-1
+    void build(const float* xs, const float* ys, uint32_t count);
+
+    // calls visit(index) for every point in the buckets of the cells that
+    // overlap the square around (x, y) with half size radius
+    template <class Visit> void query(float x, float y, float radius, Visit&& visit) const {
+        int32_t x0 = cellOf(x - radius), x1 = cellOf(x + radius);
+        int32_t y0 = cellOf(y - radius), y1 = cellOf(y + radius);
+        for (int32_t cy = y0; cy <= y1; cy++) {
+            for (int32_t cx = x0; cx <= x1; cx++) {
+                uint32_t b = bucketOf(cx, cy);
+                for (uint32_t k = cellStart[b]; k < cellStart[b + 1]; k++) visit(entries[k]);
+            }
+        }
+    }
+
+private:
+    float inverseCell;
+    uint32_t mask;
+    pmr::vector<uint32_t> cellStart;     // bucket b holds entries[cellStart[b] .. cellStart[b + 1])
+    pmr::vector<uint32_t> entries;       // point indexes grouped by bucket
+    pmr::vector<uint32_t> pointBucket;   // scratch for build
+
+    // far past any map and exact in a float. Positions are not clamped with --no-validate,
+    // so a huge one (or a NaN) is pinned here before the cast, which would be undefined
+    static constexpr float CELL_LIMIT = 16777216.0f;
+
+    int32_t cellOf(float v) const {
+        float c = floorf(v * inverseCell);
+        if (!(c > -CELL_LIMIT)) return (int32_t)-CELL_LIMIT;
+        if (c > CELL_LIMIT) return (int32_t)CELL_LIMIT;
+        return (int32_t)c;
+    }
+    uint32_t bucketOf(int32_t cx, int32_t cy) const {
+        return ((uint32_t)cx * 73856093u ^ (uint32_t)cy * 19349663u) & mask;
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef STATE_BLOB_H
+#define STATE_BLOB_H
+
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+using namespace std;
+
+// Flat little byte format for state that moves to another process (hot_restart.h).
+// Values are copied as they are in memory, both sides are the same machine.
+// Vectors and strings are a uint32 count followed by the elements.
+class BlobWriter {
+public:
+    string bytes;
+
+    template <class T>
+    void put(const T& value) {
+        static_assert(is_trivially_copyable<T>::value, "put copies raw bytes");
+        bytes.append((const char*)&value, sizeof(T));
+    }
+
+    template <class T, class A>
+    void putVector(const vector<T, A>& values) {
+        static_assert(is_trivially_copyable<T>::value, "putVector copies raw bytes");
+        put((uint32_t)values.size());
+        bytes.append((const char*)values.data(), values.size() * sizeof(T));
+    }
+
+    void putString(const string& s) {
+        put((uint32_t)s.size());
+        bytes.append(s);
+    }
+};
+
+// Reads what a BlobWriter wrote. Running past the end fails every later get,
+// so callers can read a whole record and check ok() once
+class BlobReader {
+public:
+    BlobReader(const char* data, size_t len) : p(data), end(data + len) {}
+
+    template <class T>
+    bool get(T& value) {
+        static_assert(is_trivially_copyable<T>::value, "get copies raw bytes");
+        if (!take(sizeof(T))) return false;
+        memcpy(&value, p - sizeof(T), sizeof(T));
+        return true;
+    }
+
+    template <class T, class A>
+    bool getVector(vector<T, A>& values) {
+        uint32_t count;
+        if (!get(count) || count > (size_t)(end - p) / sizeof(T)) return fail();
+        values.resize(count);
+        memcpy(values.data(), p, count * sizeof(T));
+        p += count * sizeof(T);
+        return true;
+    }
+
+    bool getString(string& s) {
+        uint32_t len;
+        if (!get(len) || !take(len)) return fail();
+        s.assign(p - len, len);
+        return true;
+    }
+
+    bool ok() const { return !failed; }
+    bool done() const { return !failed && p == end; }
+
+private:
+    const char* p;
+    const char* end;
+    bool failed = false;
+
+    bool take(size_t n) {
+        if (failed || (size_t)(end - p) < n) return fail();
+        p += n;
+        return true;
+    }
+
+    bool fail() {
+        failed = true;
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "tick_compaction.h"
+#include <algorithm>
+
+using namespace std;
+
+static const uint32_t UNIT_ID_LIMIT = MATCH_PLAYERS * UNIT_SLOTS_PER_PLAYER;
+
+static bool isUnitOrder(const Command& cmd) {
+    return cmd.command_type == COMMAND_TYPE_MOVE || cmd.command_type == COMMAND_TYPE_ATTACK;
+}
+
+// EndGame (unit id 0) and UnitDied act on the tick as a whole, clients apply them after the orders
+static bool isControl(const Command& cmd) {
+    return cmd.command_type == COMMAND_TYPE_END_GAME || cmd.command_type == COMMAND_TYPE_UNIT_DIED;
+}
+
+TickCompactor::TickCompactor(pmr::memory_resource* memory)
+    : lastOrder(UNIT_ID_LIMIT, -1, memory), diesThisTick(UNIT_ID_LIMIT, 0, memory), touched(memory) {}
+
+void TickCompactor::compact(pmr::vector<Command>& frame, const UnitIdAllocator& unitIds) {
+    totalIn += frame.size();
+
+    // 1. remember the last order and the deaths of every unit in this tick
+    for (size_t i = 0; i < frame.size(); i++) {
+        const Command& cmd = frame[i];
+        if (cmd.unit_id >= UNIT_ID_LIMIT) continue;
+        if (isUnitOrder(cmd)) lastOrder[cmd.unit_id] = (int32_t)i;
+        else if (cmd.command_type == COMMAND_TYPE_UNIT_DIED) diesThisTick[cmd.unit_id] = 1;
+        else continue;
+        touched.push_back(cmd.unit_id);
+    }
+
+    // 2. keep what still matters, in place
+    size_t kept = 0;
+    for (size_t i = 0; i < frame.size(); i++) {
+        const Command& cmd = frame[i];
+        if (isUnitOrder(cmd)) {
+            uint32_t id = cmd.unit_id;
+            bool useful = id != 0 && id < UNIT_ID_LIMIT && unitIds.isLive(id) &&
+                          lastOrder[id] == (int32_t)i && !diesThisTick[id];
+            if (!useful) continue;
+        }
+        frame[kept++] = cmd;
+    }
+
+    frame.resize(kept);
+
+    // reset only the slots we touched so the next tick starts clean
+    for (uint32_t id : touched) {
+        lastOrder[id] = -1;
+        diesThisTick[id] = 0;
+    }
+    touched.clear();
+
+    // 3. order by unit id, stable so a unit's own commands keep their order. Control commands
+    // stay behind all of them in the order they came, EndGame (id 0) must not jump ahead
+    stable_sort(frame.begin(), frame.end(), [](const Command& a, const Command& b) {
+        bool ca = isControl(a), cb = isControl(b);
+        if (ca != cb) return cb;
+        return !ca && a.unit_id < b.unit_id;
+    });
+
+    totalOut += frame.size();
+}
@@ -0,0 +1,37 @@
+#ifndef TICK_COMPACTION_H
+#define TICK_COMPACTION_H
+
+#include "shared.h"
+#include "unit_ids.h"
+
+// Shrinks a finalized tick before it is broadcast:
+//  - only the last Move/Attack of each unit in the tick is kept, it overrides the earlier ones anyway
+//  - Move/Attack that cannot do anything is dropped (no unit id, unit not alive, unit dies this same tick)
+//  - the frame is stable sorted by unit_id, so clients walk their unit arrays in order
+//    and consecutive ids are small deltas if the frame is ever delta/varint encoded.
+//    EndGame and UnitDied are left out of the sort and go last, in the order they came
+// Place, EndGame and UnitDied are always kept.
+// One compactor per match, it keeps scratch arrays indexed by unit id between ticks.
+class TickCompactor {
+public:
+    explicit TickCompactor(pmr::memory_resource* memory = pmr::get_default_resource());
+
+    void compact(pmr::vector<Command>& frame, const UnitIdAllocator& unitIds);
+
+    uint64_t commandsIn() const { return totalIn; }
+    uint64_t commandsOut() const { return totalOut; }
+    uint64_t commandsSaved() const { return totalIn - totalOut; }
+
+    // the scratch arrays are clean between ticks, only the totals carry over
+    void save(BlobWriter& out) const { out.put(totalIn); out.put(totalOut); }
+    bool load(BlobReader& in) { return in.get(totalIn) && in.get(totalOut); }
+
+private:
+    pmr::vector<int32_t> lastOrder; // per unit: index of its last Move/Attack in the current frame, -1 if none
+    pmr::vector<uint8_t> diesThisTick;
+    pmr::vector<uint32_t> touched;  // unit ids written above, so the reset is O(frame) not O(all units)
+    uint64_t totalIn = 0;
+    uint64_t totalOut = 0;
+};
+
+#endif
@@ -0,0 +1,275 @@
+#include "tick_processor.h"
+#include "metrics.h"
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+using namespace std;
+
+TickProcessor::TickProcessor()
+    : unitIds(&arena), died_units{pmr::vector<uint32_t>(&arena), pmr::vector<uint32_t>(&arena)}, compactor(&arena),
+      validator(g_Config.mapWidth, g_Config.mapHeight, g_Config.maxCommandsPerTick, &arena), rejectedPlaces(&arena),
+      recentFrames(DESYNC_WINDOW, &arena)
+{
+    if (g_Config.simulate)
+        sim.reset(new MatchSimulation(SimRules(), &arena));
+    for (int i = 0; i < 2; ++i)
+        commandBudget[i].configure(g_Config.commandsPerSec, g_Config.commandsPerSec);
+}
+
+bool TickProcessor::buildFrame(pmr::vector<Command> requests[2], pmr::vector<Command>& frame)
+{
+    frame.clear();
+    bool game_over_signal = false;
+    tick++;
+    bool desync_found = checkStateHashes();
+
+    addMetric(g_Metrics.commandsReceived, requests[0].size() + requests[1].size());
+
+    // a player over its command rate loses the rest of this tick
+    for (int i = 0; i < 2; ++i)
+    {
+        uint32_t allowed = commandBudget[i].takeUpTo(requests[i].size());
+        if (allowed < requests[i].size())
+        {
+            addMetric(g_Metrics.commandsThrottled, requests[i].size() - allowed);
+            requests[i].resize(allowed);
+        }
+    }
+
+    // drop or fix anything a client should never have sent before the other player sees it
+    if (g_Config.validateCommands)
+    {
+        for (int i = 0; i < 2; ++i)
+            validator.validate(requests[i], i);
+    }
+
+    //Process commands and assign IDs
+    for (int i = 0; i < 2; ++i)
+    {
+        for (Command &cmd : requests[i])
+        {
+            // each player places units into its own id block
+            if (cmd.command_type == COMMAND_TYPE_PLACE)
+            {
+                cmd.unit_id = unitIds.allocate(i);
+                if (cmd.unit_id == 0)
+                {
+                    cerr << "[GAME_INSTANCE] Player " << i << " is out of unit ids, dropping Place" << endl;
+                    continue;
+                }
+            }
+
+            // only the owner can report its unit dead, and only once. The id stays live
+            // until frameSent, so a second report in the same tick is caught by died_units
+            if (cmd.command_type == COMMAND_TYPE_UNIT_DIED)
+            {
+                if (!unitIds.isLive(cmd.unit_id) || UnitIdAllocator::ownerOf(cmd.unit_id) != i)
+                    continue;
+                if (find(died_units[i].begin(), died_units[i].end(), cmd.unit_id) != died_units[i].end())
+                    continue;
+                died_units[i].push_back(cmd.unit_id);
+            }
+
+            if (cmd.command_type == COMMAND_TYPE_END_GAME)
+            {
+                game_over_signal = true;
+            }
+
+            frame.push_back(cmd);
+        }
+    }
+
+    if (g_Config.compactTicks)
+        compactor.compact(frame, unitIds);
+
+    // the simulation sees the frame as the clients will and drops what the match state does not allow.
+    // Those ids never reached a client, so they can go straight back to the allocator
+    if (sim)
+    {
+        sim->step(frame, rejectedPlaces);
+        for (uint32_t id : rejectedPlaces)
+            unitIds.release(UnitIdAllocator::ownerOf(id), id);
+        rejectedPlaces.clear();
+    }
+
+    // the last few frames for the desync log, assign reuses each slot's capacity
+    if (!desynced || desync_found)
+        recentFrames[tick % DESYNC_WINDOW] = frame;
+    if (desync_found)
+        logDesync();
+
+    return game_over_signal;
+}
+
+void TickProcessor::setStateHash(int player, uint64_t hash)
+{
+    hashed[player] = true;
+    hashes[player] = hash;
+}
+
+void TickProcessor::setTickTag(int player, uint32_t tag)
+{
+    // the commands go into the next frame buildFrame makes
+    if (tag == tick + 1)
+        return;
+    addMetric(g_Metrics.tickTagMismatches, 1);
+    if (!tagMismatchLogged)
+    {
+        tagMismatchLogged = true;
+        cerr << "[GAME_INSTANCE] Player " << player << " tagged its commands for frame " << tag
+             << " but they go into frame " << tick + 1 << endl;
+    }
+}
+
+// true on the first tick whose hashes differ
+bool TickProcessor::checkStateHashes()
+{
+    bool both = hashed[0] && hashed[1];
+    hashed[0] = hashed[1] = false;
+    if (!both || desynced)
+        return false;
+
+    hashesChecked++;
+    if (hashes[0] == hashes[1])
+        return false;
+
+    desynced = true;
+    desyncTick = tick - 1;
+    addMetric(g_Metrics.desyncs, 1);
+    return true;
+}
+
+// the diverging hashes and every frame still in the window, oldest first
+void TickProcessor::logDesync()
+{
+    cerr << "[GAME_INSTANCE] Desync after frame " << desyncTick << ": player 0 hash " << hex << setfill('0')
+         << setw(16) << hashes[0] << ", player 1 hash " << setw(16) << hashes[1] << dec << setfill(' ') << endl;
+
+    uint32_t first = tick >= DESYNC_WINDOW ? tick - DESYNC_WINDOW + 1 : 1;
+    for (uint32_t t = first; t <= tick; ++t)
+    {
+        const pmr::vector<Command> &frame = recentFrames[t % DESYNC_WINDOW];
+        cerr << "[GAME_INSTANCE]   frame " << t << (t == desyncTick ? " (diverged)" : "") << ": "
+             << frame.size() << " commands";
+        // id:type:unit_type@x,y
+        for (const Command &cmd : frame)
+            cerr << " " << cmd.unit_id << ":" << cmd.command_type << ":" << cmd.unit_type << "@"
+                 << cmd.target_x << "," << cmd.target_y;
+        cerr << endl;
+    }
+}
+
+void TickProcessor::frameSent(const pmr::vector<Command>& frame)
+{
+    addMetric(g_Metrics.ticks, 1);
+    addMetric(g_Metrics.commandsBroadcast, frame.size());
+
+    // Recycle ids only after both clients got this tick, so a reused id
+    // can never show up before its old unit's death
+    for (int i = 0; i < 2; ++i)
+    {
+        for (uint32_t id : died_units[i])
+            unitIds.release(i, id);
+        died_units[i].clear();
+    }
+}
+
+void TickProcessor::save(BlobWriter& out) const
+{
+    unitIds.save(out);
+    for (int i = 0; i < 2; ++i)
+        out.putVector(died_units[i]);
+    compactor.save(out);
+    validator.save(out);
+    out.put((uint8_t)(sim != nullptr));
+    if (sim)
+        sim->save(out);
+
+    out.put(tick);
+    out.put(hashed);
+    out.put(hashes);
+    out.put(desynced);
+    out.put(desyncTick);
+    out.put(hashesChecked);
+    for (const pmr::vector<Command> &frame : recentFrames)
+        out.putVector(frame);
+    // a restart must not hand out a fresh burst or log the same mismatch again
+    for (int i = 0; i < 2; ++i)
+        commandBudget[i].save(out);
+    out.put(tagMismatchLogged);
+}
+
+bool TickProcessor::load(BlobReader& in)
+{
+    if (!unitIds.load(in))
+        return false;
+    for (int i = 0; i < 2; ++i)
+        in.getVector(died_units[i]);
+    compactor.load(in);
+    validator.load(in);
+    // the match keeps the simulation it started with, whatever the new process was started with
+    uint8_t simulated = 0;
+    in.get(simulated);
+    sim.reset(simulated ? new MatchSimulation(SimRules(), &arena) : nullptr);
+    if (sim && !sim->load(in))
+        return false;
+
+    in.get(tick);
+    in.get(hashed);
+    in.get(hashes);
+    in.get(desynced);
+    in.get(desyncTick);
+    in.get(hashesChecked);
+    for (pmr::vector<Command> &frame : recentFrames)
+        in.getVector(frame);
+    for (int i = 0; i < 2; ++i)
+        commandBudget[i].load(in);
+    in.get(tagMismatchLogged);
+    return in.ok();
+}
+
+void TickProcessor::report()
+{
+    cout << "[GAME_INSTANCE] Match memory peaked at " << arena.peakBytes() / 1024 << " KB" << endl;
+
+    if (g_Config.compactTicks)
+    {
+        // every dropped command would have gone out to both players
+        uint64_t bytes_saved = compactor.commandsSaved() * sizeof(Command) * 2;
+        cout << "[GAME_INSTANCE] Compaction kept " << compactor.commandsOut() << "/" << compactor.commandsIn()
+             << " commands, saved " << bytes_saved << " bytes" << endl;
+        addMetric(g_Metrics.compactionCommandsSaved, compactor.commandsSaved());
+        addMetric(g_Metrics.compactionBytesSaved, bytes_saved);
+    }
+
+    if (validator.rejected() || validator.clamped())
+    {
+        cout << "[GAME_INSTANCE] Validation rejected " << validator.rejected() << " and clamped "
+             << validator.clamped() << " commands (" << validationKernelName(validator.kernel) << ")" << endl;
+        addMetric(g_Metrics.commandsRejected, validator.rejected());
+        addMetric(g_Metrics.commandsClamped, validator.clamped());
+    }
+
+    if (sim && sim->rejectedTotal())
+    {
+        cout << "[GAME_INSTANCE] Simulation rejected " << sim->rejectedTotal() << " commands:";
+        for (int r = 0; r < SIM_REJECT_COUNT; ++r)
+        {
+            if (sim->rejected((SimReject)r))
+                cout << " " << simRejectName((SimReject)r) << "=" << sim->rejected((SimReject)r);
+        }
+        cout << endl;
+        addMetric(g_Metrics.commandsSimRejected, sim->rejectedTotal());
+    }
+
+    if (hashesChecked > 0)
+    {
+        cout << "[GAME_INSTANCE] Compared " << hashesChecked << " state hashes, ";
+        if (desynced)
+            cout << "first desync after frame " << desyncTick << endl;
+        else
+            cout << "no desync" << endl;
+        addMetric(g_Metrics.stateHashesChecked, hashesChecked);
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef TICK_PROCESSOR_H
+#define TICK_PROCESSOR_H
+
+#include "shared.h"
+#include "unit_ids.h"
+#include "tick_compaction.h"
+#include "command_validation.h"
+#include "match_sim.h"
+#include "rate_limit.h"
+#include "match_memory.h"
+#include <memory>
+
+// Everything a match does to a tick between receiving both players' commands
+// and sending the result back out. Shared by the TCP and UDP match loops
+class TickProcessor {
+public:
+    TickProcessor();
+
+    // the match's own memory (match_memory.h). Everything the match keeps between
+    // ticks is in there, the match loops make their buffers from it too
+    pmr::memory_resource* memory() { return &arena; }
+    // past --match-memory-mb, the match loop ends the match
+    bool memoryExceeded() const { return arena.exceeded(); }
+    void setMatchId(int id) { arena.setMatchId(id); }
+
+    // validates both players' commands, assigns unit ids and fills frame.
+    // Returns true when a player sent EndGame
+    bool buildFrame(pmr::vector<Command> requests[2], pmr::vector<Command>& frame);
+    // hash the player sent with the commands of the next buildFrame (TICK_HAS_HASH).
+    // Both players' hashes of a tick are compared there, the first mismatch is
+    // logged once with the last DESYNC_WINDOW frames and counted in g_Metrics.desyncs
+    void setStateHash(int player, uint64_t hash);
+    // frame number the player tagged its next commands with (TICK_HAS_TAG). One that is
+    // not the frame they go into is logged once a match and counted in g_Metrics
+    void setTickTag(int player, uint32_t tag);
+    // number of the frame the last buildFrame made, echoed to MATCH_FEATURE_TICKS players
+    uint32_t frameNumber() const { return tick; }
+    // call once frame reached both players, recycles the ids of units that died in it
+    void frameSent(const pmr::vector<Command>& frame);
+    // per match summary to the log and the global metrics
+    void report();
+
+    // everything the match knows, for handing it to a new server process between
+    // ticks (hot_restart.h). load replaces the state of a fresh TickProcessor
+    void save(BlobWriter& out) const;
+    bool load(BlobReader& in);
+
+    static const uint32_t DESYNC_WINDOW = 8;
+
+private:
+    MatchMemory arena; // first, everything below lives in it
+    UnitIdAllocator unitIds;
+    pmr::vector<uint32_t> died_units[2];
+    TickCompactor compactor;
+    CommandValidator validator;
+    unique_ptr<MatchSimulation> sim; // only with --simulate
+    pmr::vector<uint32_t> rejectedPlaces;
+    TokenBucket commandBudget[2]; // --commands-per-sec of each player
+
+    // desync detection. Frames count from 1, the hash sent with tick n's commands
+    // describes the state after frame n - 1 (0 is the state before the first frame)
+    uint32_t tick = 0;
+    bool hashed[2] = {false, false};
+    uint64_t hashes[2] = {0, 0};
+    bool desynced = false;
+    uint32_t desyncTick = 0; // first frame after which the hashes differed
+    uint64_t hashesChecked = 0;
+    pmr::vector<pmr::vector<Command>> recentFrames; // DESYNC_WINDOW of them, frame n at n % DESYNC_WINDOW
+    bool tagMismatchLogged = false;
+
+    bool checkStateHashes();
+    void logDesync();
+};
+
+#endif
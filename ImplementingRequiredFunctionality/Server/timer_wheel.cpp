@@ -0,0 +1,107 @@
+#include "timer_wheel.h"
+
+using namespace std;
+
+static void linkBefore(TimerNode* head, TimerNode* node) {
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+static void unlink(TimerNode* node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->prev = node->next = nullptr;
+}
+
+// moves everything in from onto the (empty) sentinel to
+static void takeList(TimerNode* from, TimerNode* to) {
+    to->prev = to->next = to;
+    if (from->next == from) return;
+    to->next = from->next;
+    to->prev = from->prev;
+    to->next->prev = to;
+    to->prev->next = to;
+    from->prev = from->next = from;
+}
+
+TimerWheel::TimerWheel(uint64_t now) : current(now) {
+    for (auto& level : slots) {
+        for (TimerNode& head : level) head.prev = head.next = &head;
+    }
+}
+
+void TimerWheel::place(TimerNode* node) {
+    uint64_t delta = node->expires - current;
+    for (int level = 0; level < LEVELS; level++) {
+        uint64_t span = (uint64_t)1 << (LEVEL_BITS * (level + 1));
+        if (delta < span || level == LEVELS - 1) {
+            // too far even for the top level: park in the slot that comes around last
+            uint64_t at = delta < span ? node->expires : current + span - 1;
+            size_t slot = (at >> (LEVEL_BITS * level)) & (SLOTS - 1);
+            linkBefore(&slots[level][slot], node);
+            return;
+        }
+    }
+}
+
+void TimerWheel::arm(TimerNode* node, uint64_t expires) {
+    if (node->armed()) cancel(node);
+    node->expires = expires > current ? expires : current + 1;
+    place(node);
+    count++;
+}
+
+void TimerWheel::cancel(TimerNode* node) {
+    if (!node->armed()) return;
+    unlink(node);
+    count--;
+}
+
+void TimerWheel::cascade(int level, size_t slot) {
+    TimerNode moving;
+    takeList(&slots[level][slot], &moving);
+    while (moving.next != &moving) {
+        TimerNode* node = moving.next;
+        unlink(node);
+        place(node);
+    }
+}
+
+size_t TimerWheel::advance(uint64_t now) {
+    size_t fired = 0;
+    while (current < now) {
+        current++;
+        // a level 0 lap is done, the next slot of level 1 moves down (and so on up)
+        if ((current & (SLOTS - 1)) == 0) {
+            for (int level = 1; level < LEVELS; level++) {
+                size_t slot = (current >> (LEVEL_BITS * level)) & (SLOTS - 1);
+                cascade(level, slot);
+                if (slot != 0) break;
+            }
+        }
+
+        // off the wheel first, so a fire can cancel or re-arm anything it likes
+        TimerNode due;
+        takeList(&slots[0][current & (SLOTS - 1)], &due);
+        while (due.next != &due) {
+            TimerNode* node = due.next;
+            unlink(node);
+            count--;
+            fired++;
+            node->fire(node);
+        }
+    }
+    return fired;
+}
+
+uint64_t TimerWheel::ticksUntilNext() const {
+    if (count == 0) return 0;
+    uint64_t lapEnd = SLOTS - (current & (SLOTS - 1)); // the next cascade
+    for (uint64_t ahead = 1; ahead < lapEnd; ahead++) {
+        const TimerNode& head = slots[0][(current + ahead) & (SLOTS - 1)];
+        if (head.next != &head) return ahead;
+    }
+    return lapEnd;
+}
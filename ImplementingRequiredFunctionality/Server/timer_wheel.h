@@ -0,0 +1,59 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// Hierarchical timing wheel: LEVELS wheels of SLOTS slots each, level L counts in
+// units of SLOTS^L ticks. A timer goes into the coarsest slot that still tells it
+// apart from now and moves down a level every time its slot comes around, so arm
+// and cancel are a list insert/unlink and advancing one tick only looks at one slot
+// (plus a cascade every SLOTS ticks), no matter how many timers are armed.
+// Not thread safe, the owner locks around it (liveness.cpp).
+
+// Intrusive, lives inside whatever it times
+struct TimerNode {
+    TimerNode* prev = nullptr;
+    TimerNode* next = nullptr;
+    uint64_t expires = 0; // tick
+    void (*fire)(TimerNode* node) = nullptr;
+
+    bool armed() const { return prev != nullptr; }
+};
+
+class TimerWheel {
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 4; // 2^24 ticks ahead, longer timers wait at the top and re-cascade
+
+    explicit TimerWheel(uint64_t now = 0);
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // node->fire(node) runs once at tick expires, a tick that already passed means the next one.
+    // Re-arms a node that is already armed
+    void arm(TimerNode* node, uint64_t expires);
+    // fine on a node that is not armed
+    void cancel(TimerNode* node);
+    // moves to tick now and fires everything due on the way. A fire may arm and
+    // cancel any timer, its own node included. Returns how many fired
+    size_t advance(uint64_t now);
+
+    uint64_t now() const { return current; }
+    size_t size() const { return count; }
+    // ticks until the wheel has something to do, an upper bound for sleeping. 0 when nothing is armed
+    uint64_t ticksUntilNext() const;
+
+private:
+    TimerNode slots[LEVELS][SLOTS]; // circular lists, each head is its own sentinel
+    uint64_t current;
+    size_t count = 0;
+
+    void place(TimerNode* node);
+    void cascade(int level, size_t slot);
+};
+
+#endif
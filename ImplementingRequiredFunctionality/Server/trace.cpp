@@ -0,0 +1,222 @@
+#include "trace.h"
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+static string g_TracePath;
+
+#ifndef NO_TRACE
+
+static pid_t g_TracePid = 0; // the process --trace was given to, not a --workers fork of it
+
+bool g_TraceEnabled = false;
+
+struct TraceEvent {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+    uint32_t tid;
+    int32_t arg;
+};
+
+// One thread's spans. written only grows, event n is at n % TRACE_RING_SPANS
+struct TraceRing {
+    TraceEvent events[TRACE_RING_SPANS];
+    atomic<uint64_t> written{0};
+};
+
+// Every ring ever handed out. A thread per client comes and goes, so the ring of a
+// thread that ended goes back to the free list with its spans still in it
+static pthread_mutex_t g_TraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceRing*> g_Rings;
+static vector<TraceRing*> g_FreeRings;
+
+struct ThreadRing {
+    TraceRing* ring = nullptr;
+    uint32_t tid = 0;
+
+    ~ThreadRing() {
+        if (!ring) return;
+        pthread_mutex_lock(&g_TraceMutex);
+        g_FreeRings.push_back(ring);
+        pthread_mutex_unlock(&g_TraceMutex);
+    }
+};
+
+static thread_local ThreadRing t_Ring;
+
+static TraceRing* acquireRing() {
+    pthread_mutex_lock(&g_TraceMutex);
+    TraceRing* ring;
+    if (!g_FreeRings.empty()) {
+        ring = g_FreeRings.back();
+        g_FreeRings.pop_back();
+    } else {
+        ring = new TraceRing();
+        g_Rings.push_back(ring);
+    }
+    pthread_mutex_unlock(&g_TraceMutex);
+    t_Ring.tid = (uint32_t)syscall(SYS_gettid);
+    t_Ring.ring = ring;
+    return ring;
+}
+
+static uint64_t nowNs() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// where the span clock and the steady clock were at StartTracing, WriteTrace
+// measures the rate between the two from there
+static uint64_t g_ClockStart;
+static uint64_t g_NsStart;
+
+void traceRecord(const char* name, uint64_t start, int32_t arg) {
+    TraceRing* ring = t_Ring.ring ? t_Ring.ring : acquireRing();
+    uint64_t n = ring->written.load(memory_order_relaxed);
+    TraceEvent& e = ring->events[n % TRACE_RING_SPANS];
+    e.name = name;
+    e.start = start;
+    e.duration = traceClock() - start;
+    e.tid = t_Ring.tid;
+    e.arg = arg;
+    ring->written.store(n + 1, memory_order_release);
+}
+
+// what a ring holds right now. Its thread keeps writing meanwhile, whatever it may
+// have overwritten during the copy is left out
+static void copyRing(const TraceRing& ring, vector<TraceEvent>& out) {
+    uint64_t end = ring.written.load(memory_order_acquire);
+    uint64_t first = end > TRACE_RING_SPANS ? end - TRACE_RING_SPANS : 0;
+    size_t base = out.size();
+    for (uint64_t n = first; n < end; n++) out.push_back(ring.events[n % TRACE_RING_SPANS]);
+    uint64_t after = ring.written.load(memory_order_acquire);
+    uint64_t safe = after >= TRACE_RING_SPANS ? after - TRACE_RING_SPANS + 1 : 0;
+    if (safe > first) out.erase(out.begin() + base, out.begin() + base + min(safe - first, end - first));
+}
+
+// kill -HUP, and the TRACE command sends one to the process (RequestTrace)
+static void* TraceSignalThread(void*) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (true) {
+        int sig;
+        if (sigwait(&set, &sig) == 0) cout << "[TRACE] " << WriteTrace() << endl;
+    }
+    return NULL;
+}
+
+static void startSignalThread() {
+    // with every signal blocked, it must not take SIGUSR2 or SIGINT meant for someone else
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_t t;
+    if (pthread_create(&t, NULL, TraceSignalThread, NULL) == 0) pthread_detach(t);
+    else cerr << "[TRACE] Could not start the trace thread, SIGHUP does nothing" << endl;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void StartTracing(const string& path) {
+    g_TracePath = path;
+    g_TracePid = getpid();
+    g_NsStart = nowNs();
+    g_ClockStart = traceClock();
+    g_TraceEnabled = true;
+
+    // blocked in every thread that comes after, only sigwait sees it
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    startSignalThread();
+    // threads don't survive fork, every --workers process gets its own
+    pthread_atfork(NULL, NULL, startSignalThread);
+}
+
+// every --workers process has its own rings and file
+static string tracePath() {
+    int pid = getpid();
+    return pid == g_TracePid ? g_TracePath : g_TracePath + "." + to_string(pid);
+}
+
+static bool fromLoopback(int sock) {
+    sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(sock, (sockaddr*)&addr, &len) < 0) return false;
+    if (addr.ss_family == AF_INET) return (ntohl(((sockaddr_in*)&addr)->sin_addr.s_addr) >> 24) == 127;
+    if (addr.ss_family != AF_INET6) return false;
+    const in6_addr& a = ((sockaddr_in6*)&addr)->sin6_addr;
+    if (IN6_IS_ADDR_LOOPBACK(&a)) return true;
+    return IN6_IS_ADDR_V4MAPPED(&a) && a.s6_addr[12] == 127;
+}
+
+string RequestTrace(int sock) {
+    if (!g_TraceEnabled) return "ERROR Tracing is off, start the server with --trace FILE.";
+    if (!fromLoopback(sock)) return "ERROR TRACE only works over loopback.";
+
+    static atomic<uint64_t> last{ 0 };
+    uint64_t now = nowNs() / 1000000;
+    uint64_t before = last.load();
+    if ((before && now - before < (uint64_t)TRACE_COMMAND_INTERVAL_MS) || !last.compare_exchange_strong(before, now))
+        return "ERROR Slow down.";
+    // to the process, so the trace thread's sigwait takes it
+    kill(getpid(), SIGHUP);
+    return "TRACE requested, written to " + tracePath();
+}
+
+string WriteTrace() {
+    if (!g_TraceEnabled) return "ERROR Tracing is off, start the server with --trace FILE.";
+
+    uint64_t clock = traceClock();
+    double nsPerTick = (double)(nowNs() - g_NsStart) / (double)max<uint64_t>(clock - g_ClockStart, 1);
+
+    vector<TraceEvent> events;
+    pthread_mutex_lock(&g_TraceMutex);
+    for (const TraceRing* ring : g_Rings) copyRing(*ring, events);
+    pthread_mutex_unlock(&g_TraceMutex);
+
+    int pid = getpid();
+    string path = tracePath();
+    FILE* f = fopen(path.c_str(), "w");
+    if (!f) return "ERROR Could not open " + path + ".";
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", f);
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        // complete events, in microseconds of the steady clock
+        double start = g_NsStart + ((int64_t)(e.start - g_ClockStart)) * nsPerTick;
+        fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%d}}",
+                i ? "," : "", e.name, pid, e.tid, start / 1000, e.duration * nsPerTick / 1000, e.arg);
+    }
+    fputs("\n]}\n", f);
+    bool ok = fclose(f) == 0;
+    if (!ok) return "ERROR Could not write " + path + ".";
+    return "TRACE " + to_string(events.size()) + " spans written to " + path;
+}
+
+#else
+
+void StartTracing(const string& path) {
+    g_TracePath = path;
+}
+
+string WriteTrace() {
+    return "ERROR This server was built without tracing (NO_TRACE).";
+}
+
+string RequestTrace(int) {
+    return WriteTrace();
+}
+
+#endif
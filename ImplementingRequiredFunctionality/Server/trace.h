@@ -0,0 +1,81 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// Opt-in timeline of where the server's time goes, in Chrome's trace event
+// format so Perfetto (ui.perfetto.dev) or chrome://tracing can show it. With
+// --trace FILE every thread records its spans into a ring of its own (the last
+// TRACE_RING_SPANS of them, no locks and no allocations while recording) and
+// kill -HUP writes what the rings hold to FILE. Without --trace a span
+// is one untaken branch, built with -DNO_TRACE they are compiled out.
+//
+// A span covers the scope it is declared in:
+//     TRACE_SPAN("process", gameId);
+// name has to be a string literal (only the pointer is kept), arg shows up in
+// the span's args. Under --coroutines spans must not cross a co_await.
+
+const size_t TRACE_RING_SPANS = 8192;
+const int TRACE_COMMAND_INTERVAL_MS = 5000; // between two TRACE lobby commands
+
+#ifndef NO_TRACE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+extern bool g_TraceEnabled; // set once by StartTracing, before any thread records
+
+// Timestamps of spans. Two reads of the steady clock alone are ~50ns, the TSC is a
+// fraction of that and turned into ns when the trace is written
+inline uint64_t traceClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+void traceRecord(const char* name, uint64_t start, int32_t arg);
+
+class TraceSpan {
+public:
+    TraceSpan(const char* name, int32_t arg) : name(name), arg(arg), start(g_TraceEnabled ? traceClock() : 0) {}
+    ~TraceSpan() {
+        if (start) traceRecord(name, start, arg);
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    int32_t arg;
+    uint64_t start;
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SPAN(name, arg) TraceSpan TRACE_CONCAT(traceSpan_, __LINE__)(name, arg)
+
+#else
+
+#define TRACE_SPAN(name, arg) ((void)0)
+
+#endif
+
+// turns recording on, path is where TRACE writes to (--trace). kill -HUP writes it
+// as well, so this has to run before any other thread is created
+void StartTracing(const string& path);
+// every span the rings hold to the --trace file. Returns what happened, for the log
+string WriteTrace();
+// the TRACE lobby command of the connection on sock. Only a loopback client may ask,
+// once every TRACE_COMMAND_INTERVAL_MS, and the trace thread writes the file like for
+// SIGHUP, so no lobby thread or the executor waits on it. Returns the reply text
+string RequestTrace(int sock);
+
+#endif
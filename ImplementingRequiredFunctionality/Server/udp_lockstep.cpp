@@ -0,0 +1,264 @@
+#include "udp_lockstep.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include <iostream>
+#include <map>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+using namespace std;
+
+// a finalized tick, already in wire format (uint32 count + commands)
+struct EncodedFrame {
+    uint32_t tick;
+    pmr::vector<char> bytes;
+
+    explicit EncodedFrame(pmr::memory_resource* memory) : bytes(memory) {}
+};
+
+// everything here lives in the match's memory (match_memory.h)
+struct UdpPeer {
+    sockaddr_storage addr;
+    socklen_t addrLen = 0; // 0 until the first datagram tells us where the player is
+    uint32_t frameAck = 0;
+    pmr::map<uint32_t, pmr::vector<Command>> inputs; // inputs for ticks that were not run yet
+    pmr::map<uint32_t, uint64_t> hashes;             // state hashes that came with some of them
+    uint64_t lastHeard = 0;
+    uint64_t lastSent = 0;
+    bool needReply = false;
+
+    explicit UdpPeer(pmr::memory_resource* memory) : inputs(memory), hashes(memory) {}
+};
+
+static uint64_t nowMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool OpenUdpMatch(UdpMatch& match) {
+    match.sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (match.sock < 0) return false;
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = 0; // let the OS pick
+    socklen_t len = sizeof(addr);
+    if (bind(match.sock, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(match.sock, (sockaddr*)&addr, &len) < 0) {
+        CloseUdpMatch(match);
+        return false;
+    }
+    match.port = ntohs(addr.sin_port);
+
+    random_device rd;
+    match.tokens[0] = rd();
+    do { match.tokens[1] = rd(); } while (match.tokens[1] == match.tokens[0]);
+    return true;
+}
+
+void CloseUdpMatch(UdpMatch& match) {
+    if (match.sock != -1) close(match.sock);
+    match.sock = -1;
+}
+
+static void encodeFrame(uint32_t tick, const pmr::vector<Command>& frame, EncodedFrame& out) {
+    uint32_t count = frame.size();
+    out.tick = tick;
+    out.bytes.resize(sizeof(count) + count * sizeof(Command));
+    memcpy(out.bytes.data(), &count, sizeof(count));
+    memcpy(out.bytes.data() + sizeof(count), frame.data(), count * sizeof(Command));
+}
+
+// newest tick up to which every input of this player is here
+static uint32_t inputAck(const UdpPeer& peer, uint32_t nextTick) {
+    uint32_t tick = nextTick - 1;
+    while (peer.inputs.count(tick + 1)) tick++;
+    return tick;
+}
+
+// stores the inputs of one datagram, false if it is malformed
+static bool readInputs(const char* data, size_t len, UdpPeer& peer, uint32_t nextTick) {
+    UdpInputHeader header;
+    memcpy(&header, data, sizeof(header));
+    size_t offset = sizeof(header);
+    if (header.frame_ack > peer.frameAck && header.frame_ack < nextTick) peer.frameAck = header.frame_ack;
+
+    for (uint32_t k = 0; k < header.tick_count; k++) {
+        uint32_t count;
+        if (len - offset < sizeof(count)) return false;
+        memcpy(&count, data + offset, sizeof(count));
+        offset += sizeof(count);
+        // datagrams number their ticks already, a tag is skipped
+        if (count & TICK_HAS_TAG) {
+            if (len - offset < sizeof(uint32_t)) return false;
+            offset += sizeof(uint32_t);
+        }
+        bool hashed = (count & TICK_HAS_HASH) != 0;
+        uint64_t hash = 0;
+        if (hashed) {
+            if (len - offset < sizeof(hash)) return false;
+            memcpy(&hash, data + offset, sizeof(hash));
+            offset += sizeof(hash);
+        }
+        count &= ~TICK_FLAGS;
+        if (!tickCountAllowed(count) || (len - offset) / sizeof(Command) < count) return false;
+
+        uint32_t tick = header.first_tick + k;
+        // only keep ticks we still need and that are not absurdly far ahead
+        if (tick >= nextTick && tick < nextTick + UDP_WINDOW_TICKS * 2 && !peer.inputs.count(tick)) {
+            pmr::vector<Command>& cmds = peer.inputs[tick];
+            cmds.resize(count);
+            memcpy(cmds.data(), data + offset, count * sizeof(Command));
+            if (hashed) peer.hashes[tick] = hash;
+        }
+        offset += count * sizeof(Command);
+    }
+    return true;
+}
+
+// every frame this player has not acked, oldest first, as many as fit
+static void sendFrames(int sock, UdpPeer& peer, const pmr::deque<EncodedFrame>& history, uint32_t nextTick, char* out) {
+    UdpFrameHeader header;
+    header.input_ack = inputAck(peer, nextTick);
+    header.first_tick = peer.frameAck + 1;
+    header.tick_count = 0;
+    size_t offset = sizeof(header);
+
+    for (const EncodedFrame& f : history) {
+        if (f.tick <= peer.frameAck) continue;
+        size_t limit = header.tick_count == 0 ? UDP_MAX_DATAGRAM : UDP_PACK_DATAGRAM;
+        if (header.tick_count >= UDP_WINDOW_TICKS || offset + f.bytes.size() > limit) break;
+        memcpy(out + offset, f.bytes.data(), f.bytes.size());
+        offset += f.bytes.size();
+        header.tick_count++;
+    }
+    memcpy(out, &header, sizeof(header));
+    sendto(sock, out, offset, 0, (sockaddr*)&peer.addr, peer.addrLen);
+    peer.lastSent = nowMs();
+    peer.needReply = false;
+}
+
+bool RunUdpMatch(UdpMatch& match, int tcpSockets[2], TickProcessor& ticks) {
+    pmr::memory_resource* memory = ticks.memory();
+    UdpPeer peers[2] = {UdpPeer(memory), UdpPeer(memory)};
+    pmr::deque<EncodedFrame> history(memory); // frames not acked by both players yet
+    pmr::vector<Command> requests[2] = {pmr::vector<Command>(memory), pmr::vector<Command>(memory)};
+    pmr::vector<Command> frame(memory);
+    pmr::vector<char> buffer(UDP_MAX_DATAGRAM, memory);
+    uint32_t nextTick = 1;
+    bool gameOver = false;
+    uint32_t lastTick = 0;
+    uint64_t gameOverAt = 0;
+
+    uint64_t start = nowMs();
+    peers[0].lastHeard = peers[1].lastHeard = start;
+
+    while (true) {
+        pollfd fds[3] = {
+            { match.sock, POLLIN, 0 },
+            { tcpSockets[0], POLLIN, 0 },
+            { tcpSockets[1], POLLIN, 0 },
+        };
+        if (poll(fds, 3, UDP_RESEND_MS) < 0 && errno != EINTR) return false;
+        uint64_t now = nowMs();
+
+        // the TCP connections are idle during the match, any event there is a disconnect
+        for (int i = 0; i < 2; ++i) {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            char scratch[256];
+            int r = recv(tcpSockets[i], scratch, sizeof(scratch), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                cerr << "[GAME_INSTANCE] Player " << i << " closed its connection during a UDP match" << endl;
+                return false;
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            while (true) {
+                sockaddr_storage from;
+                socklen_t fromLen = sizeof(from);
+                int r = recvfrom(match.sock, buffer.data(), buffer.size(), MSG_DONTWAIT, (sockaddr*)&from, &fromLen);
+                if (r < 0) break;
+                if ((size_t)r < sizeof(UdpInputHeader)) continue;
+
+                uint32_t token;
+                memcpy(&token, buffer.data(), sizeof(token));
+                int p = token == match.tokens[0] ? 0 : token == match.tokens[1] ? 1 : -1;
+                if (p < 0) continue; // not one of our players
+                if (!readInputs(buffer.data(), r, peers[p], nextTick)) continue;
+
+                peers[p].addr = from; // follows the player if its NAT mapping changes
+                peers[p].addrLen = fromLen;
+                peers[p].lastHeard = now;
+                peers[p].needReply = true;
+            }
+        }
+
+        // run every tick both players' inputs are here for
+        while (!gameOver && peers[0].inputs.count(nextTick) && peers[1].inputs.count(nextTick)) {
+            TRACE_SPAN("process", match.port);
+            for (int i = 0; i < 2; ++i) {
+                requests[i] = move(peers[i].inputs[nextTick]);
+                peers[i].inputs.erase(nextTick);
+                auto hash = peers[i].hashes.find(nextTick);
+                if (hash != peers[i].hashes.end()) {
+                    ticks.setStateHash(i, hash->second);
+                    peers[i].hashes.erase(hash);
+                }
+            }
+            gameOver = ticks.buildFrame(requests, frame);
+            if (ticks.memoryExceeded()) {
+                shutdown(tcpSockets[0], SHUT_RDWR);
+                shutdown(tcpSockets[1], SHUT_RDWR);
+                return false;
+            }
+            if (sizeof(UdpFrameHeader) + sizeof(uint32_t) + frame.size() * sizeof(Command) > UDP_MAX_DATAGRAM) {
+                cerr << "[GAME_INSTANCE] Tick " << nextTick << " does not fit in a datagram, ending match" << endl;
+                return false;
+            }
+            history.emplace_back(memory);
+            encodeFrame(nextTick, frame, history.back());
+            // frames arrive in order, so a recycled id can only show up after the death that freed it
+            ticks.frameSent(frame);
+            if (gameOver) {
+                lastTick = nextTick;
+                gameOverAt = now;
+            }
+            nextTick++;
+            peers[0].needReply = peers[1].needReply = true;
+        }
+
+        uint32_t bothAcked = min(peers[0].frameAck, peers[1].frameAck);
+        while (!history.empty() && history.front().tick <= bothAcked) history.pop_front();
+
+        for (int i = 0; i < 2; ++i) {
+            UdpPeer& peer = peers[i];
+            if (peer.addrLen == 0) continue;
+            bool unacked = !history.empty() && history.back().tick > peer.frameAck;
+            if (peer.needReply || (unacked && now - peer.lastSent >= (uint64_t)UDP_RESEND_MS)) {
+                TRACE_SPAN(i == 0 ? "broadcast-p1" : "broadcast-p2", match.port);
+                sendFrames(match.sock, peer, history, nextTick, buffer.data());
+            }
+        }
+
+        if (gameOver) {
+            if (peers[0].frameAck >= lastTick && peers[1].frameAck >= lastTick) return true;
+            // whoever still misses the last frame gives up on its own side
+            if (now - gameOverAt > (uint64_t)UDP_LINGER_MS) return true;
+            continue;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (now - peers[i].lastHeard > (uint64_t)UDP_TIMEOUT_MS) {
+                cerr << "[GAME_INSTANCE] Player " << i << " timed out during a UDP match" << endl;
+                return false;
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef UDP_LOCKSTEP_H
+#define UDP_LOCKSTEP_H
+
+#include "tick_processor.h"
+
+// Match phase over UDP, used when both players ask for it with "ACK UDP" and
+// the server runs with --udp. The lobby and the handshake stay on TCP: after
+// the player id the server sends uint32 accepted mask, uint16 udp port, uint32 token.
+//
+// Every datagram repeats everything the other side has not acknowledged yet
+// (up to UDP_WINDOW_TICKS ticks) and carries an ack for the other direction, so
+// one lost packet is covered by the next one or by a resend UDP_RESEND_MS later,
+// instead of stalling every later tick like a lost TCP segment does.
+//
+// client -> server: UdpInputHeader, then tick_count x (uint32 count, count x Command),
+//                   with the state hash after the count when it has TICK_HAS_HASH (shared.h)
+// server -> client: UdpFrameHeader, then tick_count x (uint32 count, count x Command)
+// for ticks first_tick, first_tick + 1, ... Ticks start at 1, an ack of 0 means nothing yet.
+// A client sends one datagram with tick_count 0 after a frame with EndGame, so the
+// server knows the last frame arrived.
+#pragma pack(push, 1)
+struct UdpInputHeader {
+    uint32_t token;      // which player this is, from the TCP handshake
+    uint32_t frame_ack;  // newest frame tick the client has applied
+    uint32_t first_tick;
+    uint32_t tick_count;
+};
+
+struct UdpFrameHeader {
+    uint32_t input_ack;  // every input of this player up to here has arrived
+    uint32_t first_tick;
+    uint32_t tick_count;
+};
+#pragma pack(pop)
+
+const uint32_t UDP_WINDOW_TICKS = 8;    // most ticks repeated in one datagram
+const size_t UDP_PACK_DATAGRAM = 1200;  // older ticks are only packed in while the datagram fits one MTU
+const size_t UDP_MAX_DATAGRAM = 65000;  // a single tick can still use up to this much
+const int UDP_RESEND_MS = 20;
+const int UDP_TIMEOUT_MS = 10000;       // player is gone after this long without a datagram
+const int UDP_LINGER_MS = 1000;         // how long the final frame is resent waiting for acks
+
+struct UdpMatch {
+    int sock = -1;
+    uint16_t port = 0;
+    uint32_t tokens[2] = {0, 0};
+};
+
+// binds a new UDP socket on an ephemeral port and picks the player tokens
+bool OpenUdpMatch(UdpMatch& match);
+void CloseUdpMatch(UdpMatch& match);
+
+// runs the lockstep loop. Returns true when the match ended with EndGame and
+// false when a player was lost. tcpSockets are only watched for disconnects
+bool RunUdpMatch(UdpMatch& match, int tcpSockets[2], TickProcessor& ticks);
+
+#endif
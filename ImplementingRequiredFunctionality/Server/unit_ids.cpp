@@ -0,0 +1,55 @@
+#include "unit_ids.h"
+
+using namespace std;
+
+UnitIdAllocator::UnitIdAllocator(pmr::memory_resource* memory)
+    : freeIds{pmr::vector<uint32_t>(memory), pmr::vector<uint32_t>(memory)},
+      live(MATCH_PLAYERS * UNIT_SLOTS_PER_PLAYER, 0, memory) {
+    for (int p = 0; p < MATCH_PLAYERS; p++) {
+        nextFresh[p] = p * UNIT_SLOTS_PER_PLAYER;
+    }
+    nextFresh[0] = 1; // id 0 is reserved
+}
+
+uint32_t UnitIdAllocator::allocate(int player) {
+    if (player < 0 || player >= MATCH_PLAYERS) return 0;
+    uint32_t id;
+    if (!freeIds[player].empty()) {
+        id = freeIds[player].back();
+        freeIds[player].pop_back();
+    } else if (nextFresh[player] < (uint32_t)(player + 1) * UNIT_SLOTS_PER_PLAYER) {
+        id = nextFresh[player]++;
+    } else {
+        return 0;
+    }
+    live[id] = 1;
+    return id;
+}
+
+bool UnitIdAllocator::release(int player, uint32_t id) {
+    if (!isLive(id) || ownerOf(id) != player) return false;
+    live[id] = 0;
+    freeIds[player].push_back(id);
+    return true;
+}
+
+bool UnitIdAllocator::isLive(uint32_t id) const {
+    return id < live.size() && live[id];
+}
+
+void UnitIdAllocator::save(BlobWriter& out) const {
+    for (int p = 0; p < MATCH_PLAYERS; p++) {
+        out.putVector(freeIds[p]);
+        out.put(nextFresh[p]);
+    }
+    out.putVector(live);
+}
+
+bool UnitIdAllocator::load(BlobReader& in) {
+    for (int p = 0; p < MATCH_PLAYERS; p++) {
+        in.getVector(freeIds[p]);
+        in.get(nextFresh[p]);
+    }
+    in.getVector(live);
+    return in.ok() && live.size() == MATCH_PLAYERS * UNIT_SLOTS_PER_PLAYER;
+}
@@ -0,0 +1,45 @@
+#ifndef UNIT_IDS_H
+#define UNIT_IDS_H
+
+#include <cstdint>
+#include <vector>
+#include <memory_resource>
+#include "state_blob.h"
+
+using namespace std;
+
+// Each player owns a block of UNIT_SLOTS_PER_PLAYER ids: player p gets
+// [p * UNIT_SLOTS_PER_PLAYER, (p + 1) * UNIT_SLOTS_PER_PLAYER).
+// The owner of a unit is id / UNIT_SLOTS_PER_PLAYER and clients can keep their
+// units in a flat array of MATCH_PLAYERS * UNIT_SLOTS_PER_PLAYER entries.
+// Id 0 is never handed out, it still means "no id yet"
+const uint32_t UNIT_SLOTS_PER_PLAYER = 4096;
+const int MATCH_PLAYERS = 2;
+
+// Unit id allocator owned by a single match, so it needs no locking.
+// Ids of dead units are recycled before new ones are used, which keeps the
+// ids dense at the low end of each player's block
+class UnitIdAllocator {
+public:
+    // memory: where the id lists live, the match's MatchMemory (match_memory.h)
+    explicit UnitIdAllocator(pmr::memory_resource* memory = pmr::get_default_resource());
+
+    // returns 0 when the player has no free ids left
+    uint32_t allocate(int player);
+    // false if id is not a live unit owned by player
+    bool release(int player, uint32_t id);
+
+    bool isLive(uint32_t id) const;
+    static int ownerOf(uint32_t id) { return id / UNIT_SLOTS_PER_PLAYER; }
+
+    // hot restart (hot_restart.h)
+    void save(BlobWriter& out) const;
+    bool load(BlobReader& in);
+
+private:
+    pmr::vector<uint32_t> freeIds[MATCH_PLAYERS]; // recycled ids, reused last in first out
+    uint32_t nextFresh[MATCH_PLAYERS];            // lowest never used id in each block
+    pmr::vector<uint8_t> live;                    // indexed by unit id
+};
+
+#endif
@@ -0,0 +1,442 @@
+#ifdef __linux__
+
+#include "io_backend.h"
+#include "metrics.h"
+#include <linux/io_uring.h>
+#include <unordered_map>
+#include <deque>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+// no liburing here, the three syscalls are all we need
+static int uringSetup(unsigned entries, io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int uringRegister(int fd, unsigned opcode, void* arg, unsigned count) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// a failed accept (out of fds most likely) waits this long before it is tried again
+static const int ACCEPT_BACKOFF_MS = 50;
+
+static int64_t monotonicMs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Completion based backend on io_uring:
+//  - one multishot accept keeps accepting without a new SQE per connection
+//  - one multishot recv per socket picks buffers from a provided buffer ring,
+//    consumed buffers go back to the ring at the start of the next wait()
+//  - sends are linked SQEs with MSG_MORE on all but the last one, so a tick's
+//    header and payload leave as one segment and sends on a socket stay in order
+//  - everything queued since the last wait() goes to the kernel in one io_uring_enter
+class UringBackend : public IoBackend {
+public:
+    UringBackend(unsigned entries, unsigned bufferCount, unsigned bufferSize)
+        : bufferCount(bufferCount), bufferSize(bufferSize) {
+        setup(entries);
+    }
+
+    ~UringBackend() {
+        if (bufferRing) munmap(bufferRing, bufferCount * sizeof(io_uring_buf));
+        if (buffers) munmap(buffers, (size_t)bufferCount * bufferSize);
+        if (sqes) munmap(sqes, sqeBytes);
+        if (cqRing && cqRing != sqRing) munmap(cqRing, cqBytes);
+        if (sqRing) munmap(sqRing, sqBytes);
+        if (ringFd >= 0) close(ringFd);
+    }
+
+    bool ok() const { return ready_; }
+    const char* name() const { return "uring"; }
+
+    bool watchAccept(int fd) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->user_data = tag(OP_ACCEPT, fd);
+        listenFd = fd;
+        accepting = true;
+        return true;
+    }
+
+    bool watchRecv(int fd) {
+        Conn& c = conns[fd];
+        c.watching = true;
+        if (!c.armed) armRecv(fd, c);
+        return true;
+    }
+
+    void unwatch(int fd) {
+        if (fd == listenFd && accepting) {
+            // the multishot accept ends with -ECANCELED, anything it accepted before that is still reported
+            accepting = false;
+            if (acceptResumeMs) {
+                // backing off, there is nothing in the kernel to cancel
+                acceptResumeMs = 0;
+                done.push_back({ IO_RECV_DONE, fd, -ECANCELED, nullptr });
+                return;
+            }
+            io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = tag(OP_ACCEPT, fd);
+            sqe->user_data = tag(OP_CANCEL, fd);
+            return;
+        }
+        auto it = conns.find(fd);
+        if (it == conns.end() || !it->second.watching) return;
+        Conn& c = it->second;
+        c.watching = false;
+        if (c.armed) {
+            // the recv finishes with -ECANCELED and reports IO_RECV_DONE then
+            io_uring_sqe* sqe = getSqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = -1;
+            sqe->addr = tag(OP_RECV, fd);
+            sqe->user_data = tag(OP_CANCEL, fd);
+        } else {
+            done.push_back({ IO_RECV_DONE, fd, -ECANCELED, nullptr });
+        }
+    }
+
+    void send(int fd, const iovec* iov, int iovcnt) {
+        Conn& c = conns[fd];
+        c.pending.emplace_back();
+        SendJob& job = c.pending.back();
+        for (int i = 0; i < iovcnt; i++) {
+            const char* p = (const char*)iov[i].iov_base;
+            job.bytes.insert(job.bytes.end(), p, p + iov[i].iov_len);
+            job.parts.push_back(iov[i].iov_len);
+        }
+        dirty.push_back(fd);
+    }
+
+    int wait(vector<IoEvent>& events, int timeoutMs) {
+        if (acceptResumeMs) {
+            int64_t left = acceptResumeMs - monotonicMs();
+            if (left <= 0) {
+                acceptResumeMs = 0;
+                watchAccept(listenFd);
+            } else if (timeoutMs < 0 || timeoutMs > left) {
+                timeoutMs = left;
+            }
+        }
+        events.clear();
+        events.swap(done);
+
+        recycleBuffers();
+        for (int fd : rearm) {
+            Conn& c = conns[fd];
+            if (c.watching && !c.armed) armRecv(fd, c);
+        }
+        rearm.clear();
+        for (int fd : dirty) startSends(fd);
+        dirty.clear();
+
+        // only enter the kernel when there is something to submit or we have to wait
+        bool block = events.empty() && timeoutMs != 0 && cqReady() == 0;
+        if (unsubmitted > 0 || block) {
+            unsigned flags = 0;
+            io_uring_getevents_arg arg;
+            __kernel_timespec ts;
+            memset(&arg, 0, sizeof(arg));
+            if (block) {
+                flags |= IORING_ENTER_GETEVENTS;
+                if (timeoutMs > 0) {
+                    ts.tv_sec = timeoutMs / 1000;
+                    ts.tv_nsec = (timeoutMs % 1000) * 1000000LL;
+                    arg.ts = (uint64_t)(uintptr_t)&ts;
+                }
+                arg.sigmask_sz = _NSIG / 8;
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+            enter(unsubmitted, block ? 1 : 0, flags, block ? &arg : nullptr, block ? sizeof(arg) : 0);
+        }
+
+        reap(events);
+        return events.size();
+    }
+
+private:
+    enum Op : uint64_t { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_SEND_PART, OP_CANCEL };
+
+    struct SendJob {
+        vector<char> bytes;
+        vector<size_t> parts; // iov lengths, one SQE each
+    };
+
+    struct Conn {
+        bool watching = false; // IO_RECEIVED wanted
+        bool armed = false;    // a multishot recv is in the kernel
+        deque<SendJob> pending;  // queued, not submitted
+        deque<SendJob> inflight; // one linked chain in the kernel, completes front first
+    };
+
+    static uint64_t tag(Op op, int fd) { return op << 56 | (uint32_t)fd; }
+
+    bool ready_ = false;
+    int ringFd = -1;
+    int listenFd = -1;
+    bool accepting = false; // the multishot accept on listenFd is wanted
+    int64_t acceptResumeMs = 0; // when a failed accept is armed again, 0 when it is not backing off
+
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqBytes = 0, cqBytes = 0, sqeBytes = 0;
+    io_uring_sqe* sqes = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqHead = nullptr;
+    unsigned sqMask = 0, sqEntries = 0;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned localTail = 0;   // SQEs written so far
+    unsigned unsubmitted = 0; // of those, not handed to the kernel yet
+
+    unsigned bufferCount, bufferSize;
+    // io_uring_buf_ring's flexible array is laid out wrong under C++, so the ring
+    // is used as plain io_uring_buf entries, the tail sits in entry 0's resv
+    io_uring_buf* bufferRing = nullptr;
+    char* buffers = nullptr;
+    unsigned short bufferTail = 0;
+    vector<unsigned short> used; // buffer ids handed out by the last wait()
+
+    unordered_map<int, Conn> conns;
+    vector<int> dirty;   // sockets with queued sends
+    vector<int> rearm;   // multishot recvs the kernel ended that we still want
+    vector<IoEvent> done; // events produced outside of wait()
+
+    void setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = uringSetup(entries, &params);
+        if (ringFd < 0) return;
+        // wait() needs a timeout, older kernels are left to epoll
+        if (!(params.features & IORING_FEAT_EXT_ARG)) return;
+
+        sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single) sqBytes = cqBytes = max(sqBytes, cqBytes);
+
+        sqRing = mmap(nullptr, sqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) { sqRing = nullptr; return; }
+        cqRing = single ? sqRing : mmap(nullptr, cqBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) { cqRing = nullptr; return; }
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        void* s = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (s == MAP_FAILED) return;
+        sqes = (io_uring_sqe*)s;
+
+        char* sq = (char*)sqRing;
+        sqHead = (unsigned*)(sq + params.sq_off.head);
+        sqTail = (unsigned*)(sq + params.sq_off.tail);
+        sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        // SQE i always sits in slot i
+        unsigned* array = (unsigned*)(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sqEntries; i++) array[i] = i;
+        localTail = *sqTail;
+
+        char* cq = (char*)cqRing;
+        cqHead = (unsigned*)(cq + params.cq_off.head);
+        cqTail = (unsigned*)(cq + params.cq_off.tail);
+        cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+        // provided buffers for recv, group 0
+        void* r = mmap(nullptr, bufferCount * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (r == MAP_FAILED) return;
+        bufferRing = (io_uring_buf*)r;
+        void* b = mmap(nullptr, (size_t)bufferCount * bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) return;
+        buffers = (char*)b;
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)bufferRing;
+        reg.ring_entries = bufferCount;
+        reg.bgid = 0;
+        if (uringRegister(ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return;
+        for (unsigned short id = 0; id < bufferCount; id++) used.push_back(id);
+        recycleBuffers();
+
+        ready_ = true;
+    }
+
+    void enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+        addMetric(g_Metrics.ioSyscalls, 1);
+        int r = uringEnter(ringFd, toSubmit, minComplete, flags, arg, argSize);
+        if (r > 0) unsubmitted -= min((unsigned)r, unsubmitted);
+    }
+
+    io_uring_sqe* getSqe() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        if (localTail - head >= sqEntries) {
+            // ring is full: hand what we have to the kernel early
+            enter(unsubmitted, 0, 0, nullptr, 0);
+            head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        }
+        io_uring_sqe* sqe = &sqes[localTail & sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        localTail++;
+        unsubmitted++;
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    unsigned sqFree() const {
+        return sqEntries - (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+    }
+
+    unsigned cqReady() const {
+        return __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) - *cqHead;
+    }
+
+    void armRecv(int fd, Conn& c) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = tag(OP_RECV, fd);
+        c.armed = true;
+    }
+
+    void recycleBuffers() {
+        if (used.empty()) return;
+        unsigned mask = bufferCount - 1;
+        for (unsigned short id : used) {
+            io_uring_buf& buf = bufferRing[bufferTail & mask];
+            buf.addr = (uint64_t)(uintptr_t)(buffers + (size_t)id * bufferSize);
+            buf.len = bufferSize;
+            buf.bid = id;
+            bufferTail++;
+        }
+        __atomic_store_n(&bufferRing[0].resv, bufferTail, __ATOMIC_RELEASE);
+        used.clear();
+    }
+
+    // submits fd's queued sends as one linked chain, unless a chain is still running
+    void startSends(int fd) {
+        Conn& c = conns[fd];
+        if (!c.inflight.empty() || c.pending.empty()) return;
+
+        // a link chain can't span two submissions, so only take what fits the ring
+        size_t total = 0;
+        size_t jobs = 0;
+        for (const SendJob& job : c.pending) {
+            if (total + job.parts.size() > sqEntries) break;
+            total += job.parts.size();
+            jobs++;
+        }
+        if (jobs == 0) {
+            // a job with more parts than the ring can't be linked in one go, send it anyway
+            jobs = 1;
+            total = c.pending.front().parts.size();
+        }
+        if (sqFree() < min(total, (size_t)sqEntries)) enter(unsubmitted, 0, 0, nullptr, 0);
+
+        size_t left = total;
+        for (size_t j = 0; j < jobs; j++) {
+            c.inflight.push_back(move(c.pending.front()));
+            c.pending.pop_front();
+            SendJob& job = c.inflight.back();
+            size_t offset = 0;
+            for (size_t k = 0; k < job.parts.size(); k++) {
+                bool lastPart = k + 1 == job.parts.size();
+                bool lastInChain = --left == 0;
+                io_uring_sqe* sqe = getSqe();
+                sqe->opcode = IORING_OP_SEND;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(uintptr_t)(job.bytes.data() + offset);
+                sqe->len = job.parts[k];
+                sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (lastInChain ? 0 : MSG_MORE);
+                if (!lastInChain) sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = tag(lastPart ? OP_SEND : OP_SEND_PART, fd);
+                offset += job.parts[k];
+            }
+        }
+    }
+
+    void reap(vector<IoEvent>& events) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            Op op = (Op)(cqe.user_data >> 56);
+            int fd = (int)(uint32_t)cqe.user_data;
+            bool more = cqe.flags & IORING_CQE_F_MORE;
+
+            if (op == OP_ACCEPT) {
+                if (cqe.res >= 0) events.push_back({ IO_ACCEPTED, cqe.res, 0, nullptr });
+                // EMFILE/ENFILE would fail again straight away, re-arming now spins the accept thread
+                if (!more && accepting && cqe.res < 0) acceptResumeMs = monotonicMs() + ACCEPT_BACKOFF_MS;
+                else if (!more && accepting) watchAccept(listenFd);
+                else if (!more) events.push_back({ IO_RECV_DONE, listenFd, -ECANCELED, nullptr });
+            } else if (op == OP_RECV) {
+                Conn& c = conns[fd];
+                if (cqe.flags & IORING_CQE_F_BUFFER) {
+                    unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                    used.push_back(id);
+                    if (cqe.res > 0) events.push_back({ IO_RECEIVED, fd, cqe.res, buffers + (size_t)id * bufferSize });
+                }
+                if (!more) {
+                    c.armed = false;
+                    // the kernel ends a multishot recv when it runs out of buffers, start another one
+                    if (c.watching && (cqe.res > 0 || cqe.res == -ENOBUFS)) {
+                        rearm.push_back(fd);
+                    } else {
+                        int result = c.watching ? cqe.res : -ECANCELED;
+                        c.watching = false;
+                        events.push_back({ IO_RECV_DONE, fd, result, nullptr });
+                    }
+                }
+            } else if (op == OP_SEND) {
+                Conn& c = conns[fd];
+                // a failed part cancels the rest of the chain, so the last part's result covers the job
+                int result = cqe.res;
+                if (!c.inflight.empty()) {
+                    if (result >= 0) result = c.inflight.front().bytes.size();
+                    c.inflight.pop_front();
+                }
+                events.push_back({ IO_SENT, fd, result, nullptr });
+                if (c.inflight.empty() && !c.pending.empty()) dirty.push_back(fd);
+            }
+            // OP_SEND_PART and OP_CANCEL only matter through the CQEs above
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+IoBackend* CreateUringBackend(unsigned queueDepth) {
+    // the provided buffer ring size has to be a power of two
+    unsigned entries = 1;
+    while (entries < queueDepth) entries <<= 1;
+    UringBackend* backend = new UringBackend(entries, entries, 4096);
+    if (!backend->ok()) {
+        delete backend;
+        return nullptr;
+    }
+    return backend;
+}
+
+#endif
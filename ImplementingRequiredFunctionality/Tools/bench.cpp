@@ -0,0 +1,423 @@
+// Micro benchmarks for the server hot paths. Single threaded, so every number is per core.
+// Build from this folder (see READ_ME.md):
+// g++ -O2 -o bench bench.cpp ../Server/line_reader.cpp ../Server/lobby_protocol.cpp ../Server/command_validation.cpp ../Server/match_sim.cpp ../Server/spatial_grid.cpp ../Server/timer_wheel.cpp ../Server/frame_codec.cpp ../Server/metrics.cpp ../Server/trace.cpp -std=c++17 -lpthread
+#include "../Server/line_reader.h"
+#include "../Server/lobby_protocol.h"
+#include "../Server/command_validation.h"
+#include "../Server/match_sim.h"
+#include "../Server/timer_wheel.h"
+#include "../Server/frame_codec.h"
+#include "../Server/trace.h"
+#include <iostream>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <cmath>
+#include <random>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+static double secondsSince(chrono::steady_clock::time_point t0) {
+    return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+// Pipelined lobby traffic pushed through the framer and parser in recv sized chunks
+static void benchLobbyParse() {
+    const char* script =
+        "REGISTER player_one\n"
+        "LIST\n"
+        "CHAT gg well played everyone\n"
+        "JOIN 42\n"
+        "LEADERBOARD\r\n"
+        "CREATE\n"
+        "NOT_A_COMMAND\n";
+    string stream;
+    while (stream.size() < (1 << 20)) stream += script;
+
+    const int rounds = 200;
+    LineReader reader;
+    string_view line;
+    long long handled = 0;
+    long long checksum = 0; // keeps the optimizer from dropping the parse
+    auto t0 = chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (size_t off = 0; off < stream.size(); off += LineReader::READ_CHUNK) {
+            size_t len = min(stream.size() - off, (size_t)LineReader::READ_CHUNK);
+            reader.append(stream.data() + off, len);
+            while (reader.nextLine(line)) {
+                string_view rest = line;
+                LobbyCommand cmd = parseLobbyCommand(nextToken(rest));
+                if (cmd == LOBBY_JOIN) {
+                    int id = 0;
+                    parseInt(nextToken(rest), id);
+                    checksum += id;
+                }
+                checksum += cmd;
+                handled++;
+            }
+        }
+    }
+    double secs = secondsSince(t0);
+    cout << "lobby_parse: " << handled << " commands in " << secs << " s = "
+         << (long long)(handled / secs) << " commands/sec/core (checksum " << checksum << ")" << endl;
+}
+
+// binary frame of one command, as a client sends it (lobby_protocol.h)
+static void putFrame(string& out, LobbyCommand cmd, int number = 0, string_view text = {}) {
+    bool hasText = cmd == LOBBY_REGISTER || cmd == LOBBY_CHAT;
+    bool hasNumber = cmd == LOBBY_JOIN || cmd == LOBBY_ACK;
+    uint32_t len = 1 + (hasText ? 4 + text.size() : 0) + (hasNumber ? 4 : 0);
+    out.append((const char*)&len, 4);
+    out += (char)cmd;
+    if (hasNumber) out.append((const char*)&number, 4);
+    if (hasText) {
+        uint32_t n = text.size();
+        out.append((const char*)&n, 4);
+        out.append(text.data(), text.size());
+    }
+}
+
+// The same session in both lobby formats: frame and parse each command, then build
+// the reply the lobby would send. What is left per message is the protocol's own cost
+static void benchLobbyFormats() {
+    string streams[2];
+    while (streams[LOBBY_TEXT].size() < (1 << 20)) {
+        streams[LOBBY_TEXT] += "REGISTER player_one\nLIST\nCHAT gg well played everyone\nJOIN 42\nLEADERBOARD\nCREATE\nPING\n";
+        string& bin = streams[LOBBY_BINARY];
+        putFrame(bin, LOBBY_REGISTER, 0, "player_one");
+        putFrame(bin, LOBBY_LIST);
+        putFrame(bin, LOBBY_CHAT, 0, "gg well played everyone");
+        putFrame(bin, LOBBY_JOIN, 42);
+        putFrame(bin, LOBBY_LEADERBOARD);
+        putFrame(bin, LOBBY_CREATE);
+        putFrame(bin, LOBBY_PING);
+    }
+    const int rooms[8] = {3, 5, 8, 13, 21, 34, 55, 89};
+    const LobbyRank top[3] = {{"player_one", 12}, {"someone_else", 7}, {"x", 1}};
+
+    const char* names[2] = {"text", "binary"};
+    for (int f = LOBBY_TEXT; f <= LOBBY_BINARY; f++) {
+        LobbyFormat format = (LobbyFormat)f;
+        const string& stream = streams[f];
+        const int rounds = 100;
+        LineReader reader;
+        reader.setFormat(format);
+        LobbyWriter reply(format);
+        string_view message;
+        long long handled = 0, replyBytes = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (size_t off = 0; off < stream.size(); off += LineReader::READ_CHUNK) {
+                size_t len = min(stream.size() - off, (size_t)LineReader::READ_CHUNK);
+                reader.append(stream.data() + off, len);
+                while (reader.nextMessage(message)) {
+                    LobbyRequest req;
+                    if (!parseRequest(format, message, req)) continue;
+                    string_view out;
+                    switch (req.cmd) {
+                        case LOBBY_REGISTER: out = reply.user(false, req.arg, 12); break;
+                        case LOBBY_LIST: out = reply.games(rooms, 8); break;
+                        case LOBBY_CHAT: out = reply.echo(req.arg); break;
+                        case LOBBY_JOIN: out = req.room == 42 ? reply.matchStart() : reply.error(LOBBY_ERROR_GAME_FULL); break;
+                        case LOBBY_LEADERBOARD: out = reply.leaderboard(top, 3); break;
+                        case LOBBY_CREATE: out = reply.created(7); break;
+                        case LOBBY_PING: out = reply.pong(); break;
+                        default: out = reply.error(LOBBY_ERROR_UNKNOWN_COMMAND);
+                    }
+                    replyBytes += out.size();
+                    handled++;
+                }
+            }
+        }
+        double secs = secondsSince(t0);
+        cout << "lobby_" << names[f] << ": " << (long long)(handled / secs) << " messages/sec/core, "
+             << (double)stream.size() * rounds / handled << " bytes in and " << (double)replyBytes / handled
+             << " bytes out per message" << endl;
+    }
+}
+
+// A big battle tick full of mostly honest commands with some garbage mixed in,
+// validated with every kernel this cpu has. Each kernel must agree with the scalar one
+static void benchValidation() {
+    const size_t n = 4096;
+    const int rounds = 2000;
+    mt19937 rng(7);
+    vector<Command> tick(n);
+    for (size_t i = 0; i < n; i++) {
+        Command& c = tick[i];
+        c.unit_id = 1 + rng() % 4000;
+        c.command_type = 1 + rng() % 3;
+        c.unit_type = 0;
+        c.target_x = (rng() % 20000) * 0.1;
+        c.target_y = (rng() % 20000) * 0.1;
+        switch (rng() % 40) {
+            case 0: c.target_x = NAN; break;
+            case 1: c.target_y = INFINITY; break;
+            case 2: c.command_type = 77; break;
+            case 3: c.unit_id = 5000; break; // the other player's unit
+            case 4: c.target_x = -50; break;
+        }
+    }
+
+    pmr::vector<Command> reference;
+    ValidationKernel kernels[] = { KERNEL_SCALAR, KERNEL_SSE2, KERNEL_AVX2 };
+    for (ValidationKernel k : kernels) {
+        if (k > bestValidationKernel()) break;
+        CommandValidator validator(1500, 1500, n);
+        validator.kernel = k;
+        pmr::vector<Command> work;
+        auto t0 = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            work.assign(tick.begin(), tick.end());
+            validator.validate(work, 0);
+        }
+        double secs = secondsSince(t0);
+        bool same = true;
+        if (k == KERNEL_SCALAR) reference = work;
+        else same = work.size() == reference.size() &&
+                    memcmp(work.data(), reference.data(), work.size() * sizeof(Command)) == 0;
+        cout << "validate_" << validationKernelName(k) << ": " << secs * 1e9 / ((double)n * rounds)
+             << " ns/command (includes the tick copy), kept " << work.size() << "/" << n
+             << (same ? "" : " MISMATCH vs scalar") << endl;
+    }
+}
+
+// Many --simulate matches stepped round robin on one core, like a server full of
+// busy games. Every match starts with unitsPerPlayer units per side in two groups
+// that overlap a bit, then each player sends ordersPerTick Move/Attack a tick.
+// The result is how many such matches one core keeps at 30 ticks/sec
+static void benchSimulation() {
+    const int matches = 300;
+    const int ticks = 300; // 10 seconds of game time
+    const uint32_t unitsPerPlayer = 200;
+    const uint32_t ordersPerTick = 16;
+
+    SimRules rules;
+    rules.manaStart = 1e9f; // everything is placed on the first tick
+    vector<unique_ptr<MatchSimulation>> sims;
+    for (int m = 0; m < matches; m++) sims.emplace_back(new MatchSimulation(rules));
+
+    // ids are assigned here like the server's UnitIdAllocator would: 1.. and 4096..
+    pmr::vector<Command> placeFrame;
+    mt19937 rng(11);
+    for (int p = 0; p < 2; p++) {
+        for (uint32_t k = 0; k < unitsPerPlayer; k++) {
+            Command c;
+            c.unit_id = p * UNIT_SLOTS_PER_PLAYER + (p == 0 ? 1 : 0) + k;
+            c.command_type = COMMAND_TYPE_PLACE;
+            c.unit_type = k % 4;
+            c.target_x = (p == 0 ? 500 : 800) + (rng() % 200);
+            c.target_y = 200 + (rng() % 1100);
+            placeFrame.push_back(c);
+        }
+    }
+
+    pmr::vector<Command> frame;
+    pmr::vector<uint32_t> rejectedPlaces;
+    uint64_t commands = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (int t = 0; t < ticks; t++) {
+        for (int m = 0; m < matches; m++) {
+            if (t == 0) {
+                frame = placeFrame;
+            } else {
+                frame.clear();
+                for (int p = 0; p < 2; p++) {
+                    for (uint32_t k = 0; k < ordersPerTick; k++) {
+                        Command c;
+                        c.unit_id = p * UNIT_SLOTS_PER_PLAYER + (p == 0 ? 1 : 0) + rng() % unitsPerPlayer;
+                        // attacks aim anywhere, so most of them are dropped as out of range
+                        c.command_type = rng() % 4 ? COMMAND_TYPE_MOVE : COMMAND_TYPE_ATTACK;
+                        c.unit_type = 0;
+                        c.target_x = 200 + (rng() % 1300);
+                        c.target_y = 200 + (rng() % 1100);
+                        frame.push_back(c);
+                    }
+                }
+            }
+            commands += frame.size();
+            sims[m]->step(frame, rejectedPlaces);
+        }
+    }
+    double secs = secondsSince(t0);
+
+    uint64_t units = 0, rejected = 0;
+    for (auto& sim : sims) {
+        units += sim->unitCount();
+        rejected += sim->rejectedTotal();
+    }
+    double nsPerTick = secs * 1e9 / ((double)matches * ticks);
+    cout << "simulate: " << nsPerTick << " ns per match tick (" << unitsPerPlayer * 2 << " units, "
+         << ordersPerTick * 2 << " orders), " << (long long)(1e9 / (nsPerTick * 30))
+         << " matches/core at 30 Hz (" << units / matches << " units left per match, rejected "
+         << rejected << "/" << commands << " commands)" << endl;
+}
+
+// One heartbeat timer per connection on a TimerWheel, like liveness.cpp: every
+// fire re-arms its timer one heartbeat later and every tick a few connections
+// change phase (cancel + arm). Run at 1k, 10k and 100k connections, the cost per
+// timer operation should not move
+static TimerWheel* g_BenchWheel = nullptr;
+static mt19937 g_BenchRng(5);
+static uint64_t g_BenchFires = 0;
+
+static void benchFire(TimerNode* node) {
+    g_BenchFires++;
+    g_BenchWheel->arm(node, g_BenchWheel->now() + 900 + g_BenchRng() % 200); // 10s heartbeat at 10ms ticks, jittered
+}
+
+static void benchTimers() {
+    const uint64_t ticks = 6000; // a minute of 10ms ticks
+    for (size_t conns : { (size_t)1000, (size_t)10000, (size_t)100000 }) {
+        TimerWheel wheel(0);
+        g_BenchWheel = &wheel;
+        g_BenchFires = 0;
+        vector<TimerNode> nodes(conns);
+        for (TimerNode& node : nodes) {
+            node.fire = benchFire;
+            wheel.arm(&node, 1 + g_BenchRng() % 1000);
+        }
+
+        size_t churnPerTick = conns / 1000; // each connection changes phase every 10s or so
+        uint64_t churned = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (uint64_t t = 1; t <= ticks; t++) {
+            for (size_t k = 0; k < churnPerTick; k++) {
+                TimerNode& node = nodes[g_BenchRng() % conns];
+                wheel.cancel(&node);
+                wheel.arm(&node, t + 1000 + g_BenchRng() % 2000); // into a handshake or a match
+            }
+            churned += churnPerTick;
+            wheel.advance(t);
+        }
+        double secs = secondsSince(t0);
+        uint64_t ops = g_BenchFires * 2 + churned * 2; // a fire is an unlink plus a re-arm
+        cout << "timers " << conns << " connections: " << secs * 1e9 / ops << " ns per timer operation, "
+             << secs * 1e6 / ticks << " us per 10ms tick (" << g_BenchFires << " fired, " << wheel.size()
+             << " armed)" << endl;
+    }
+}
+
+// Late game fight frames, sorted by unit id like --compact-ticks leaves them: most
+// orders are group moves and attacks (a selection all sent to the same spot), the
+// rest single units sent to fractional positions, with a few Places and deaths.
+// Prints how much smaller frame_codec packs them and what that costs per tick
+static void fightFrame(mt19937& rng, uint32_t n, vector<Command>& frame) {
+    frame.clear();
+    while (frame.size() < n) {
+        uint32_t owner = rng() % 2;
+        uint32_t firstId = owner * UNIT_SLOTS_PER_PLAYER + 1 + rng() % 600;
+        uint32_t kind = rng() % 20;
+        Command c;
+        c.unit_type = 0;
+        if (kind < 12) {
+            // a selection of up to 24 units, all ordered to one spot
+            c.command_type = kind < 9 ? COMMAND_TYPE_MOVE : COMMAND_TYPE_ATTACK;
+            c.target_x = 800 + rng() % 400;
+            c.target_y = 600 + rng() % 300;
+            uint32_t group = 1 + rng() % 24;
+            for (uint32_t k = 0; k < group && frame.size() < n; k++) {
+                c.unit_id = firstId + k * (1 + rng() % 3);
+                frame.push_back(c);
+            }
+            continue;
+        }
+        c.unit_id = firstId;
+        if (kind < 18) {
+            c.command_type = COMMAND_TYPE_MOVE;
+            c.target_x = 800 + (rng() % 40000) * 0.01;
+            c.target_y = 600 + (rng() % 30000) * 0.01;
+        } else if (kind == 18) {
+            c.unit_id = 0;
+            c.command_type = COMMAND_TYPE_PLACE;
+            c.unit_type = rng() % 4;
+            c.target_x = owner ? 1400 : 200;
+            c.target_y = 300 + rng() % 900;
+        } else {
+            c.command_type = COMMAND_TYPE_UNIT_DIED;
+            c.target_x = c.target_y = 0;
+        }
+        frame.push_back(c);
+    }
+    stable_sort(frame.begin(), frame.end(), [](const Command& a, const Command& b) { return a.unit_id < b.unit_id; });
+}
+
+static void benchCompression() {
+    mt19937 rng(3);
+    for (uint32_t n : { 16u, 64u, 256u, 1024u }) {
+        const int frames = 64;
+        const int rounds = 200000 / n;
+        vector<vector<Command>> ticks(frames);
+        for (auto& frame : ticks) fightFrame(rng, n, frame);
+
+        pmr::string packed;
+        size_t plainBytes = 0, packedBytes = 0;
+        auto t0 = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (const auto& frame : ticks) {
+                packCommands(frame.data(), n, packed);
+                if (r == 0) {
+                    plainBytes += sizeof(uint32_t) + n * sizeof(Command);
+                    packedBytes += 2 * sizeof(uint32_t) + packed.size();
+                }
+            }
+        }
+        double packSecs = secondsSince(t0);
+
+        vector<pmr::string> packedFrames;
+        for (const auto& frame : ticks) {
+            packCommands(frame.data(), n, packed);
+            packedFrames.push_back(packed);
+        }
+        vector<Command> out(n);
+        bool same = true;
+        t0 = chrono::steady_clock::now();
+        for (int r = 0; r < rounds; r++) {
+            for (int f = 0; f < frames; f++) {
+                same &= unpackCommands(packedFrames[f].data(), packedFrames[f].size(), n, out.data());
+                if (r == 0) same &= memcmp(out.data(), ticks[f].data(), n * sizeof(Command)) == 0;
+            }
+        }
+        double unpackSecs = secondsSince(t0);
+
+        double count = (double)frames * rounds;
+        cout << "compress " << n << " commands: " << plainBytes / frames << " -> " << packedBytes / frames
+             << " bytes a frame (" << (double)plainBytes / packedBytes << "x), pack " << packSecs * 1e6 / count
+             << " us, unpack " << unpackSecs * 1e6 / count << " us" << (same ? "" : " MISMATCH") << endl;
+    }
+}
+
+// A tick's worth of spans, recording and not. Nothing goes to disk, the rings just wrap
+static void benchTrace() {
+    const int rounds = 20000000;
+    volatile int sink = 0;
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        TRACE_SPAN("bench", i);
+        sink = sink + 1;
+    }
+    double offSecs = secondsSince(t0);
+
+    StartTracing("/dev/null");
+    t0 = chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        TRACE_SPAN("bench", i);
+        sink = sink + 1;
+    }
+    double onSecs = secondsSince(t0);
+    cout << "trace span: " << offSecs * 1e9 / rounds << " ns off, " << onSecs * 1e9 / rounds << " ns recording" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    string only = argc > 1 ? argv[1] : "";
+    if (only.empty() || only == "lobby") benchLobbyParse();
+    if (only.empty() || only == "lobby") benchLobbyFormats();
+    if (only.empty() || only == "validate") benchValidation();
+    if (only.empty() || only == "simulate") benchSimulation();
+    if (only.empty() || only == "timers") benchTimers();
+    if (only.empty() || only == "compress") benchCompression();
+    if (only.empty() || only == "trace") benchTrace();
+    return 0;
+}
@@ -0,0 +1,205 @@
+// Load scenario for comparing the server's --io-backend options.
+// Runs M matches at once, each on its own thread driving both players over raw
+// sockets: register, create/join, ACK, then N lockstep ticks of K Move commands
+// per player, each tick written with a single send. Reports tick round trip
+// latency and the server's io_syscalls per tick (from STATS before and after).
+// Build from this folder (see READ_ME.md):
+// g++ -O2 -o loadgen loadgen.cpp -std=c++17 -lpthread
+#include "../Server/shared.h"
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+static string g_Host = "127.0.0.1";
+static int g_Port = 8080;
+
+static int connectServer() {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_Port);
+    inet_pton(AF_INET, g_Host.c_str(), &addr.sin_addr);
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+static bool recvAll(int sock, char* buf, size_t len) {
+    while (len > 0) {
+        int r = recv(sock, buf, len, 0);
+        if (r <= 0) return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+static bool sendAll(int sock, const char* buf, size_t len) {
+    while (len > 0) {
+        int r = send(sock, buf, len, MSG_NOSIGNAL);
+        if (r <= 0) return false;
+        buf += r;
+        len -= r;
+    }
+    return true;
+}
+
+// one byte at a time is fine for the few lobby lines we read
+static bool readLine(int sock, string& line) {
+    line.clear();
+    char c;
+    while (recvAll(sock, &c, 1)) {
+        if (c == '\n') return true;
+        line += c;
+    }
+    return false;
+}
+
+static bool command(int sock, const string& text, string& reply) {
+    string msg = text + "\n";
+    return sendAll(sock, msg.data(), msg.size()) && readLine(sock, reply);
+}
+
+// parses the io_syscalls and ticks counters out of a STATS line
+static bool readStats(int sock, uint64_t& syscalls, uint64_t& ticks) {
+    string reply;
+    if (!command(sock, "STATS", reply)) return false;
+    auto field = [&](const string& name) -> uint64_t {
+        size_t at = reply.find(name + "=");
+        return at == string::npos ? 0 : strtoull(reply.c_str() + at + name.size() + 1, NULL, 10);
+    };
+    syscalls = field("io_syscalls");
+    ticks = field("ticks");
+    return true;
+}
+
+struct MatchResult {
+    vector<double> tickMs;
+    bool ok = false;
+};
+
+static void runMatch(int index, int ticks, int commands, MatchResult& result) {
+    int socks[2] = { connectServer(), connectServer() };
+    if (socks[0] < 0 || socks[1] < 0) return;
+    for (int i = 0; i < 2; i++) {
+        // the server sends a tick as count + commands, don't add our own delayed acks on top
+        int one = 1;
+        setsockopt(socks[i], IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    string line;
+    string base = "lg" + to_string(getpid()) + "_" + to_string(index);
+    if (!readLine(socks[0], line) || !readLine(socks[1], line)) return;
+    if (!command(socks[0], "REGISTER " + base + "h", line) || !command(socks[1], "REGISTER " + base + "j", line)) return;
+    if (!command(socks[0], "CREATE", line) || line.rfind("CREATED ", 0) != 0) return;
+    string gameId = line.substr(8, line.find(' ', 8) - 8);
+    if (!command(socks[1], "JOIN " + gameId, line) || line != "MATCH_START") return;
+    if (!readLine(socks[0], line) || line != "MATCH_START") return;
+    if (!sendAll(socks[0], "ACK\n", 4) || !sendAll(socks[1], "ACK\n", 4)) return;
+    uint32_t playerId;
+    for (int i = 0; i < 2; i++)
+        if (!recvAll(socks[i], (char*)&playerId, sizeof(playerId))) return;
+
+    // each player moves its own units around, so validation keeps every command
+    vector<char> out[2];
+    vector<char> frame;
+    result.tickMs.reserve(ticks);
+
+    for (int t = 0; t < ticks; t++) {
+        for (int p = 0; p < 2; p++) {
+            uint32_t count = (t == ticks - 1 && p == 0) ? commands + 1 : commands;
+            out[p].resize(sizeof(uint32_t) + count * sizeof(Command));
+            memcpy(out[p].data(), &count, sizeof(count));
+            for (uint32_t k = 0; k < count; k++) {
+                Command cmd = { (uint32_t)(p * 4096 + 1 + k % 4000), COMMAND_TYPE_MOVE, 0, (double)(t % 1000), (double)k };
+                if (k == (uint32_t)commands) cmd = { 0, COMMAND_TYPE_END_GAME, 0, 0, 0 }; // last tick ends the match
+                memcpy(out[p].data() + sizeof(uint32_t) + k * sizeof(Command), &cmd, sizeof(cmd));
+            }
+        }
+
+        auto t0 = chrono::steady_clock::now();
+        for (int p = 0; p < 2; p++)
+            if (!sendAll(socks[p], out[p].data(), out[p].size())) return;
+        for (int p = 0; p < 2; p++) {
+            uint32_t count;
+            if (!recvAll(socks[p], (char*)&count, sizeof(count))) return;
+            frame.resize(count * sizeof(Command));
+            if (!recvAll(socks[p], frame.data(), frame.size())) return;
+        }
+        result.tickMs.push_back(chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count());
+    }
+    result.ok = true;
+
+    // no EXIT round trip: the joiner's lobby thread may still be parked on the room
+    close(socks[0]);
+    close(socks[1]);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        cerr << "Usage: " << argv[0] << " host port [matches=8] [ticks=2000] [commands=16]" << endl;
+        return 1;
+    }
+    g_Host = argv[1];
+    g_Port = atoi(argv[2]);
+    int matches = argc > 3 ? atoi(argv[3]) : 8;
+    int ticks = argc > 4 ? atoi(argv[4]) : 2000;
+    int commands = argc > 5 ? atoi(argv[5]) : 16;
+
+    int statsSock = connectServer();
+    string line;
+    uint64_t syscallsBefore, ticksBefore, syscallsAfter, ticksAfter;
+    if (statsSock < 0 || !readLine(statsSock, line) || !command(statsSock, "REGISTER lg_stats", line) ||
+        !readStats(statsSock, syscallsBefore, ticksBefore)) {
+        cerr << "Could not reach the server on " << g_Host << ":" << g_Port << endl;
+        return 1;
+    }
+
+    vector<MatchResult> results(matches);
+    vector<thread> threads;
+    auto t0 = chrono::steady_clock::now();
+    for (int i = 0; i < matches; i++) threads.emplace_back(runMatch, i, ticks, commands, ref(results[i]));
+    for (thread& t : threads) t.join();
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    // the last frame can still be on its way back to the lobby when our recv returns
+    usleep(200000);
+    readStats(statsSock, syscallsAfter, ticksAfter);
+
+    vector<double> all;
+    int failed = 0;
+    for (MatchResult& r : results) {
+        if (!r.ok) failed++;
+        all.insert(all.end(), r.tickMs.begin(), r.tickMs.end());
+    }
+    if (all.empty()) {
+        cerr << "No tick completed" << endl;
+        return 1;
+    }
+    sort(all.begin(), all.end());
+    auto pct = [&](double q) { return all[min(all.size() - 1, (size_t)(q * all.size()))]; };
+    uint64_t serverTicks = ticksAfter - ticksBefore;
+
+    cout << matches << " matches x " << ticks << " ticks x " << commands << " commands/player"
+         << (failed ? " (" + to_string(failed) + " failed)" : "") << endl;
+    cout << "ticks/sec: " << (long long)(all.size() / secs) << endl;
+    cout << "tick round trip ms: p50 " << pct(0.50) << "  p90 " << pct(0.90) << "  p99 " << pct(0.99) << "  p99.9 " << pct(0.999) << "  max " << all.back() << endl;
+    if (serverTicks)
+        cout << "server syscalls/tick: " << (double)(syscallsAfter - syscallsBefore) / serverTicks << endl;
+    close(statsSock);
+    return failed ? 1 : 0;
+}
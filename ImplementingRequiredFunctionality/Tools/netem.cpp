@@ -0,0 +1,681 @@
+// Network condition emulator: a TCP proxy that goes between the client DLL (or
+// loadgen) and the server and adds delay, jitter, bandwidth limits and loss, so
+// lockstep stalls from real networks can be reproduced on one machine.
+// TCP bytes keep their order, so loss there shows up the way TCP shows it: a
+// chunk (and everything after it) waits one retransmit timeout. When a match
+// switches to UDP the proxy rewrites the port in the handshake and relays the
+// datagrams too, where loss drops them and reordering lets them overtake.
+// Conditions can change over time with a scenario file, and the same --seed and
+// scenario give the same decisions for the same traffic on every run.
+// Build from this folder (see READ_ME.md):
+// g++ -O2 -o netem netem.cpp -std=c++17
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <queue>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+enum DelayDist { DIST_UNIFORM, DIST_NORMAL, DIST_PARETO };
+
+// what the link looks like, one direction each way (delays are one way)
+struct Conditions {
+    double delayMs = 0;
+    double jitterMs = 0;
+    DelayDist dist = DIST_UNIFORM;
+    double loss = 0;      // chance per TCP chunk of a retransmit stall, per UDP datagram of a drop
+    double rtoMs = 200;   // how long a "lost" TCP chunk waits
+    double rateKbps = 0;  // 0 = no limit
+    double reorder = 0;   // chance a UDP datagram is held back reorderMs and overtaken
+    double reorderMs = 20;
+};
+
+// scenario: conditions from at seconds on, stop the run at end
+struct Step {
+    double at;
+    Conditions conditions;
+    bool end = false;
+};
+
+static vector<Step> g_Steps;
+static size_t g_Step = 0;
+static Conditions g_Now;
+static uint64_t g_Seed = 1;
+static string g_ServerHost;
+static int g_ServerPort = 0;
+static const size_t MAX_QUEUED = 4 * 1024 * 1024; // a direction stops reading past this
+// binary lobby (Server/lobby_protocol.h): this first byte, then uint32 length, uint8 type, payload
+static const uint8_t LOBBY_BINARY_HELLO = 0xB1;
+static const uint8_t LOBBY_ACK = 13;
+static volatile sig_atomic_t g_Stop = 0;
+
+static struct {
+    uint64_t connections = 0;
+    uint64_t bytesUp = 0;
+    uint64_t bytesDown = 0;
+    uint64_t tcpStalls = 0;
+    uint64_t datagrams = 0;
+    uint64_t datagramsDropped = 0;
+    uint64_t datagramsReordered = 0;
+    uint64_t udpRelays = 0;
+} g_Stats;
+
+static int64_t nowUs() {
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t g_StartUs = nowUs();
+
+static void setNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+// one direction of a connection or relay, with its own random stream so a
+// direction's decisions don't depend on how traffic elsewhere interleaves
+struct Link {
+    mt19937_64 rng;
+    int64_t linkFree = 0;    // when the bandwidth limit has sent what is queued
+    int64_t lastRelease = 0; // TCP only: nothing may overtake
+
+    explicit Link(uint64_t seed) : rng(seed) {}
+
+    double uniform() { return uniform_real_distribution<double>(0.0, 1.0)(rng); }
+
+    int64_t sampleDelayUs() {
+        const Conditions& c = g_Now;
+        double ms = c.delayMs;
+        if (c.jitterMs > 0) {
+            if (c.dist == DIST_UNIFORM) ms += (uniform() * 2 - 1) * c.jitterMs;
+            else if (c.dist == DIST_NORMAL) ms += normal_distribution<double>(0.0, c.jitterMs)(rng);
+            else ms += c.jitterMs * (pow(1 - uniform(), -1.0 / 2.5) - 1); // long tail, mostly small
+        }
+        return (int64_t)(max(0.0, ms) * 1000);
+    }
+
+    // when bytes sent now arrive at the other end
+    int64_t schedule(size_t bytes, bool ordered) {
+        int64_t now = nowUs();
+        int64_t depart = now;
+        if (g_Now.rateKbps > 0) {
+            depart = max(now, linkFree) + (int64_t)(bytes * 8000.0 / g_Now.rateKbps);
+            linkFree = depart;
+        }
+        int64_t release = depart + sampleDelayUs();
+        if (ordered) {
+            if (g_Now.loss > 0 && uniform() < g_Now.loss) {
+                release += (int64_t)(g_Now.rtoMs * 1000);
+                g_Stats.tcpStalls++;
+            }
+            release = max(release, lastRelease);
+            lastRelease = release;
+        }
+        return release;
+    }
+};
+
+struct Chunk {
+    int64_t release;
+    string bytes;
+    size_t sent = 0;
+};
+
+struct Pipe {
+    int from = -1;
+    int to = -1;
+    Link link;
+    deque<Chunk> queue;
+    size_t queued = 0;
+    bool eof = false;   // from has nothing more to send
+    bool shut = false;  // and we passed that on
+    bool blocked = false; // to's send buffer is full, wait for POLLOUT
+    uint64_t* counter;
+
+    Pipe(uint64_t seed, uint64_t* counter) : link(seed), counter(counter) {}
+};
+
+struct UdpRelay {
+    int front = -1; // the client sends here
+    int back = -1;  // connected to the server's match port
+    sockaddr_storage client;
+    socklen_t clientLen = 0;
+    Link up;
+    Link down;
+
+    UdpRelay(uint64_t seed) : up(seed * 2 + 101), down(seed * 2 + 102) {}
+    ~UdpRelay() {
+        if (front != -1) close(front);
+        if (back != -1) close(back);
+    }
+};
+
+struct TcpPair {
+    uint64_t id;
+    Pipe up;   // client -> server
+    Pipe down; // server -> client
+    bool closed = false;
+
+    // match handshake: a line starting with ACK from the client is answered with the
+    // player id, and if the ACK listed features, the accepted mask (+ UDP port and token).
+    // A binary lobby client sends an ACK frame instead, always answered with the mask
+    string line;            // or the header of the current frame
+    bool sawFirstByte = false;
+    bool binary = false;
+    uint32_t frameLeft = 0; // payload still to skip
+    bool inMatch = false; // the ACK went by, the client sends ticks from here on and they are not lines
+    bool ackPending = false;
+    bool extendedAck = false;
+    string handshake;
+    unique_ptr<UdpRelay> relay;
+
+    TcpPair(uint64_t id) : id(id), up(g_Seed * 1000003 + id * 2, &g_Stats.bytesUp), down(g_Seed * 1000003 + id * 2 + 1, &g_Stats.bytesDown) {}
+};
+
+struct Datagram {
+    int64_t release;
+    uint64_t pairId;
+    bool toServer;
+    string bytes;
+    bool operator>(const Datagram& o) const { return release > o.release; }
+};
+
+static map<uint64_t, unique_ptr<TcpPair>> g_Pairs;
+static priority_queue<Datagram, vector<Datagram>, greater<Datagram>> g_Datagrams;
+
+static bool resolveServer(int port, sockaddr_storage& addr, socklen_t& len) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(g_ServerHost.c_str(), to_string(port).c_str(), &hints, &result) != 0) return false;
+    memcpy(&addr, result->ai_addr, result->ai_addrlen);
+    len = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static int connectServer() {
+    sockaddr_storage addr;
+    socklen_t len;
+    if (!resolveServer(g_ServerPort, addr, len)) return -1;
+    int sock = socket(addr.ss_family, SOCK_STREAM, 0);
+    if (sock < 0) return -1;
+    if (connect(sock, (sockaddr*)&addr, len) < 0) {
+        close(sock);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setNonBlocking(sock);
+    return sock;
+}
+
+// relay for the match's UDP port, returns the port the client should use instead
+static int openRelay(TcpPair& pair, uint16_t serverPort) {
+    unique_ptr<UdpRelay> relay(new UdpRelay(g_Seed * 1000003 + pair.id));
+    sockaddr_storage addr;
+    socklen_t len;
+    if (!resolveServer(serverPort, addr, len)) return -1;
+    relay->back = socket(addr.ss_family, SOCK_DGRAM, 0);
+    if (relay->back < 0 || connect(relay->back, (sockaddr*)&addr, len) < 0) return -1;
+
+    // the client reaches the relay at the address it reached us on
+    sockaddr_storage local;
+    socklen_t localLen = sizeof(local);
+    if (getsockname(pair.down.to, (sockaddr*)&local, &localLen) < 0) return -1;
+    if (local.ss_family == AF_INET) ((sockaddr_in*)&local)->sin_port = 0;
+    else ((sockaddr_in6*)&local)->sin6_port = 0;
+    relay->front = socket(local.ss_family, SOCK_DGRAM, 0);
+    if (relay->front < 0 || bind(relay->front, (sockaddr*)&local, localLen) < 0) return -1;
+    localLen = sizeof(local);
+    getsockname(relay->front, (sockaddr*)&local, &localLen);
+    setNonBlocking(relay->front);
+    setNonBlocking(relay->back);
+
+    int port = ntohs(local.ss_family == AF_INET ? ((sockaddr_in*)&local)->sin_port : ((sockaddr_in6*)&local)->sin6_port);
+    pair.relay = move(relay);
+    g_Stats.udpRelays++;
+    return port;
+}
+
+static void enqueue(Pipe& pipe, string bytes) {
+    if (bytes.empty()) return;
+    int64_t release = pipe.link.schedule(bytes.size(), true);
+    pipe.queued += bytes.size();
+    *pipe.counter += bytes.size();
+    pipe.queue.push_back({ release, move(bytes) });
+}
+
+static void startHandshake(TcpPair& pair, bool extended) {
+    pair.inMatch = true;
+    pair.ackPending = true;
+    pair.extendedAck = extended;
+    pair.handshake.clear();
+}
+
+static void scanLine(TcpPair& pair, char c) {
+    if (c != '\n') {
+        if (pair.line.size() < 64) pair.line += c;
+        return;
+    }
+    if (pair.line.size() < 64 && pair.line.compare(0, 3, "ACK") == 0)
+        startHandshake(pair, pair.line.find_first_not_of(" \r", 3) != string::npos);
+    pair.line.clear();
+}
+
+static void scanFrame(TcpPair& pair, char c) {
+    if (pair.frameLeft > 0) {
+        pair.frameLeft--;
+        return;
+    }
+    pair.line += c;
+    if (pair.line.size() < 5) return;
+    uint32_t length;
+    memcpy(&length, pair.line.data(), sizeof(length));
+    if ((uint8_t)pair.line[4] == LOBBY_ACK) startHandshake(pair, true);
+    pair.frameLeft = length > 0 ? length - 1 : 0;
+    pair.line.clear();
+}
+
+// client -> server bytes, looking for the ACK line (or frame) that starts a match. Only
+// the first match of a connection is followed: a tick can hold "\nACK" as well, and taking
+// it for one would hold back server bytes and patch a frame as the UDP port
+static void fromClient(TcpPair& pair, string bytes) {
+    for (size_t i = 0; i < bytes.size() && !pair.inMatch; i++) {
+        char c = bytes[i];
+        if (!pair.sawFirstByte) {
+            pair.sawFirstByte = true;
+            pair.binary = (uint8_t)c == LOBBY_BINARY_HELLO;
+            if (pair.binary) continue;
+        }
+        if (pair.binary) scanFrame(pair, c);
+        else scanLine(pair, c);
+    }
+    enqueue(pair.up, move(bytes));
+}
+
+// server -> client bytes. After an extended ACK the handshake is held back until its
+// accepted mask is in, and a UDP port in it is swapped for a relay of ours
+static void fromServer(TcpPair& pair, string bytes) {
+    if (!pair.ackPending) {
+        enqueue(pair.down, move(bytes));
+        return;
+    }
+    pair.handshake += bytes;
+    size_t need = pair.extendedAck ? 8 : 4;
+    uint32_t accepted = 0;
+    if (pair.handshake.size() >= 8 && pair.extendedAck) {
+        memcpy(&accepted, pair.handshake.data() + 4, sizeof(accepted));
+        if (accepted & 1) need = 14; // + u16 port, u32 token
+    }
+    if (pair.handshake.size() < need) return;
+
+    if (accepted & 1) {
+        uint16_t port;
+        memcpy(&port, pair.handshake.data() + 8, sizeof(port));
+        pair.relay.reset();
+        int relayPort = openRelay(pair, port);
+        if (relayPort < 0) {
+            cerr << "[NETEM] Could not relay UDP port " << port << ", the match talks to the server directly" << endl;
+            pair.relay.reset();
+        } else {
+            port = relayPort;
+            memcpy(&pair.handshake[8], &port, sizeof(port));
+        }
+    }
+    pair.ackPending = false;
+    enqueue(pair.down, move(pair.handshake));
+    pair.handshake.clear();
+}
+
+static void closePair(TcpPair& pair) {
+    if (pair.closed) return;
+    pair.closed = true;
+    close(pair.up.from);
+    close(pair.down.from);
+    pair.relay.reset();
+}
+
+// reads what from has, false when the pair should go
+static bool readPipe(TcpPair& pair, Pipe& pipe) {
+    char buffer[65536];
+    ssize_t r = recv(pipe.from, buffer, sizeof(buffer), 0);
+    if (r < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (r == 0) {
+        pipe.eof = true;
+        return true;
+    }
+    string bytes(buffer, r);
+    if (&pipe == &pair.up) fromClient(pair, move(bytes));
+    else fromServer(pair, move(bytes));
+    return true;
+}
+
+// sends every chunk that is due, false when the pair should go
+static bool flushPipe(Pipe& pipe, int64_t now) {
+    pipe.blocked = false;
+    while (!pipe.queue.empty() && pipe.queue.front().release <= now) {
+        Chunk& chunk = pipe.queue.front();
+        ssize_t w = send(pipe.to, chunk.bytes.data() + chunk.sent, chunk.bytes.size() - chunk.sent, MSG_NOSIGNAL);
+        if (w < 0) {
+            pipe.blocked = true;
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        chunk.sent += w;
+        if (chunk.sent < chunk.bytes.size()) {
+            pipe.blocked = true;
+            return true;
+        }
+        pipe.queued -= chunk.bytes.size();
+        pipe.queue.pop_front();
+    }
+    if (pipe.queue.empty() && pipe.eof && !pipe.shut) {
+        shutdown(pipe.to, SHUT_WR);
+        pipe.shut = true;
+    }
+    return true;
+}
+
+static void readRelay(TcpPair& pair, bool toServer) {
+    UdpRelay& relay = *pair.relay;
+    char buffer[65536];
+    while (true) {
+        ssize_t r;
+        if (toServer) {
+            sockaddr_storage from;
+            socklen_t fromLen = sizeof(from);
+            r = recvfrom(relay.front, buffer, sizeof(buffer), 0, (sockaddr*)&from, &fromLen);
+            if (r >= 0) {
+                relay.client = from;
+                relay.clientLen = fromLen;
+            }
+        } else {
+            r = recv(relay.back, buffer, sizeof(buffer), 0);
+        }
+        if (r < 0) return;
+
+        Link& link = toServer ? relay.up : relay.down;
+        g_Stats.datagrams++;
+        if (g_Now.loss > 0 && link.uniform() < g_Now.loss) {
+            g_Stats.datagramsDropped++;
+            continue;
+        }
+        int64_t release = link.schedule(r, false);
+        if (g_Now.reorder > 0 && link.uniform() < g_Now.reorder) {
+            release += (int64_t)(g_Now.reorderMs * 1000);
+            g_Stats.datagramsReordered++;
+        }
+        g_Datagrams.push({ release, pair.id, toServer, string(buffer, r) });
+    }
+}
+
+static void flushDatagrams(int64_t now) {
+    while (!g_Datagrams.empty() && g_Datagrams.top().release <= now) {
+        const Datagram& d = g_Datagrams.top();
+        auto it = g_Pairs.find(d.pairId);
+        if (it != g_Pairs.end() && it->second->relay) {
+            UdpRelay& relay = *it->second->relay;
+            if (d.toServer) send(relay.back, d.bytes.data(), d.bytes.size(), 0);
+            else if (relay.clientLen) sendto(relay.front, d.bytes.data(), d.bytes.size(), 0, (sockaddr*)&relay.client, relay.clientLen);
+        }
+        g_Datagrams.pop();
+    }
+}
+
+static void printStats() {
+    cerr << "[NETEM] " << (nowUs() - g_StartUs) / 1000000.0 << "s: connections=" << g_Stats.connections
+         << " bytes_up=" << g_Stats.bytesUp << " bytes_down=" << g_Stats.bytesDown
+         << " tcp_stalls=" << g_Stats.tcpStalls << " udp_relays=" << g_Stats.udpRelays
+         << " datagrams=" << g_Stats.datagrams << " dropped=" << g_Stats.datagramsDropped
+         << " reordered=" << g_Stats.datagramsReordered << endl;
+}
+
+static void printConditions() {
+    static const char* dists[] = { "uniform", "normal", "pareto" };
+    cerr << "[NETEM] delay " << g_Now.delayMs << "ms jitter " << g_Now.jitterMs << "ms (" << dists[g_Now.dist]
+         << ") loss " << g_Now.loss << " rto " << g_Now.rtoMs << "ms rate "
+         << (g_Now.rateKbps > 0 ? to_string((long long)g_Now.rateKbps) + "kbit/s" : string("unlimited"))
+         << " reorder " << g_Now.reorder << " (" << g_Now.reorderMs << "ms)" << endl;
+}
+
+// "delay=20" and friends, the same keys on the command line (--delay 20) and in scenarios
+static bool setCondition(Conditions& c, const string& key, const string& value) {
+    char* end;
+    double v = strtod(value.c_str(), &end);
+    bool number = !value.empty() && *end == '\0';
+    if (key == "dist") {
+        if (value == "uniform") c.dist = DIST_UNIFORM;
+        else if (value == "normal") c.dist = DIST_NORMAL;
+        else if (value == "pareto") c.dist = DIST_PARETO;
+        else return false;
+        return true;
+    }
+    if (!number || v < 0) return false;
+    if (key == "delay") c.delayMs = v;
+    else if (key == "jitter") c.jitterMs = v;
+    else if (key == "loss") c.loss = min(v, 1.0);
+    else if (key == "rto") c.rtoMs = v;
+    else if (key == "rate") c.rateKbps = v;
+    else if (key == "reorder") c.reorder = min(v, 1.0);
+    else if (key == "reorder-ms") c.reorderMs = v;
+    else return false;
+    return true;
+}
+
+// one step per line: "<seconds> key=value ..." or "<seconds> end", # starts a comment.
+// Every step starts from the one before
+static bool loadScenario(const string& path, const Conditions& start) {
+    ifstream in(path);
+    if (!in) {
+        cerr << "Could not open " << path << endl;
+        return false;
+    }
+    Conditions current = start;
+    string line;
+    int number = 0;
+    while (getline(in, line)) {
+        number++;
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        Step step;
+        if (!(words >> step.at)) continue;
+        string word;
+        while (words >> word) {
+            size_t eq = word.find('=');
+            if (word == "end") step.end = true;
+            else if (eq == string::npos || !setCondition(current, word.substr(0, eq), word.substr(eq + 1))) {
+                cerr << path << ":" << number << ": bad setting " << word << endl;
+                return false;
+            }
+        }
+        step.conditions = current;
+        g_Steps.push_back(step);
+    }
+    stable_sort(g_Steps.begin(), g_Steps.end(), [](const Step& a, const Step& b) { return a.at < b.at; });
+    // a step at the same time as the one before replaces it (the command line is the step at 0)
+    vector<Step> steps;
+    for (const Step& step : g_Steps) {
+        if (!steps.empty() && step.at <= steps.back().at) steps.back() = step;
+        else steps.push_back(step);
+    }
+    g_Steps.swap(steps);
+    return true;
+}
+
+static void onSignal(int) {
+    g_Stop = 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " listen_port server_host server_port [--delay MS] [--jitter MS] [--dist uniform|normal|pareto]"
+             << " [--loss P] [--rto MS] [--rate KBIT] [--reorder P] [--reorder-ms MS] [--seed N] [--scenario FILE]" << endl;
+        return 1;
+    }
+    int listenPort = atoi(argv[1]);
+    g_ServerHost = argv[2];
+    g_ServerPort = atoi(argv[3]);
+    Conditions start;
+    string scenario;
+    for (int i = 4; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--seed") g_Seed = strtoull(argv[i + 1], NULL, 10);
+        else if (arg == "--scenario") scenario = argv[i + 1];
+        else if (arg.rfind("--", 0) != 0 || !setCondition(start, arg.substr(2), argv[i + 1])) {
+            cerr << "Bad option " << arg << " " << argv[i + 1] << endl;
+            return 1;
+        }
+    }
+    g_Steps.push_back({ 0, start });
+    if (!scenario.empty() && !loadScenario(scenario, start)) return 1;
+
+    int listener = socket(AF_INET6, SOCK_STREAM, 0);
+    int off = 0, one = 1;
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(listenPort);
+    if (bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(listener, 128) < 0) {
+        cerr << "Could not listen on " << listenPort << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    setNonBlocking(listener);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    cerr << "[NETEM] " << listenPort << " -> " << g_ServerHost << ":" << g_ServerPort << " seed " << g_Seed << endl;
+
+    vector<pollfd> fds;
+    vector<pair<uint64_t, int>> owners; // pair id and what the fd is: 0 up.from, 1 down.from, 2 up.to, 3 down.to, 4 relay front, 5 relay back
+    uint64_t nextId = 1;
+    while (!g_Stop) {
+        int64_t now = nowUs();
+        // scenario steps
+        while (g_Step + 1 < g_Steps.size() && g_Steps[g_Step + 1].at * 1000000 <= now - g_StartUs) {
+            g_Step++;
+            if (g_Steps[g_Step].end) g_Stop = 1;
+        }
+        if (g_Stop) break;
+        static size_t shownStep = SIZE_MAX;
+        if (shownStep != g_Step) {
+            shownStep = g_Step;
+            g_Now = g_Steps[g_Step].conditions;
+            if (g_Step > 0) printStats();
+            printConditions();
+        }
+
+        // due output first, then see what is left to wait for
+        for (auto it = g_Pairs.begin(); it != g_Pairs.end();) {
+            TcpPair& pair = *it->second;
+            if (!pair.closed && (!flushPipe(pair.up, now) || !flushPipe(pair.down, now))) closePair(pair);
+            bool done = pair.up.shut && pair.down.shut;
+            if (pair.closed || done) {
+                closePair(pair);
+                it = g_Pairs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        flushDatagrams(now);
+
+        int64_t wake = now + 1000000;
+        if (g_Step + 1 < g_Steps.size()) wake = min(wake, g_StartUs + (int64_t)(g_Steps[g_Step + 1].at * 1000000));
+        if (!g_Datagrams.empty()) wake = min(wake, g_Datagrams.top().release);
+
+        fds.clear();
+        owners.clear();
+        fds.push_back({ listener, POLLIN, 0 });
+        owners.push_back({ 0, -1 });
+        for (auto& entry : g_Pairs) {
+            TcpPair& pair = *entry.second;
+            Pipe* pipes[2] = { &pair.up, &pair.down };
+            for (int d = 0; d < 2; d++) {
+                Pipe& pipe = *pipes[d];
+                if (!pipe.eof && pipe.queued < MAX_QUEUED) {
+                    fds.push_back({ pipe.from, POLLIN, 0 });
+                    owners.push_back({ pair.id, d });
+                }
+                if (pipe.blocked) {
+                    fds.push_back({ pipe.to, POLLOUT, 0 });
+                    owners.push_back({ pair.id, 2 + d });
+                } else if (!pipe.queue.empty()) {
+                    wake = min(wake, pipe.queue.front().release);
+                }
+            }
+            if (pair.relay) {
+                fds.push_back({ pair.relay->front, POLLIN, 0 });
+                owners.push_back({ pair.id, 4 });
+                fds.push_back({ pair.relay->back, POLLIN, 0 });
+                owners.push_back({ pair.id, 5 });
+            }
+        }
+
+        int timeout = (int)max<int64_t>(0, (wake - nowUs() + 999) / 1000);
+        if (poll(fds.data(), fds.size(), timeout) <= 0) continue;
+
+        for (size_t i = 0; i < fds.size(); i++) {
+            if (!fds[i].revents) continue;
+            if (owners[i].second == -1) {
+                int client;
+                while ((client = accept(listener, NULL, NULL)) >= 0) {
+                    int server = connectServer();
+                    if (server < 0) {
+                        cerr << "[NETEM] Could not reach " << g_ServerHost << ":" << g_ServerPort << endl;
+                        close(client);
+                        continue;
+                    }
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    setNonBlocking(client);
+                    unique_ptr<TcpPair> pair(new TcpPair(nextId));
+                    pair->up.from = pair->down.to = client;
+                    pair->down.from = pair->up.to = server;
+                    g_Pairs[nextId++] = move(pair);
+                    g_Stats.connections++;
+                }
+                continue;
+            }
+            auto it = g_Pairs.find(owners[i].first);
+            if (it == g_Pairs.end() || it->second->closed) continue;
+            TcpPair& pair = *it->second;
+            switch (owners[i].second) {
+            case 0:
+                if (!readPipe(pair, pair.up)) closePair(pair);
+                break;
+            case 1:
+                if (!readPipe(pair, pair.down)) closePair(pair);
+                break;
+            case 4:
+                if (pair.relay) readRelay(pair, true);
+                break;
+            case 5:
+                if (pair.relay) readRelay(pair, false);
+                break;
+            default:
+                break; // writable again, the flush at the top of the loop sends
+            }
+        }
+    }
+
+    printStats();
+    return 0;
+}